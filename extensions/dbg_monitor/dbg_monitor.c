@@ -71,6 +71,49 @@ static void display_info(char * queue_desc, char * peer, int current_count, int
 	}
 }
 
+/* Display the delay percentiles and the throughput of a queue */
+static void print_latency(char * queue_desc, struct peer_hdr * p, struct fd_fifo_latency * delay, struct fd_fifo_latency * blocking, double r1, double r10, double r60)
+{
+	TRACE_DEBUG(INFO, "'%s'@'%s': delay p50:%ld.%06lds p99:%ld.%06lds p999:%ld.%06lds max:%ld.%06lds, blocked p99:%ld.%06lds, rate 1s:%.1f 10s:%.1f 60s:%.1f items/s",
+		queue_desc, p ? p->info.pi_diamid : "(global)",
+		delay->p50.tv_sec, delay->p50.tv_nsec/1000, delay->p99.tv_sec, delay->p99.tv_nsec/1000,
+		delay->p999.tv_sec, delay->p999.tv_nsec/1000, delay->max.tv_sec, delay->max.tv_nsec/1000,
+		blocking->p99.tv_sec, blocking->p99.tv_nsec/1000, r1, r10, r60);
+}
+
+static void display_latency(char * queue_desc, enum fd_stat_type stat, struct peer_hdr * p)
+{
+	struct fd_fifo_latency delay, blocking;
+	double r1, r10, r60;
+
+	CHECK_FCT_DO( fd_stat_getlatency(stat, p, &delay, &blocking), return );
+	CHECK_FCT_DO( fd_stat_getrates(stat, p, &r1, &r10, &r60), return );
+	print_latency(queue_desc, p, &delay, &blocking, r1, r10, r60);
+}
+
+/* Same for the queue of a dispatch pool. Returns 0 if there is no such pool. */
+static int display_pool(int pool)
+{
+	int current_count, limit_count, highest_count;
+	long long total_count;
+	struct timespec total, blocking, last;
+	struct fd_fifo_latency delay, blocking_lat;
+	double r1, r10, r60;
+	application_id_t appid;
+	char desc[40];
+
+	if (fd_stat_getpool(pool, &appid, NULL))
+		return 0;
+	snprintf(desc, sizeof(desc), "Local delivery app %u", appid);
+	if (fd_stat_getpoolstats(pool, &current_count, &limit_count, &highest_count, &total_count, &total, &blocking, &last))
+		return 0;
+	display_info(desc, NULL, current_count, limit_count, highest_count, total_count, &total, &blocking, &last);
+	if (fd_stat_getpoollatency(pool, &delay, &blocking_lat) || fd_stat_getpoolrates(pool, &r1, &r10, &r60))
+		return 0;
+	print_latency(desc, NULL, &delay, &blocking_lat, r1, r10, r60);
+	return 1;
+}
+
 /* Thread to display periodical debug information */
 static pthread_t thr;
 static void * mn_thr(void * arg)
@@ -88,6 +131,7 @@ static void * mn_thr(void * arg)
 		long long total_count;
 		struct timespec total, blocking, last;
 		struct fd_list * li;
+		int pool;
 	
 		#ifdef DEBUG
 		for (i++; i % 30; i++) {
@@ -101,12 +145,18 @@ static void * mn_thr(void * arg)
 		
 		CHECK_FCT_DO( fd_stat_getstats(STAT_G_LOCAL, NULL, &current_count, &limit_count, &highest_count, &total_count, &total, &blocking, &last), );
 		display_info("Local delivery", NULL, current_count, limit_count, highest_count, total_count, &total, &blocking, &last);
+		display_latency("Local delivery", STAT_G_LOCAL, NULL);
+		
+		for (pool = 0; display_pool(pool); pool++)
+			;
 		
 		CHECK_FCT_DO( fd_stat_getstats(STAT_G_INCOMING, NULL, &current_count, &limit_count, &highest_count, &total_count, &total, &blocking, &last), );
 		display_info("Total received", NULL, current_count, limit_count, highest_count, total_count, &total, &blocking, &last);
+		display_latency("Total received", STAT_G_INCOMING, NULL);
 		
 		CHECK_FCT_DO( fd_stat_getstats(STAT_G_OUTGOING, NULL, &current_count, &limit_count, &highest_count, &total_count, &total, &blocking, &last), );
 		display_info("Total sending", NULL, current_count, limit_count, highest_count, total_count, &total, &blocking, &last);
+		display_latency("Total sending", STAT_G_OUTGOING, NULL);
 		
 		
 		CHECK_FCT_DO( pthread_rwlock_rdlock(&fd_g_peers_rw), /* continue */ );
@@ -118,9 +168,11 @@ static void * mn_thr(void * arg)
 			
 			CHECK_FCT_DO( fd_stat_getstats(STAT_P_PSM, p, &current_count, &limit_count, &highest_count, &total_count, &total, &blocking, &last), );
 			display_info("Events, incl. recept", p->info.pi_diamid, current_count, limit_count, highest_count, total_count, &total, &blocking, &last);
+			display_latency("Events, incl. recept", STAT_P_PSM, p);
 			
 			CHECK_FCT_DO( fd_stat_getstats(STAT_P_TOSEND, p, &current_count, &limit_count, &highest_count, &total_count, &total, &blocking, &last), );
 			display_info("Outgoing", p->info.pi_diamid, current_count, limit_count, highest_count, total_count, &total, &blocking, &last);
+			display_latency("Outgoing", STAT_P_TOSEND, p);
 			
 		}
 
@@ -129,6 +181,9 @@ static void * mn_thr(void * arg)
 		TRACE_DEBUG(INFO, "[dbg_monitor] Dumping servers information");
 		TRACE_DEBUG(INFO, "%s", fd_servers_dump(&buf, &len, NULL, 1));
 		
+		TRACE_DEBUG(INFO, "[dbg_monitor] Dumping dispatch handlers statistics");
+		TRACE_DEBUG(INFO, "%s", fd_disp_dump(&buf, &len, NULL));
+		
 		sleep(1);
 	}
 	
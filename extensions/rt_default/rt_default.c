@@ -94,6 +94,10 @@ static void sig_hdlr(void)
 		return;
 	}
 	rtd_conf_reload(rtd_config_file);
+	/* The new rules may give other scores, this also empties the routing cache */
+	if (rtd_hdl) {
+		CHECK_FCT_DO( fd_rt_out_cacheable( rtd_hdl, rtd_cacheable() ), );
+	}
 	if (pthread_rwlock_unlock(&rtd_lock) != 0) {
 		fd_log_error("%s: unlocking failed after config reload, exiting", MODULE_NAME);
 		exit(1);
@@ -108,6 +112,7 @@ static void sig_hdlr(void)
 /* entry point */
 static int rtd_entry(char * conffile)
 {
+	int cacheable;
 	TRACE_ENTRY("%p", conffile);
 
 	rtd_config_file = conffile;
@@ -123,6 +128,7 @@ static int rtd_entry(char * conffile)
 	
 	/* Parse the configuration file */
 	CHECK_FCT( rtd_conf_handle(conffile) );
+	cacheable = rtd_cacheable();
 
 	if (pthread_rwlock_unlock(&rtd_lock) != 0) {
 		fd_log_notice("%s: write-unlock failed, aborting", MODULE_NAME);
@@ -139,6 +145,7 @@ static int rtd_entry(char * conffile)
 	
 	/* Register the callback */
 	CHECK_FCT( fd_rt_out_register( rtd_out, NULL, 5, &rtd_hdl ) );
+	CHECK_FCT( fd_rt_out_cacheable( rtd_hdl, cacheable ) );
 	
 	/* We're done */
 	return 0;
@@ -85,5 +85,8 @@ int rtd_process( struct msg * msg, struct fd_list * candidates );
 /* Reload the config file */
 void rtd_conf_reload(char *config_file);
 
+/* Check if the scores only depend on the key of the routing cache (see fd_rt_out_cacheable) */
+int rtd_cacheable(void);
+
 /* For debug: dump the rule repository */
 void rtd_dump(void);
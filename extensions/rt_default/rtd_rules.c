@@ -628,6 +628,32 @@ int rtd_process( struct msg * msg, struct fd_list * candidates )
 	return 0;
 }
 
+/* Only the rules on the destination, or on the additional AVP of the routing cache, can be cached */
+int rtd_cacheable(void)
+{
+	int i, j;
+	
+	for (j = 1; j < RTD_CRI_MAX; j++) {
+		struct dict_avp_data data;
+		
+		if ((j == RTD_CRI_DH) || (j == RTD_CRI_DR))
+			continue;
+		if (fd_g_config->cnf_rt_cache_avp && (fd_dict_getval(AVP_MODELS[j], &data) == 0) 
+				&& !strcmp(data.avp_name, fd_g_config->cnf_rt_cache_avp))
+			continue;
+		
+		for (i = 0; i < RTD_TAR_MAX; i++) {
+			struct fd_list * li;
+			for (li = TARGETS[i].next; li != &TARGETS[i]; li = li->next) {
+				if (!FD_IS_LIST_EMPTY(&((struct target *)li)->rules[j]))
+					return 0;
+			}
+		}
+	}
+	
+	return 1;
+}
+
 void rtd_dump(void)
 {
 	int i;
@@ -114,6 +114,15 @@ int fd_connections_shutdown(void);
 /*                          CONFIG                            */
 /*============================================================*/
 
+/* A pool of dispatch threads dedicated to the messages of one application (DispatchPool) */
+struct fd_disp_pool {
+	struct fd_list	 chain;		/* link in cnf_disp_pools */
+	application_id_t appid;		/* the messages with this Application-Id are handled by this pool */
+	uint16_t	 threads;	/* number of dispatch threads of the pool */
+	int		 qlimit;	/* limit for the queue of the pool */
+	char		*cpus;		/* CPUs the threads are pinned to, e.g. "0,2-3", or NULL */
+};
+
 /* Structure to hold the configuration of the freeDiameter daemon */
 #define	EYEC_CONFIG	0xC011F16
 struct fd_config {
@@ -139,12 +148,20 @@ struct fd_config {
 	regex_t		 cnf_processing_peers_pattern_regex;	/* Regex pattern for identifying processing peers */
 	struct fd_list	 cnf_apps;	/* Applications locally supported (except relay, see flags). Use fd_disp_app_support to add one. list of struct fd_app. */
 	uint16_t	 cnf_dispthr;	/* Number of dispatch threads to create */
+	struct fd_list	 cnf_disp_pools;	/* Dedicated dispatch pools, list of struct fd_disp_pool. Other messages use the cnf_dispthr threads */
 	uint16_t     cnf_rtinthr;  /* Number of routing in threads to create */
 	uint16_t     cnf_rtoutthr;  /* Number of routing out threads to create */
+	uint16_t	 cnf_io_thr;	/* Number of I/O threads receiving on the TCP connections, 0 for one thread per connection */
+	uint16_t	 cnf_parse_thr;	/* Number of threads parsing the received messages, 0 to parse in the PSM threads */
 	uint16_t	 cnf_rr_in_answers;	/* include Route-Record AVP in answers */
 	int		 cnf_qin_limit;	/* limit for incoming queue*/
 	int		 cnf_qout_limit;	/* limit for outgoing queue */
 	int		 cnf_qlocal_limit;	/* limit for local queue */
+	int		 cnf_send_batch;	/* max number of messages sent together by a peer's out thread */
+	int		 cnf_send_delay;	/* microseconds the out thread waits for more messages to complete a batch */
+	int		 cnf_prio_sched;	/* ordering of the incoming, outgoing and peers' sending queues: 0 (FIFO), FD_PRIO_SCHED_STRICT or FD_PRIO_SCHED_WEIGHTED */
+	int		 cnf_rt_cache;	/* max number of routing decisions kept in the cache (see fd_rt_out_cacheable), 0 to disable the cache */
+	char		*cnf_rt_cache_avp; /* name of an additional AVP in the key of the routing cache, or NULL */
 	struct {
 		unsigned no_fwd : 1;	/* the peer does not relay messages (0xffffff app id) */
 		unsigned no_ip4 : 1;	/* disable IP */
@@ -154,6 +171,11 @@ struct fd_config {
 		unsigned pr_tcp	: 1;	/* prefer TCP over SCTP */
 		unsigned tls_alg: 1;	/* TLS algorithm for initiated cnx. 0: separate port. 1: inband-security (old) */
 		unsigned no_bind: 1;	/* disable client bind to cnf_endpoints if non configured (bind all) */
+		unsigned msg_pools: 1;	/* allocate messages and AVPs from per-thread pools (fd_msg_pool_enable) */
+		unsigned msg_huge: 1;	/* back the message pools with huge pages */
+		unsigned lazy_parse: 1;	/* decode the AVPs of received messages on first access (fd_msg_parse_lazy) */
+		unsigned raw_relay: 1;	/* keep the received messages raw until the AVPs are needed (fd_msg_parse_buffer_raw) */
+		unsigned lf_queues: 1;	/* the incoming, outgoing and local queues use the lock-free backend (fd_fifo_new_ring) */
 	} 		 cnf_flags;
 	
 	struct {
@@ -183,10 +205,24 @@ struct fd_config {
 	
 	uint32_t	 cnf_orstateid;	/* The value to use in Origin-State-Id, default to random value */
 	struct dictionary *cnf_dict;	/* pointer to the global dictionary */
+	char		  *cnf_dict_image; /* binary image of the dictionary used instead of the dict_* extensions (fd_dict_image_load), or NULL */
 	struct fifo	  *cnf_main_ev;	/* events for the daemon's main (struct fd_event items) */
 };
 extern struct fd_config *fd_g_config; /* The pointer to access the global configuration, initialized in main */
 
+/* Values of cnf_prio_sched */
+#define FD_PRIO_SCHED_STRICT	1	/* a message is processed only when no message of a higher class is queued */
+#define FD_PRIO_SCHED_WEIGHTED	2	/* the classes are served in rounds, higher classes get more messages per round */
+
+/* The priority classes of the messages in the queues when cnf_prio_sched is set, from the highest priority */
+enum fd_msg_prio {
+	FD_PRIO_LINKLOCAL = 0,	/* CER/CEA, DWR/DWA, DPR/DPA */
+	FD_PRIO_ANSWER,		/* All other answers, since they complete a transaction */
+	FD_PRIO_DRMP,		/* Requests with a DRMP AVP are in class FD_PRIO_DRMP + the DRMP value (PRIORITY_0 is the highest) */
+	FD_PRIO_DEFAULT = FD_PRIO_DRMP + 16,	/* Requests without DRMP */
+	FD_PRIO_CLASSES		/* The number of classes */
+};
+
 
 
 /*============================================================*/
@@ -834,6 +870,43 @@ int fd_rt_out_register ( int (*rt_out_cb)(void * cbdata, struct msg ** pmsg, str
  */
 int fd_rt_out_unregister ( struct fd_rt_out_hdl * handler, void ** cbdata );
 
+/*
+ * FUNCTION:	fd_rt_out_cacheable
+ *
+ * PARAMETERS:
+ *  handler     : The handler of a callback registered with fd_rt_out_register.
+ *  cacheable	: 1 if the decisions of the callback can be cached, 0 otherwise (default).
+ *
+ * DESCRIPTION: 
+ *   Declare whether the scores given by a callback can be reused for other requests. This is the case if 
+ *  the score of each candidate only depends on the candidate itself, the state of the peers, and the 
+ *  Destination-Realm, Destination-Host, Application-Id, Command-Code and the AVP configured with RoutingCache 
+ *  of the request; and if the callback does not modify or dispose of the message.
+ *   When RoutingCache is configured and all the registered callbacks are cacheable, the scores computed for
+ *  a request are saved and reused for the next requests with the same values, until a peer enters or leaves
+ *  the OPEN state, or the list of callbacks changes. The cache is emptied by this function.
+ *
+ * RETURN VALUE:
+ *  0      	: The callback is updated.
+ *  EINVAL 	: A parameter is invalid.
+ */
+int fd_rt_out_cacheable ( struct fd_rt_out_hdl * handler, int cacheable );
+
+/*
+ * FUNCTION:	fd_rt_out_cache_flush
+ *
+ * PARAMETERS:
+ *  none.
+ *
+ * DESCRIPTION: 
+ *   Empty the routing cache (see fd_rt_out_cacheable). A cacheable callback calls this function when its 
+ *  decisions change, for example when its configuration is reloaded.
+ *
+ * RETURN VALUE:
+ *  0      	: The cache is empty.
+ */
+int fd_rt_out_cache_flush ( void );
+
 
 /*============================================================*/
 /*                         EVENTS                             */
@@ -1214,6 +1287,25 @@ enum fd_stat_type {
 	STAT_P_TOSEND,		/* Queue of messages for sending to this peer */
 };
 
+/*
+ * FUNCTION:	fd_stat_getpool
+ *
+ * PARAMETERS:
+ *  index	  : Index of the dispatch pool, starting at 0
+ *  appid	  : (out) The Application-Id of the messages handled by this pool
+ *  threads	  : (out) The number of threads of the pool
+ *  
+ * DESCRIPTION: 
+ *   Get the description of a dispatch pool configured with DispatchPool. The statistics of its queue 
+ *  are retrieved with fd_stat_getpoolstats, fd_stat_getpoollatency and fd_stat_getpoolrates. 
+ *  Any of the (out) parameters can be NULL.
+ *
+ * RETURN VALUE:
+ *  0      	: The pool exists.
+ *  ENOENT 	: There is no pool with this index.
+ */
+int fd_stat_getpool(int index, application_id_t * appid, int * threads);
+
 /*
  * FUNCTION:	fd_stat_getstats
  *
@@ -1240,6 +1332,134 @@ int fd_stat_getstats(enum fd_stat_type stat, struct peer_hdr * peer,
 			int * current_count, int * limit_count, int * highest_count, long long * total_count,
 			struct timespec * total, struct timespec * blocking, struct timespec * last);
 
+/*
+ * FUNCTION:	fd_stat_getlatency
+ *
+ * PARAMETERS:
+ *  stat	  : Which queue is being queried
+ *  peer	  : (depending on the stat parameter) which peer is being queried
+ *  delay	  : (out) Percentiles of the time the items spent in this queue, including blocking time
+ *  blocking      : (out) Percentiles of the time threads trying to post new items were blocked (queue full)
+ *  
+ * DESCRIPTION: 
+ *   Get the distribution of the queueing delay of a given queue since startup or the last fd_stat_resetlatency 
+ *  (see fd_fifo_getlatency), e.g. to monitor the p99 / p999 delay of the messages sent to a peer.
+ *  Any of the (out) parameters can be NULL if not requested.
+ *
+ * RETURN VALUE:
+ *  0      	: The statistics have been retrieved.
+ *  EINVAL 	: A parameter is invalid.
+ */
+int fd_stat_getlatency(enum fd_stat_type stat, struct peer_hdr * peer, struct fd_fifo_latency * delay, struct fd_fifo_latency * blocking);
+
+/*
+ * FUNCTION:	fd_stat_resetlatency
+ *
+ * PARAMETERS:
+ *  stat	  : Which queue is being reset
+ *  peer	  : (depending on the stat parameter) which peer is being queried
+ *  
+ * DESCRIPTION: 
+ *   Restart the distributions returned by fd_stat_getlatency and fd_stat_getclassstats from empty 
+ *  (see fd_fifo_resetlatency), to get the percentiles over a monitoring period.
+ *
+ * RETURN VALUE:
+ *  0      	: The statistics have been reset.
+ *  EINVAL 	: A parameter is invalid.
+ */
+int fd_stat_resetlatency(enum fd_stat_type stat, struct peer_hdr * peer);
+
+/*
+ * FUNCTION:	fd_stat_getrates
+ *
+ * PARAMETERS:
+ *  stat	  : Which queue is being queried
+ *  peer	  : (depending on the stat parameter) which peer is being queried
+ *  rate_1s	  : (out) Number of items retrieved from the queue during the last complete second
+ *  rate_10s	  : (out) Average number of items retrieved per second during the last 10 seconds
+ *  rate_60s	  : (out) Same, over the last 60 seconds
+ *  
+ * DESCRIPTION: 
+ *   Get the throughput of a given queue over sliding windows (see fd_fifo_getrates).
+ *  Any of the (out) parameters can be NULL if not requested.
+ *
+ * RETURN VALUE:
+ *  0      	: The statistics have been retrieved.
+ *  EINVAL 	: A parameter is invalid.
+ */
+int fd_stat_getrates(enum fd_stat_type stat, struct peer_hdr * peer, double * rate_1s, double * rate_10s, double * rate_60s);
+
+/*
+ * FUNCTION:	fd_stat_getclassstats
+ *
+ * PARAMETERS:
+ *  stat	  : Which queue is being queried
+ *  peer	  : (depending on the stat parameter) which peer is being queried
+ *  cls		  : The priority class (enum fd_msg_prio)
+ *  current_count : (out) The number of messages of this class in the queue currently
+ *  total_count	  : (out) Total number of messages of this class that this queue has processed
+ *  delay	  : (out) Percentiles of the time these messages spent in this queue
+ *  
+ * DESCRIPTION: 
+ *   Get the statistics of a priority class of a given queue. When PriorityQueues is not configured,
+ *  the queues only have the class 0 that contains all the messages.
+ *  Any of the (out) parameters can be NULL if not requested.
+ *
+ * RETURN VALUE:
+ *  0      	: The statistics have been retrieved.
+ *  EINVAL 	: A parameter is invalid, or the queue does not have this class.
+ */
+int fd_stat_getclassstats(enum fd_stat_type stat, struct peer_hdr * peer, int cls, int * current_count, long long * total_count, struct fd_fifo_latency * delay);
+
+/*
+ * FUNCTION:	fd_stat_getpoolstats
+ *
+ * PARAMETERS:
+ *  index	  : Index of the dispatch pool, starting at 0 (see fd_stat_getpool)
+ *  current_count, limit_count, highest_count, total_count, total, blocking, last : (out) see fd_stat_getstats
+ *  
+ * DESCRIPTION: 
+ *   Same as fd_stat_getstats, for the queue of a dispatch pool.
+ *
+ * RETURN VALUE:
+ *  0      	: The statistics have been retrieved.
+ *  ENOENT 	: There is no pool with this index.
+ */
+int fd_stat_getpoolstats(int index, int * current_count, int * limit_count, int * highest_count, long long * total_count,
+			struct timespec * total, struct timespec * blocking, struct timespec * last);
+
+/*
+ * FUNCTION:	fd_stat_getpoollatency
+ *
+ * PARAMETERS:
+ *  index	  : Index of the dispatch pool, starting at 0 (see fd_stat_getpool)
+ *  delay, blocking : (out) see fd_stat_getlatency
+ *  
+ * DESCRIPTION: 
+ *   Same as fd_stat_getlatency, for the queue of a dispatch pool.
+ *
+ * RETURN VALUE:
+ *  0      	: The statistics have been retrieved.
+ *  ENOENT 	: There is no pool with this index.
+ */
+int fd_stat_getpoollatency(int index, struct fd_fifo_latency * delay, struct fd_fifo_latency * blocking);
+
+/*
+ * FUNCTION:	fd_stat_getpoolrates
+ *
+ * PARAMETERS:
+ *  index	  : Index of the dispatch pool, starting at 0 (see fd_stat_getpool)
+ *  rate_1s, rate_10s, rate_60s : (out) see fd_stat_getrates
+ *  
+ * DESCRIPTION: 
+ *   Same as fd_stat_getrates, for the queue of a dispatch pool.
+ *
+ * RETURN VALUE:
+ *  0      	: The statistics have been retrieved.
+ *  ENOENT 	: There is no pool with this index.
+ */
+int fd_stat_getpoolrates(int index, double * rate_1s, double * rate_10s, double * rate_60s);
+
 /*============================================================*/
 /*                         EOF                                */
 /*============================================================*/
@@ -73,6 +73,7 @@ extern "C" {
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netdb.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -1008,6 +1009,77 @@ int fd_dict_new ( struct dictionary * dict, enum dict_object_type type, void * d
  */
 int fd_dict_search ( struct dictionary * dict, enum dict_object_type type, int criteria, const void * what, struct dict_object ** result, int retval );
 
+/*
+ * FUNCTION: 	fd_dict_freeze
+ *
+ * PARAMETERS:
+ *  dict	: Pointer to the dictionary, once it has been populated.
+ *
+ * DESCRIPTION:
+ *   Publish a read-only snapshot of the dictionary indexes. After this call, the searches of AVPs by code or name,
+ *  of commands by code, of applications by id and of enumerated values of a type object are done in the snapshot
+ *  without locking the dictionary. The objects added later with fd_dict_new are still found: each change publishes
+ *  a new version of the snapshot, copying only the affected indexes. The previous versions are kept until fd_dict_fini,
+ *  so the dictionary should not receive a large number of changes after this call. Objects cannot be deleted anymore
+ *  after this call (fd_dict_delete returns EBUSY), since a search may return them at any time. Calling the function
+ *  again has no effect.
+ *
+ * RETURN VALUE:
+ *  0      	: The snapshot is published.
+ *  EINVAL 	: The dictionary is invalid.
+ *  ENOMEM	: Not enough memory, the searches keep taking the lock.
+ */
+int fd_dict_freeze ( struct dictionary * dict );
+
+/*
+ * FUNCTION: 	fd_dict_image_save
+ *
+ * PARAMETERS:
+ *  dict	: Pointer to the dictionary to save.
+ *  path	: The file where the image is written. It is replaced only once the new image is complete.
+ *  tag		: A string saved in the image, that fd_dict_image_load will check.
+ *
+ * DESCRIPTION:
+ *   Save all the objects of the dictionary in a binary image, that fd_dict_image_load can load much faster than
+ *  creating the objects again with fd_dict_new. The image does not contain pointers: the type callbacks are saved by
+ *  their symbol name, so they must be exported functions (as the fd_dictfct_* ones). The tag should identify
+ *  everything that defined the objects (e.g. the extensions and their configuration), so that an outdated image
+ *  is not loaded.
+ *
+ * RETURN VALUE:
+ *  0      	: The image is saved.
+ *  EINVAL 	: A parameter is invalid.
+ *  ENOTSUP	: A type callback is not an exported symbol, or a type has a type_check_param.
+ *  ENOMEM	: Not enough memory.
+ *  errno	: The file could not be written.
+ */
+int fd_dict_image_save ( struct dictionary * dict, const char * path, const char * tag );
+
+/*
+ * FUNCTION: 	fd_dict_image_load
+ *
+ * PARAMETERS:
+ *  dict	: Pointer to the dictionary.
+ *  path	: The image file, created by fd_dict_image_save.
+ *  tag		: The tag that the image must have been saved with.
+ *
+ * DESCRIPTION:
+ *   Replace the contents of the dictionary with the objects from the image. The file is mapped in memory and
+ *  checked completely before the dictionary is changed, so the dictionary is unchanged on error. The objects that were
+ *  in the dictionary are destroyed, so this must be called before any reference to them is kept (e.g. at startup,
+ *  before loading the extensions), and before fd_dict_freeze. The image is assumed to come from fd_dict_image_save:
+ *  its structure is checked, not the consistency of the definitions.
+ *
+ * RETURN VALUE:
+ *  0      	: The dictionary now contains the objects of the image.
+ *  EINVAL 	: A parameter is invalid, or the file is not a valid image.
+ *  ESTALE	: The image was saved with a different tag, or by a different version.
+ *  ENOENT	: The file does not exist, or a type callback of the image cannot be found.
+ *  EBUSY	: The dictionary is frozen.
+ *  ENOMEM	: Not enough memory.
+ */
+int fd_dict_image_load ( struct dictionary * dict, const char * path, const char * tag );
+
 /* Special case: get the generic error command object */
 int fd_dict_get_error_cmd(struct dictionary * dict, struct dict_object ** obj);
 
@@ -1040,7 +1112,8 @@ int fd_dict_getlistof(int criteria, void * parent, struct fd_list ** sentinel);
 
 /* Function to remove an entry from the dictionary.
   This cannot be used if the object has children (for example a vendor with vendor-specific AVPs).
-  In such case, the children must be removed first. */
+  In such case, the children must be removed first.
+  Returns EBUSY once the dictionary has been frozen (see fd_dict_freeze). */
 int fd_dict_delete(struct dict_object * obj);
 
 /*
@@ -1844,6 +1917,7 @@ The "parent" parameter can not be NULL. It points to the object (grouped avp or
 #define AC_INBAND_SECURITY_ID		299
 #define ACV_ISI_NO_INBAND_SECURITY		0
 #define ACV_ISI_TLS				1
+#define AC_DRMP				301
 
 /* Error codes from Base protocol
 (reference: http://www.iana.org/assignments/aaa-parameters/aaa-parameters.xml#aaa-parameters-4)
@@ -2127,6 +2201,32 @@ DECLARE_FD_DUMP_PROTOTYPE(fd_sess_dump_hdl, struct session_handler * handler);
 /* For statistics / monitoring: get the number of struct session in memory */
 int fd_sess_getcount(uint32_t *cnt);
 
+/* Load of the sessions hash table, see fd_sess_gethashstats */
+#define FD_SESS_CHAIN_HIST	8
+struct fd_sess_hashstats {
+	uint32_t	buckets;	/* Current number of buckets, the table grows and shrinks with the number of sessions */
+	uint32_t	sessions;	/* Number of sessions in the table, including the destroyed ones still referenced by messages */
+	double		load;		/* sessions / buckets */
+	uint32_t	max_chain;	/* Number of sessions in the longest bucket */
+	uint32_t	chains[FD_SESS_CHAIN_HIST]; /* Number of buckets containing 0, 1, ... sessions, the last entry counts the longer ones */
+};
+
+/*
+ * FUNCTION:	fd_sess_gethashstats
+ *
+ * PARAMETERS:
+ *  stats	: Where the statistics are stored.
+ *
+ * DESCRIPTION:
+ *  Retrieve the load factor and the chain lengths of the sessions hash table, for monitoring.
+ * This walks the whole table, one lock at a time, so the values are not a consistent snapshot.
+ *
+ * RETURN VALUE:
+ *  0      	: The statistics are stored.
+ *  EINVAL 	: A parameter is invalid.
+ */
+int fd_sess_gethashstats(struct fd_sess_hashstats * stats);
+
 /*============================================================*/
 /*                         ROUTING                            */
 /*============================================================*/
@@ -2411,6 +2511,70 @@ int fd_msg_free ( msg_or_avp * object );
  */
 void fd_msg_unhook_avp (msg_or_avp *msg);
 
+/***************************************/
+/*   Memory pools                      */
+/***************************************/
+
+/* The classes of objects managed by the pools */
+enum fd_msg_pool_class {
+	FD_MSG_POOL_MSG = 0,		/* struct msg objects */
+	FD_MSG_POOL_AVP,		/* struct avp objects */
+	FD_MSG_POOL_BUF_SMALL,		/* AVP payloads (octetstring values, raw data) up to 64 bytes */
+	FD_MSG_POOL_BUF_MEDIUM,		/* AVP payloads up to 256 bytes */
+	FD_MSG_POOL_MAX			/* The number of classes */
+};
+
+/* The counters of one class */
+struct fd_msg_pool_stats {
+	const char *		name;		/* description of the class */
+	size_t			objsize;	/* size of one object in the slabs */
+	unsigned long long	allocs;		/* objects handed out since the pools were enabled */
+	unsigned long long	frees;		/* objects given back */
+	unsigned long long	hits;		/* allocations served from the calling thread's magazines, without locking */
+	unsigned long long	depot;		/* full magazines obtained from the shared depot */
+	unsigned long long	slabs;		/* slabs allocated from the system */
+	size_t			slab_bytes;	/* memory reserved by these slabs */
+	unsigned long long	huge;		/* slabs backed by huge pages */
+};
+
+/*
+ * FUNCTION:	fd_msg_pool_enable
+ *
+ * PARAMETERS:
+ *  hugepages	: if not 0, the slabs are allocated from huge pages (MAP_HUGETLB) when the system provides them.
+ *
+ * DESCRIPTION:
+ *   Switch the allocation of messages, AVPs and small AVP payloads to per-thread object pools
+ *  instead of individual malloc / free calls. The objects may be freed by a different thread than the
+ *  one that created them. This should be called early (e.g. while parsing the configuration);
+ *  once enabled, the pools cannot be disabled and their memory is not returned to the system.
+ *
+ * RETURN VALUE:
+ *  0      	: The pools are in use.
+ *  EINVAL 	: The library is not initialized.
+ */
+int fd_msg_pool_enable(int hugepages);
+
+/* Returns 1 if the pools have been enabled, 0 otherwise */
+int fd_msg_pool_enabled(void);
+
+/*
+ * FUNCTION:	fd_msg_pool_getstats
+ *
+ * PARAMETERS:
+ *  cls		: the class of objects to retrieve the counters of.
+ *  stats	: the counters are copied here.
+ *
+ * DESCRIPTION:
+ *   Retrieve the usage counters of a pool. The hit rate of the per-thread caches is hits / allocs.
+ *  The counters of the running threads are read without locking, so the values are approximate.
+ *
+ * RETURN VALUE:
+ *  0      	: The counters have been retrieved.
+ *  EINVAL 	: A parameter is invalid.
+ */
+int fd_msg_pool_getstats(enum fd_msg_pool_class cls, struct fd_msg_pool_stats * stats);
+
 /***************************************/
 /*   Dump functions                    */
 /***************************************/
@@ -2582,7 +2746,8 @@ int fd_msg_is_routable ( struct msg * msg );
  * DESCRIPTION:
  *   Store or retrieve the diameted id of the peer from which this message was received.
  * Will be used for example by the routing module to add the Route-Record AVP in forwarded requests,
- * or to direct answers to the appropriate peer.
+ * or to direct answers to the appropriate peer. On a raw message, fd_msg_source_setrr may reallocate the
+ * received buffer, so the pointers obtained before with fd_msg_raw_next are no longer valid.
  *
  * RETURN VALUE:
  *  0      	: Operation complete.
@@ -2721,6 +2886,29 @@ int fd_msg_avp_value_interpret ( struct avp *avp, void *data );
  */
 int fd_msg_bufferize ( struct msg * msg, uint8_t ** buffer, size_t * len );
 
+/*
+ * FUNCTION:	fd_msg_bufferize_iov
+ *
+ * PARAMETERS:
+ *  msg		: A valid msg object. All AVPs must have a value set.
+ *  iov 	: Upon success, points to an array of iovec describing the message in network format.
+ *  iovcnt	: Upon success, the number of elements in the array.
+ *
+ * DESCRIPTION:
+ *   Same as fd_msg_bufferize, but the message is not copied in a single buffer. The headers and small values are
+ *  written in a memory area allocated with the array, and the iovec point directly to the other values where they
+ *  are stored: in the AVP objects, or in the buffer the message was received in (which is then kept allocated).
+ *  The result can be sent with writev / sendmsg. The message must not be modified or freed while the array
+ *  is in use. The array must be released with fd_msg_iov_free.
+ *
+ * RETURN VALUE:
+ *  0      	: The array has been created.
+ *  EINVAL 	: The message is invalid or an AVP has no value.
+ *  ENOMEM	: Unable to allocate enough memory to create the array.
+ */
+int fd_msg_bufferize_iov ( struct msg * msg, struct iovec ** iov, int * iovcnt );
+void fd_msg_iov_free ( struct iovec * iov );
+
 /*
  * FUNCTION:	fd_msg_parse_buffer
  *
@@ -2743,6 +2931,89 @@ int fd_msg_bufferize ( struct msg * msg, uint8_t ** buffer, size_t * len );
  */
 int fd_msg_parse_buffer ( uint8_t ** buffer, size_t buflen, struct msg ** msg );
 
+/*
+ * FUNCTION:	fd_msg_parse_buffer_raw
+ *
+ * PARAMETERS:
+ *  buffer 	: Pointer to a buffer containing a message received from the network.
+ *  buflen	: the size in bytes of the buffer.
+ *  msg		: Upon success, this points to a valid msg object.
+ *
+ * DESCRIPTION:
+ *   Same as fd_msg_parse_buffer, except that only the message header is parsed and the framing of the AVPs is checked.
+ *  The AVP objects are created the first time they are needed (fd_msg_browse, fd_msg_avp_add, fd_msg_parse_dict, ...),
+ *  so the message behaves exactly as if it had been created by fd_msg_parse_buffer. Until then:
+ *   - fd_msg_raw_next can be used to read the AVPs directly in the received buffer;
+ *   - fd_msg_source_setrr appends the Route-Record AVP directly to the buffer (which may move it, see fd_msg_raw_next);
+ *   - fd_msg_sess_get reads the Session-Id directly in the buffer;
+ *   - fd_msg_bufferize only rewrites the header (hop-by-hop id, ...) and copies the buffer.
+ *  This allows a relay to forward a message without ever creating its AVP objects.
+ *
+ * RETURN VALUE:
+ *  Same as fd_msg_parse_buffer.
+ */
+int fd_msg_parse_buffer_raw ( uint8_t ** buffer, size_t buflen, struct msg ** msg );
+
+/*
+ * FUNCTION:	fd_msg_is_raw
+ *
+ * PARAMETERS:
+ *  msg		: A msg object.
+ *
+ * DESCRIPTION:
+ *   Tell if the AVP objects of a message parsed with fd_msg_parse_buffer_raw have not been created yet.
+ *
+ * RETURN VALUE:
+ *  0      	: The message is not raw (or is invalid).
+ *  1		: The AVPs of the message are only in the received buffer, fd_msg_raw_next can be used.
+ */
+int fd_msg_is_raw ( struct msg * msg );
+
+/*
+ * FUNCTION:	fd_msg_raw_next
+ *
+ * PARAMETERS:
+ *  msg		: A raw msg object (see fd_msg_is_raw).
+ *  pos		: Position in the buffer. Must be 0 for the first call, it is updated to the next AVP upon return.
+ *  hdr		: Receives the header of the AVP (code, flags, length, vendor). avp_value is NULL.
+ *  data	: Receives a pointer to the data of the AVP inside the buffer (not '\0'-terminated).
+ *  datalen	: If not NULL, receives the size of the data.
+ *
+ * DESCRIPTION:
+ *   Walk the top-level AVPs of a raw message without creating the AVP objects. The data must not be modified,
+ *  and is valid only while the message is raw and until the next call to fd_msg_source_setrr on this message:
+ *  appending the Route-Record AVP may reallocate the buffer. The positions in *pos remain valid.
+ *
+ * RETURN VALUE:
+ *  0      	: The next AVP has been read.
+ *  ENOENT	: There is no more AVP in the message.
+ *  EINVAL 	: A parameter is invalid, or the message is not raw.
+ */
+int fd_msg_raw_next ( struct msg * msg, size_t * pos, struct avp_hdr * hdr, uint8_t ** data, size_t * datalen );
+
+/*
+ * FUNCTION:	fd_msg_peek_i32
+ *
+ * PARAMETERS:
+ *  msg		: A msg object.
+ *  code	: The code of the AVP to read.
+ *  vendor	: The vendor of the AVP to read, 0 for an AVP without vendor.
+ *  val		: Upon success, receives the value of the AVP.
+ *
+ * DESCRIPTION:
+ *   Read the value of the first top-level Integer32 or Enumerated AVP with this code and vendor, without creating,
+ *  decoding or resolving any AVP object. This works on raw messages, on received messages that were not parsed
+ *  with the dictionary yet, and on messages built locally. It is meant for the code that must look at a message
+ *  without changing how it is processed later (e.g. queue classifiers).
+ *
+ * RETURN VALUE:
+ *  0      	: The value has been read.
+ *  ENOENT	: There is no such AVP in the message.
+ *  EBADMSG	: The AVP was found but does not contain a 32-bit value.
+ *  EINVAL 	: A parameter is invalid.
+ */
+int fd_msg_peek_i32 ( struct msg * msg, uint32_t code, vendor_id_t vendor, int32_t * val );
+
 /* Parsing Error Information structure */
 struct fd_pei {
 	char *		pei_errcode;	/* name of the error code to use */
@@ -2765,10 +3036,12 @@ struct fd_pei {
  *  If the dictionary definition is found, avp_model is set and the value of the AVP is interpreted accordingly and:
  *   - for grouped AVPs, the children AVP are created and interpreted also.
  *   - for numerical AVPs, the value is converted to host byte order and saved in the avp_value field.
- *   - for octetstring AVPs, the string is copied into a new buffer and its address is saved in avp_value.
+ *   - for octetstring AVPs, avp_value points to the string, either directly inside the received buffer or in a copy.
+ *     In both cases the string is followed by a '\0'. Use fd_msg_avp_setvalue to modify it.
  *  If the dictionary definition is not found, avp_model is set to NULL and
  *  the content of the AVP is saved as an octetstring in an internal structure. avp_value is NULL.
- *  As a result, after this function has been called, there is no more dependency of the msg object to the message buffer, that is freed.
+ *  As a result, after this function has been called, the msg object releases the message buffer. This buffer is freed
+ *  when no AVP value points inside it anymore.
  *
  * RETURN VALUE:
  *  0      	: The message has been fully parsed as described.
@@ -2778,6 +3051,27 @@ struct fd_pei {
  */
 int fd_msg_parse_dict ( msg_or_avp * object, struct dictionary * dict, struct fd_pei * error_info );
 
+/*
+ * FUNCTION:	fd_msg_parse_lazy
+ *
+ * PARAMETERS:
+ *  dict	: the dictionary used to decode the AVPs on demand, or NULL to disable the lazy mode.
+ *
+ * DESCRIPTION:
+ *   Enable the on-demand decoding of the AVPs of received messages. In this mode, an AVP of a message that was not
+ *  passed to fd_msg_parse_dict is decoded with this dictionary the first time it is accessed through fd_msg_avp_hdr,
+ *  fd_msg_browse (for the children of a grouped AVP) or fd_msg_search_avp. Only this AVP is decoded: the AVPs inside
+ *  a grouped AVP are split but remain undecoded until they are accessed in turn. This avoids decoding the whole message
+ *  when only a few AVPs are used, for example when it is only relayed.
+ *  Decoding errors are not reported by these functions; the AVP is left undecoded and the error is returned by
+ *  fd_msg_parse_dict, which still decodes all the remaining AVPs of the message when it is called.
+ *  This function should be called once at startup, before messages are received.
+ *
+ * RETURN VALUE:
+ *  0      	: The mode has been changed.
+ */
+int fd_msg_parse_lazy ( struct dictionary * dict );
+
 /*
  * FUNCTION:	fd_msg_parse_rules
  *
@@ -2997,6 +3291,26 @@ int fd_disp_unregister ( struct disp_hdl ** handle, void ** opaque );
 /* Destroy all handlers */
 void fd_disp_unregister_all ( void );
 
+/*
+ * FUNCTION:	fd_disp_getstats
+ *
+ * PARAMETERS:
+ *  handle       : A handle returned by fd_disp_register.
+ *  hits         : If not NULL, the number of times the callback was called is stored here.
+ *  time         : If not NULL, the total time spent in the callback is stored here.
+ *
+ * DESCRIPTION:
+ *   Retrieve the counters maintained for a dispatch callback, for monitoring purpose.
+ *
+ * RETURN VALUE:
+ *  0      	: The counters are returned.
+ *  EINVAL 	: A parameter is invalid.
+ */
+int fd_disp_getstats ( struct disp_hdl * handle, unsigned long long * hits, struct timespec * time );
+
+/* Dump all the registered handlers with their criteria and counters, one per line */
+DECLARE_FD_DUMP_PROTOTYPE(fd_disp_dump);
+
 /*
  * FUNCTION:	fd_msg_dispatch
  *
@@ -3050,6 +3364,30 @@ struct fifo;
  */
 int fd_fifo_new ( struct fifo ** queue, int max );
 
+/*
+ * FUNCTION:	fd_fifo_new_ring
+ *
+ * PARAMETERS:
+ *  queue	: Upon success, a pointer to the new queue is saved here.
+ *  max		: max number of items in the queue, as in fd_fifo_new.
+ *
+ * DESCRIPTION:
+ *  Create a new empty queue that stores its items in a lock-free ring instead of a locked list.
+ * Posting and getting items do not take the queue lock, which is only used to park the threads
+ * while the queue is empty or full. This scales better when many threads share the queue.
+ *  The ring has a fixed capacity of twice max (1024 items if max is 0). When it is full but the
+ * queue accepts more items (max is 0, or fd_fifo_post_noblock), the items overflow in a locked
+ * list until the ring has been emptied, so that fd_fifo_post_noblock never blocks and a queue
+ * without max is not bounded. The queue is otherwise used with the same functions, thresholds
+ * and statistics as the queues created by fd_fifo_new.
+ *
+ * RETURN VALUE :
+ *  0		: The queue has been initialized successfully.
+ *  EINVAL 	: The parameter is invalid.
+ *  ENOMEM	: Not enough memory to complete the creation.
+ */
+int fd_fifo_new_ring ( struct fifo ** queue, int max );
+
 /*
  * FUNCTION:	fd_fifo_set_max
  *
@@ -3065,6 +3403,33 @@ int fd_fifo_new ( struct fifo ** queue, int max );
  */
 int fd_fifo_set_max ( struct fifo * queue, int max );
 
+/*
+ * FUNCTION:	fd_fifo_set_classes
+ *
+ * PARAMETERS:
+ *  queue	: The queue that must order its items by priority.
+ *  nb		: The number of priority classes. Class 0 has the highest priority.
+ *  classify	: Callback that returns the class (0 .. nb-1) of an item, called by the posting thread before the queue is locked.
+ *		  Out of range values are treated as the last class.
+ *  weights	: NULL for strict priority: an item is retrieved from a class only when the higher classes are empty.
+ *		  Otherwise an array of nb positive weights: in each round, up to weights[i] items are retrieved from class i
+ *		  (higher classes first), so that no class starves.
+ *  nb_nolimit	: The items of the nb_nolimit first classes are posted even if the queue has reached its max,
+ *		  so that e.g. answers are not blocked behind requests.
+ *
+ * DESCRIPTION:
+ *  Turn a FIFO queue into a multi-level queue. Each class keeps its items in FIFO order, the items already
+ * in the queue are put in the last class. If the queue already has classes, the classifier and scheduler are
+ * updated (nb must not change). This is not supported with the ring backend.
+ *
+ * RETURN VALUE:
+ *  0		: The queue now uses the classes.
+ *  EINVAL 	: A parameter is invalid.
+ *  ENOTSUP	: The queue uses the ring backend.
+ *  ENOMEM	: Not enough memory.
+ */
+int fd_fifo_set_classes ( struct fifo * queue, int nb, int (*classify)(void * item), int * weights, int nb_nolimit );
+
 /*
  * FUNCTION:	fd_fifo_del
  *
@@ -3121,6 +3486,90 @@ int fd_fifo_move ( struct fifo * oldq, struct fifo * newq, struct fifo ** loc_up
 int fd_fifo_getstats( struct fifo * queue, int * current_count, int * limit_count, int * highest_count, long long * total_count,
 				           struct timespec * total, struct timespec * blocking, struct timespec * last);
 
+/* Distribution of durations measured on a queue, see fd_fifo_getlatency */
+struct fd_fifo_latency {
+	long long	count;	/* Number of durations measured */
+	struct timespec	p50;	/* Percentiles of the durations, with a precision of 12.5% */
+	struct timespec	p90;
+	struct timespec	p99;
+	struct timespec	p999;
+	struct timespec	max;	/* Highest duration measured */
+};
+
+/*
+ * FUNCTION:	fd_fifo_getlatency
+ *
+ * PARAMETERS:
+ *  queue	  : The queue from which to retrieve the information.
+ *  delay	  : If not NULL, the distribution of the time between posting (including blocking) and popping of the items.
+ *  blocking      : If not NULL, the distribution of the time the post calls were blocked because the queue was full.
+ *
+ * DESCRIPTION:
+ *  Retrieve the percentiles of the queueing delay and blocking time of a queue since its creation or the last call to
+ * fd_fifo_resetlatency, for monitoring purpose.
+ * The durations are kept in log-bucketed histograms, so the values are upper bounds with a relative precision of 12.5%.
+ *
+ * RETURN VALUE:
+ *  0		: The statistics have been updated.
+ *  EINVAL 	: A parameter is invalid.
+ */
+int fd_fifo_getlatency( struct fifo * queue, struct fd_fifo_latency * delay, struct fd_fifo_latency * blocking);
+
+/*
+ * FUNCTION:	fd_fifo_resetlatency
+ *
+ * PARAMETERS:
+ *  queue	  : The queue whose distributions are reset.
+ *
+ * DESCRIPTION:
+ *  Empty the histograms of the queueing delay and blocking time of a queue, including those of its priority classes.
+ * A monitor that reads the percentiles with fd_fifo_getlatency and then calls this function at a fixed period gets the
+ * distribution over each period, like the rates of fd_fifo_getrates, instead of the distribution since the creation.
+ * The reset is seen by all the readers of the queue statistics. The durations measured while the reset runs may be lost.
+ *
+ * RETURN VALUE:
+ *  0		: The histograms have been reset.
+ *  EINVAL 	: A parameter is invalid.
+ */
+int fd_fifo_resetlatency( struct fifo * queue );
+
+/*
+ * FUNCTION:	fd_fifo_getrates
+ *
+ * PARAMETERS:
+ *  queue	  : The queue from which to retrieve the information.
+ *  rate_1s	  : If not NULL, the number of items popped during the last complete second.
+ *  rate_10s	  : If not NULL, the average number of items popped per second during the last 10 complete seconds.
+ *  rate_60s	  : If not NULL, the same over the last 60 complete seconds.
+ *
+ * DESCRIPTION:
+ *  Retrieve the throughput of a queue over sliding windows, for monitoring purpose.
+ *
+ * RETURN VALUE:
+ *  0		: The statistics have been updated.
+ *  EINVAL 	: A parameter is invalid.
+ */
+int fd_fifo_getrates( struct fifo * queue, double * rate_1s, double * rate_10s, double * rate_60s);
+
+/*
+ * FUNCTION:	fd_fifo_getclassstats
+ *
+ * PARAMETERS:
+ *  queue	  : The queue from which to retrieve the information.
+ *  cls		  : The priority class (see fd_fifo_set_classes). A queue without classes only has the class 0.
+ *  current_count : If not NULL, the number of items of this class currently in the queue.
+ *  total_count   : If not NULL, the number of items of this class retrieved from the queue.
+ *  delay	  : If not NULL, the distribution of the time these items spent in the queue.
+ *
+ * DESCRIPTION:
+ *  Retrieve the statistics of a priority class of a queue, for monitoring purpose.
+ *
+ * RETURN VALUE:
+ *  0		: The statistics have been updated.
+ *  EINVAL 	: A parameter is invalid, or the class does not exist.
+ */
+int fd_fifo_getclassstats( struct fifo * queue, int cls, int * current_count, long long * total_count, struct fd_fifo_latency * delay);
+
 /*
  * FUNCTION:	fd_fifo_length
  *
@@ -3192,6 +3641,28 @@ int fd_fifo_post_int ( struct fifo * queue, void ** item );
 only for failure recovery for example. */
 int fd_fifo_post_noblock( struct fifo * queue, void ** item );
 
+/*
+ * FUNCTION:	fd_fifo_post_batch
+ *
+ * PARAMETERS:
+ *  queue	: The queue in which the elements must be posted.
+ *  items	: Array of the elements that are put in the queue, in this order.
+ *  nb		: Number of elements in items.
+ *
+ * DESCRIPTION:
+ *  Same as calling fd_fifo_post for each element, but the queue is locked and the waiting
+ * threads are woken up once for all the elements, as long as the queue has room for them.
+ * The posted elements are set to NULL in items.
+ *
+ * RETURN VALUE:
+ *  0		: The elements are queued.
+ *  EINVAL 	: A parameter is invalid.
+ *  ENOMEM 	: Not enough memory to complete the operation (some elements may have been queued).
+ */
+int fd_fifo_post_batch_int ( struct fifo * queue, void ** items, int nb );
+#define fd_fifo_post_batch(queue, items, nb) \
+	fd_fifo_post_batch_int((queue), (void *)(items), (nb))
+
 /*
  * FUNCTION:	fd_fifo_get
  *
@@ -3254,6 +3725,39 @@ int fd_fifo_timedget_int ( struct fifo * queue, void ** item, const struct times
 #define fd_fifo_timedget(queue, item, abstime) \
 	fd_fifo_timedget_int((queue), (void *)(item), (abstime))
 
+/*
+ * FUNCTION:	fd_fifo_get_batch, fd_fifo_tryget_batch, fd_fifo_timedget_batch
+ *
+ * PARAMETERS:
+ *  queue	: The queue from which the elements must be retrieved.
+ *  items	: Array where the retrieved elements are stored, in the queue order.
+ *  max		: Size of the items array.
+ *  nb		: On return, the number of elements stored in items.
+ *  abstime	: (timedget only) the absolute time until which we allow waiting for an element.
+ *
+ * DESCRIPTION:
+ *  These functions are similar to fd_fifo_get, fd_fifo_tryget and fd_fifo_timedget, but they 
+ * retrieve up to max elements at once, with a single lock of the queue. They wait (or not)
+ * only for the first element. When other threads are waiting on the same queue, the 
+ * elements are shared with them instead of being all retrieved by the caller.
+ *
+ * RETURN VALUE:
+ *  0		: At least one element has been retrieved.
+ *  EINVAL 	: A parameter is invalid.
+ *  EWOULDBLOCK : (tryget only) The queue was empty.
+ *  ETIMEDOUT   : (timedget only) The time out has passed and no item has been received.
+ *  EPIPE	: The queue is being destroyed.
+ */
+int fd_fifo_get_batch_int ( struct fifo * queue, void ** items, int max, int * nb );
+#define fd_fifo_get_batch(queue, items, max, nb) \
+	fd_fifo_get_batch_int((queue), (void *)(items), (max), (nb))
+int fd_fifo_tryget_batch_int ( struct fifo * queue, void ** items, int max, int * nb );
+#define fd_fifo_tryget_batch(queue, items, max, nb) \
+	fd_fifo_tryget_batch_int((queue), (void *)(items), (max), (nb))
+int fd_fifo_timedget_batch_int ( struct fifo * queue, void ** items, int max, int * nb, const struct timespec *abstime );
+#define fd_fifo_timedget_batch(queue, items, max, nb, abstime) \
+	fd_fifo_timedget_batch_int((queue), (void *)(items), (max), (nb), (abstime))
+
 
 /*
  * FUNCTION:	fd_fifo_select
@@ -3274,6 +3778,29 @@ int fd_fifo_timedget_int ( struct fifo * queue, void ** item, const struct times
  */
 int fd_fifo_select ( struct fifo * queue, const struct timespec *abstime );
 
+/*
+ * FUNCTION:	fd_fifo_get_fd
+ *
+ * PARAMETERS:
+ *  queue	: The queue to monitor.
+ *  fd		: (out) A file descriptor that is readable while the queue contains items.
+ *
+ * DESCRIPTION:
+ *  Attach an eventfd to the queue, so that it can be monitored with poll / epoll together with
+ * sockets or other queues, instead of blocking a thread in fd_fifo_get. The descriptor is signaled
+ * when the queue becomes non-empty and reset when it becomes empty again (level-triggered).
+ * When it is readable, retrieve the items with fd_fifo_tryget (or fd_fifo_tryget_batch) until EWOULDBLOCK;
+ * the readiness may be spurious if another thread got the items first.
+ *  The descriptor belongs to the queue: the caller must not read, write or close it. It is created on the
+ * first call (the following calls return the same descriptor) and closed by fd_fifo_del.
+ *
+ * RETURN VALUE:
+ *  0		: The descriptor is returned in *fd.
+ *  EINVAL 	: A parameter is invalid.
+ *  errno of eventfd otherwise.
+ */
+int fd_fifo_get_fd ( struct fifo * queue, int * fd );
+
 
 
 /* Dump a fifo list and optionally its inner elements -- beware of deadlocks! */
@@ -39,6 +39,7 @@
 #include <net/if.h>
 #include <ifaddrs.h> /* for getifaddrs */
 #include <sys/uio.h> /* writev */
+#include <limits.h> /* IOV_MAX */
 
 /* The maximum size of Diameter message we accept to receive (<= 2^24) to avoid too big mallocs in case of trashed headers */
 #ifndef DIAMETER_MSG_SIZE_MAX
@@ -627,7 +628,7 @@ void fd_cnx_markerror(struct cnxctx * conn)
 	/* Report the error if not reported yet, and not closing */
 	if (!fd_cnx_teststate(conn, CC_STATUS_CLOSING | CC_STATUS_SIGNALED ))  {
 		TRACE_DEBUG(FULL, "Sending FDEVP_CNX_ERROR event");
-		CHECK_FCT_DO( fd_event_send( fd_cnx_target_queue(conn), FDEVP_CNX_ERROR, 0, NULL), goto fatal);
+		CHECK_FCT_DO( (conn->cc_reactor ? fd_event_send_noblock : fd_event_send)( fd_cnx_target_queue(conn), FDEVP_CNX_ERROR, 0, NULL), goto fatal);
 		fd_cnx_addstate(conn, CC_STATUS_SIGNALED);
 	}
 
@@ -693,6 +694,26 @@ again:
 	return ret;
 }
 
+/* The pull function of the TLS sessions read by the I/O threads: it does not wait for data, gnutls_record_recv returns GNUTLS_E_AGAIN instead */
+static ssize_t fd_cnx_s_recv_nb(struct cnxctx * conn, void *buffer, size_t length)
+{
+	ssize_t ret;
+
+	ret = recv(conn->cc_socket, buffer, length, MSG_DONTWAIT);
+	if ((ret < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))) {
+		gnutls_transport_set_errno(conn->cc_tls_para.session, (errno == EINTR) ? EINTR : EAGAIN);
+		return -1;
+	}
+
+	/* Mark the error */
+	if (ret <= 0) {
+		CHECK_SYS_DO(ret, /* continue, this is only used to log the error here */);
+		fd_cnx_markerror(conn);
+	}
+
+	return ret;
+}
+
 /* Send */
 static ssize_t fd_cnx_s_sendv(struct cnxctx * conn, const struct iovec * iov, int iovcnt)
 {
@@ -778,10 +799,85 @@ static void free_rcvdata(void * arg)
 	free(data->buffer);
 }
 
+/* Rebuild the message boundaries in data received on a TCP stream, and pass the complete messages. The incomplete
+ message is kept in the connection until the next call. The number of messages passed is added to count.
+ Returns ENOTCONN if the stream is invalid (the error was signaled), or another error code if it is fatal. */
+int fd_cnx_rcv_stream(struct cnxctx * conn, uint8_t * data, size_t len, int * count)
+{
+	struct cnx_stream * st = &conn->cc_stream;
+
+	while (len) {
+		struct fd_cnx_rcvdata rcv_data;
+		size_t n;
+		int ret;
+
+		if (!st->msg.buffer) {
+			size_t length;
+
+			/* Receive the header of the next message */
+			n = (len < sizeof(st->header) - st->hdrlen) ? len : sizeof(st->header) - st->hdrlen;
+			memcpy(st->header + st->hdrlen, data, n);
+			st->hdrlen += n;
+			data += n;
+			len -= n;
+
+			length = ((size_t)st->header[1] << 16) + ((size_t)st->header[2] << 8) + (size_t)st->header[3];
+
+			/* Check the received word is a valid beginning of a Diameter message */
+			if ((st->header[0] != DIAMETER_VERSION)	/* defined in <libfdproto.h> */
+			   || ((st->hdrlen == sizeof(st->header)) && ((length < sizeof(st->header)) || (length > DIAMETER_MSG_SIZE_MAX)))) { /* to avoid too big mallocs */
+				/* The message is suspect */
+				LOG_E( "Received suspect header [ver: %d, size: %zd] from '%s', assuming disconnection", (int)st->header[0], length, conn->cc_remid);
+				fd_cnx_markerror(conn);
+				return ENOTCONN; /* The recipient of the event will cleanup */
+			}
+
+			if (st->hdrlen < sizeof(st->header))
+				break;
+
+			/* Ok, now we can really receive the data */
+			CHECK_MALLOC( st->msg.buffer = fd_cnx_alloc_msg_buffer( length, &st->pmdl ) );
+			st->msg.length = length;
+			memcpy(st->msg.buffer, st->header, sizeof(st->header));
+			st->received = sizeof(st->header);
+			st->hdrlen = 0;
+		}
+
+		n = st->msg.length - st->received;
+		if (n > len)
+			n = len;
+		memcpy(st->msg.buffer + st->received, data, n);
+		st->received += n;
+		data += n;
+		len -= n;
+
+		if (st->received < st->msg.length)
+			break;
+
+		fd_hook_call(HOOK_DATA_RECEIVED, NULL, NULL, &st->msg, st->pmdl);
+
+		/* We have received a complete message, pass it to the daemon. An I/O thread does not wait for room in the
+		 queue since it serves other connections, it stops reading this one instead (see rct_read) */
+		rcv_data = st->msg;
+		st->msg.buffer = NULL;
+		CHECK_FCT_DO( ret = (conn->cc_reactor ? fd_event_send_noblock : fd_event_send)( fd_cnx_target_queue(conn), FDEVP_CNX_MSG_RECV, rcv_data.length, rcv_data.buffer),
+			{
+				free_rcvdata(&rcv_data);
+				return ret;
+			} );
+		(*count)++;
+	}
+
+	return 0;
+}
+
 /* Receiver thread (TCP & noTLS) : incoming message is directly saved into the target queue */
 static void * rcvthr_notls_tcp(void * arg)
 {
 	struct cnxctx * conn = arg;
+	uint8_t * chunk;
+	int count = 0;
+	int ret = 0;
 
 	TRACE_ENTRY("%p", arg);
 	CHECK_PARAMS_DO(conn && (conn->cc_socket > 0), goto out);
@@ -797,63 +893,32 @@ static void * rcvthr_notls_tcp(void * arg)
 	ASSERT( ! fd_cnx_teststate(conn, CC_STATUS_TLS ) );
 	ASSERT( fd_cnx_target_queue(conn) );
 
-	/* Receive from a TCP connection: we have to rebuild the message boundaries */
+	/* Receive from a TCP connection: we have to rebuild the message boundaries. The stream is read by chunks,
+	 all the complete messages in a chunk are passed at once. */
+	CHECK_MALLOC_DO( chunk = malloc(RCV_CHUNK_SIZE), goto fatal );
+	pthread_cleanup_push(free, chunk);
 	do {
-		uint8_t header[4];
-		struct fd_cnx_rcvdata rcv_data;
-		struct fd_msg_pmdl *pmdl=NULL;
-		ssize_t ret = 0;
-		size_t	received = 0;
-
-		do {
-			ret = fd_cnx_s_recv(conn, &header[received], sizeof(header) - received);
-			if (ret <= 0) {
-				goto out; /* Stop the thread, the event was already sent */
-			}
-
-			received += ret;
-
-			if (header[0] != DIAMETER_VERSION)
-				break; /* No need to wait for 4 bytes in this case */
-		} while (received < sizeof(header));
-
-		rcv_data.length = ((size_t)header[1] << 16) + ((size_t)header[2] << 8) + (size_t)header[3];
-
-		/* Check the received word is a valid beginning of a Diameter message */
-		if ((header[0] != DIAMETER_VERSION)	/* defined in <libfdproto.h> */
-		   || (rcv_data.length > DIAMETER_MSG_SIZE_MAX)) { /* to avoid too big mallocs */
-			/* The message is suspect */
-			LOG_E( "Received suspect header [ver: %d, size: %zd] from '%s', assuming disconnection", (int)header[0], rcv_data.length, conn->cc_remid);
-			fd_cnx_markerror(conn);
-			goto out; /* Stop the thread, the recipient of the event will cleanup */
-		}
-
-		/* Ok, now we can really receive the data */
-		CHECK_MALLOC_DO(  rcv_data.buffer = fd_cnx_alloc_msg_buffer( rcv_data.length, &pmdl ), goto fatal );
-		memcpy(rcv_data.buffer, header, sizeof(header));
-
-		while (received < rcv_data.length) {
-			pthread_cleanup_push(free_rcvdata, &rcv_data); /* In case we are canceled, clean the partially built buffer */
-			ret = fd_cnx_s_recv(conn, rcv_data.buffer + received, rcv_data.length - received);
-			pthread_cleanup_pop(0);
-
-			if (ret <= 0) {
-				free_rcvdata(&rcv_data);
-				goto out;
-			}
-			received += ret;
+		ssize_t received;
+		size_t want = RCV_CHUNK_SIZE;
+
+		if (!conn->cc_loop) {
+			/* Do not read past the first message, the next data is not for this thread (e.g. TLS handshake) */
+			if (conn->cc_stream.msg.buffer)
+				want = conn->cc_stream.msg.length - conn->cc_stream.received;
+			else
+				want = sizeof(conn->cc_stream.header) - conn->cc_stream.hdrlen;
 		}
 
-		fd_hook_call(HOOK_DATA_RECEIVED, NULL, NULL, &rcv_data, pmdl);
+		received = fd_cnx_s_recv(conn, chunk, want);
+		if (received <= 0)
+			break; /* Stop the thread, the event was already sent */
 
-		/* We have received a complete message, pass it to the daemon */
-		CHECK_FCT_DO( fd_event_send( fd_cnx_target_queue(conn), FDEVP_CNX_MSG_RECV, rcv_data.length, rcv_data.buffer),
-			{
-				free_rcvdata(&rcv_data);
-				goto fatal;
-			} );
+		ret = fd_cnx_rcv_stream(conn, chunk, received, &count);
+	} while ((ret == 0) && (conn->cc_loop || !count));
+	pthread_cleanup_pop(1);
 
-	} while (conn->cc_loop);
+	if (ret && (ret != ENOTCONN))
+		goto fatal;
 
 out:
 	TRACE_DEBUG(FULL, "Thread terminated");
@@ -934,6 +999,11 @@ int fd_cnx_start_clear(struct cnxctx * conn, int loop)
 
 	switch (conn->cc_proto) {
 		case IPPROTO_TCP:
+			if (loop && fd_g_config->cnf_io_thr) {
+				/* The I/O threads receive the messages */
+				CHECK_FCT( fd_reactor_add(conn) );
+				break;
+			}
 			/* Start the tcp_notls thread */
 			CHECK_POSIX( pthread_create( &conn->cc_rcvthr, NULL, rcvthr_notls_tcp, conn ) );
 			break;
@@ -1004,6 +1074,88 @@ end:
 	return ret;
 }
 
+/* Read the data available on a connection without waiting, for the I/O threads. The TLS sessions are decrypted here.
+ Returns the size of the data, or -1 with errno set to EAGAIN if no data is available. On other errors, the connection is
+ marked in error and 0 or -1 is returned. */
+ssize_t fd_cnx_rcv_nb(struct cnxctx * conn, uint8_t * buf, size_t len)
+{
+	gnutls_session_t session = conn->cc_tls_para.session;
+	ssize_t ret;
+
+	if (!fd_cnx_teststate(conn, CC_STATUS_TLS)) {
+		ret = recv(conn->cc_socket, buf, len, MSG_DONTWAIT);
+		if ((ret < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))) {
+			errno = EAGAIN;
+			return -1;
+		}
+		if (ret <= 0) {
+			CHECK_SYS_DO(ret, /* continue, this is only used to log the error here */);
+			fd_cnx_markerror(conn);
+		}
+		return ret;
+	}
+
+again:
+	/* Not CHECK_GNUTLS_DO, GNUTLS_E_AGAIN is the normal end of the data */
+	GNUTLS_TRACE( ret = gnutls_record_recv(session, buf, len) );
+	if (ret > 0)
+		return ret;
+
+	switch (ret) {
+		case GNUTLS_E_AGAIN:
+			errno = EAGAIN;
+			return -1;
+
+		case GNUTLS_E_INTERRUPTED:
+			goto again;
+
+		case GNUTLS_E_REHANDSHAKE:
+			/* The handshake is not driven by the I/O thread events, it waits for the data as in the receiver threads */
+			if (!fd_cnx_teststate(conn, CC_STATUS_CLOSING)) {
+				GNUTLS_TRACE( gnutls_transport_set_pull_function(session, (void *)fd_cnx_s_recv) );
+				CHECK_GNUTLS_DO( ret = gnutls_handshake(session),
+					{
+						if (TRACE_BOOL(INFO)) {
+							fd_log_debug("TLS re-handshake failed on socket %d (%s) : %s", conn->cc_socket, conn->cc_id, gnutls_strerror(ret));
+						}
+					} );
+				GNUTLS_TRACE( gnutls_transport_set_pull_function(session, (void *)fd_cnx_s_recv_nb) );
+				if (ret == 0)
+					goto again;
+			}
+			break;
+
+		case 0:
+			/* The remote peer closed the session, do not wait for more data */
+			CHECK_GNUTLS_DO( gnutls_bye(session, GNUTLS_SHUT_WR),  );
+			break;
+
+		case GNUTLS_E_UNEXPECTED_PACKET_LENGTH:
+			/* The connection is closed */
+			TRACE_DEBUG(FULL, "Got 0 size while reading the socket, probably connection closed...");
+			break;
+
+		default:
+			if (gnutls_error_is_fatal (ret) == 0) {
+				LOG_N("Ignoring non-fatal GNU TLS error: %s", gnutls_strerror (ret));
+				goto again;
+			}
+			LOG_E("Fatal GNUTLS error: %s", gnutls_strerror (ret));
+	}
+
+	fd_cnx_markerror(conn);
+	return 0;
+}
+
+/* Size of the data already received on a connection and not returned yet by fd_cnx_rcv_nb. GnuTLS reads the records
+ from the socket and may keep decrypted data, which epoll does not report. */
+size_t fd_cnx_rcv_pending(struct cnxctx * conn)
+{
+	if (!fd_cnx_teststate(conn, CC_STATUS_TLS))
+		return 0;
+	return gnutls_record_check_pending(conn->cc_tls_para.session);
+}
+
 /* Wrapper around gnutls_record_send to handle some error codes. This is also used for DTLS-protected associations */
 static ssize_t fd_tls_send_handle_error(struct cnxctx * conn, gnutls_session_t session, void * data, size_t sz)
 {
@@ -1513,7 +1665,11 @@ int fd_cnx_handshake(struct cnxctx * conn, int mode, int algo, char * priority,
 #endif /* DISABLE_SCTP */
 	} else {
 		/* Start decrypting the data */
-		if (!dtls) {
+		if ((!dtls) && (conn->cc_proto == IPPROTO_TCP) && fd_g_config->cnf_io_thr) {
+			/* The I/O threads decrypt the data, the session must not wait for it anymore */
+			GNUTLS_TRACE( gnutls_transport_set_pull_function(conn->cc_tls_para.session, (void *)fd_cnx_s_recv_nb) );
+			CHECK_FCT( fd_reactor_add(conn) );
+		} else if (!dtls) {
 			CHECK_POSIX( pthread_create( &conn->cc_rcvthr, NULL, rcvthr_tls_single, conn ) );
 		} else {
 			TODO("Signal the dtls_push function that multiple streams can be used from this point.");
@@ -1555,7 +1711,7 @@ int fd_cnx_receive(struct cnxctx * conn, struct timespec * timeout, unsigned cha
 
 	TRACE_ENTRY("%p %p %p %p", conn, timeout, buf, len);
 	CHECK_PARAMS(conn && (conn->cc_socket > 0) && buf && len);
-	CHECK_PARAMS(conn->cc_rcvthr != (pthread_t)NULL);
+	CHECK_PARAMS((conn->cc_rcvthr != (pthread_t)NULL) || conn->cc_reactor);
 	CHECK_PARAMS(conn->cc_alt == NULL);
 
 	/* Now, pull the first event */
@@ -1713,6 +1869,56 @@ int fd_cnx_send(struct cnxctx * conn, unsigned char * buf, size_t len)
 	return 0;
 }
 
+/* Send a message given as an array of iovec (see fd_msg_bufferize_iov). The array is modified. */
+int fd_cnx_sendv(struct cnxctx * conn, struct iovec * iov, int iovcnt)
+{
+	TRACE_ENTRY("%p %p %d", conn, iov, iovcnt);
+
+	CHECK_PARAMS(conn && (conn->cc_socket > 0) && (! fd_cnx_teststate(conn, CC_STATUS_ERROR)) && iov && iovcnt);
+
+	/* TLS records and SCTP streams are sent from a single buffer */
+	if ((conn->cc_proto != IPPROTO_TCP) || fd_cnx_teststate(conn, CC_STATUS_TLS)) {
+		unsigned char * buf;
+		size_t len = 0, offset = 0;
+		int i, ret;
+
+		for (i = 0; i < iovcnt; i++)
+			len += iov[i].iov_len;
+		CHECK_MALLOC( buf = malloc(len) );
+		for (i = 0; i < iovcnt; i++) {
+			memcpy(buf + offset, iov[i].iov_base, iov[i].iov_len);
+			offset += iov[i].iov_len;
+		}
+
+		pthread_cleanup_push( free, buf );
+		ret = fd_cnx_send(conn, buf, len);
+		pthread_cleanup_pop( 1 );
+		return ret;
+	}
+
+	TRACE_DEBUG(FULL, "Sending %d iovec on connection %s", iovcnt, conn->cc_id);
+
+	while (iovcnt) {
+		ssize_t ret;
+		CHECK_SYS_DO( ret = fd_cnx_s_sendv(conn, iov, iovcnt > IOV_MAX ? IOV_MAX : iovcnt), );
+		if (ret <= 0)
+			return ENOTCONN;
+
+		/* Skip the data that was sent */
+		while (iovcnt && ((size_t)ret >= iov->iov_len)) {
+			ret -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt) {
+			iov->iov_base = (uint8_t *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+
+	return 0;
+}
+
 
 /**************************************/
 /*     Destruction of connection      */
@@ -1779,6 +1985,9 @@ void fd_cnx_destroy(struct cnxctx * conn)
 				CHECK_FCT_DO( fd_thr_term(&conn->cc_rcvthr), /* continue */ );
 			}
 
+			/* The I/O thread must not use the session anymore */
+			fd_reactor_del(conn);
+
 			/* Free the resources of the TLS session */
 			if (conn->cc_tls_para.session) {
 				GNUTLS_TRACE( gnutls_deinit(conn->cc_tls_para.session) );
@@ -1791,6 +2000,11 @@ void fd_cnx_destroy(struct cnxctx * conn)
 
 	/* Terminate the thread in case it is not done yet -- is there any such case left ?*/
 	CHECK_FCT_DO( fd_thr_term(&conn->cc_rcvthr), /* continue */ );
+	fd_reactor_del(conn);
+
+	/* Partially received message */
+	if (conn->cc_stream.msg.buffer)
+		free_rcvdata(&conn->cc_stream.msg);
 
 	/* Shut the connection down */
 	if (conn->cc_socket > 0) {
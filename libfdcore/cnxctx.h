@@ -60,6 +60,19 @@ struct cnxctx {
 	pthread_t	cc_rcvthr;	/* thread for receiving messages on the connection */
 	int		cc_loop;	/* tell the thread if it loops or stops after the first message is received */
 
+	struct rct_thread * cc_reactor;	/* the I/O thread receiving on this connection instead of cc_rcvthr (IOThreads), TCP only */
+	uint32_t	cc_rct_gen;	/* identifies the registration in the I/O thread */
+	int		cc_rct_paused;	/* the I/O thread does not read this connection until its target queue has room */
+
+	/* If cc_proto == TCP and no TLS, or TLS in an I/O thread: rebuild the message boundaries in the stream */
+	struct cnx_stream {
+		uint8_t		 header[4];	/* beginning of the next message */
+		size_t		 hdrlen;
+		struct fd_cnx_rcvdata msg;	/* the message being received, buffer is NULL if none */
+		struct fd_msg_pmdl * pmdl;
+		size_t		 received;
+	}		cc_stream;
+
 	struct fifo *	cc_incoming;	/* FIFO queue of events received on the connection, FDEVP_CNX_* */
 	struct fifo *	cc_alt;		/* alternate fifo to send FDEVP_CNX_* events to. */
 
@@ -99,6 +112,16 @@ struct fifo * fd_cnx_target_queue(struct cnxctx * conn);
 ssize_t fd_cnx_s_recv(struct cnxctx * conn, void *buffer, size_t length);
 void fd_cnx_s_setto(int sock);
 
+/* TCP stream */
+#define RCV_CHUNK_SIZE	65536	/* Size of the buffer in which the TCP stream is received */
+int fd_cnx_rcv_stream(struct cnxctx * conn, uint8_t * data, size_t len, int * count);
+ssize_t fd_cnx_rcv_nb(struct cnxctx * conn, uint8_t * buf, size_t len);
+size_t fd_cnx_rcv_pending(struct cnxctx * conn);
+
+/* I/O threads (reactor.c) */
+int  fd_reactor_add(struct cnxctx * conn);
+void fd_reactor_del(struct cnxctx * conn);
+
 /* TLS */
 int fd_tls_rcvthr_core(struct cnxctx * conn, gnutls_session_t session);
 int fd_tls_prepare(gnutls_session_t * session, int mode, int dtls, char * priority, void * alt_creds);
@@ -66,8 +66,12 @@ int fd_conf_init()
 	fd_g_config->cnf_qin_limit = 20;
 	fd_g_config->cnf_qout_limit = 30;
 	fd_g_config->cnf_qlocal_limit = 25;
+	fd_g_config->cnf_send_batch = 32;
+	fd_g_config->cnf_send_delay = 0;
+	fd_g_config->cnf_prio_sched = 0;
 	fd_list_init(&fd_g_config->cnf_endpoints, NULL);
 	fd_list_init(&fd_g_config->cnf_apps, NULL);
+	fd_list_init(&fd_g_config->cnf_disp_pools, NULL);
 	#ifdef DISABLE_SCTP
 	fd_g_config->cnf_flags.no_sctp = 1;
 	#endif /* DISABLE_SCTP */
@@ -105,12 +109,36 @@ DECLARE_FD_DUMP_PROTOTYPE(fd_conf_dump)
 	CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "  Number of SCTP streams . : %hu\n", fd_g_config->cnf_sctp_str), return NULL);
 	CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "  Number of clients thr .. : %d\n", fd_g_config->cnf_thr_srv), return NULL);
 	CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "  Number of app threads .. : %hu\n", fd_g_config->cnf_dispthr), return NULL);
+	if (!FD_IS_LIST_EMPTY(&fd_g_config->cnf_disp_pools)) {
+		struct fd_list * li;
+		CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "  Dispatch pools ......... : "), return NULL);
+		for (li = fd_g_config->cnf_disp_pools.next; li != &fd_g_config->cnf_disp_pools; li = li->next) {
+			struct fd_disp_pool * pool = (struct fd_disp_pool *)li;
+			CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "App: %u,Thr:%hu,Q:%d%s%s\t", 
+					pool->appid, pool->threads, pool->qlimit,
+					pool->cpus ? ",CPU:" : "", pool->cpus ?: ""), return NULL);
+		}
+		CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "\n"), return NULL);
+	}
 	CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "  Minimal processing peers : %d\n", fd_g_config->cnf_processing_peers_minimum), return NULL);
 	CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "  Number of rtin threads . : %hu\n", fd_g_config->cnf_rtinthr), return NULL);
 	CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "  Number of rtout threads  : %hu\n", fd_g_config->cnf_rtoutthr), return NULL);
+	if (fd_g_config->cnf_rt_cache) {
+		CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "  Routing cache .......... : %d entries%s%s\n", fd_g_config->cnf_rt_cache, 
+					fd_g_config->cnf_rt_cache_avp ? ", key AVP " : "", fd_g_config->cnf_rt_cache_avp ?: ""), return NULL);
+	} else {
+		CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "  Routing cache .......... : Disabled\n"), return NULL);
+	}
+	CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "  Number of I/O threads .. : %hu\n", fd_g_config->cnf_io_thr), return NULL);
+	CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "  Number of parsing thr .. : %hu\n", fd_g_config->cnf_parse_thr), return NULL);
 	CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "  Incoming queue limit     : %d\n", fd_g_config->cnf_qin_limit), return NULL);
 	CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "  Outgoing queue limit     : %d\n", fd_g_config->cnf_qout_limit), return NULL);
 	CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "  Local queue limit        : %d\n", fd_g_config->cnf_qlocal_limit), return NULL);
+	CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "  Lock-free queues ....... : %s\n", fd_g_config->cnf_flags.lf_queues ? "Enabled" : "Disabled"), return NULL);
+	CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "  Send batch size ........ : %d (delay %dus)\n", fd_g_config->cnf_send_batch, fd_g_config->cnf_send_delay), return NULL);
+	CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "  Priority queues ........ : %s\n", 
+				(fd_g_config->cnf_prio_sched == FD_PRIO_SCHED_STRICT) ? "Strict" : 
+				(fd_g_config->cnf_prio_sched == FD_PRIO_SCHED_WEIGHTED) ? "Weighted" : "Disabled (FIFO)"), return NULL);
 	if (FD_IS_LIST_EMPTY(&fd_g_config->cnf_endpoints)) {
 		CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "  Local endpoints ........ : Default (use all available)\n"), return NULL);
 	} else {
@@ -146,6 +174,9 @@ DECLARE_FD_DUMP_PROTOTYPE(fd_conf_dump)
 	CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "          - Pref. proto .. : %s\n", fd_g_config->cnf_flags.pr_tcp ? "TCP" : "SCTP"), return NULL);
 	CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "          - TLS method ... : %s\n", fd_g_config->cnf_flags.tls_alg ? "INBAND" : "Separate port"), return NULL);
 	CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "          - Client bind .. : %s\n", fd_g_config->cnf_flags.no_bind ? "DISABLED" : "Enabled"), return NULL);
+	CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "          - Msg pools .... : %s\n", fd_g_config->cnf_flags.msg_pools ? (fd_g_config->cnf_flags.msg_huge ? "Enabled (huge pages)" : "Enabled") : "Disabled"), return NULL);
+	CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "          - Lazy parsing . : %s\n", fd_g_config->cnf_flags.lazy_parse ? "Enabled" : "Disabled"), return NULL);
+	CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "          - Raw relay .... : %s\n", fd_g_config->cnf_flags.raw_relay ? "Enabled" : "Disabled"), return NULL);
 	
 	CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "  TLS :   - Certificate .. : %s\n", fd_g_config->cnf_sec_data.cert_file ?: "(NONE)"), return NULL);
 	CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "          - Private key .. : %s\n", fd_g_config->cnf_sec_data.key_file ?: "(NONE)"), return NULL);
@@ -158,6 +189,7 @@ DECLARE_FD_DUMP_PROTOTYPE(fd_conf_dump)
 		CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "          - DH bits ...... : %d\n", fd_g_config->cnf_sec_data.dh_bits ?: GNUTLS_DEFAULT_DHBITS), return NULL);
 	}
 	
+	CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "  Dictionary image ....... : %s\n", fd_g_config->cnf_dict_image ?: "(none)"), return NULL);
 	CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "  Origin-State-Id ........ : %u", fd_g_config->cnf_orstateid), return NULL);
 	
 	return *buf;
@@ -362,6 +394,16 @@ int fd_conf_parse()
 		}
 	}
 	
+	/* Switch the messages allocations to the pools if requested */
+	if (fd_g_config->cnf_flags.msg_pools) {
+		CHECK_FCT( fd_msg_pool_enable(fd_g_config->cnf_flags.msg_huge) );
+	}
+	
+	/* Decode the received AVPs only when they are used */
+	if (fd_g_config->cnf_flags.lazy_parse) {
+		CHECK_FCT( fd_msg_parse_lazy(fd_g_config->cnf_dict) );
+	}
+	
 	/* Configure TLS default parameters */
 	if ((!fd_g_config->cnf_sec_data.tls_disabled) && (!fd_g_config->cnf_sec_data.prio_string)) {
 		const char * err_pos = NULL;
@@ -558,6 +600,8 @@ int fd_conf_deinit()
 	
 	/* Destroy dictionary */
 	CHECK_FCT_DO( fd_dict_fini(&fd_g_config->cnf_dict), );
+	free(fd_g_config->cnf_dict_image); fd_g_config->cnf_dict_image = NULL;
+	free(fd_g_config->cnf_rt_cache_avp); fd_g_config->cnf_rt_cache_avp = NULL;
 	
 	/* Destroy the main event queue */
 	CHECK_FCT_DO( fd_fifo_del(&fd_g_config->cnf_main_ev), );
@@ -565,6 +609,12 @@ int fd_conf_deinit()
 	/* Destroy the local endpoints and applications */
 	CHECK_FCT_DO(fd_ep_filter(&fd_g_config->cnf_endpoints, 0 ), );
 	CHECK_FCT_DO(fd_app_empty(&fd_g_config->cnf_apps ), );
+	while (!FD_IS_LIST_EMPTY(&fd_g_config->cnf_disp_pools)) {
+		struct fd_disp_pool * pool = (struct fd_disp_pool *)fd_g_config->cnf_disp_pools.next;
+		fd_list_unlink(&pool->chain);
+		free(pool->cpus);
+		free(pool);
+	}
 	
 	/* Destroy the local identity */	
 	free(fd_g_config->cnf_diamid); fd_g_config->cnf_diamid = NULL;
@@ -100,6 +100,8 @@ static void core_shutdown(void)
 	CHECK_FCT_DO( fd_servers_stop(), /* Stop accepting new connections */ );
 	CHECK_FCT_DO( fd_rtdisp_cleanstop(), /* Stop dispatch thread(s) after a clean loop if possible */ );
 	CHECK_FCT_DO( fd_peer_fini(), /* Stop all connections */ );
+	CHECK_FCT_DO( fd_reactor_fini(), /* Stop the I/O threads */ );
+	CHECK_FCT_DO( fd_p_parse_fini(), /* Stop the parsing threads */ );
 	CHECK_FCT_DO( fd_rtdisp_fini(), /* Stop routing threads and destroy routing queues */ );
 	
 	CHECK_FCT_DO( fd_ext_term(), /* Cleanup all extensions */ );
@@ -110,6 +112,7 @@ static void core_shutdown(void)
 	CHECK_FCT_DO( fd_conf_deinit(), );
 	
 	CHECK_FCT_DO( fd_event_trig_fini(), );
+	fd_event_fini();
 	
 	fd_log_debug(FD_PROJECT_BINARY " framework is terminated.");
 	
@@ -233,6 +236,9 @@ static int fd_core_parseconf_int(const char * conffile)
 	
 	CHECK_FCT( fd_conf_parse() );
 	
+	/* Size the queues, and switch them to the lock-free backend before any thread waits on them */
+	CHECK_FCT( fd_queues_init_after_conf() );
+	
 	/* The following module use data from the configuration */
 	CHECK_FCT( fd_rtdisp_init() );
 	
@@ -285,6 +291,10 @@ int fd_core_waitstartcomplete(void)
 /* Start the server & client threads */
 static int fd_core_start_int(void)
 {
+	/* Start the I/O and parsing threads, if configured */
+	CHECK_FCT( fd_reactor_init() );
+	CHECK_FCT( fd_p_parse_init() );
+	
 	/* Start server threads */ 
 	CHECK_FCT( fd_servers_start() );
 	
@@ -304,7 +314,9 @@ static int fd_core_start_int(void)
 int fd_core_start(void)
 {
 	int ret;
-	CHECK_FCT( fd_queues_init_after_conf() );
+
+	/* The extensions have registered their dictionary objects, the lookups can now be done without locking */
+	CHECK_FCT( fd_dict_freeze(fd_g_config->cnf_dict) );
 
 	CHECK_POSIX( pthread_mutex_lock(&core_lock) );
 	ret = fd_core_start_int();
@@ -2515,6 +2515,40 @@ int fd_dict_base_protocol(struct dictionary * dict)
 			CHECK_dict_new( DICT_AVP, &data , type, NULL);
 		}
 		
+		/* DRMP (RFC 7944) */
+		{
+			/*
+				The DRMP AVP (AVP Code 301) is of type Enumerated.  The value of the
+				AVP indicates the routing message priority for the message, from
+				PRIORITY_0 (the highest priority) to PRIORITY_15 (the lowest).
+				It is used by freeDiameter to order the queued messages when
+				PriorityQueues is configured.
+			*/
+			struct dict_object  	* 	type;
+			struct dict_type_data	 	tdata = { AVP_TYPE_INTEGER32,	"Enumerated(DRMP)"	, NULL, NULL, NULL };
+			struct dict_avp_data 		data = { 
+					301, 					/* Code */
+					#if AC_DRMP != 301
+					#error "AC_DRMP definition mismatch"
+					#endif
+					0, 					/* Vendor */
+					"DRMP",					/* Name */
+					AVP_FLAG_VENDOR, 			/* Fixed flags */
+					0,					/* Fixed flag values */
+					AVP_TYPE_INTEGER32 			/* base type of data */
+					};
+			int i;
+			/* Create the Enumerated type, and then the AVP */
+			CHECK_dict_new( DICT_TYPE, &tdata , NULL, &type);
+			for (i = 0; i <= 15; i++) {
+				char name[16];
+				struct dict_enumval_data t = { name, { .i32 = i }};
+				snprintf(name, sizeof(name), "PRIORITY_%d", i);
+				CHECK_dict_new( DICT_ENUMVAL, &t , type, NULL);
+			}
+			CHECK_dict_new( DICT_AVP, &data , type, NULL);
+		}
+		
 	}
 	
 	/* Commands section */
@@ -37,15 +37,161 @@
 
 /* Events are a subset of fifo queues, with a known type */
 
+/* The struct fd_event objects are recycled instead of being freed. Each thread keeps a stash of spare
+ events, and exchanges EV_STASH_BATCH of them at once with a shared list when its stash is empty or full,
+ since events are usually created and released by different threads. They are still allocated with
+ malloc, so it is not an error to free them directly. */
+#define EV_STASH_MAX	64
+#define EV_STASH_BATCH	32
+#define EV_SPARE_MAX	4096	/* max number of events in the shared list */
+
+struct ev_stash {
+	int		 nb;
+	struct fd_event	*ev[EV_STASH_MAX];
+};
+
+static pthread_key_t	 ev_stash_key;
+static pthread_once_t	 ev_stash_once = PTHREAD_ONCE_INIT;
+static int		 ev_stash_ok = 0;
+static pthread_mutex_t	 ev_spare_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct fd_event	*ev_spare = NULL;	/* the shared list, chained through the data field */
+static int		 ev_spare_nb = 0;	/* also read without the lock, as a hint */
+
+/* Move events from the stash to the shared list, down to keep events in the stash */
+static void ev_stash_flush(struct ev_stash * st, int keep)
+{
+	CHECK_POSIX_DO( pthread_mutex_lock(&ev_spare_lock), return );
+	while (st->nb > keep) {
+		struct fd_event * ev = st->ev[--st->nb];
+		if (ev_spare_nb < EV_SPARE_MAX) {
+			ev->data = ev_spare;
+			ev_spare = ev;
+			__atomic_add_fetch(&ev_spare_nb, 1, __ATOMIC_RELAXED);
+		} else {
+			free(ev);
+		}
+	}
+	CHECK_POSIX_DO( pthread_mutex_unlock(&ev_spare_lock), );
+}
+
+/* A thread is terminating, give back its events */
+static void ev_stash_release(void * arg)
+{
+	struct ev_stash * st = arg;
+	ev_stash_flush(st, 0);
+	free(st);
+}
+
+static void ev_stash_init(void)
+{
+	CHECK_POSIX_DO( pthread_key_create(&ev_stash_key, ev_stash_release), return );
+	__atomic_store_n(&ev_stash_ok, 1, __ATOMIC_RELEASE);
+}
+
+/* The stash of the calling thread, NULL if it is not available */
+static struct ev_stash * ev_stash_get(void)
+{
+	struct ev_stash * st;
+	CHECK_POSIX_DO( pthread_once(&ev_stash_once, ev_stash_init), return NULL );
+	if (!__atomic_load_n(&ev_stash_ok, __ATOMIC_ACQUIRE))
+		return NULL;
+	st = pthread_getspecific(ev_stash_key);
+	if (!st) {
+		CHECK_MALLOC_DO( st = calloc(1, sizeof(struct ev_stash)), return NULL );
+		CHECK_POSIX_DO( pthread_setspecific(ev_stash_key, st), { free(st); return NULL; } );
+	}
+	return st;
+}
+
+static struct fd_event * ev_alloc(void)
+{
+	struct ev_stash * st = ev_stash_get();
+	if (!st)
+		return malloc(sizeof(struct fd_event));
+	
+	if (!st->nb && __atomic_load_n(&ev_spare_nb, __ATOMIC_RELAXED)) {
+		/* Take a batch from the shared list */
+		CHECK_POSIX_DO( pthread_mutex_lock(&ev_spare_lock), return malloc(sizeof(struct fd_event)) );
+		while (ev_spare && (st->nb < EV_STASH_BATCH)) {
+			st->ev[st->nb++] = ev_spare;
+			ev_spare = ev_spare->data;
+			__atomic_sub_fetch(&ev_spare_nb, 1, __ATOMIC_RELAXED);
+		}
+		CHECK_POSIX_DO( pthread_mutex_unlock(&ev_spare_lock), );
+	}
+	
+	if (st->nb)
+		return st->ev[--st->nb];
+	return malloc(sizeof(struct fd_event));
+}
+
+static void ev_free(struct fd_event * ev)
+{
+	struct ev_stash * st = ev_stash_get();
+	if (!st) {
+		free(ev);
+		return;
+	}
+	if (st->nb == EV_STASH_MAX)
+		ev_stash_flush(st, EV_STASH_MAX - EV_STASH_BATCH);
+	if (st->nb == EV_STASH_MAX) {
+		/* the flush failed */
+		free(ev);
+		return;
+	}
+	st->ev[st->nb++] = ev;
+}
+
+/* Release the spare events at shutdown. Events released afterwards are freed directly. The stashes of the
+ threads that are still running (other than the caller) are not reclaimed. */
+void fd_event_fini(void)
+{
+	struct ev_stash * st;
+	
+	if (!__atomic_load_n(&ev_stash_ok, __ATOMIC_ACQUIRE))
+		return;
+	__atomic_store_n(&ev_stash_ok, 0, __ATOMIC_RELEASE);
+	
+	st = pthread_getspecific(ev_stash_key);
+	if (st) {
+		while (st->nb)
+			free(st->ev[--st->nb]);
+		free(st);
+	}
+	CHECK_POSIX_DO( pthread_key_delete(ev_stash_key), );
+	
+	CHECK_POSIX_DO( pthread_mutex_lock(&ev_spare_lock), return );
+	while (ev_spare) {
+		struct fd_event * ev = ev_spare;
+		ev_spare = ev->data;
+		free(ev);
+	}
+	__atomic_store_n(&ev_spare_nb, 0, __ATOMIC_RELAXED);
+	CHECK_POSIX_DO( pthread_mutex_unlock(&ev_spare_lock), );
+}
+
 int fd_event_send(struct fifo *queue, int code, size_t datasz, void * data)
 {
 	struct fd_event * ev;
 	int ret = 0;
-	CHECK_MALLOC( ev = malloc(sizeof(struct fd_event)) );
+	CHECK_MALLOC( ev = ev_alloc() );
 	ev->code = code;
 	ev->size = datasz;
 	ev->data = data;
-	CHECK_FCT_DO( ret = fd_fifo_post(queue, &ev), { free(ev); return ret; } );
+	CHECK_FCT_DO( ret = fd_fifo_post(queue, &ev), { ev_free(ev); return ret; } );
+	return 0;
+}
+
+/* Same as fd_event_send, but the event is queued even if the queue is full */
+int fd_event_send_noblock(struct fifo *queue, int code, size_t datasz, void * data)
+{
+	struct fd_event * ev;
+	int ret = 0;
+	CHECK_MALLOC( ev = ev_alloc() );
+	ev->code = code;
+	ev->size = datasz;
+	ev->data = data;
+	CHECK_FCT_DO( ret = fd_fifo_post_noblock(queue, (void *)&ev), { ev_free(ev); return ret; } );
 	return 0;
 }
 
@@ -59,7 +205,7 @@ int fd_event_get(struct fifo *queue, int *code, size_t *datasz, void ** data)
 		*datasz = ev->size;
 	if (data)
 		*data = ev->data;
-	free(ev);
+	ev_free(ev);
 	return 0;
 }
 
@@ -83,7 +229,7 @@ int fd_event_timedget(struct fifo *queue, struct timespec * timeout, int timeout
 			*datasz = ev->size;
 		if (data)
 			*data = ev->data;
-		free(ev);
+		ev_free(ev);
 	}
 	return 0;
 }
@@ -94,7 +240,7 @@ void fd_event_destroy(struct fifo **queue, void (*free_cb)(void * data))
 	/* Purge all events, and free the associated data if any */
 	while (fd_fifo_tryget( *queue, &ev ) == 0) {
 		(*free_cb)(ev->data);
-		free(ev);
+		ev_free(ev);
 	}
 	CHECK_FCT_DO( fd_fifo_del(queue), /* continue */ );
 	return ;
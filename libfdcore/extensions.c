@@ -37,6 +37,7 @@
 
 #include <dlfcn.h>	/* We may use libtool's <ltdl.h> later for better portability.... */
 #include <libgen.h>	/* for "basename" */
+#include <sys/stat.h>
 
 /* plugins management */
 
@@ -144,15 +145,39 @@ static int check_dependencies(struct fd_ext_info * ext)
 	return 0;
 }
 
-/* Load all extensions in the list */
-int fd_ext_load()
+/* Describe a file in the tag of the dictionary image */
+static char * ext_tag_file(char ** buf, size_t * len, size_t * offset, const char * file)
+{
+	struct stat st;
+	
+	if (file && !stat(file, &st))
+		return fd_dump_extend(buf, len, offset, " %s:%lld:%lld", file, (long long)st.st_size, (long long)st.st_mtime);
+	return fd_dump_extend(buf, len, offset, " %s", file ?: "-");
+}
+
+/* The tag of the dictionary image, that changes with the extensions and their files */
+static int ext_dict_tag(char ** tag)
+{
+	size_t len = 0, offset = 0;
+	struct fd_list * li;
+	
+	CHECK_MALLOC( fd_dump_extend(tag, &len, &offset, "freeDiameter %s", fd_core_version) );
+	for (li = ext_list.next; li != &ext_list; li = li->next) {
+		struct fd_ext_info * ext = (struct fd_ext_info *)li;
+		CHECK_MALLOC( fd_dump_extend(tag, &len, &offset, "\n") );
+		CHECK_MALLOC( ext_tag_file(tag, &len, &offset, ext->filename) );
+		CHECK_MALLOC( ext_tag_file(tag, &len, &offset, ext->conffile) );
+	}
+	return 0;
+}
+
+/* Load all extensions in the list. If the dictionary was loaded from the image, the dict_* extensions without a configuration file are not initialized. */
+static int ext_load_all(int dict_from_image)
 {
 	int ret;
 	int (*fd_ext_init)(int, int, char *) = NULL;
 	struct fd_list * li;
 	
-	TRACE_ENTRY();
-	
 	/* Loop on all extensions */
 	for (li = ext_list.next; li != &ext_list; li = li->next)
 	{
@@ -177,6 +202,13 @@ int fd_ext_load()
 		/* Check if declared dependencies are satisfied. */
 		CHECK_FCT( check_dependencies(ext) );
 		
+		/* The dictionary extensions only define objects, which are already in the image. The configuration file of an extension
+		 may name other files with more definitions, which the tag of the image does not cover, so these extensions are always initialized. */
+		if (dict_from_image && !ext->conffile && !strncasecmp(ext->ext_name, "dict_", 5)) {
+			LOG_D( "Extension %s not initialized, its dictionary objects were loaded from the image", ext->ext_name);
+			continue;
+		}
+		
 		/* Resolve the entry point of the extension */
 		fd_ext_init = ( int (*) (int, int, char *) )dlsym( ext->handler, "fd_ext_init" );
 		
@@ -214,6 +246,38 @@ int fd_ext_load()
 	return 0;
 }
 
+/* Load the extensions, and the dictionary from its image if configured */
+int fd_ext_load()
+{
+	char * tag = NULL;
+	int dict_from_image = 0;
+	int ret;
+	
+	TRACE_ENTRY();
+	
+	if (fd_g_config->cnf_dict_image) {
+		CHECK_FCT_DO( ret = ext_dict_tag(&tag), { free(tag); return ret; } );
+		ret = fd_dict_image_load(fd_g_config->cnf_dict, fd_g_config->cnf_dict_image, tag);
+		if (ret == 0) {
+			LOG_N("Dictionary loaded from the image '%s'", fd_g_config->cnf_dict_image);
+			dict_from_image = 1;
+		} else {
+			LOG_N("Dictionary image '%s' not used (%s), it will be saved once the extensions are loaded", fd_g_config->cnf_dict_image, strerror(ret));
+		}
+	}
+	
+	ret = ext_load_all(dict_from_image);
+	
+	/* Save the dictionary for the next start */
+	if (!ret && tag && !dict_from_image) {
+		CHECK_FCT_DO( fd_dict_image_save(fd_g_config->cnf_dict, fd_g_config->cnf_dict_image, tag),
+			LOG_E("The dictionary image '%s' was not saved, the dictionary extensions will be initialized again", fd_g_config->cnf_dict_image) );
+	}
+	
+	free(tag);
+	return ret;
+}
+
 /* Now unload the extensions and free the memory */
 int fd_ext_term( void ) 
 {
@@ -110,8 +110,15 @@ extern struct fifo * fd_g_local; /* messages to be handled to local extensions *
 /* Message queues */
 int fd_queues_init(void);
 int fd_queues_init_after_conf(void);
+int fd_queues_set_prio(struct fifo * queue);
 int fd_queues_fini(struct fifo ** queue);
 
+/* Events posted by the I/O threads, that must not wait for room in the queue */
+int fd_event_send_noblock(struct fifo *queue, int code, size_t datasz, void * data);
+
+/* Free the recycled events at shutdown */
+void fd_event_fini(void);
+
 /* Triggered events */
 int fd_event_trig_call_cb(int trigger_val);
 int fd_event_trig_fini(void);
@@ -124,6 +131,8 @@ int fd_rtdisp_init(void);
 int fd_rtdisp_cleanstop(void);
 int fd_rtdisp_fini(void);
 int fd_rtdisp_cleanup(void);
+int fd_rtdisp_getpool(int index, struct fd_disp_pool ** conf, struct fifo ** queue); /* on success, call fd_rtdisp_releasepool when done */
+void fd_rtdisp_releasepool(void);
 
 /* Sentinel for the sent requests list */
 struct sr_list {
@@ -188,6 +197,14 @@ struct fd_peer { /* The "real" definition of the peer structure */
 	struct sr_list	 p_sr;
 	struct fifo	*p_tofailover;
 	
+	/* Received messages being parsed by the parsing threads, in the order of reception (only modified by the PSM thread) */
+	struct fd_list	 p_parsing;
+	pthread_mutex_t	 p_parsing_mtx;	/* protects the "done" status of the parsing */
+	pthread_cond_t	 p_parsing_cnd;
+	int		 p_deferred;	/* an event received while messages were being parsed, handled after them (PSM thread only) */
+	size_t		 p_deferred_sz;
+	void		*p_deferred_data;
+	
 	/* Pending received requests not yet answered (count only) */
 	long		 p_reqin_count; /* We use p_state_mtx to protect this value */
 	
@@ -243,6 +260,9 @@ enum {
 	/* A connection attempt (initiator side) has failed */
 	,FDEVP_CNX_FAILED
 	
+	/* A received message was parsed by a parsing thread (no data, see fd_p_parse_next) */
+	,FDEVP_CNX_MSG_PARSED
+	
 	/* The PSM state is expired */
 	,FDEVP_PSM_TIMEOUT
 	
@@ -261,6 +281,7 @@ const char * fd_pev_str(int event)			\
 		case_str(FDEVP_CNX_INCOMING);		\
 		case_str(FDEVP_CNX_ESTABLISHED);	\
 		case_str(FDEVP_CNX_FAILED);		\
+		case_str(FDEVP_CNX_MSG_PARSED);		\
 		case_str(FDEVP_PSM_TIMEOUT);		\
 	}						\
 	TRACE_DEBUG(FULL, "Unknown event : %d", event);	\
@@ -299,6 +320,16 @@ void fd_psm_next_timeout(struct fd_peer * peer, int add_random, int delay);
 int fd_psm_change_state(struct fd_peer * peer, int new_state);
 void fd_psm_cleanup(struct fd_peer * peer, int terminate);
 
+/* Parsing threads */
+int  fd_p_parse_init(void);
+int  fd_p_parse_fini(void);
+int  fd_p_parse_pending(struct fd_peer * peer);
+int  fd_p_parse_submit(struct fd_peer * peer, uint8_t * buf, size_t len);
+int  fd_p_parse_next(struct fd_peer * peer, int wait, struct timespec * abstime, void ** job);
+int  fd_p_parse_result(void * job, uint8_t ** buf, size_t * len, struct msg ** msg);
+void fd_p_parse_flush(struct fd_peer * peer);
+int  fd_p_parse_getevent(struct fd_peer * peer, int * event, size_t * ev_sz, void ** ev_data);
+
 /* Peer out */
 int fd_out_send(struct msg ** msg, struct cnxctx * cnx, struct fd_peer * peer, int update_reqin_cnt);
 int fd_out_start(struct fd_peer * peer);
@@ -338,6 +369,10 @@ extern pthread_rwlock_t fd_g_activ_peers_rw; /* protect the list */
 int  fd_servers_start();
 int  fd_servers_stop();
 
+/* I/O threads receiving on the TCP connections */
+int  fd_reactor_init(void);
+int  fd_reactor_fini(void);
+
 /* Connection contexts -- there are also definitions in cnxctx.h for the relevant files */
 struct cnxctx * fd_cnx_serv_tcp(uint16_t port, int family, struct fd_endpoint * ep);
 struct cnxctx * fd_cnx_serv_sctp(uint16_t port, struct fd_list * ep_list);
@@ -363,6 +398,7 @@ char *          fd_cnx_getremoteid(struct cnxctx * conn);
 int             fd_cnx_receive(struct cnxctx * conn, struct timespec * timeout, unsigned char **buf, size_t * len);
 int             fd_cnx_recv_setaltfifo(struct cnxctx * conn, struct fifo * alt_fifo); /* send FDEVP_CNX_MSG_RECV event to the fifo list */
 int             fd_cnx_send(struct cnxctx * conn, unsigned char * buf, size_t len);
+int             fd_cnx_sendv(struct cnxctx * conn, struct iovec * iov, int iovcnt);
 void            fd_cnx_destroy(struct cnxctx * conn);
 int             fd_tls_verify_credentials_2(gnutls_session_t session);
 
@@ -107,11 +107,23 @@ struct peer_info fddpi;
 %token		NOTLS
 %token		SCTPSTREAMS
 %token		APPSERVTHREADS
+%token		DISPATCHPOOL
 %token		ROUTINGINTHREADS
 %token		ROUTINGOUTTHREADS
+%token		ROUTINGCACHE
+%token		IOTHREADS
+%token		PARSINGTHREADS
 %token		QINLIMIT
+%token		LOCKFREEQUEUES
+%token		PRIORITYQUEUES
 %token		QOUTLIMIT
 %token		QLOCALLIMIT
+%token		SENDBATCH
+%token		SENDBATCHDELAY
+%token		MSGPOOLS
+%token		HUGEPAGES
+%token		LAZYPARSING
+%token		RAWRELAY
 %token		LISTENON
 %token		THRPERSRV
 %token		PROCESSINGPEERSPATTERN
@@ -120,6 +132,7 @@ struct peer_info fddpi;
 %token		TWTIMER
 %token		NORELAY
 %token		LOADEXT
+%token		DICTIMAGE
 %token		CONNPEER
 %token		CONNTO
 %token		TLS_CRED
@@ -152,11 +165,22 @@ conffile:		/* Empty is OK -- for simplicity here, we reject in daemon later */
 			| conffile processingpeersminimum
 			| conffile norelay
 			| conffile appservthreads
+			| conffile dispatchpool
 			| conffile routinginthreads
 			| conffile routingoutthreads
+			| conffile routingcache
+			| conffile iothreads
+			| conffile parsingthreads
 			| conffile qinlimit
 			| conffile qoutlimit
 			| conffile qlocallimit
+			| conffile lockfreequeues
+			| conffile priorityqueues
+			| conffile sendbatch
+			| conffile sendbatchdelay
+			| conffile msgpools
+			| conffile lazyparsing
+			| conffile rawrelay
 			| conffile noip
 			| conffile noip6
 			| conffile notcp
@@ -164,6 +188,7 @@ conffile:		/* Empty is OK -- for simplicity here, we reject in daemon later */
 			| conffile prefertcp
 			| conffile oldtls
 			| conffile loadext
+			| conffile dictimage
 			| conffile connpeer
 			| conffile tls_cred
 			| conffile tls_ca
@@ -319,6 +344,31 @@ appservthreads:		APPSERVTHREADS '=' INTEGER ';'
 			}
 			;
 
+dispatchpool:		DISPATCHPOOL '=' INTEGER ':' INTEGER ':' INTEGER extconf ';'
+			{
+				struct fd_disp_pool * pool;
+				struct fd_list * li;
+				
+				CHECK_PARAMS_DO( ($5 > 0) && ($5 < 256) && ($7 >= 0),
+					{ yyerror (&yylloc, conf, "Invalid value"); free($8); YYERROR; } );
+				for (li = conf->cnf_disp_pools.next; li != &conf->cnf_disp_pools; li = li->next) {
+					if (((struct fd_disp_pool *)li)->appid == (application_id_t)$3) {
+						yyerror (&yylloc, conf, "Duplicate DispatchPool for this application");
+						free($8);
+						YYERROR;
+					}
+				}
+				CHECK_MALLOC_DO( pool = calloc(1, sizeof(struct fd_disp_pool)),
+					{ yyerror (&yylloc, conf, "Not enough memory"); free($8); YYERROR; } );
+				fd_list_init(&pool->chain, pool);
+				pool->appid = (application_id_t)$3;
+				pool->threads = (uint16_t)$5;
+				pool->qlimit = $7;
+				pool->cpus = $8;
+				fd_list_insert_before(&conf->cnf_disp_pools, &pool->chain);
+			}
+			;
+
 routinginthreads:		ROUTINGINTHREADS '=' INTEGER ';'
 			{
 				CHECK_PARAMS_DO( ($3 > 0) && ($3 < 256),
@@ -335,6 +385,32 @@ routingoutthreads:		ROUTINGOUTTHREADS '=' INTEGER ';'
 			}
 			;
 
+routingcache:		ROUTINGCACHE '=' INTEGER extconf ';'
+			{
+				CHECK_PARAMS_DO( ($3 >= 0),
+					{ yyerror (&yylloc, conf, "Invalid value"); free($4); YYERROR; } );
+				conf->cnf_rt_cache = $3;
+				free(conf->cnf_rt_cache_avp);
+				conf->cnf_rt_cache_avp = $4;
+			}
+			;
+
+iothreads:		IOTHREADS '=' INTEGER ';'
+			{
+				CHECK_PARAMS_DO( ($3 >= 0) && ($3 < 256),
+					{ yyerror (&yylloc, conf, "Invalid value"); YYERROR; } );
+				conf->cnf_io_thr = (uint16_t)$3;
+			}
+			;
+
+parsingthreads:		PARSINGTHREADS '=' INTEGER ';'
+			{
+				CHECK_PARAMS_DO( ($3 >= 0) && ($3 < 256),
+					{ yyerror (&yylloc, conf, "Invalid value"); YYERROR; } );
+				conf->cnf_parse_thr = (uint16_t)$3;
+			}
+			;
+
 qinlimit:		QINLIMIT '=' INTEGER ';'
 			{
 				CHECK_PARAMS_DO( ($3 >= 0),
@@ -359,6 +435,66 @@ qlocallimit:		QLOCALLIMIT '=' INTEGER ';'
 			}
 			;
 
+lockfreequeues:		LOCKFREEQUEUES ';'
+			{
+				conf->cnf_flags.lf_queues = 1;
+			}
+			;
+
+priorityqueues:		PRIORITYQUEUES '=' QSTRING ';'
+			{
+				if (!strcasecmp($3, "strict")) {
+					conf->cnf_prio_sched = FD_PRIO_SCHED_STRICT;
+				} else if (!strcasecmp($3, "weighted")) {
+					conf->cnf_prio_sched = FD_PRIO_SCHED_WEIGHTED;
+				} else {
+					yyerror (&yylloc, conf, "Invalid value, use \"strict\" or \"weighted\"");
+					free($3);
+					YYERROR;
+				}
+				free($3);
+			}
+			;
+
+sendbatch:		SENDBATCH '=' INTEGER ';'
+			{
+				CHECK_PARAMS_DO( ($3 > 0),
+					{ yyerror (&yylloc, conf, "Invalid value"); YYERROR; } );
+				conf->cnf_send_batch = $3;
+			}
+			;
+
+sendbatchdelay:		SENDBATCHDELAY '=' INTEGER ';'
+			{
+				CHECK_PARAMS_DO( ($3 >= 0) && ($3 < 1000000),
+					{ yyerror (&yylloc, conf, "Invalid value"); YYERROR; } );
+				conf->cnf_send_delay = $3;
+			}
+			;
+
+msgpools:		MSGPOOLS ';'
+			{
+				conf->cnf_flags.msg_pools = 1;
+			}
+			| MSGPOOLS '=' HUGEPAGES ';'
+			{
+				conf->cnf_flags.msg_pools = 1;
+				conf->cnf_flags.msg_huge = 1;
+			}
+			;
+
+lazyparsing:		LAZYPARSING ';'
+			{
+				conf->cnf_flags.lazy_parse = 1;
+			}
+			;
+
+rawrelay:		RAWRELAY ';'
+			{
+				conf->cnf_flags.raw_relay = 1;
+			}
+			;
+
 noip:			NOIP ';'
 			{
 				if (got_peer_noipv6) { 
@@ -425,6 +561,13 @@ oldtls:			OLDTLS ';'
 			}
 			;
 
+dictimage:		DICTIMAGE '=' QSTRING ';'
+			{
+				free(conf->cnf_dict_image);
+				conf->cnf_dict_image = $3;
+			}
+			;
+
 loadext:		LOADEXT '=' QSTRING extconf ';'
 			{
 				char * fname;
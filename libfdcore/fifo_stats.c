@@ -35,45 +35,162 @@
 
 #include "fdcore-internal.h"
 
-/* See include/freeDiameter/libfdcore.h for more information */
-int fd_stat_getstats(enum fd_stat_type stat, struct peer_hdr * peer, 
-			int * current_count, int * limit_count, int * highest_count, long long * total_count, 
-			struct timespec * total, struct timespec * blocking, struct timespec * last)
+/* Find the queue corresponding to a stat */
+static int stat_queue(enum fd_stat_type stat, struct peer_hdr * peer, struct fifo ** queue)
 {
 	struct fd_peer * p = (struct fd_peer *)peer;
-	TRACE_ENTRY( "%d %p %p %p %p %p %p %p %p", stat, peer, current_count, limit_count, highest_count, total_count, total, blocking, last);
-	
+
 	switch (stat) {
-		case STAT_G_LOCAL: {
-			CHECK_FCT( fd_fifo_getstats(fd_g_local, current_count, limit_count, highest_count, total_count, total, blocking, last) );
-		}
-		break;
-
-		case STAT_G_INCOMING: {
-			CHECK_FCT( fd_fifo_getstats(fd_g_incoming, current_count, limit_count, highest_count, total_count, total, blocking, last) );
-		}
-		break;
-
-		case STAT_G_OUTGOING: {
-			CHECK_FCT( fd_fifo_getstats(fd_g_outgoing, current_count, limit_count, highest_count, total_count, total, blocking, last) );
-		}
-		break;
-
-		case STAT_P_PSM: {
+		case STAT_G_LOCAL:
+			*queue = fd_g_local;
+			break;
+
+		case STAT_G_INCOMING:
+			*queue = fd_g_incoming;
+			break;
+
+		case STAT_G_OUTGOING:
+			*queue = fd_g_outgoing;
+			break;
+
+		case STAT_P_PSM:
 			CHECK_PARAMS( CHECK_PEER( peer ) );
-			CHECK_FCT( fd_fifo_getstats(p->p_events, current_count, limit_count, highest_count, total_count, total, blocking, last) );
-		}
-		break;
+			*queue = p->p_events;
+			break;
 
-		case STAT_P_TOSEND: {
+		case STAT_P_TOSEND:
 			CHECK_PARAMS( CHECK_PEER( peer ) );
-			CHECK_FCT( fd_fifo_getstats(p->p_tosend, current_count, limit_count, highest_count, total_count, total, blocking, last) );
-		}
-		break;
+			*queue = p->p_tosend;
+			break;
 
 		default:
 			return EINVAL;
 	}
+
+	return 0;
+}
+
+/* See include/freeDiameter/libfdcore.h for more information */
+int fd_stat_getpool(int index, application_id_t * appid, int * threads)
+{
+	struct fd_disp_pool * pool;
+	TRACE_ENTRY( "%d %p %p", index, appid, threads);
+	
+	if (fd_rtdisp_getpool(index, &pool, NULL))
+		return ENOENT;
+	if (appid)
+		*appid = pool->appid;
+	if (threads)
+		*threads = pool->threads;
+	fd_rtdisp_releasepool();
+	
+	return 0;
+}
+
+/* See include/freeDiameter/libfdcore.h for more information */
+int fd_stat_getpoolstats(int index, int * current_count, int * limit_count, int * highest_count, long long * total_count,
+			struct timespec * total, struct timespec * blocking, struct timespec * last)
+{
+	struct fifo * queue;
+	int ret;
+	TRACE_ENTRY( "%d %p %p %p %p %p %p %p", index, current_count, limit_count, highest_count, total_count, total, blocking, last);
+	
+	if (fd_rtdisp_getpool(index, NULL, &queue))
+		return ENOENT;
+	CHECK_FCT_DO( ret = fd_fifo_getstats(queue, current_count, limit_count, highest_count, total_count, total, blocking, last), );
+	fd_rtdisp_releasepool();
+	
+	return ret;
+}
+
+/* See include/freeDiameter/libfdcore.h for more information */
+int fd_stat_getpoollatency(int index, struct fd_fifo_latency * delay, struct fd_fifo_latency * blocking)
+{
+	struct fifo * queue;
+	int ret;
+	TRACE_ENTRY( "%d %p %p", index, delay, blocking);
+	
+	if (fd_rtdisp_getpool(index, NULL, &queue))
+		return ENOENT;
+	CHECK_FCT_DO( ret = fd_fifo_getlatency(queue, delay, blocking), );
+	fd_rtdisp_releasepool();
+	
+	return ret;
+}
+
+/* See include/freeDiameter/libfdcore.h for more information */
+int fd_stat_getpoolrates(int index, double * rate_1s, double * rate_10s, double * rate_60s)
+{
+	struct fifo * queue;
+	int ret;
+	TRACE_ENTRY( "%d %p %p %p", index, rate_1s, rate_10s, rate_60s);
+	
+	if (fd_rtdisp_getpool(index, NULL, &queue))
+		return ENOENT;
+	CHECK_FCT_DO( ret = fd_fifo_getrates(queue, rate_1s, rate_10s, rate_60s), );
+	fd_rtdisp_releasepool();
+	
+	return ret;
+}
+
+/* See include/freeDiameter/libfdcore.h for more information */
+int fd_stat_getstats(enum fd_stat_type stat, struct peer_hdr * peer, 
+			int * current_count, int * limit_count, int * highest_count, long long * total_count, 
+			struct timespec * total, struct timespec * blocking, struct timespec * last)
+{
+	struct fifo * queue;
+	TRACE_ENTRY( "%d %p %p %p %p %p %p %p %p", stat, peer, current_count, limit_count, highest_count, total_count, total, blocking, last);
+	
+	CHECK_FCT( stat_queue(stat, peer, &queue) );
+	CHECK_FCT( fd_fifo_getstats(queue, current_count, limit_count, highest_count, total_count, total, blocking, last) );
+	
+	return 0;
+}
+
+/* See include/freeDiameter/libfdcore.h for more information */
+int fd_stat_getlatency(enum fd_stat_type stat, struct peer_hdr * peer, struct fd_fifo_latency * delay, struct fd_fifo_latency * blocking)
+{
+	struct fifo * queue;
+	TRACE_ENTRY( "%d %p %p %p", stat, peer, delay, blocking);
+	
+	CHECK_FCT( stat_queue(stat, peer, &queue) );
+	CHECK_FCT( fd_fifo_getlatency(queue, delay, blocking) );
+	
+	return 0;
+}
+
+/* See include/freeDiameter/libfdcore.h for more information */
+int fd_stat_resetlatency(enum fd_stat_type stat, struct peer_hdr * peer)
+{
+	struct fifo * queue;
+	TRACE_ENTRY( "%d %p", stat, peer);
+	
+	CHECK_FCT( stat_queue(stat, peer, &queue) );
+	CHECK_FCT( fd_fifo_resetlatency(queue) );
+	
+	return 0;
+}
+
+/* See include/freeDiameter/libfdcore.h for more information */
+int fd_stat_getclassstats(enum fd_stat_type stat, struct peer_hdr * peer, int cls, int * current_count, long long * total_count, struct fd_fifo_latency * delay)
+{
+	struct fifo * queue;
+	TRACE_ENTRY( "%d %p %d %p %p %p", stat, peer, cls, current_count, total_count, delay);
+	
+	CHECK_FCT( stat_queue(stat, peer, &queue) );
+	CHECK_FCT( fd_fifo_getclassstats(queue, cls, current_count, total_count, delay) );
+	
+	return 0;
+}
+
+/* See include/freeDiameter/libfdcore.h for more information */
+int fd_stat_getrates(enum fd_stat_type stat, struct peer_hdr * peer, double * rate_1s, double * rate_10s, double * rate_60s)
+{
+	struct fifo * queue;
+	TRACE_ENTRY( "%d %p %p %p %p", stat, peer, rate_1s, rate_10s, rate_60s);
+	
+	CHECK_FCT( stat_queue(stat, peer, &queue) );
+	CHECK_FCT( fd_fifo_getrates(queue, rate_1s, rate_10s, rate_60s) );
 	
 	return 0;
 }
@@ -35,18 +35,42 @@
 
 #include "fdcore-internal.h"
 
-/* Alloc a new hbh for requests, bufferize the message and send on the connection, save in sentreq if provided */
-static int do_send(struct msg ** msg, struct cnxctx * cnx, uint32_t * hbh, struct fd_peer * peer)
+/* Upper limit of the data sent in one batch by the out thread */
+#define OUT_BATCH_BYTES	65536
+
+/* A message ready to be written on the connection */
+struct out_msg {
+	struct msg	* msg;		/* The message to free once sent (answers), NULL if it was saved in sentreq */
+	uint8_t		* buf;		/* Either a flat copy of the message... */
+	size_t		  sz;
+	struct iovec	* iov;		/* ... or the iovec array from fd_msg_bufferize_iov */
+	int		  iovcnt;
+};
+
+/* Release the buffers and the remaining message */
+static void out_msg_cleanup(struct out_msg * om)
+{
+	free(om->buf);
+	if (om->iov)
+		fd_msg_iov_free(om->iov);
+	if (om->msg) {
+		CHECK_FCT_DO( fd_msg_free(om->msg), /* continue */ );
+	}
+	memset(om, 0, sizeof(struct out_msg));
+}
+
+/* Alloc a new hbh for requests, bufferize the message and save in sentreq if provided. On success, the message is owned by om. */
+static int prepare_send(struct msg ** msg, uint32_t * hbh, struct fd_peer * peer, struct out_msg * om)
 {
 	struct msg_hdr * hdr;
 	int msg_is_a_req;
-	uint8_t * buf;
-	size_t sz;
 	int ret;
 	uint32_t bkp_hbh = 0;
 	struct msg *cpy_for_logs_only;
 	
-	TRACE_ENTRY("%p %p %p %p", msg, cnx, hbh, peer);
+	TRACE_ENTRY("%p %p %p %p", msg, hbh, peer, om);
+	
+	memset(om, 0, sizeof(struct out_msg));
 	
 	/* Retrieve the message header */
 	CHECK_FCT( fd_msg_hdr(*msg, &hdr) );
@@ -60,41 +84,118 @@ static int do_send(struct msg ** msg, struct cnxctx * cnx, uint32_t * hbh, struc
 		*hbh = hdr->msg_hbhid + 1;
 	}
 	
-	/* Create the message buffer */
-	CHECK_FCT(fd_msg_bufferize( *msg, &buf, &sz ));
-	pthread_cleanup_push( free, buf );
+	/* Create the message buffer. The values are not copied unless the request can expire (and be freed by the
+	 expiry thread) while we are still sending it. */
+	if (msg_is_a_req && fd_msg_anscb_gettimeout(*msg)) {
+		CHECK_FCT(fd_msg_bufferize( *msg, &om->buf, &om->sz ));
+	} else {
+		CHECK_FCT(fd_msg_bufferize_iov( *msg, &om->iov, &om->iovcnt ));
+	}
 	
 	cpy_for_logs_only = *msg;
 	
 	/* Save a request before sending so that there is no race condition with the answer */
 	if (msg_is_a_req) {
-		CHECK_FCT_DO( ret = fd_p_sr_store(&peer->p_sr, msg, &hdr->msg_hbhid, bkp_hbh), goto out );
+		CHECK_FCT_DO( ret = fd_p_sr_store(&peer->p_sr, msg, &hdr->msg_hbhid, bkp_hbh), 
+			{
+				out_msg_cleanup(om);
+				return ret;
+			} );
 	}
 	
 	/* Log the message */
 	fd_hook_call(HOOK_MESSAGE_SENT, cpy_for_logs_only, peer, NULL, fd_msg_pmdl_get(cpy_for_logs_only));
 	
-	pthread_cleanup_push((void *)fd_msg_free, *msg /* might be NULL, no problem */);
+	om->msg = *msg; /* might be NULL, no problem */
+	*msg = NULL;
+	
+	return 0;
+}
+
+/* Bufferize and send one message on the connection, save in sentreq if provided */
+static int do_send(struct msg ** msg, struct cnxctx * cnx, uint32_t * hbh, struct fd_peer * peer)
+{
+	struct out_msg om;
+	int ret;
+	
+	TRACE_ENTRY("%p %p %p %p", msg, cnx, hbh, peer);
+	
+	CHECK_FCT( prepare_send(msg, hbh, peer, &om) );
+	
+	pthread_cleanup_push((void *)out_msg_cleanup, &om);
 	
 	/* Send the message */
-	CHECK_FCT_DO( ret = fd_cnx_send(cnx, buf, sz), );
+	if (om.iov) {
+		CHECK_FCT_DO( ret = fd_cnx_sendv(cnx, om.iov, om.iovcnt), );
+	} else {
+		CHECK_FCT_DO( ret = fd_cnx_send(cnx, om.buf, om.sz), );
+	}
 	
-	pthread_cleanup_pop(0);
+	/* In case of error, the caller takes care of the remaining message */
+	if (ret) {
+		*msg = om.msg;
+		om.msg = NULL;
+	}
 	
-out:
-	;	
 	pthread_cleanup_pop(1);
 	
-	if (ret)
-		return ret;
+	return ret;
+}
+
+/* The messages retrieved by the out thread and sent together */
+struct out_batch {
+	struct out_msg	* msgs;		/* array of cnf_send_batch messages */
+	int		  count;
+	struct iovec	* iov;		/* all the iovec of the batch */
+	int		  iovmax;
+	struct msg	**picked;	/* the messages retrieved from p_tosend, before they are prepared */
+};
+
+static void out_batch_cleanup(struct out_batch * batch)
+{
+	int i;
+	for (i = 0; i < batch->count; i++)
+		out_msg_cleanup(&batch->msgs[i]);
+	batch->count = 0;
+}
+
+static void out_batch_free(struct out_batch * batch)
+{
+	out_batch_cleanup(batch);
+	free(batch->msgs);
+	free(batch->iov);
+	free(batch->picked);
+}
+
+/* Send all the messages of the batch with a single call */
+static int out_batch_send(struct out_batch * batch, struct cnxctx * cnx)
+{
+	int i, iovcnt = 0;
+	
+	TRACE_ENTRY("%p %p", batch, cnx);
 	
-	/* Free remaining messages (i.e. answers) */
-	if (*msg) {
-		CHECK_FCT( fd_msg_free(*msg) );
-		*msg = NULL;
+	for (i = 0; i < batch->count; i++) {
+		struct out_msg * om = &batch->msgs[i];
+		int n = om->iov ? om->iovcnt : 1;
+		
+		if (iovcnt + n > batch->iovmax) {
+			int newmax = (iovcnt + n) * 2;
+			struct iovec * newiov;
+			CHECK_MALLOC( newiov = realloc(batch->iov, newmax * sizeof(struct iovec)) );
+			batch->iov = newiov;
+			batch->iovmax = newmax;
+		}
+		
+		if (om->iov) {
+			memcpy(&batch->iov[iovcnt], om->iov, n * sizeof(struct iovec));
+		} else {
+			batch->iov[iovcnt].iov_base = om->buf;
+			batch->iov[iovcnt].iov_len  = om->sz;
+		}
+		iovcnt += n;
 	}
 	
-	return 0;
+	return fd_cnx_sendv(cnx, batch->iov, iovcnt);
 }
 
 /* The code of the "out" thread */
@@ -103,6 +204,10 @@ static void * out_thr(void * arg)
 	struct fd_peer * peer = arg;
 	int stop = 0;
 	struct msg * msg;
+	struct out_batch batch;
+	struct msg ** msgs;
+	int nb;
+	int batchmax = fd_g_config->cnf_send_batch > 0 ? fd_g_config->cnf_send_batch : 1;
 	ASSERT( CHECK_PEER(peer) );
 	
 	/* Set the thread name */
@@ -112,27 +217,88 @@ static void * out_thr(void * arg)
 		fd_log_threadname ( buf );
 	}
 	
+	memset(&batch, 0, sizeof(batch));
+	CHECK_MALLOC_DO( batch.msgs = calloc(batchmax, sizeof(struct out_msg)), goto error );
+	CHECK_MALLOC_DO( batch.picked = calloc(batchmax, sizeof(struct msg *)), { free(batch.msgs); goto error; } );
+	msgs = batch.picked;
+	pthread_cleanup_push((void *)out_batch_free, &batch);
+	
 	/* Loop until cancellation */
 	while (!stop) {
 		int ret;
+		size_t bytes = 0;
+		struct timespec flush = { 0, 0 };
 		
-		/* Retrieve next message to send */
-		CHECK_FCT_DO( fd_fifo_get(peer->p_tosend, &msg), goto error );
+		/* Retrieve the messages already queued */
+		CHECK_FCT_DO( fd_fifo_get_batch(peer->p_tosend, msgs, batchmax, &nb), break );
 		
-		/* Send the message, log any error */
-		CHECK_FCT_DO( ret = do_send(&msg, peer->p_cnxctx, &peer->p_hbh, peer),
+		/* Add them (and the messages arriving within the flush delay) to the batch */
+		do {
+			int i, j;
+			
+			for (i = 0; i < nb; i++) {
+				struct out_msg * om = &batch.msgs[batch.count];
+				
+				CHECK_FCT_DO( ret = prepare_send(&msgs[i], &peer->p_hbh, peer, om),
+					{
+						char buf[256];
+						snprintf(buf, sizeof(buf), "Error while sending this message: %s", strerror(ret));
+						for (; i < nb; i++) {
+							fd_hook_call(HOOK_MESSAGE_DROPPED, msgs[i], NULL, buf, fd_msg_pmdl_get(msgs[i]));
+							fd_msg_free(msgs[i]);
+						}
+						stop = 1;
+						break;
+					} );
+				batch.count++;
+				if (om->iov) {
+					for (j = 0; j < om->iovcnt; j++)
+						bytes += om->iov[j].iov_len;
+				} else {
+					bytes += om->sz;
+				}
+			}
+			
+			if (stop || (batch.count >= batchmax) || (bytes >= OUT_BATCH_BYTES))
+				break;
+			
+			ret = fd_fifo_tryget_batch(peer->p_tosend, msgs, batchmax - batch.count, &nb);
+			if ((ret == EWOULDBLOCK) && fd_g_config->cnf_send_delay) {
+				if (!flush.tv_sec) {
+					CHECK_SYS_DO( clock_gettime(CLOCK_REALTIME, &flush), break );
+					flush.tv_nsec += (long)fd_g_config->cnf_send_delay * 1000;
+					flush.tv_sec  += flush.tv_nsec / 1000000000;
+					flush.tv_nsec %= 1000000000;
+				}
+				ret = fd_fifo_timedget_batch(peer->p_tosend, msgs, batchmax - batch.count, &nb, &flush);
+			}
+		} while (ret == 0);
+		
+		if (!batch.count)
+			continue;
+		
+		/* Send the messages, log any error */
+		CHECK_FCT_DO( ret = out_batch_send(&batch, peer->p_cnxctx),
 			{
-				if (msg) {
-					char buf[256];
-					snprintf(buf, sizeof(buf), "Error while sending this message: %s", strerror(ret));
-					fd_hook_call(HOOK_MESSAGE_DROPPED, msg, NULL, buf, fd_msg_pmdl_get(msg));
-					fd_msg_free(msg);
+				int i;
+				char buf[256];
+				snprintf(buf, sizeof(buf), "Error while sending this message: %s", strerror(ret));
+				for (i = 0; i < batch.count; i++) {
+					if (batch.msgs[i].msg)
+						fd_hook_call(HOOK_MESSAGE_DROPPED, batch.msgs[i].msg, NULL, buf, fd_msg_pmdl_get(batch.msgs[i].msg));
 				}
 				stop = 1;
 			} );
-			
+		
+		/* Free remaining messages (i.e. answers) and the buffers */
+		out_batch_cleanup(&batch);
 	}
 	
+	pthread_cleanup_pop(1);
+	
+	if (!stop)
+		goto error;
+	
 	/* If we're here it means there was an error on the socket. We need to continue to purge the fifo & until we are canceled */
 	CHECK_FCT_DO( fd_event_send(peer->p_events, FDEVP_CNX_ERROR, 0, NULL), /* What do we do if it fails? */ );
 	
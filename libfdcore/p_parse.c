@@ -0,0 +1,304 @@
+/*********************************************************************************************************
+* Software License Agreement (BSD License)                                                               *
+* Author: Sebastien Decugis <sdecugis@freediameter.net>							 *
+*													 *
+* Copyright (c) 2023, WIDE Project and NICT								 *
+* All rights reserved.											 *
+* 													 *
+* Redistribution and use of this software in source and binary forms, with or without modification, are  *
+* permitted provided that the following conditions are met:						 *
+* 													 *
+* * Redistributions of source code must retain the above 						 *
+*   copyright notice, this list of conditions and the 							 *
+*   following disclaimer.										 *
+*    													 *
+* * Redistributions in binary form must reproduce the above 						 *
+*   copyright notice, this list of conditions and the 							 *
+*   following disclaimer in the documentation and/or other						 *
+*   materials provided with the distribution.								 *
+* 													 *
+* * Neither the name of the WIDE Project or NICT nor the 						 *
+*   names of its contributors may be used to endorse or 						 *
+*   promote products derived from this software without 						 *
+*   specific prior written permission of WIDE Project and 						 *
+*   NICT.												 *
+* 													 *
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED *
+* WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A *
+* PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR *
+* ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT 	 *
+* LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 	 *
+* INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR *
+* TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF   *
+* ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.								 *
+*********************************************************************************************************/
+
+
+/* Parsing threads (ParsingThreads configuration): the messages received from the peers are parsed by a shared 
+ pool of threads instead of the PSM thread of each peer. The PSM thread handles the parsed messages in the order
+ they were received on the connection. */
+
+#include "fdcore-internal.h"
+
+/* A received buffer to parse */
+struct parse_job {
+	struct fd_list	 chain;		/* link in peer->p_parsing, in the order of reception */
+	struct fd_peer	*peer;
+	uint8_t		*buf;		/* the received buffer (owned by msg once parsed) */
+	size_t		 len;
+	struct msg	*msg;		/* the result */
+	int		 ret;		/* the error code of the parsing */
+	int		 done;
+};
+
+static struct fifo * parse_queue = NULL;
+static pthread_t   * parse_thr = NULL;
+static int           parse_thr_nb = 0;
+
+/* The parsing thread */
+static void * parse_th(void * arg)
+{
+	struct parse_job * job;
+	
+	/* Set the thread name */
+	{
+		char buf[48];
+		snprintf(buf, sizeof(buf), "Parser %ld", (long)arg);
+		fd_log_threadname ( buf );
+	}
+	
+	/* The thread is only canceled while waiting for a job, so that no job is left unfinished */
+	CHECK_POSIX_DO( pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL), goto fatal );
+	
+	while (1) {
+		struct fd_peer * peer;
+		uint8_t * buf;
+		
+		CHECK_POSIX_DO( pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL), goto fatal );
+		CHECK_FCT_DO( fd_fifo_get(parse_queue, &job), goto fatal );
+		CHECK_POSIX_DO( pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL), goto fatal );
+		
+		peer = job->peer;
+		
+		/* Parse the received buffer */
+		buf = job->buf;
+		job->ret = (fd_g_config->cnf_flags.raw_relay ? fd_msg_parse_buffer_raw : fd_msg_parse_buffer)( &buf, job->len, &job->msg);
+		
+		/* Wake up the PSM thread */
+		CHECK_POSIX_DO( pthread_mutex_lock(&peer->p_parsing_mtx), goto fatal );
+		job->done = 1;
+		CHECK_FCT_DO( fd_event_send(peer->p_events, FDEVP_CNX_MSG_PARSED, 0, NULL), /* the message will be handled with the next one */ );
+		CHECK_POSIX_DO( pthread_cond_broadcast(&peer->p_parsing_cnd), goto fatal );
+		CHECK_POSIX_DO( pthread_mutex_unlock(&peer->p_parsing_mtx), goto fatal );
+	}
+	
+fatal:
+	/* An unrecoverable error occurred, stop the daemon */
+	CHECK_FCT_DO(fd_core_shutdown(), );
+	return NULL;
+}
+
+/* Start the parsing threads */
+int fd_p_parse_init(void)
+{
+	long i;
+	
+	TRACE_ENTRY("");
+	
+	if (!fd_g_config->cnf_parse_thr)
+		return 0;
+	
+	CHECK_FCT( fd_fifo_new(&parse_queue, 0) );
+	CHECK_MALLOC( parse_thr = calloc(fd_g_config->cnf_parse_thr, sizeof(pthread_t)) );
+	
+	for (i = 0; i < fd_g_config->cnf_parse_thr; i++) {
+		CHECK_POSIX( pthread_create(&parse_thr[i], NULL, parse_th, (void *)i) );
+		parse_thr_nb++;
+	}
+	
+	return 0;
+}
+
+/* Stop the parsing threads. Must be called after the PSM threads are terminated. */
+int fd_p_parse_fini(void)
+{
+	int i;
+	
+	TRACE_ENTRY("");
+	
+	for (i = 0; i < parse_thr_nb; i++) {
+		CHECK_FCT_DO( fd_thr_term(&parse_thr[i]), /* continue */ );
+	}
+	free(parse_thr);
+	parse_thr = NULL;
+	parse_thr_nb = 0;
+	
+	if (parse_queue) {
+		CHECK_FCT_DO( fd_fifo_del(&parse_queue), /* continue */ );
+	}
+	
+	return 0;
+}
+
+/* Are the messages of this peer parsed by the parsing threads? */
+int fd_p_parse_pending(struct fd_peer * peer)
+{
+	return !FD_IS_LIST_EMPTY(&peer->p_parsing);
+}
+
+/* Queue a received buffer to be parsed. Called by the PSM thread only. On error, the caller still owns buf. */
+int fd_p_parse_submit(struct fd_peer * peer, uint8_t * buf, size_t len)
+{
+	struct parse_job * job;
+	
+	TRACE_ENTRY("%p %p %zd", peer, buf, len);
+	CHECK_PARAMS( parse_queue );
+	
+	CHECK_MALLOC( job = calloc(1, sizeof(struct parse_job)) );
+	fd_list_init(&job->chain, job);
+	job->peer = peer;
+	job->buf = buf;
+	job->len = len;
+	
+	CHECK_POSIX_DO( pthread_mutex_lock(&peer->p_parsing_mtx), { free(job); return EINVAL; } );
+	fd_list_insert_before(&peer->p_parsing, &job->chain);
+	CHECK_POSIX( pthread_mutex_unlock(&peer->p_parsing_mtx) );
+	
+	CHECK_FCT_DO( fd_fifo_post(parse_queue, &job), 
+		{
+			CHECK_POSIX_DO( pthread_mutex_lock(&peer->p_parsing_mtx), );
+			fd_list_unlink(&job->chain);
+			CHECK_POSIX_DO( pthread_mutex_unlock(&peer->p_parsing_mtx), );
+			free(job);
+			return ENOMEM;
+		} );
+	
+	return 0;
+}
+
+/* Retrieve the first received message if it is parsed (or wait for it, until abstime if not NULL). *job is NULL if it is not parsed yet. 
+ Returns ETIMEDOUT if abstime was reached while waiting. */
+int fd_p_parse_next(struct fd_peer * peer, int wait, struct timespec * abstime, void ** job)
+{
+	struct parse_job * first = NULL;
+	int ret = 0;
+	
+	TRACE_ENTRY("%p %d %p %p", peer, wait, abstime, job);
+	
+	CHECK_POSIX( pthread_mutex_lock(&peer->p_parsing_mtx) );
+	pthread_cleanup_push( fd_cleanup_mutex, &peer->p_parsing_mtx );
+	if (!FD_IS_LIST_EMPTY(&peer->p_parsing)) {
+		first = peer->p_parsing.next->o;
+		while (wait && !first->done) {
+			if (abstime) {
+				ret = pthread_cond_timedwait(&peer->p_parsing_cnd, &peer->p_parsing_mtx, abstime);
+				if (ret == ETIMEDOUT)
+					break;
+				CHECK_POSIX_DO( ret, { ret = 0; break; } );
+			} else {
+				CHECK_POSIX_DO( pthread_cond_wait(&peer->p_parsing_cnd, &peer->p_parsing_mtx), break );
+			}
+		}
+		if (first->done) {
+			fd_list_unlink(&first->chain);
+			ret = 0;
+		} else {
+			first = NULL;
+		}
+	}
+	pthread_cleanup_pop( 0 );
+	CHECK_POSIX( pthread_mutex_unlock(&peer->p_parsing_mtx) );
+	
+	*job = first;
+	return ret;
+}
+
+/* Get the result of the parsing and free the job. *buf is the received buffer, it must be freed on error. Otherwise *msg is the parsed message. */
+int fd_p_parse_result(void * job, uint8_t ** buf, size_t * len, struct msg ** msg)
+{
+	struct parse_job * j = job;
+	int ret = j->ret;
+	
+	*buf = j->buf;
+	*len = j->len;
+	*msg = j->msg;
+	free(j);
+	
+	return ret;
+}
+
+/* Wait until all the received messages are parsed, then discard them */
+void fd_p_parse_flush(struct fd_peer * peer)
+{
+	void * job;
+	
+	TRACE_ENTRY("%p", peer);
+	
+	while (fd_p_parse_pending(peer)) {
+		uint8_t * buf;
+		size_t len;
+		struct msg * msg;
+		
+		CHECK_FCT_DO( fd_p_parse_next(peer, 1, NULL, &job), break );
+		if (!job)
+			break;
+		
+		if (fd_p_parse_result(job, &buf, &len, &msg) == 0) {
+			fd_hook_call(HOOK_MESSAGE_DROPPED, msg, peer, "Message discarded while cleaning peer state machine queue.", fd_msg_pmdl_get(msg));
+			CHECK_FCT_DO( fd_msg_free(msg), /* continue */ );
+		} else {
+			free(buf);
+		}
+	}
+}
+
+/* Get the next event for the PSM thread of a peer. The messages parsed by the parsing threads are returned first
+ (FDEVP_CNX_MSG_PARSED), in the order of reception, and the other events received meanwhile are deferred after them.
+ While waiting for the parsing of these messages, the PSM timer still expires (FDEVP_PSM_TIMEOUT), and the deferred
+ event stays pending. */
+int fd_p_parse_getevent(struct fd_peer * peer, int * event, size_t * ev_sz, void ** ev_data)
+{
+	TRACE_ENTRY("%p %p %p %p", peer, event, ev_sz, ev_data);
+	
+	while (1) {
+		if (fd_p_parse_pending(peer)) {
+			/* A deferred timeout has expired already, it waits for the messages received before it */
+			int ret = fd_p_parse_next(peer, peer->p_deferred, (peer->p_deferred == FDEVP_PSM_TIMEOUT) ? NULL : &peer->p_psm_timer, ev_data);
+			if (ret == ETIMEDOUT) {
+				*event = FDEVP_PSM_TIMEOUT;
+				*ev_sz = 0;
+				*ev_data = NULL;
+				return 0;
+			}
+			CHECK_FCT( ret );
+			if (*ev_data) {
+				*event = FDEVP_CNX_MSG_PARSED;
+				*ev_sz = 0;
+				return 0;
+			}
+		}
+		
+		if (peer->p_deferred) {
+			*event = peer->p_deferred;
+			*ev_sz = peer->p_deferred_sz;
+			*ev_data = peer->p_deferred_data;
+			peer->p_deferred = 0;
+			return 0;
+		}
+		
+		CHECK_FCT( fd_event_timedget(peer->p_events, &peer->p_psm_timer, FDEVP_PSM_TIMEOUT, event, ev_sz, ev_data) );
+		
+		if (*event == FDEVP_CNX_MSG_PARSED)
+			continue; /* A parsing thread has completed a message */
+		
+		if ((*event != FDEVP_CNX_MSG_RECV) && fd_p_parse_pending(peer)) {
+			/* Handle the messages received before this event first */
+			peer->p_deferred = *event;
+			peer->p_deferred_sz = *ev_sz;
+			peer->p_deferred_data = *ev_data;
+			continue;
+		}
+		
+		return 0;
+	}
+}
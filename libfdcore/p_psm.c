@@ -183,6 +183,9 @@ static int enter_open_state(struct fd_peer * peer)
 	}
 	fd_list_insert_before(li, &peer->p_actives);
 	CHECK_POSIX( pthread_rwlock_unlock(&fd_g_activ_peers_rw) );
+	
+	/* The routing decisions may change */
+	CHECK_FCT( fd_rt_out_cache_flush() );
 
 	/* Callback registered when the peer was added, by fd_peer_add */
 	if (peer->p_cb) {
@@ -206,6 +209,7 @@ static int leave_open_state(struct fd_peer * peer, int skip_failover)
 	CHECK_POSIX( pthread_rwlock_wrlock(&fd_g_activ_peers_rw) );
 	fd_list_unlink( &peer->p_actives );
 	CHECK_POSIX( pthread_rwlock_unlock(&fd_g_activ_peers_rw) );
+	CHECK_FCT( fd_rt_out_cache_flush() );
 
 	/* Stop the "out" thread */
 	CHECK_FCT( fd_out_stop(peer) );
@@ -360,6 +364,9 @@ void fd_psm_cleanup(struct fd_peer * peer, int terminate)
 
 	fd_p_sr_on_disconnect(&peer->p_sr);
 
+	/* Discard the messages being parsed */
+	fd_p_parse_flush(peer);
+
 	fd_p_cnx_abort(peer, terminate);
 
 	fd_p_ce_clear_cnx(peer, NULL);
@@ -428,10 +435,10 @@ static void * p_psm_th( void * arg )
 	}
 
 psm_loop:
-	/* Get next event */
+	/* Get next event (the messages parsed by the parsing threads come first, in the order of reception) */
 	TRACE_DEBUG(FULL, "'%s' in state '%s' waiting for next event.",
 			peer->p_hdr.info.pi_diamid, STATE_STR(fd_peer_getstate(peer)));
-	CHECK_FCT_DO( fd_event_timedget(peer->p_events, &peer->p_psm_timer, FDEVP_PSM_TIMEOUT, &event, &ev_sz, &ev_data), goto psm_end );
+	CHECK_FCT_DO( fd_p_parse_getevent(peer, &event, &ev_sz, &ev_data), goto psm_end );
 
 	cur_state = fd_peer_getstate(peer);
 	if (cur_state == -1)
@@ -482,18 +489,32 @@ psm_loop:
 	}
 
 	/* A message was received */
-	if (event == FDEVP_CNX_MSG_RECV) {
+	if ((event == FDEVP_CNX_MSG_RECV) || (event == FDEVP_CNX_MSG_PARSED)) {
 		struct msg * msg = NULL;
 		struct msg_hdr * hdr;
 		struct fd_cnx_rcvdata rcv_data;
 		struct fd_msg_pmdl * pmdl = NULL;
+		int ret;
+
+		if (event == FDEVP_CNX_MSG_PARSED) {
+			/* A parsing thread already did the job */
+			ret = fd_p_parse_result(ev_data, (void *)&ev_data, &ev_sz, &msg);
+		} else if (fd_g_config->cnf_parse_thr && ((cur_state == STATE_OPEN) || fd_p_parse_pending(peer))) {
+			/* Let a parsing thread do the job */
+			CHECK_FCT_DO( fd_p_parse_submit(peer, ev_data, ev_sz), { free(ev_data); goto psm_end; } );
+			goto psm_loop;
+		}
 
 		rcv_data.buffer = ev_data;
 		rcv_data.length = ev_sz;
 		pmdl = fd_msg_pmdl_get_inbuf(rcv_data.buffer, rcv_data.length);
 
-		/* Parse the received buffer */
-		CHECK_FCT_DO( fd_msg_parse_buffer( (void *)&ev_data, ev_sz, &msg),
+		if (event == FDEVP_CNX_MSG_RECV) {
+			/* Parse the received buffer */
+			ret = (fd_g_config->cnf_flags.raw_relay ? fd_msg_parse_buffer_raw : fd_msg_parse_buffer)( (void *)&ev_data, ev_sz, &msg);
+		}
+
+		CHECK_FCT_DO( ret,
 			{
 				fd_hook_call(HOOK_MESSAGE_PARSING_ERROR, NULL, peer, &rcv_data, pmdl );
 				free(ev_data);
@@ -901,6 +922,11 @@ psm_reset:
 	goto psm_loop;
 
 psm_end:
+	if (peer->p_deferred) {
+		/* Let the cleanup free this event */
+		CHECK_FCT_DO( fd_event_send(peer->p_events, peer->p_deferred, peer->p_deferred_sz, peer->p_deferred_data), free(peer->p_deferred_data) );
+		peer->p_deferred = 0;
+	}
 	cur_state = fd_peer_getstate(peer);
 	if ((cur_state == STATE_CLOSING) || (cur_state == STATE_CLOSING_GRACE)) {
 		LOG_N("%s: Going to ZOMBIE state (no more activity) after normal shutdown", peer->p_hdr.info.pi_diamid);
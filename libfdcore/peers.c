@@ -77,6 +77,7 @@ int fd_peer_alloc(struct fd_peer ** ptr)
 	fd_list_init(&p->p_actives, p);
 	fd_list_init(&p->p_expiry, p);
 	CHECK_FCT( fd_fifo_new(&p->p_tosend, 5) );
+	CHECK_FCT( fd_queues_set_prio(p->p_tosend) );
 	CHECK_FCT( fd_fifo_new(&p->p_tofailover, 0) );
 	p->p_hbh = lrand48();
 	
@@ -87,6 +88,10 @@ int fd_peer_alloc(struct fd_peer ** ptr)
 	
 	fd_list_init(&p->p_connparams, p);
 	
+	fd_list_init(&p->p_parsing, p);
+	CHECK_POSIX( pthread_mutex_init(&p->p_parsing_mtx, NULL) );
+	CHECK_POSIX( pthread_cond_init(&p->p_parsing_cnd, NULL) );
+	
 	return 0;
 }
 
@@ -350,6 +355,8 @@ int fd_peer_free(struct fd_peer ** ptr)
 	CHECK_POSIX_DO( pthread_mutex_destroy(&p->p_state_mtx), /* continue */);
 	CHECK_POSIX_DO( pthread_mutex_destroy(&p->p_sr.mtx), /* continue */);
 	CHECK_POSIX_DO( pthread_cond_destroy(&p->p_sr.cnd), /* continue */);
+	CHECK_POSIX_DO( pthread_mutex_destroy(&p->p_parsing_mtx), /* continue */);
+	CHECK_POSIX_DO( pthread_cond_destroy(&p->p_parsing_cnd), /* continue */);
 	
 	/* If the callback is still around... */
 	if (p->p_cb)
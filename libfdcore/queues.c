@@ -50,13 +50,98 @@ int fd_queues_init(void)
 	return 0;
 }
 
+/* Replace a queue by a lock-free one, if it is still empty */
+static int queue_to_ring(struct fifo ** queue, int max)
+{
+	if (fd_fifo_length(*queue) != 0) {
+		TRACE_DEBUG(INFO, "The queue already contains messages, keep the locked backend");
+		return fd_fifo_set_max(*queue, max);
+	}
+	CHECK_FCT( fd_fifo_del( queue ) );
+	CHECK_FCT( fd_fifo_new_ring( queue, max ) );
+	return 0;
+}
+
+/* Priority class of a message, used as classifier of the queues (fd_fifo_set_classes). The message is not
+ decoded here: it is called on every post, and raw or lazily parsed messages must stay so. */
+static int msg_prio_class(void * item)
+{
+	struct msg * msg = item;
+	struct msg_hdr * hdr;
+	int32_t drmp;
+	
+	CHECK_FCT_DO( fd_msg_hdr(msg, &hdr), return FD_PRIO_DEFAULT );
+	if ((hdr->msg_appl == 0) && ((hdr->msg_code == CC_CAPABILITIES_EXCHANGE) 
+					|| (hdr->msg_code == CC_DEVICE_WATCHDOG) 
+					|| (hdr->msg_code == CC_DISCONNECT_PEER)))
+		return FD_PRIO_LINKLOCAL;
+	if (!(hdr->msg_flags & CMD_FLAG_REQUEST))
+		return FD_PRIO_ANSWER;
+	
+	/* The requests are ordered by their DRMP AVP (RFC 7944) */
+	if ((fd_msg_peek_i32(msg, AC_DRMP, 0, &drmp) == 0) && (drmp >= 0) && (drmp < FD_PRIO_DEFAULT - FD_PRIO_DRMP))
+		return FD_PRIO_DRMP + drmp;
+	return FD_PRIO_DEFAULT;
+}
+
+/* Order the messages of a queue by priority class, according to the configuration */
+int fd_queues_set_prio(struct fifo * queue)
+{
+	int weights[FD_PRIO_CLASSES];
+	int i;
+	
+	if (!fd_g_config->cnf_prio_sched)
+		return 0;
+	
+	/* With the weighted scheduler, link-local messages and answers get the largest share, then the DRMP levels in order */
+	weights[FD_PRIO_LINKLOCAL] = 64;
+	weights[FD_PRIO_ANSWER] = 32;
+	for (i = FD_PRIO_DRMP; i < FD_PRIO_DEFAULT; i++)
+		weights[i] = FD_PRIO_DEFAULT - i;
+	weights[FD_PRIO_DEFAULT] = 1;
+	
+	/* Link-local messages and answers are queued even when the queue is full */
+	CHECK_FCT( fd_fifo_set_classes(queue, FD_PRIO_CLASSES, msg_prio_class, 
+			(fd_g_config->cnf_prio_sched == FD_PRIO_SCHED_WEIGHTED) ? weights : NULL, FD_PRIO_ANSWER + 1) );
+	return 0;
+}
+
 /* Resize according to values given in configuration file */
 int fd_queues_init_after_conf(void)
 {
+	struct fd_list * li;
+	
 	TRACE_ENTRY();
-	CHECK_FCT( fd_fifo_set_max ( fd_g_incoming, fd_g_config->cnf_qin_limit ) );
-	CHECK_FCT( fd_fifo_set_max ( fd_g_outgoing, fd_g_config->cnf_qout_limit ) );
-	CHECK_FCT( fd_fifo_set_max ( fd_g_local,    fd_g_config->cnf_qlocal_limit ) );
+	if (fd_g_config->cnf_flags.lf_queues) {
+		if (fd_g_config->cnf_prio_sched) {
+			/* The rings cannot reorder the messages */
+			TRACE_DEBUG(INFO, "PriorityQueues is set, the incoming and outgoing queues use the locked backend");
+			CHECK_FCT( fd_fifo_set_max ( fd_g_incoming, fd_g_config->cnf_qin_limit ) );
+			CHECK_FCT( fd_fifo_set_max ( fd_g_outgoing, fd_g_config->cnf_qout_limit ) );
+		} else {
+			CHECK_FCT( queue_to_ring ( &fd_g_incoming, fd_g_config->cnf_qin_limit ) );
+			CHECK_FCT( queue_to_ring ( &fd_g_outgoing, fd_g_config->cnf_qout_limit ) );
+		}
+		CHECK_FCT( queue_to_ring ( &fd_g_local,    fd_g_config->cnf_qlocal_limit ) );
+	} else {
+		CHECK_FCT( fd_fifo_set_max ( fd_g_incoming, fd_g_config->cnf_qin_limit ) );
+		CHECK_FCT( fd_fifo_set_max ( fd_g_outgoing, fd_g_config->cnf_qout_limit ) );
+		CHECK_FCT( fd_fifo_set_max ( fd_g_local,    fd_g_config->cnf_qlocal_limit ) );
+	}
+	
+	if (!fd_g_config->cnf_prio_sched)
+		return 0;
+	
+	CHECK_FCT( fd_queues_set_prio ( fd_g_incoming ) );
+	CHECK_FCT( fd_queues_set_prio ( fd_g_outgoing ) );
+	
+	/* The peers created before the configuration was complete */
+	CHECK_POSIX( pthread_rwlock_rdlock(&fd_g_peers_rw) );
+	for (li = fd_g_peers.next; li != &fd_g_peers; li = li->next) {
+		struct fd_peer * p = (struct fd_peer *)li;
+		CHECK_FCT_DO( fd_queues_set_prio ( p->p_tosend ), break );
+	}
+	CHECK_POSIX( pthread_rwlock_unlock(&fd_g_peers_rw) );
 	return 0;
 }
 
@@ -0,0 +1,365 @@
+/*********************************************************************************************************
+* Software License Agreement (BSD License)                                                               *
+* Author: Sebastien Decugis <sdecugis@freediameter.net>							 *
+*													 *
+* Copyright (c) 2023, WIDE Project and NICT								 *
+* All rights reserved.											 *
+* 													 *
+* Redistribution and use of this software in source and binary forms, with or without modification, are  *
+* permitted provided that the following conditions are met:						 *
+* 													 *
+* * Redistributions of source code must retain the above 						 *
+*   copyright notice, this list of conditions and the 							 *
+*   following disclaimer.										 *
+*    													 *
+* * Redistributions in binary form must reproduce the above 						 *
+*   copyright notice, this list of conditions and the 							 *
+*   following disclaimer in the documentation and/or other						 *
+*   materials provided with the distribution.								 *
+* 													 *
+* * Neither the name of the WIDE Project or NICT nor the 						 *
+*   names of its contributors may be used to endorse or 						 *
+*   promote products derived from this software without 						 *
+*   specific prior written permission of WIDE Project and 						 *
+*   NICT.												 *
+* 													 *
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED *
+* WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A *
+* PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR *
+* ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT 	 *
+* LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 	 *
+* INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR *
+* TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF   *
+* ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.								 *
+*********************************************************************************************************/
+
+/* I/O threads (IOThreads configuration): instead of one receiver thread per connection, a small pool of threads
+ waits for data on the TCP connections with epoll, and reads it with non-blocking calls. For TLS, the GnuTLS session
+ pulls the data without waiting, and the records are decrypted in the I/O thread once the handshake is done.
+ An I/O thread never waits for room in the queue that receives the messages of a connection, since it would stall
+ all the other connections it serves. When that queue is full, the thread stops watching the connection instead,
+ and checks every RCT_RETRY ms whether it can watch it again. The data waits in the socket meanwhile, so the
+ peer is slowed down by TCP flow control. */
+
+#include "fdcore-internal.h"
+#include "cnxctx.h"
+
+#include <sys/epoll.h>
+
+/* Max number of events retrieved by epoll_wait */
+#define RCT_EVENTS	64
+
+/* Max number of chunks read on a connection before processing the other ones */
+#define RCT_READS	4
+
+/* Delay in ms between the checks of the connections paused because their queue is full */
+#define RCT_RETRY	10
+
+struct rct_thread {
+	pthread_t	  thr;
+	int		  epfd;		/* the epoll instance */
+	uint8_t		* chunk;	/* buffer of RCV_CHUNK_SIZE bytes for the received data */
+	
+	pthread_mutex_t	  lock;		/* protects the following fields */
+	pthread_cond_t	  cond;		/* signaled when cur is reset */
+	struct cnxctx  ** conns;	/* the connections handled by this thread, indexed by socket */
+	int		  size;		/* size of the conns array */
+	struct cnxctx	* cur;		/* the connection being processed */
+	int		  paused;	/* number of connections not watched because their queue is full */
+	long long	  resume_at;	/* time (ms) of the next check of the paused connections, used only by the thread */
+};
+
+static struct rct_thread * rct_threads = NULL;
+static int rct_count = 0;
+static pthread_mutex_t rct_lock = PTHREAD_MUTEX_INITIALIZER; /* protects rct_next and rct_gen */
+static int rct_next = 0;
+static uint32_t rct_gen = 0;
+
+/* Is the queue receiving the messages of a connection full? */
+static int rct_full(struct cnxctx * conn)
+{
+	int cur = 0, limit = 0;
+	CHECK_FCT_DO( fd_fifo_getstats(fd_cnx_target_queue(conn), &cur, &limit, NULL, NULL, NULL, NULL, NULL), return 0 );
+	return limit && (cur >= limit);
+}
+
+/* Stop or resume watching a connection. The lock of the thread is held. */
+static void rct_pause(struct rct_thread * t, struct cnxctx * conn, int pause)
+{
+	struct epoll_event ev;
+	
+	memset(&ev, 0, sizeof(ev));
+	ev.events = pause ? 0 : EPOLLIN;
+	ev.data.u64 = ((uint64_t)conn->cc_rct_gen << 32) | (uint32_t)conn->cc_socket;
+	CHECK_SYS_DO( epoll_ctl(t->epfd, EPOLL_CTL_MOD, conn->cc_socket, &ev), return );
+	conn->cc_rct_paused = pause;
+	__atomic_add_fetch(&t->paused, pause ? 1 : -1, __ATOMIC_RELAXED);
+}
+
+/* Watch again the paused connections whose queue has room */
+static void rct_resume(struct rct_thread * t)
+{
+	int fd;
+	
+	CHECK_POSIX_DO( pthread_mutex_lock(&t->lock), return );
+	for (fd = 0; (fd < t->size) && t->paused; fd++) {
+		struct cnxctx * conn = t->conns[fd];
+		if (conn && conn->cc_rct_paused && !rct_full(conn))
+			rct_pause(t, conn, 0);
+	}
+	CHECK_POSIX_DO( pthread_mutex_unlock(&t->lock), );
+}
+
+/* Read the available data on a connection */
+static void rct_read(struct rct_thread * t, struct cnxctx * conn)
+{
+	int i, count = 0, ret;
+	
+	for (i = 0; i < RCT_READS; i++) {
+		ssize_t received;
+		
+		/* The data already decrypted is passed first, epoll would not report it after a pause */
+		if (!fd_cnx_rcv_pending(conn) && rct_full(conn)) {
+			/* Leave the data in the socket until the messages already received are processed */
+			CHECK_POSIX_DO( pthread_mutex_lock(&t->lock), return );
+			rct_pause(t, conn, 1);
+			CHECK_POSIX_DO( pthread_mutex_unlock(&t->lock), );
+			return;
+		}
+		
+		received = fd_cnx_rcv_nb(conn, t->chunk, RCV_CHUNK_SIZE);
+		
+		if ((received < 0) && (errno == EAGAIN))
+			return;
+		
+		if (received <= 0)
+			break; /* The error was signaled */
+		
+		ret = fd_cnx_rcv_stream(conn, t->chunk, received, &count);
+		if (ret) {
+			if (ret != ENOTCONN) {
+				/* An unrecoverable error occurred, stop the daemon */
+				CHECK_FCT_DO(fd_core_shutdown(), );
+			}
+			break;
+		}
+		
+		if (fd_cnx_rcv_pending(conn)) {
+			/* A TLS record was only partly returned, it does not count as a read */
+			i--;
+			continue;
+		}
+		
+		if ((received < RCV_CHUNK_SIZE) && !fd_cnx_teststate(conn, CC_STATUS_TLS))
+			return; /* Let the other connections be processed, epoll reports the remaining data if any */
+	}
+	
+	if (i == RCT_READS)
+		return;
+	
+	/* The connection is in error, stop watching it until it is destroyed */
+	CHECK_SYS_DO( epoll_ctl(t->epfd, EPOLL_CTL_DEL, conn->cc_socket, NULL), );
+}
+
+/* The I/O thread */
+static void * rct_th(void * arg)
+{
+	struct rct_thread * t = arg;
+	struct epoll_event events[RCT_EVENTS];
+	
+	/* Set the thread name */
+	{
+		char buf[48];
+		snprintf(buf, sizeof(buf), "I/O thread %d", (int)(t - rct_threads));
+		fd_log_threadname ( buf );
+	}
+	
+	/* The thread is only canceled while waiting for events */
+	CHECK_POSIX_DO( pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL), goto fatal );
+	
+	while (1) {
+		int n, i;
+		
+		CHECK_POSIX_DO( pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL), goto fatal );
+		n = epoll_wait(t->epfd, events, RCT_EVENTS, __atomic_load_n(&t->paused, __ATOMIC_RELAXED) ? RCT_RETRY : -1);
+		CHECK_POSIX_DO( pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL), goto fatal );
+		
+		if ((n < 0) && (errno == EINTR))
+			continue;
+		CHECK_SYS_DO( n, goto fatal );
+		
+		for (i = 0; i < n; i++) {
+			int fd = (int)(events[i].data.u64 & 0xffffffff);
+			uint32_t gen = (uint32_t)(events[i].data.u64 >> 32);
+			struct cnxctx * conn = NULL;
+			
+			/* Check the connection was not removed since the event was retrieved */
+			CHECK_POSIX_DO( pthread_mutex_lock(&t->lock), goto fatal );
+			if (fd < t->size)
+				conn = t->conns[fd];
+			if (conn && (conn->cc_rct_gen != gen))
+				conn = NULL;
+			t->cur = conn;
+			CHECK_POSIX_DO( pthread_mutex_unlock(&t->lock), goto fatal );
+			
+			if (!conn)
+				continue;
+			
+			rct_read(t, conn);
+			
+			CHECK_POSIX_DO( pthread_mutex_lock(&t->lock), goto fatal );
+			t->cur = NULL;
+			CHECK_POSIX_DO( pthread_cond_broadcast(&t->cond), goto fatal );
+			CHECK_POSIX_DO( pthread_mutex_unlock(&t->lock), goto fatal );
+		}
+		
+		if (__atomic_load_n(&t->paused, __ATOMIC_RELAXED)) {
+			struct timespec now;
+			long long now_ms;
+			CHECK_SYS_DO( clock_gettime(CLOCK_MONOTONIC, &now), goto fatal );
+			now_ms = now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+			if (now_ms >= t->resume_at) {
+				rct_resume(t);
+				t->resume_at = now_ms + RCT_RETRY;
+			}
+		}
+	}
+	
+fatal:
+	/* An unrecoverable error occurred, stop the daemon */
+	CHECK_FCT_DO(fd_core_shutdown(), );
+	return NULL;
+}
+
+/* Start the I/O threads */
+int fd_reactor_init(void)
+{
+	int i;
+	
+	TRACE_ENTRY("");
+	
+	if (!fd_g_config->cnf_io_thr)
+		return 0;
+	
+	CHECK_PARAMS( rct_threads == NULL );
+	CHECK_MALLOC( rct_threads = calloc(fd_g_config->cnf_io_thr, sizeof(struct rct_thread)) );
+	
+	for (i = 0; i < fd_g_config->cnf_io_thr; i++) {
+		struct rct_thread * t = &rct_threads[i];
+		
+		CHECK_SYS( t->epfd = epoll_create1(EPOLL_CLOEXEC) );
+		CHECK_MALLOC( t->chunk = malloc(RCV_CHUNK_SIZE) );
+		CHECK_POSIX( pthread_mutex_init(&t->lock, NULL) );
+		CHECK_POSIX( pthread_cond_init(&t->cond, NULL) );
+		CHECK_POSIX( pthread_create(&t->thr, NULL, rct_th, t) );
+		rct_count++;
+	}
+	
+	return 0;
+}
+
+/* Stop the I/O threads. The connections still registered do not receive anymore. */
+int fd_reactor_fini(void)
+{
+	int i, j;
+	
+	TRACE_ENTRY("");
+	
+	for (i = 0; i < rct_count; i++) {
+		struct rct_thread * t = &rct_threads[i];
+		
+		CHECK_FCT_DO( fd_thr_term(&t->thr), /* continue */ );
+		
+		for (j = 0; j < t->size; j++) {
+			if (t->conns[j])
+				t->conns[j]->cc_reactor = NULL;
+		}
+		free(t->conns);
+		free(t->chunk);
+		close(t->epfd);
+		CHECK_POSIX_DO( pthread_cond_destroy(&t->cond), );
+		CHECK_POSIX_DO( pthread_mutex_destroy(&t->lock), );
+	}
+	
+	free(rct_threads);
+	rct_threads = NULL;
+	rct_count = 0;
+	
+	return 0;
+}
+
+/* Receive the messages of a connection in one of the I/O threads */
+int fd_reactor_add(struct cnxctx * conn)
+{
+	struct rct_thread * t;
+	struct epoll_event ev;
+	uint32_t gen;
+	int ret = 0;
+	
+	TRACE_ENTRY("%p", conn);
+	CHECK_PARAMS( conn && (conn->cc_socket > 0) && !conn->cc_reactor && rct_count );
+	
+	/* Share the connections between the threads */
+	CHECK_POSIX( pthread_mutex_lock(&rct_lock) );
+	t = &rct_threads[rct_next];
+	rct_next = (rct_next + 1) % rct_count;
+	gen = ++rct_gen;
+	CHECK_POSIX( pthread_mutex_unlock(&rct_lock) );
+	
+	CHECK_POSIX( pthread_mutex_lock(&t->lock) );
+	if (conn->cc_socket >= t->size) {
+		int newsize = conn->cc_socket + 64;
+		struct cnxctx ** conns = realloc(t->conns, newsize * sizeof(struct cnxctx *));
+		if (!conns) {
+			ret = ENOMEM;
+			goto out;
+		}
+		memset(conns + t->size, 0, (newsize - t->size) * sizeof(struct cnxctx *));
+		t->conns = conns;
+		t->size = newsize;
+	}
+	t->conns[conn->cc_socket] = conn;
+	conn->cc_rct_gen = gen;
+	conn->cc_rct_paused = 0;
+	conn->cc_reactor = t;
+	
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u64 = ((uint64_t)gen << 32) | (uint32_t)conn->cc_socket;
+	CHECK_SYS_DO( epoll_ctl(t->epfd, EPOLL_CTL_ADD, conn->cc_socket, &ev), 
+		{
+			ret = errno;
+			t->conns[conn->cc_socket] = NULL;
+			conn->cc_reactor = NULL;
+		} );
+out:
+	CHECK_POSIX( pthread_mutex_unlock(&t->lock) );
+	return ret;
+}
+
+/* Stop receiving on a connection. On return, the I/O thread does not access the connection anymore. */
+void fd_reactor_del(struct cnxctx * conn)
+{
+	struct rct_thread * t;
+	
+	TRACE_ENTRY("%p", conn);
+	CHECK_PARAMS_DO( conn, return );
+	
+	t = conn->cc_reactor;
+	if (!t)
+		return;
+	
+	CHECK_POSIX_DO( pthread_mutex_lock(&t->lock), return );
+	/* The socket may have been removed already after an error */
+	(void) epoll_ctl(t->epfd, EPOLL_CTL_DEL, conn->cc_socket, NULL);
+	t->conns[conn->cc_socket] = NULL;
+	if (conn->cc_rct_paused) {
+		conn->cc_rct_paused = 0;
+		__atomic_sub_fetch(&t->paused, 1, __ATOMIC_RELAXED);
+	}
+	while (t->cur == conn) {
+		CHECK_POSIX_DO( pthread_cond_wait(&t->cond, &t->lock), break );
+	}
+	conn->cc_reactor = NULL;
+	CHECK_POSIX_DO( pthread_mutex_unlock(&t->lock), );
+}
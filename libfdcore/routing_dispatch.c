@@ -66,8 +66,11 @@ struct rt_hdl {
 		int (*rt_fwd_cb)(void * cbdata, struct msg ** msg);
 		int (*rt_out_cb)(void * cbdata, struct msg ** msg, struct fd_list * candidates);
 	};
+	int		cacheable;	/* for OUT handlers, see fd_rt_out_cacheable */
 };	
 
+static int rt_cache_callbacks(int nocache_delta);
+
 /* Add a new entry in the list */
 static int add_ordered(struct rt_hdl * new, struct fd_list * list)
 {
@@ -161,6 +164,9 @@ int fd_rt_out_register ( int (*rt_out_cb)(void * cbdata, struct msg ** pmsg, str
 	/* Save this in the list */
 	CHECK_FCT( add_ordered(new, &rt_out_list) );
 	
+	/* The new callback is not cacheable until it is declared so */
+	CHECK_FCT( rt_cache_callbacks(1) );
+	
 	/* Give it back to the extension if needed */
 	if (handler)
 		*handler = (void *)new;
@@ -182,6 +188,7 @@ int fd_rt_out_unregister ( struct fd_rt_out_hdl * handler, void ** cbdata )
 	CHECK_POSIX( pthread_rwlock_wrlock(&rt_out_lock) );
 	fd_list_unlink(&del->chain);
 	CHECK_POSIX( pthread_rwlock_unlock(&rt_out_lock) );
+	CHECK_FCT( rt_cache_callbacks(del->cacheable ? 0 : -1) );
 	
 	if (cbdata)
 		*cbdata = del->cbdata;
@@ -190,6 +197,363 @@ int fd_rt_out_unregister ( struct fd_rt_out_hdl * handler, void ** cbdata )
 	return 0;
 }
 
+/********************************************************************************/
+/*                      Cache of the OUT routing decisions                      */
+/********************************************************************************/
+
+/* When RoutingCache is configured and all the OUT callbacks are cacheable, the scores they give to the 
+ candidates of a request are saved, and reused for the next requests with the same key (see rt_cache_key). */
+#define RT_CACHE_BUCKETS	256
+#define RT_CACHE_KEY_MAX	512
+
+/* A candidate and its score */
+struct rt_cache_cand {
+	DiamId_t	diamid;
+	size_t		diamidlen;
+	DiamId_t	realm;
+	size_t		realmlen;
+	int		score;
+};
+
+/* An entry of the cache, allocated in one block with its key and candidates */
+struct rt_cache_entry {
+	struct fd_list		chain;	/* link in the bucket */
+	struct fd_list		age;	/* link in rt_cache_age, the oldest first */
+	uint32_t		hash;
+	uint8_t *		key;
+	size_t			keylen;
+	int			nb;
+	struct rt_cache_cand *	cands;	/* ordered by Diameter Id, as the candidates of rt_data */
+};
+
+static pthread_rwlock_t	rt_cache_lock = PTHREAD_RWLOCK_INITIALIZER; /* read for the lookups, write for the changes */
+static struct fd_list	rt_cache_hash[RT_CACHE_BUCKETS];
+static struct fd_list	rt_cache_age = FD_LIST_INITIALIZER(rt_cache_age);
+static int		rt_cache_count = 0;
+static unsigned long	rt_cache_gen = 0;	/* incremented each time the cache is emptied */
+static int		rt_out_nocache = 0;	/* number of registered OUT callbacks that are not cacheable */
+
+/* The additional AVP of the key, resolved on first use since the dictionaries are loaded after the routing is initialized.
+ The state is written under rt_cache_lock and read without it, with atomic accesses; rt_cache_avp is set before the state. */
+static enum { RT_AVP_UNRESOLVED = 0, RT_AVP_RESOLVED, RT_AVP_MISSING } rt_cache_avp_state = RT_AVP_UNRESOLVED;
+static struct dict_avp_data rt_cache_avp;
+
+/* Empty the cache; the caller holds rt_cache_lock for writing */
+static void rt_cache_empty(void)
+{
+	rt_cache_gen++;
+	while (!FD_IS_LIST_EMPTY(&rt_cache_age)) {
+		struct rt_cache_entry * e = rt_cache_age.next->o;
+		fd_list_unlink(&e->chain);
+		fd_list_unlink(&e->age);
+		free(e);
+	}
+	rt_cache_count = 0;
+}
+
+/* The list of OUT callbacks has changed */
+static int rt_cache_callbacks(int nocache_delta)
+{
+	CHECK_POSIX( pthread_rwlock_wrlock(&rt_cache_lock) );
+	rt_out_nocache += nocache_delta;
+	rt_cache_empty();
+	CHECK_POSIX( pthread_rwlock_unlock(&rt_cache_lock) );
+	return 0;
+}
+
+/* Declare an OUT callback (not) cacheable */
+int fd_rt_out_cacheable ( struct fd_rt_out_hdl * handler, int cacheable )
+{
+	struct rt_hdl * hdl;
+	TRACE_ENTRY( "%p %d", handler, cacheable);
+	CHECK_PARAMS( handler );
+	
+	hdl = (struct rt_hdl *)handler;
+	CHECK_PARAMS( hdl->chain.head == &rt_out_list );
+	
+	CHECK_POSIX( pthread_rwlock_wrlock(&rt_cache_lock) );
+	if (hdl->cacheable != !!cacheable) {
+		hdl->cacheable = !!cacheable;
+		rt_out_nocache += cacheable ? -1 : 1;
+	}
+	rt_cache_empty();
+	CHECK_POSIX( pthread_rwlock_unlock(&rt_cache_lock) );
+	return 0;
+}
+
+/* Empty the cache, e.g. when a peer enters or leaves the OPEN state */
+int fd_rt_out_cache_flush ( void )
+{
+	TRACE_ENTRY();
+	CHECK_POSIX( pthread_rwlock_wrlock(&rt_cache_lock) );
+	rt_cache_empty();
+	CHECK_POSIX( pthread_rwlock_unlock(&rt_cache_lock) );
+	return 0;
+}
+
+/* Search the additional AVP of the key in the dictionary */
+static void rt_cache_resolve(void)
+{
+	struct dict_object * model = NULL;
+	
+	CHECK_POSIX_DO( pthread_rwlock_wrlock(&rt_cache_lock), return );
+	if (__atomic_load_n(&rt_cache_avp_state, __ATOMIC_RELAXED) == RT_AVP_UNRESOLVED) {
+		if ((fd_dict_search(fd_g_config->cnf_dict, DICT_AVP, AVP_BY_NAME_ALL_VENDORS, fd_g_config->cnf_rt_cache_avp, &model, ENOENT) == 0)
+				&& (fd_dict_getval(model, &rt_cache_avp) == 0)
+				&& (rt_cache_avp.avp_basetype != AVP_TYPE_GROUPED)) {
+			__atomic_store_n(&rt_cache_avp_state, RT_AVP_RESOLVED, __ATOMIC_RELEASE);
+		} else {
+			LOG_E("The AVP '%s' of RoutingCache is unknown or grouped, the routing cache is disabled", fd_g_config->cnf_rt_cache_avp);
+			__atomic_store_n(&rt_cache_avp_state, RT_AVP_MISSING, __ATOMIC_RELEASE);
+		}
+	}
+	CHECK_POSIX_DO( pthread_rwlock_unlock(&rt_cache_lock), );
+}
+
+/* Append a field (absent if data is NULL) to the key */
+static int rt_cache_key_add(uint8_t * key, size_t * keylen, uint8_t * data, size_t len)
+{
+	if (*keylen + 3 + len > RT_CACHE_KEY_MAX)
+		return ENOSPC;
+	key[(*keylen)++] = data ? 1 : 0;
+	key[(*keylen)++] = (uint8_t)(len >> 8);
+	key[(*keylen)++] = (uint8_t)len;
+	if (len)
+		memcpy(key + *keylen, data, len);
+	*keylen += len;
+	return 0;
+}
+
+/* Build the key of a request in the cache: Application-Id, Command-Code, Destination-Realm, Destination-Host and the configured AVP.
+ Returns ENOENT if the request cannot use the cache. */
+static int rt_cache_key(struct msg * msg, struct msg_hdr * hdr, uint8_t * key, size_t * keylen)
+{
+	struct { uint8_t * data; size_t len; } f[3]; /* Destination-Realm, Destination-Host, additional AVP */
+	uint8_t num[8];
+	int nb, found = 0;
+	uint32_t u32;
+	
+	if (!fd_g_config->cnf_rt_cache)
+		return ENOENT;
+	
+	nb = 2;
+	if (fd_g_config->cnf_rt_cache_avp) {
+		if (__atomic_load_n(&rt_cache_avp_state, __ATOMIC_ACQUIRE) == RT_AVP_UNRESOLVED)
+			rt_cache_resolve();
+		if (__atomic_load_n(&rt_cache_avp_state, __ATOMIC_ACQUIRE) != RT_AVP_RESOLVED)
+			return ENOENT;
+		nb = 3;
+	}
+	memset(f, 0, sizeof(f));
+	
+	if (fd_msg_is_raw(msg)) {
+		/* Read the values directly in the received buffer */
+		struct avp_hdr ahdr;
+		uint8_t * data;
+		size_t pos = 0, len;
+		
+		while ((found < nb) && (fd_msg_raw_next(msg, &pos, &ahdr, &data, &len) == 0)) {
+			vendor_id_t vnd = (ahdr.avp_flags & AVP_FLAG_VENDOR) ? ahdr.avp_vendor : 0;
+			int i = -1;
+			
+			if ((vnd == 0) && (ahdr.avp_code == AC_DESTINATION_REALM))
+				i = 0;
+			else if ((vnd == 0) && (ahdr.avp_code == AC_DESTINATION_HOST))
+				i = 1;
+			else if ((nb == 3) && (vnd == rt_cache_avp.avp_vendor) && (ahdr.avp_code == rt_cache_avp.avp_code))
+				i = 2;
+			
+			if ((i >= 0) && !f[i].data) {
+				f[i].data = data;
+				f[i].len = len;
+				found++;
+			}
+		}
+	} else {
+		struct avp * avp;
+		
+		CHECK_FCT_DO( fd_msg_browse(msg, MSG_BRW_FIRST_CHILD, &avp, NULL), return ENOENT );
+		while ((found < nb) && avp) {
+			struct avp_hdr * ahdr;
+			vendor_id_t vnd;
+			int i = -1;
+			
+			CHECK_FCT_DO( fd_msg_avp_hdr( avp, &ahdr ), return ENOENT );
+			vnd = (ahdr->avp_flags & AVP_FLAG_VENDOR) ? ahdr->avp_vendor : 0;
+			if ((vnd == 0) && (ahdr->avp_code == AC_DESTINATION_REALM))
+				i = 0;
+			else if ((vnd == 0) && (ahdr->avp_code == AC_DESTINATION_HOST))
+				i = 1;
+			else if ((nb == 3) && (vnd == rt_cache_avp.avp_vendor) && (ahdr->avp_code == rt_cache_avp.avp_code))
+				i = 2;
+			
+			if ((i >= 0) && !f[i].data) {
+				union avp_value * v;
+				CHECK_FCT_DO( fd_msg_parse_dict ( avp, fd_g_config->cnf_dict, NULL ), return ENOENT );
+				if (!(v = ahdr->avp_value))
+					return ENOENT;
+				
+				/* Use the same representation as in the received buffers, so that all messages share the entries */
+				switch ((i < 2) ? AVP_TYPE_OCTETSTRING : rt_cache_avp.avp_basetype) {
+					case AVP_TYPE_INTEGER32:
+					case AVP_TYPE_UNSIGNED32:
+					case AVP_TYPE_FLOAT32:
+						u32 = htonl(v->u32);
+						memcpy(num, &u32, sizeof(u32));
+						f[i].data = num;
+						f[i].len = sizeof(u32);
+						break;
+					
+					case AVP_TYPE_INTEGER64:
+					case AVP_TYPE_UNSIGNED64:
+					case AVP_TYPE_FLOAT64:
+						{
+							uint64_t u64 = htonll(v->u64);
+							memcpy(num, &u64, sizeof(u64));
+						}
+						f[i].data = num;
+						f[i].len = sizeof(uint64_t);
+						break;
+					
+					default:
+						f[i].data = v->os.data ?: num; /* an empty string is present */
+						f[i].len = v->os.len;
+				}
+				found++;
+			}
+			
+			CHECK_FCT_DO( fd_msg_browse(avp, MSG_BRW_NEXT, &avp, NULL), return ENOENT );
+		}
+	}
+	
+	/* Now write the key */
+	u32 = htonl(hdr->msg_appl);
+	memcpy(key, &u32, sizeof(u32));
+	u32 = htonl(hdr->msg_code);
+	memcpy(key + sizeof(u32), &u32, sizeof(u32));
+	*keylen = 2 * sizeof(u32);
+	for (found = 0; found < nb; found++) {
+		if (rt_cache_key_add(key, keylen, f[found].data, f[found].len))
+			return ENOENT;
+	}
+	return 0;
+}
+
+/* Search a request in the cache. On hit, the candidates are added to rtd and extracted in *candidates with their saved scores.
+ On miss, *candidates is NULL and *gen receives the value to pass to rt_cache_save. Returns ENOENT if the cache cannot be used. */
+static int rt_cache_lookup(uint8_t * key, size_t keylen, uint32_t hash, struct rt_data * rtd, struct fd_list ** candidates, unsigned long * gen)
+{
+	struct fd_list * li;
+	int ret = 0;
+	
+	*candidates = NULL;
+	CHECK_POSIX( pthread_rwlock_rdlock(&rt_cache_lock) );
+	if (rt_out_nocache) {
+		ret = ENOENT;
+		goto out;
+	}
+	*gen = rt_cache_gen;
+	
+	for (li = rt_cache_hash[hash % RT_CACHE_BUCKETS].next; li != &rt_cache_hash[hash % RT_CACHE_BUCKETS]; li = li->next) {
+		struct rt_cache_entry * e = li->o;
+		int i;
+		
+		if ((e->hash != hash) || (e->keylen != keylen) || memcmp(e->key, key, keylen))
+			continue;
+		
+		for (i = 0; i < e->nb; i++) {
+			CHECK_FCT_DO( ret = fd_rtd_candidate_add(rtd, e->cands[i].diamid, e->cands[i].diamidlen, e->cands[i].realm, e->cands[i].realmlen), goto out );
+		}
+		fd_rtd_candidate_extract(rtd, candidates, FD_SCORE_INI);
+		for (i = 0, li = (*candidates)->next; (i < e->nb) && (li != *candidates); i++, li = li->next)
+			((struct rtd_candidate *)li)->score = e->cands[i].score;
+		break;
+	}
+out:
+	CHECK_POSIX( pthread_rwlock_unlock(&rt_cache_lock) );
+	return ret;
+}
+
+/* Save the scores of the candidates of a request, unless the cache was emptied since rt_cache_lookup */
+static int rt_cache_save(uint8_t * key, size_t keylen, uint32_t hash, struct fd_list * candidates, unsigned long gen)
+{
+	struct rt_cache_entry * e;
+	struct fd_list * li, * bucket = &rt_cache_hash[hash % RT_CACHE_BUCKETS];
+	size_t size = sizeof(struct rt_cache_entry) + keylen;
+	uint8_t * p;
+	int nb = 0;
+	
+	for (li = candidates->next; li != candidates; li = li->next) {
+		struct rtd_candidate * c = (struct rtd_candidate *)li;
+		size += sizeof(struct rt_cache_cand) + c->diamidlen + 1 + c->realmlen + 1;
+		nb++;
+	}
+	
+	CHECK_MALLOC( e = malloc(size) );
+	memset(e, 0, sizeof(struct rt_cache_entry));
+	fd_list_init(&e->chain, e);
+	fd_list_init(&e->age, e);
+	e->hash = hash;
+	e->nb = nb;
+	e->cands = (struct rt_cache_cand *)(e + 1);
+	p = (uint8_t *)(e->cands + nb);
+	e->key = p;
+	e->keylen = keylen;
+	memcpy(p, key, keylen);
+	p += keylen;
+	
+	nb = 0;
+	for (li = candidates->next; li != candidates; li = li->next) {
+		struct rtd_candidate * c = (struct rtd_candidate *)li;
+		struct rt_cache_cand * cc = &e->cands[nb++];
+		
+		cc->diamid = (DiamId_t)p;
+		cc->diamidlen = c->diamidlen;
+		memcpy(p, c->diamid, c->diamidlen);
+		p[c->diamidlen] = '\0';
+		p += c->diamidlen + 1;
+		
+		cc->realm = NULL;
+		cc->realmlen = 0;
+		if (c->realm) {
+			cc->realm = (DiamId_t)p;
+			cc->realmlen = c->realmlen;
+			memcpy(p, c->realm, c->realmlen);
+			p[c->realmlen] = '\0';
+			p += c->realmlen + 1;
+		}
+		cc->score = c->score;
+	}
+	
+	CHECK_POSIX_DO( pthread_rwlock_wrlock(&rt_cache_lock), { free(e); return EINVAL; } );
+	
+	if (gen != rt_cache_gen)
+		goto drop; /* the peers or the callbacks have changed meanwhile */
+	for (li = bucket->next; li != bucket; li = li->next) {
+		struct rt_cache_entry * o = li->o;
+		if ((o->hash == hash) && (o->keylen == keylen) && !memcmp(o->key, key, keylen))
+			goto drop; /* saved by another thread meanwhile */
+	}
+	
+	/* Make room by removing the oldest entry */
+	if (rt_cache_count >= fd_g_config->cnf_rt_cache) {
+		struct rt_cache_entry * o = rt_cache_age.next->o;
+		fd_list_unlink(&o->chain);
+		fd_list_unlink(&o->age);
+		free(o);
+		rt_cache_count--;
+	}
+	
+	fd_list_insert_before(bucket, &e->chain);
+	fd_list_insert_before(&rt_cache_age, &e->age);
+	rt_cache_count++;
+	e = NULL;
+drop:
+	CHECK_POSIX_DO( pthread_rwlock_unlock(&rt_cache_lock), );
+	free(e);
+	return 0;
+}
+
 /********************************************************************************/
 /*                      Some default OUT routing callbacks                      */
 /********************************************************************************/
@@ -234,12 +598,42 @@ static int score_destination_avp(void * cbdata, struct msg ** pmsg, struct fd_li
 	struct fd_list * li;
 	struct avp * avp;
 	union avp_value *dh = NULL, *dr = NULL;
+	union avp_value raw_dh, raw_dr;
 	
 	TRACE_ENTRY("%p %p %p", cbdata, msg, candidates);
 	CHECK_PARAMS(msg && candidates);
 	
-	/* Search the Destination-Host and Destination-Realm AVPs -- we could also use fd_msg_search_avp here, but this one is slightly more efficient */
-	CHECK_FCT(  fd_msg_browse(msg, MSG_BRW_FIRST_CHILD, &avp, NULL) );
+	if (fd_msg_is_raw(msg)) {
+		/* Read the values directly in the received buffer */
+		struct avp_hdr ahdr;
+		uint8_t * data;
+		size_t pos = 0, len;
+		
+		while (fd_msg_raw_next(msg, &pos, &ahdr, &data, &len) == 0) {
+			if (! (ahdr.avp_flags & AVP_FLAG_VENDOR)) {
+				switch (ahdr.avp_code) {
+					case AC_DESTINATION_HOST:
+						raw_dh.os.data = data;
+						raw_dh.os.len = len;
+						dh = &raw_dh;
+						break;
+
+					case AC_DESTINATION_REALM:
+						raw_dr.os.data = data;
+						raw_dr.os.len = len;
+						dr = &raw_dr;
+						break;
+				}
+			}
+			
+			if (dh && dr)
+				break;
+		}
+		avp = NULL;
+	} else {
+		/* Search the Destination-Host and Destination-Realm AVPs -- we could also use fd_msg_search_avp here, but this one is slightly more efficient */
+		CHECK_FCT(  fd_msg_browse(msg, MSG_BRW_FIRST_CHILD, &avp, NULL) );
+	}
 	while (avp) {
 		struct avp_hdr * ahdr;
 		CHECK_FCT(  fd_msg_avp_hdr( avp, &ahdr ) );
@@ -340,12 +734,17 @@ static void nai_get_indexes(union avp_value * un, int * excl_idx, int * at_idx)
 
 /* Test if a User-Name AVP contains a Decorated NAI -- RFC4282, RFC5729 */
 /* Create new User-Name and Destination-Realm values */
-static int process_decorated_NAI(int * was_nai, union avp_value * un, union avp_value * dr)
+static int process_decorated_NAI(int * was_nai, struct avp * un_avp, struct avp * dr_avp)
 {
 	int at_idx, sep_idx;
-	unsigned char * old_un;
-	TRACE_ENTRY("%p %p %p", was_nai, un, dr);
-	CHECK_PARAMS(was_nai && un && dr);
+	struct avp_hdr * un_hdr;
+	union avp_value * un, val;
+	unsigned char * old_un, * new_un;
+	TRACE_ENTRY("%p %p %p", was_nai, un_avp, dr_avp);
+	CHECK_PARAMS(was_nai && un_avp && dr_avp);
+	
+	CHECK_FCT( fd_msg_avp_hdr( un_avp, &un_hdr ) );
+	un = un_hdr->avp_value;
 	
 	/* Save the decorated User-Name, for example 'homerealm.example.net!user@otherrealm.example.net' */
 	old_un = un->os.data;
@@ -360,22 +759,26 @@ static int process_decorated_NAI(int * was_nai, union avp_value * un, union avp_
 	*was_nai = 1;
 	
 	/* Create the new User-Name value */
-	CHECK_MALLOC( un->os.data = malloc( at_idx ) );
-	memcpy( un->os.data, old_un + sep_idx + 1, at_idx - sep_idx ); /* user@ */
-	memcpy( un->os.data + at_idx - sep_idx, old_un, sep_idx ); /* homerealm.example.net */
-	
-	/* Create the new Destination-Realm value */
-	CHECK_MALLOC( dr->os.data = realloc(dr->os.data, sep_idx) );
-	memcpy( dr->os.data, old_un, sep_idx );
-	dr->os.len = sep_idx;
+	CHECK_MALLOC( new_un = malloc( at_idx ) );
+	memcpy( new_un, old_un + sep_idx + 1, at_idx - sep_idx ); /* user@ */
+	memcpy( new_un + at_idx - sep_idx, old_un, sep_idx ); /* homerealm.example.net */
 	
 	TRACE_DEBUG(FULL, "Processed Decorated NAI : '%.*s' became '%.*s' (%.*s)",
 				(int)un->os.len, old_un,
-				(int)at_idx, un->os.data,
-				(int)dr->os.len, dr->os.data);
+				(int)at_idx, new_un,
+				(int)sep_idx, old_un);
 	
-	un->os.len = at_idx;
-	free(old_un);
+	/* The storage of the values belongs to the AVPs, so we replace them with fd_msg_avp_setvalue. */
+	/* Destination-Realm first, since old_un is released when the User-Name is updated */
+	val.os.data = old_un;
+	val.os.len  = sep_idx;
+	CHECK_FCT_DO( fd_msg_avp_setvalue( dr_avp, &val ), { free(new_un); return __ret__; } );
+	
+	val.os.data = new_un;
+	val.os.len  = at_idx;
+	CHECK_FCT_DO( fd_msg_avp_setvalue( un_avp, &val ), { free(new_un); return __ret__; } );
+	
+	free(new_un);
 	
 	return 0;
 }
@@ -433,6 +836,37 @@ static int return_error(struct msg ** pmsg, char * error_code, char * error_mess
 /*         Second part : threads moving messages in the daemon              */
 /****************************************************************************/
 
+/* The dedicated dispatch pools (DispatchPool), in the order of the configuration */
+struct disp_pool {
+	struct fd_disp_pool *	conf;
+	struct fifo *		queue;	/* messages of conf->appid to be handled to local extensions */
+	pthread_t *		thr;
+	struct pool_thr *	st;	/* the states of the threads */
+#ifdef linux
+	cpu_set_t		cpus;
+#endif /* linux */
+};
+static struct disp_pool * pools = NULL;
+static int nb_pools = 0;
+static pthread_rwlock_t pools_rwl = PTHREAD_RWLOCK_INITIALIZER; /* protects pools and nb_pools against fd_rtdisp_fini for the statistics. The routing threads do not need it, they are stopped first. */
+
+/* The dedicated pool of the application of a message, or NULL if the message is handled by the shared dispatch threads */
+static struct disp_pool * local_pool(struct msg * msg)
+{
+	struct msg_hdr * hdr;
+	int i;
+	
+	if (!nb_pools)
+		return NULL;
+	
+	CHECK_FCT_DO( fd_msg_hdr(msg, &hdr), return NULL );
+	for (i = 0; i < nb_pools; i++) {
+		if (pools[i].conf->appid == hdr->msg_appl)
+			return &pools[i];
+	}
+	return NULL;
+}
+
 /* The DISPATCH message processing */
 static int msg_dispatch(struct msg * msg)
 {
@@ -558,6 +992,30 @@ static int msg_dispatch(struct msg * msg)
 	return 0;
 }
 
+/* Pass a message to the local extensions. The routing threads never wait for room in the queue of a dedicated pool,
+   so that a slow application does not delay the messages of the other ones: when the queue of the pool is full, a request
+   is answered with DIAMETER_TOO_BUSY. The answers to the local requests are always queued. */
+static int local_post(struct msg ** pmsg)
+{
+	struct disp_pool * pool = local_pool(*pmsg);
+	struct msg_hdr * hdr;
+	
+	if (!pool) {
+		CHECK_FCT( fd_fifo_post(fd_g_local, pmsg) );
+		return 0;
+	}
+	
+	CHECK_FCT( fd_msg_hdr(*pmsg, &hdr) );
+	if ((hdr->msg_flags & CMD_FLAG_REQUEST) && (pool->conf->qlimit > 0) && (fd_fifo_length(pool->queue) >= pool->conf->qlimit)) {
+		fd_hook_call(HOOK_MESSAGE_ROUTING_ERROR, *pmsg, NULL, "The queue of the dispatch pool of the application is full", fd_msg_pmdl_get(*pmsg));
+		CHECK_FCT( return_error( pmsg, "DIAMETER_TOO_BUSY", "The application is overloaded", NULL) );
+		return 0;
+	}
+	
+	CHECK_FCT( fd_fifo_post_noblock(pool->queue, (void *)pmsg) );
+	return 0;
+}
+
 /* The ROUTING-IN message processing */
 static int msg_rt_in(struct msg * msg)
 {
@@ -581,7 +1039,7 @@ static int msg_rt_in(struct msg * msg)
 	
 	/* If it is a request, we must analyze its content to decide what we do with it */
 	if (is_req) {
-		struct avp * avp, *un = NULL;
+		struct avp * avp, *un = NULL, *dr = NULL;
 		union avp_value * un_val = NULL, *dr_val = NULL;
 		enum status { UNKNOWN, YES, NO };
 		/* Are we Destination-Host? */
@@ -602,6 +1060,54 @@ static int msg_rt_in(struct msg * msg)
 			is_local_app = (app ? YES : NO);
 		}
 
+		/* For a raw message, read these AVPs directly in the received buffer (relay fast path) */
+		if (fd_msg_is_raw(msgptr)) {
+			struct avp_hdr ahdr;
+			uint8_t * data;
+			size_t pos = 0, len;
+			int has_un = 0;
+			int ret;
+			
+			while ((ret = fd_msg_raw_next(msgptr, &pos, &ahdr, &data, &len)) == 0) {
+				if (! (ahdr.avp_flags & AVP_FLAG_VENDOR)) {
+					switch (ahdr.avp_code) {
+						case AC_DESTINATION_HOST:
+							is_dest_host = fd_os_almostcasesrch(data, len, fd_g_config->cnf_diamid, fd_g_config->cnf_diamid_len, NULL) ? NO : YES;
+							break;
+							
+						case AC_DESTINATION_REALM:
+							is_dest_realm = fd_os_almostcasesrch(data, len, fd_g_config->cnf_diamrlm, fd_g_config->cnf_diamrlm_len, NULL) ? NO : YES;
+							break;
+							
+						case AC_USER_NAME:
+							has_un = 1;
+							break;
+							
+						case AC_ROUTE_RECORD:
+							if (!fd_os_almostcasesrch(data, len, fd_g_config->cnf_diamid, fd_g_config->cnf_diamid_len, NULL)) {
+								char * error = "DIAMETER_LOOP_DETECTED";
+								fd_hook_call(HOOK_MESSAGE_PARSING_ERROR, msgptr, NULL, error, fd_msg_pmdl_get(msgptr));
+								CHECK_FCT( return_error( &msgptr, error, NULL, NULL) );
+								return 0;
+							}
+							break;
+					}
+				}
+				
+				if ((is_dest_host != UNKNOWN) && (is_dest_realm != UNKNOWN) && has_un)
+					break;
+			}
+			if (ret && (ret != ENOENT))
+				return ret;
+			
+			/* The decorated NAI is processed on the AVP objects, otherwise we are done */
+			if (has_un && (is_dest_host == UNKNOWN) && (is_dest_realm == YES)) {
+				is_dest_realm = UNKNOWN;
+			} else {
+				goto routing_avps_done;
+			}
+		}
+
 		/* Parse the message for Dest-Host, Dest-Realm, and Route-Record */
 		CHECK_FCT(  fd_msg_browse(msgptr, MSG_BRW_FIRST_CHILD, &avp, NULL)  );
 		while (avp) {
@@ -653,6 +1159,7 @@ static int msg_rt_in(struct msg * msg)
 								}
 							} );
 						ASSERT( ahdr->avp_value );
+						dr = avp;
 						dr_val = ahdr->avp_value;
 						/* Compare the Destination-Realm AVP of the message with our identity */
 						if (!fd_os_almostcasesrch(dr_val->os.data, dr_val->os.len, fd_g_config->cnf_diamrlm, fd_g_config->cnf_diamrlm_len, NULL)) {
@@ -718,6 +1225,7 @@ static int msg_rt_in(struct msg * msg)
 			/* Go to next AVP */
 			CHECK_FCT(  fd_msg_browse(avp, MSG_BRW_NEXT, &avp, NULL)  );
 		}
+routing_avps_done:
 
 		/* OK, now decide what we do with the request */
 
@@ -733,7 +1241,7 @@ static int msg_rt_in(struct msg * msg)
 			if (is_local_app == YES) {
 				/* Ok, give the message to the dispatch thread */
 				fd_hook_call(HOOK_MESSAGE_ROUTING_LOCAL, msgptr, NULL, NULL, fd_msg_pmdl_get(msgptr));
-				CHECK_FCT( fd_fifo_post(fd_g_local, &msgptr) );
+				CHECK_FCT( local_post(&msgptr) );
 			} else {
 				/* We don't support the application, reply an error */
 				fd_hook_call(HOOK_MESSAGE_PARSING_ERROR, msgptr, NULL, "Application unsupported", fd_msg_pmdl_get(msgptr));
@@ -763,7 +1271,7 @@ static int msg_rt_in(struct msg * msg)
 			/* test for decorated NAI  (RFC5729 section 4.4) */
 			/* Handle the decorated NAI */
 			if (un_val) {
-				CHECK_FCT_DO( process_decorated_NAI(&is_nai, un_val, dr_val),
+				CHECK_FCT_DO( process_decorated_NAI(&is_nai, un, dr),
 					{
 						/* If the process failed, we assume it is because of the AVP format */
 						fd_hook_call(HOOK_MESSAGE_PARSING_ERROR, msgptr, NULL, "Failed to process decorated NAI", fd_msg_pmdl_get(msgptr));
@@ -781,7 +1289,7 @@ static int msg_rt_in(struct msg * msg)
 			if (is_local_app == YES) {
 				/* Handle locally since we are able to */
 				fd_hook_call(HOOK_MESSAGE_ROUTING_LOCAL, msgptr, NULL, NULL, fd_msg_pmdl_get(msgptr));
-				CHECK_FCT(fd_fifo_post(fd_g_local, &msgptr) );
+				CHECK_FCT( local_post(&msgptr) );
 				return 0;
 			}
 
@@ -806,7 +1314,7 @@ static int msg_rt_in(struct msg * msg)
 		if ((!qry_src) && (!is_err)) {
 			/* The message is a normal answer to a request issued locally, we do not call the callbacks chain on it. */
 			fd_hook_call(HOOK_MESSAGE_ROUTING_LOCAL, msgptr, NULL, NULL, fd_msg_pmdl_get(msgptr));
-			CHECK_FCT(fd_fifo_post(fd_g_local, &msgptr) );
+			CHECK_FCT( local_post(&msgptr) );
 			return 0;
 		}
 		
@@ -858,7 +1366,7 @@ static int msg_rt_in(struct msg * msg)
 		CHECK_FCT(fd_fifo_post(fd_g_outgoing, &msgptr) );
 	} else {
 		fd_hook_call(HOOK_MESSAGE_ROUTING_LOCAL, msgptr, NULL, NULL, fd_msg_pmdl_get(msgptr));
-		CHECK_FCT(fd_fifo_post(fd_g_local, &msgptr) );
+		CHECK_FCT( local_post(&msgptr) );
 	}
 
 	/* We're done with this message */
@@ -866,6 +1374,37 @@ static int msg_rt_in(struct msg * msg)
 }
 		
 
+/* Pass the candidates of a request to the OUT callbacks. Upon return, *pmsg is NULL if the message was disposed of. */
+static int rt_out_callbacks(struct msg ** pmsg, struct fd_list * candidates)
+{
+	struct fd_list * li;
+	int ret;
+	
+	CHECK_FCT( pthread_rwlock_rdlock( &rt_out_lock ) );
+	pthread_cleanup_push( fd_cleanup_rwlock, &rt_out_lock );
+
+	/* We call the cb by reverse priority order */
+	for (	li = rt_out_list.prev ; (*pmsg != NULL) && (li != &rt_out_list) ; li = li->prev ) {
+		struct rt_hdl * rh = (struct rt_hdl *)li;
+
+		TRACE_DEBUG(ANNOYING, "Calling next OUT callback on %p : %p (prio %d)", *pmsg, rh->rt_out_cb, rh->prio);
+		CHECK_FCT_DO( ret = (*rh->rt_out_cb)(rh->cbdata, pmsg, candidates),
+			{
+				char buf[256];
+				snprintf(buf, sizeof(buf), "An OUT routing callback returned an error: %s", strerror(ret));
+				fd_hook_call(HOOK_MESSAGE_ROUTING_ERROR, *pmsg, NULL, buf, fd_msg_pmdl_get(*pmsg));
+				fd_hook_call(HOOK_MESSAGE_DROPPED, *pmsg, NULL, buf, fd_msg_pmdl_get(*pmsg));
+				fd_msg_free(*pmsg);
+				*pmsg = NULL;
+			} );
+	}
+
+	pthread_cleanup_pop(0);
+	CHECK_FCT( pthread_rwlock_unlock( &rt_out_lock ) );
+	
+	return 0;
+}
+
 /* The ROUTING-OUT message processing */
 static int msg_rt_out(struct msg * msg)
 {
@@ -873,7 +1412,7 @@ static int msg_rt_out(struct msg * msg)
 	struct msg_hdr * hdr;
 	int is_req = 0;
 	int ret;
-	struct fd_list * li, *candidates;
+	struct fd_list * li, *candidates = NULL;
 	struct avp * avp;
 	struct rtd_candidate * c;
 	struct msg *msgptr = msg;
@@ -927,23 +1466,63 @@ static int msg_rt_out(struct msg * msg)
 
 	/* If there is no routing data already, let's create it */
 	if (rtd == NULL) {
+		uint8_t key[RT_CACHE_KEY_MAX];
+		size_t keylen = 0;
+		uint32_t hash = 0;
+		unsigned long gen = 0;
+		int use_cache = 0;
+		
 		CHECK_FCT( fd_rtd_init(&rtd) );
+		
+		/* Search the scores in the routing cache */
+		if (rt_cache_key(msgptr, hdr, key, &keylen) == 0) {
+			hash = fd_os_hash(key, keylen);
+			use_cache = (rt_cache_lookup(key, keylen, hash, rtd, &candidates, &gen) == 0);
+		}
 
-		/* Add all peers currently in OPEN state */
-		CHECK_FCT( pthread_rwlock_rdlock(&fd_g_activ_peers_rw) );
-		for (li = fd_g_activ_peers.next; li != &fd_g_activ_peers; li = li->next) {
-			struct fd_peer * p = (struct fd_peer *)li->o;
-			CHECK_FCT_DO( ret = fd_rtd_candidate_add(rtd, 
-							p->p_hdr.info.pi_diamid, 
-							p->p_hdr.info.pi_diamidlen, 
-							p->p_hdr.info.runtime.pir_realm,
-							p->p_hdr.info.runtime.pir_realmlen), 
-				{ CHECK_FCT_DO( pthread_rwlock_unlock(&fd_g_activ_peers_rw), ); return ret; } );
+		if (candidates == NULL) {
+			/* Add all peers currently in OPEN state */
+			CHECK_FCT( pthread_rwlock_rdlock(&fd_g_activ_peers_rw) );
+			for (li = fd_g_activ_peers.next; li != &fd_g_activ_peers; li = li->next) {
+				struct fd_peer * p = (struct fd_peer *)li->o;
+				CHECK_FCT_DO( ret = fd_rtd_candidate_add(rtd, 
+								p->p_hdr.info.pi_diamid, 
+								p->p_hdr.info.pi_diamidlen, 
+								p->p_hdr.info.runtime.pir_realm,
+								p->p_hdr.info.runtime.pir_realmlen), 
+					{ CHECK_FCT_DO( pthread_rwlock_unlock(&fd_g_activ_peers_rw), ); return ret; } );
+			}
+			CHECK_FCT( pthread_rwlock_unlock(&fd_g_activ_peers_rw) );
+			
+			if (use_cache) {
+				/* The scores of cacheable callbacks do not depend on the Route-Records, compute them on all the peers for the next requests */
+				fd_rtd_candidate_extract(rtd, &candidates, FD_SCORE_INI);
+				CHECK_FCT_DO( ret = rt_out_callbacks(&msgptr, candidates), { fd_rtd_free(&rtd); return ret; } );
+				if (! msgptr) {
+					fd_rtd_free(&rtd);
+					return 0;
+				}
+				CHECK_FCT_DO( rt_cache_save(key, keylen, hash, candidates, gen), /* continue */ );
+			}
 		}
-		CHECK_FCT( pthread_rwlock_unlock(&fd_g_activ_peers_rw) );
 
 		/* Now let's remove all peers from the Route-Records */
-		CHECK_FCT(  fd_msg_browse(msgptr, MSG_BRW_FIRST_CHILD, &avp, NULL)  );
+		if (fd_msg_is_raw(msgptr)) {
+			/* Read them directly in the received buffer */
+			struct avp_hdr ahdr;
+			uint8_t * data;
+			size_t pos = 0, len;
+			
+			while ((ret = fd_msg_raw_next(msgptr, &pos, &ahdr, &data, &len)) == 0) {
+				if ((ahdr.avp_code == AC_ROUTE_RECORD) && (! (ahdr.avp_flags & AVP_FLAG_VENDOR)) )
+					fd_rtd_candidate_del(rtd, data, len);
+			}
+			if (ret != ENOENT)
+				return ret;
+			avp = NULL;
+		} else {
+			CHECK_FCT(  fd_msg_browse(msgptr, MSG_BRW_FIRST_CHILD, &avp, NULL)  );
+		}
 		while (avp) {
 			struct avp_hdr * ahdr;
 			struct fd_pei error_info;
@@ -976,32 +1555,12 @@ static int msg_rt_out(struct msg * msg)
 
 	/* Note: we reset the scores and pass the message to the callbacks, maybe we could reuse the saved scores when we have received an error ? -- TODO */
 
-	/* Ok, we have our list in rtd now, let's (re)initialize the scores */
-	fd_rtd_candidate_extract(rtd, &candidates, FD_SCORE_INI);
+	if (candidates == NULL) {
+		/* Ok, we have our list in rtd now, let's (re)initialize the scores */
+		fd_rtd_candidate_extract(rtd, &candidates, FD_SCORE_INI);
 
-	/* Pass the list to registered callbacks (even if it is empty list) */
-	{
-		CHECK_FCT( pthread_rwlock_rdlock( &rt_out_lock ) );
-		pthread_cleanup_push( fd_cleanup_rwlock, &rt_out_lock );
-
-		/* We call the cb by reverse priority order */
-		for (	li = rt_out_list.prev ; (msgptr != NULL) && (li != &rt_out_list) ; li = li->prev ) {
-			struct rt_hdl * rh = (struct rt_hdl *)li;
-
-			TRACE_DEBUG(ANNOYING, "Calling next OUT callback on %p : %p (prio %d)", msgptr, rh->rt_out_cb, rh->prio);
-			CHECK_FCT_DO( ret = (*rh->rt_out_cb)(rh->cbdata, &msgptr, candidates),
-				{
-					char buf[256];
-					snprintf(buf, sizeof(buf), "An OUT routing callback returned an error: %s", strerror(ret));
-					fd_hook_call(HOOK_MESSAGE_ROUTING_ERROR, msgptr, NULL, buf, fd_msg_pmdl_get(msgptr));
-					fd_hook_call(HOOK_MESSAGE_DROPPED, msgptr, NULL, buf, fd_msg_pmdl_get(msgptr));
-					fd_msg_free(msgptr);
-					msgptr = NULL;
-				} );
-		}
-
-		pthread_cleanup_pop(0);
-		CHECK_FCT( pthread_rwlock_unlock( &rt_out_lock ) );
+		/* Pass the list to registered callbacks (even if it is empty list) */
+		CHECK_FCT( rt_out_callbacks(&msgptr, candidates) );
 
 		/* If an error occurred or the callback disposed of the message, go to next message */
 		if (! msgptr) {
@@ -1069,9 +1628,30 @@ static void cleanup_state(void * state_loc)
 	CHECK_POSIX_DO( pthread_mutex_unlock(&order_state_lock), );
 }
 
+/* The threads pick up to this number of messages from their queue at once */
+#define PROCESS_BATCH	16
+
+/* The messages picked from the queue, those not processed yet are dropped if the thread is canceled */
+struct process_batch {
+	struct msg *	msgs[PROCESS_BATCH];
+	int		nb;
+	int		cur;	/* next message to process */
+};
+static void cleanup_batch(void * arg)
+{
+	struct process_batch * batch = arg;
+	while (batch->cur < batch->nb) {
+		struct msg * msg = batch->msgs[batch->cur++];
+		fd_hook_call(HOOK_MESSAGE_DROPPED, msg, NULL, "Message lost because framework is terminating.", fd_msg_pmdl_get(msg));
+		fd_msg_free(msg);
+	}
+}
+
 /* This is the common thread code (same for routing and dispatching) */
 static void * process_thr(void * arg, int (*action_cb)(struct msg * msg), struct fifo * queue, char * action_name)
 {
+	struct process_batch batch;
+	
 	TRACE_ENTRY("%p %p %p %p", arg, action_cb, queue, action_name);
 	
 	/* Set the thread name */
@@ -1090,10 +1670,15 @@ static void * process_thr(void * arg, int (*action_cb)(struct msg * msg), struct
 	*(enum thread_state *)arg = RUNNING;
 	CHECK_POSIX_DO( pthread_mutex_unlock(&order_state_lock), );
 	
-	do {
-		struct msg * msg;
+	memset(&batch, 0, sizeof(batch));
+	pthread_cleanup_push( cleanup_batch, &batch );
 	
-		/* Get the next message from the queue */
+	if (queue == NULL)
+		/* The queue was destroyed before the thread started, we are exiting */
+		goto end;
+	
+	do {
+		/* Get the next messages from the queue */
 		{
 			int ret;
 			struct timespec ts;
@@ -1101,7 +1686,8 @@ static void * process_thr(void * arg, int (*action_cb)(struct msg * msg), struct
 			CHECK_SYS_DO( clock_gettime(CLOCK_REALTIME, &ts), goto fatal_error );
 			ts.tv_sec += 1;
 			
-			ret = fd_fifo_timedget ( queue, &msg, &ts );
+			batch.nb = batch.cur = 0;
+			ret = fd_fifo_timedget_batch ( queue, batch.msgs, PROCESS_BATCH, &batch.nb, &ts );
 			if (ret == ETIMEDOUT) {
 				/* Test the current order */
 				{
@@ -1125,12 +1711,15 @@ static void * process_thr(void * arg, int (*action_cb)(struct msg * msg), struct
 			CHECK_FCT_DO( ret, goto fatal_error );
 		}
 		
-		LOG_A("%s: Picked next message", action_name);
+		LOG_A("%s: Picked next %d message(s)", action_name, batch.nb);
 
-		/* Now process the message */
-		CHECK_FCT_DO( (*action_cb)(msg), goto fatal_error);
+		/* Now process the messages */
+		while (batch.cur < batch.nb) {
+			struct msg * msg = batch.msgs[batch.cur++];
+			CHECK_FCT_DO( (*action_cb)(msg), goto fatal_error);
+		}
 
-		/* We're done with this message */
+		/* We're done with these messages */
 	
 	} while (1);
 	
@@ -1140,7 +1729,8 @@ fatal_error:
 	
 end:	
 	; /* noop so that we get rid of "label at end of compound statement" warning */
-	/* Mark the thread as terminated */
+	/* Drop the messages not processed, and mark the thread as terminated */
+	pthread_cleanup_pop(1);
 	pthread_cleanup_pop(1);
 	return NULL;
 }
@@ -1151,6 +1741,17 @@ static void * dispatch_thr(void * arg)
 	return process_thr(arg, msg_dispatch, fd_g_local, "Dispatch");
 }
 
+/* The threads of a dedicated dispatch pool */
+struct pool_thr {
+	enum thread_state	state;	/* first, so that the structure is passed to process_thr as the thread state */
+	struct disp_pool *	pool;
+};
+static void * pool_thr(void * arg)
+{
+	struct pool_thr * pt = arg;
+	return process_thr(arg, msg_dispatch, pt->pool->queue, "Dispatch-Pool");
+}
+
 /* The (routing-in) thread -- see description in freeDiameter.h */
 static void * routing_in_thr(void * arg)
 {
@@ -1177,11 +1778,102 @@ static enum thread_state * out_state = NULL;
 static pthread_t * rt_in  = NULL;
 static enum thread_state * in_state = NULL;
 
+#ifdef linux
+/* Parse a list of CPUs such as "0,2-3" */
+static int parse_cpus(char * list, cpu_set_t * cpus)
+{
+	char * c = list;
+	
+	CPU_ZERO(cpus);
+	do {
+		char * end;
+		unsigned long first, last;
+		
+		first = last = strtoul(c, &end, 10);
+		if (end == c)
+			return EINVAL;
+		if (*end == '-') {
+			c = end + 1;
+			last = strtoul(c, &end, 10);
+			if (end == c)
+				return EINVAL;
+		}
+		if ((last < first) || (last >= CPU_SETSIZE))
+			return EINVAL;
+		for (; first <= last; first++)
+			CPU_SET(first, cpus);
+		
+		c = end;
+		if (*c == ',')
+			c++;
+		else if (*c)
+			return EINVAL;
+	} while (*c);
+	
+	return 0;
+}
+#endif /* linux */
+
+/* Create the queues and threads of the dedicated dispatch pools */
+static int pools_init(void)
+{
+	struct fd_list * li;
+	int nb = 0, i;
+	
+	for (li = fd_g_config->cnf_disp_pools.next; li != &fd_g_config->cnf_disp_pools; li = li->next)
+		nb++;
+	if (!nb)
+		return 0;
+	
+	CHECK_MALLOC( pools = calloc(nb, sizeof(struct disp_pool)) );
+	
+	for (li = fd_g_config->cnf_disp_pools.next; li != &fd_g_config->cnf_disp_pools; li = li->next) {
+		struct disp_pool * p = &pools[nb_pools];
+		
+		p->conf = (struct fd_disp_pool *)li;
+		if (p->conf->cpus) {
+#ifdef linux
+			CHECK_FCT_DO( parse_cpus(p->conf->cpus, &p->cpus), 
+				{ LOG_E("Invalid CPU list '%s' in the DispatchPool of application %u", p->conf->cpus, p->conf->appid); return EINVAL; } );
+#else /* linux */
+			LOG_N("CPU pinning is not supported on this system, ignoring the CPU list of the DispatchPool of application %u", p->conf->appid);
+#endif /* linux */
+		}
+		
+		/* The queue has the same backend as the shared local queue */
+		if (fd_g_config->cnf_flags.lf_queues) {
+			CHECK_FCT( fd_fifo_new_ring( &p->queue, p->conf->qlimit ) );
+		} else {
+			CHECK_FCT( fd_fifo_new( &p->queue, p->conf->qlimit ) );
+		}
+		nb_pools++;
+		
+		CHECK_MALLOC( p->st = calloc(p->conf->threads, sizeof(struct pool_thr)) );
+		CHECK_MALLOC( p->thr = calloc(p->conf->threads, sizeof(pthread_t)) );
+		for (i = 0; i < p->conf->threads; i++) {
+			p->st[i].pool = p;
+			CHECK_POSIX( pthread_create( &p->thr[i], NULL, pool_thr, &p->st[i] ) );
+#ifdef linux
+			pthread_setname_np(p->thr[i], "fd-dispatch-app");
+			if (p->conf->cpus) {
+				CHECK_POSIX( pthread_setaffinity_np(p->thr[i], sizeof(cpu_set_t), &p->cpus) );
+			}
+#endif
+		}
+	}
+	
+	return 0;
+}
+
 /* Initialize the routing and dispatch threads */
 int fd_rtdisp_init(void)
 {
+	struct fd_rt_out_hdl * hdl;
 	int i;
 	
+	/* The pools must exist before the routing threads hand them messages */
+	CHECK_FCT( pools_init() );
+	
 	/* Prepare the array for threads */
 	CHECK_MALLOC( disp_state = calloc(fd_g_config->cnf_dispthr, sizeof(enum thread_state)) );
 	CHECK_MALLOC( dispatch = calloc(fd_g_config->cnf_dispthr, sizeof(pthread_t)) );
@@ -1212,9 +1904,15 @@ int fd_rtdisp_init(void)
 	
 	/* Later: TODO("Set the thresholds for the queues to create more threads as needed"); */
 	
-	/* Register the built-in callbacks */
-	CHECK_FCT( fd_rt_out_register( dont_send_if_no_common_app, NULL, 10, NULL ) );
-	CHECK_FCT( fd_rt_out_register( score_destination_avp, NULL, 10, NULL ) );
+	/* Prepare the routing cache */
+	for (i = 0; i < RT_CACHE_BUCKETS; i++)
+		fd_list_init(&rt_cache_hash[i], NULL);
+	
+	/* Register the built-in callbacks, their scores only depend on the destination and the peers */
+	CHECK_FCT( fd_rt_out_register( dont_send_if_no_common_app, NULL, 10, &hdl ) );
+	CHECK_FCT( fd_rt_out_cacheable( hdl, 1 ) );
+	CHECK_FCT( fd_rt_out_register( score_destination_avp, NULL, 10, &hdl ) );
+	CHECK_FCT( fd_rt_out_cacheable( hdl, 1 ) );
 	
 	return 0;
 }
@@ -1273,7 +1971,8 @@ static void stop_thread_delayed(enum thread_state *st, pthread_t * thr, char * t
 /* Stop the thread after up to one second of wait */
 int fd_rtdisp_fini(void)
 {
-	int i;
+	struct disp_pool * old_pools;
+	int i, nb;
 	
 	/* Destroy the incoming queue */
 	CHECK_FCT_DO( fd_queues_fini(&fd_g_incoming), /* ignore */);
@@ -1323,9 +2022,52 @@ int fd_rtdisp_fini(void)
 		disp_state = NULL;
 	}
 	
+	/* Same for the dedicated pools */
+	CHECK_POSIX( pthread_rwlock_wrlock(&pools_rwl) );
+	old_pools = pools;
+	nb = nb_pools;
+	pools = NULL;
+	nb_pools = 0;
+	CHECK_POSIX( pthread_rwlock_unlock(&pools_rwl) );
+	for (i = 0; i < nb; i++) {
+		struct disp_pool * p = &old_pools[i];
+		int j;
+		
+		CHECK_FCT_DO( fd_queues_fini(&p->queue), /* ignore */);
+		if (p->thr != NULL) {
+			for (j = 0; j < p->conf->threads; j++) {
+				stop_thread_delayed(&p->st[j].state, &p->thr[j], "Dispatching (pool)");
+			}
+		}
+		free(p->thr);
+		free(p->st);
+	}
+	free(old_pools);
+	
 	return 0;
 }
 
+/* Retrieve a dedicated dispatch pool, for the statistics. On success, the pools stay locked until fd_rtdisp_releasepool. */
+int fd_rtdisp_getpool(int index, struct fd_disp_pool ** conf, struct fifo ** queue)
+{
+	CHECK_PARAMS( index >= 0 );
+	CHECK_POSIX( pthread_rwlock_rdlock(&pools_rwl) );
+	if (index >= nb_pools) {
+		CHECK_POSIX( pthread_rwlock_unlock(&pools_rwl) );
+		return ENOENT;
+	}
+	if (conf)
+		*conf = pools[index].conf;
+	if (queue)
+		*queue = pools[index].queue;
+	return 0;
+}
+
+void fd_rtdisp_releasepool(void)
+{
+	CHECK_POSIX_DO( pthread_rwlock_unlock(&pools_rwl), );
+}
+
 /* Cleanup handlers */
 int fd_rtdisp_cleanup(void)
 {
@@ -1338,6 +2080,7 @@ int fd_rtdisp_cleanup(void)
 	}
 	
 	fd_disp_unregister_all(); /* destroy remaining handlers */
+	CHECK_FCT_DO( fd_rt_out_cache_flush(), /* continue */ );
 
 	return 0;
 }
@@ -114,6 +114,118 @@ struct dict_object {
 	 /* Sentinel for the dispatch callbacks */
 	 struct fd_list		disp_cbs;
 
+	/* Chaining in the hash indexes of the dictionary (see dict_hash_index below), protected by dict_lock.
+	   hnext[0] is used in the index by code, id or value of the object, hnext[1] in the index by name. */
+	struct dict_object *	hnext[2];
+	uint32_t		hval[2]; /* the hash values of the object in these indexes */
+
+	/* For commands and grouped AVPs, the rules compiled by fd_dict_iterate_rules_compiled, or NULL.
+	   Set under the read lock (atomically), dropped under the write lock when the rules change. */
+	struct dict_rules_compiled * rules_cmp;
+};
+
+/* The hash indexes of a dictionary, maintained in addition to the ordered lists for the most frequent searches. */
+enum dict_hash_index {
+	DICT_H_AVP_CODE = 0,	/* AVP by vendor id and code */
+	DICT_H_AVP_NAME,	/* AVP by vendor id and name */
+	DICT_H_CMD_CODE,	/* Command by code and 'R' flag */
+	DICT_H_APPLICATION,	/* Application by id */
+	DICT_H_ENUM_VAL,	/* Enumerated value by type and value (except float types) */
+	DICT_H_ENUM_NAME,	/* Enumerated value by type and name */
+	DICT_H_MAX
+};
+
+struct dict_hash {
+	struct dict_object **	buckets; /* chains of objects, through their hnext field */
+	uint32_t		size;	 /* number of buckets, power of 2 -- 0 before the first object */
+	uint32_t		count;	 /* number of objects in the index */
+};
+
+/* A frozen copy of a hash index, in an open addressing table read without lock (see fd_dict_freeze) */
+struct dict_snap_index {
+	uint32_t		mask;	/* number of slots - 1 */
+	struct {
+		struct dict_object *	obj;	/* NULL for a free slot */
+		uint32_t		hval;	/* hash value of obj in the index */
+	}			slots[];
+};
+
+/* A version of the frozen indexes. A new version is published each time the dictionary is changed after fd_dict_freeze;
+   the indexes that did not change are shared with the previous version. Versions are only freed with the dictionary,
+   since lookups may still be using them. */
+struct dict_snapshot {
+	int			 version;
+	struct dict_snap_index * idx[DICT_H_MAX];
+	uint32_t		 owned;	/* bit i set if idx[i] must be freed with this version, i.e. it is not used by a newer version */
+	struct dict_snapshot *	 older;	/* previous version */
+};
+
+/* Layout of a binary image of the dictionary (see fd_dict_image_save). The image does not contain pointers: the objects
+   are designated by their references (see DICT_IMAGE_REF_*), the strings by their offset in the strings section, and the
+   type callbacks by their symbol name. The values are stored in the byte order of the host that saved the image. */
+#define DICT_IMAGE_MAGIC	"FDDICTIM"
+#define DICT_IMAGE_VERSION	1		/* to be changed with the layout of the image or of the dictionary lists */
+#define DICT_IMAGE_BOM		0x01020304	/* detect an image saved with a different byte order */
+
+/* References of the objects */
+#define DICT_IMAGE_REF_NONE	0	/* NULL, or the dictionary itself for a list head */
+#define DICT_IMAGE_REF_VENDOR0	1	/* dict_vendors */
+#define DICT_IMAGE_REF_APP0	2	/* dict_applications */
+#define DICT_IMAGE_REF_CMDERR	3	/* dict_cmd_error */
+#define DICT_IMAGE_REF_OBJ	4	/* first object of the image */
+
+/* Lists heads in the dictionary structure, for a head with reference DICT_IMAGE_REF_NONE */
+enum dict_image_list {
+	DICT_IMAGE_L_VENDORS = 0,	/* dict_vendors.list[0] */
+	DICT_IMAGE_L_APPLICATIONS,	/* dict_applications.list[0] */
+	DICT_IMAGE_L_TYPES,		/* dict_types */
+	DICT_IMAGE_L_CMD_NAME,		/* dict_cmd_name */
+	DICT_IMAGE_L_CMD_CODE,		/* dict_cmd_code */
+	DICT_IMAGE_L_MAX
+};
+
+struct dict_image_hdr {
+	char		magic[8];	/* DICT_IMAGE_MAGIC, without the terminating '\0' */
+	uint32_t	version;	/* DICT_IMAGE_VERSION */
+	uint32_t	bom;		/* DICT_IMAGE_BOM */
+	uint32_t	tag;		/* offset of the tag provided when the image was saved */
+	uint32_t	nb_obj;		/* number of struct dict_image_obj */
+	uint32_t	nb_head;	/* number of struct dict_image_head */
+	uint32_t	nb_link;	/* number of struct dict_image_link */
+	uint64_t	obj_off;	/* offsets of the sections from the beginning of the image */
+	uint64_t	head_off;
+	uint64_t	link_off;
+	uint64_t	str_off;
+	uint64_t	str_size;	/* the strings section starts with a '\0', so that offset 0 means no string */
+};
+
+/* An object of the image */
+struct dict_image_obj {
+	uint32_t	type;		/* enum dict_object_type */
+	uint32_t	parent;		/* reference of the parent, or DICT_IMAGE_REF_NONE */
+	uint32_t	name;		/* offset and length of the name of the object, 0 for rules */
+	uint32_t	name_len;
+	uint32_t	u32[4];		/* the scalar data of the object, depending on its type */
+	uint64_t	u64;		/* the value of a scalar enumerated value */
+	uint32_t	ref;		/* reference of the AVP of a rule */
+	uint32_t	os;		/* offset and length of the value of an octetstring enumerated value */
+	uint32_t	os_len;
+	uint32_t	fct[4];		/* offsets of the symbol names of the type callbacks: interpret, encode, dump, check */
+	uint32_t	pad;
+};
+
+/* A list of the dictionary: the elements are in links[first] to links[first + count - 1], in the order of the list */
+struct dict_image_head {
+	uint32_t	ref;		/* the object that contains the sentinel, or DICT_IMAGE_REF_NONE for the dictionary */
+	uint32_t	list;		/* the index of the sentinel in the list array of the object, or enum dict_image_list */
+	uint32_t	first;
+	uint32_t	count;
+};
+
+/* An element of a list */
+struct dict_image_link {
+	uint32_t	ref;		/* the object */
+	uint32_t	list;		/* the index of the element in the list array of the object */
 };
 
 /* Definition of the dictionary structure */
@@ -131,6 +243,10 @@ struct dictionary {
 	struct dict_object	dict_cmd_error;		/* Special command object for answers with the 'E' bit set */
 
 	int			dict_count[DICT_TYPE_MAX + 1]; /* Number of objects of each type */
+
+	struct dict_hash	dict_hash[DICT_H_MAX];	/* The hash indexes */
+
+	struct dict_snapshot *	dict_snap;		/* Current snapshot of the indexes, read without dict_lock. NULL until fd_dict_freeze */
 };
 
 #endif /* HAD_DICTIONARY_INTERNAL_H */
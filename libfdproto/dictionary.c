@@ -36,6 +36,10 @@
 #include "fdproto-internal.h"
 #include "dictionary-internal.h"
 #include <inttypes.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 /* Names of the base types */
 const char * type_base_name[] = { /* must keep in sync with dict_avp_basetype */
@@ -281,8 +285,9 @@ static void destroy_object_data(struct dict_object * obj)
 	}
 }
 
-/* Forward declaration */
+/* Forward declarations */
 static void destroy_object(struct dict_object * obj);
+static void dict_hash_unlink(struct dictionary * dict, struct dict_object * obj);
 
 /* Destroy all objects in a list - the lock must be held */
 static void destroy_list(struct fd_list * head)
@@ -297,6 +302,13 @@ static void destroy_list(struct fd_list * head)
 	}
 }
 
+/* Drop the compiled rules of a command or grouped AVP when its rules change. The write lock must be held. */
+static void dict_rules_drop(struct dict_object * parent)
+{
+	free(parent->rules_cmp);
+	parent->rules_cmp = NULL;
+}
+
 /* Free an object and its sublists */
 static void destroy_object(struct dict_object * obj)
 {
@@ -304,9 +316,15 @@ static void destroy_object(struct dict_object * obj)
 
 	/* TRACE_ENTRY("%p", obj); */
 
-	/* Update global count */
-	if (obj->dico)
+	/* Update global count, and unlink from the indexes */
+	if (obj->dico) {
 		obj->dico->dict_count[obj->type]--;
+		dict_hash_unlink(obj->dico, obj);
+	}
+
+	/* The rules of the parent are no longer the compiled ones */
+	if ((obj->type == DICT_RULE) && obj->parent)
+		dict_rules_drop(obj->parent);
 
 	/* Mark the object as invalid */
 	obj->objeyec = 0xdead;
@@ -323,14 +341,11 @@ static void destroy_object(struct dict_object * obj)
 			destroy_list( &obj->list[i] );
 	}
 
-	/* Unlink all elements from the dispatch list; they will be freed when callback is unregistered */
-	CHECK_POSIX_DO( pthread_rwlock_wrlock(&fd_disp_lock), /* continue */ );
-	while (!FD_IS_LIST_EMPTY(&obj->disp_cbs)) {
-		fd_list_unlink( obj->disp_cbs.next );
-	}
-	CHECK_POSIX_DO( pthread_rwlock_unlock(&fd_disp_lock), /* continue */ );
+	/* Unlink all elements from the dispatch list and index; they will be freed when callback is unregistered */
+	fd_disp_unlink_obj( &obj->disp_cbs );
 
 	/* Last, destroy the object */
+	dict_rules_drop(obj);
 	free(obj);
 }
 
@@ -469,6 +484,300 @@ static int order_rule_by_avpvc ( struct dict_object *o1, struct dict_object *o2
 		?: ORDER_scalar(o1->data.rule.rule_avp->data.avp.avp_code, o2->data.rule.rule_avp->data.avp.avp_code) ;
 }
 
+/*******************************************************************************************************/
+/*******************************************************************************************************/
+/*                                                                                                     */
+/*                                  Hash indexes                                                       */
+/*                                                                                                     */
+/*******************************************************************************************************/
+/*******************************************************************************************************/
+
+/* The objects are also linked in hash indexes, so that the most frequent searches (e.g. AVP by code and vendor
+ * when parsing each AVP of a message) do not depend on the size of the dictionary. The indexes are chained hash
+ * tables that double their size when they contain as many objects as buckets. The dict_lock must be held. */
+
+/* The hnext / hval slot used by each index */
+static const int dict_hash_slot[DICT_H_MAX] = { 0, 1, 0, 0, 0, 1 };
+
+/* Mix two keys into a hash value */
+static __inline__ uint32_t hash_key(uint64_t k1, uint64_t k2)
+{
+	uint64_t h = (k1 * 0x9E3779B97F4A7C15ULL) ^ k2;
+	h ^= h >> 31;
+	h *= 0xBF58476D1CE4E5B9ULL;
+	h ^= h >> 29;
+	return (uint32_t)(h ^ (h >> 32));
+}
+
+/* The key of an enumerated value. Returns 0 if the values of this type are not indexed (floats, that compare differently) */
+static int hash_enum_value(enum dict_avp_basetype base, union avp_value * val, uint64_t * key)
+{
+	switch (base) {
+		case AVP_TYPE_OCTETSTRING:
+			*key = fd_os_hash(val->os.data, val->os.len);
+			return 1;
+		case AVP_TYPE_INTEGER32:
+			*key = (uint64_t)(int64_t)val->i32;
+			return 1;
+		case AVP_TYPE_INTEGER64:
+			*key = (uint64_t)val->i64;
+			return 1;
+		case AVP_TYPE_UNSIGNED32:
+			*key = val->u32;
+			return 1;
+		case AVP_TYPE_UNSIGNED64:
+			*key = val->u64;
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+/* Compute the hash value of an object in the index of a slot. Returns the index, or -1 if the object is not indexed in this slot. */
+static int hash_obj(struct dict_object * obj, int slot, uint32_t * hval)
+{
+	uint64_t key;
+
+	switch (obj->type) {
+		case DICT_AVP:
+			if (slot == 0) {
+				*hval = hash_key(obj->data.avp.avp_vendor, obj->data.avp.avp_code);
+				return DICT_H_AVP_CODE;
+			}
+			*hval = hash_key(obj->data.avp.avp_vendor, fd_os_hash((uint8_t *)obj->data.avp.avp_name, obj->datastr_len));
+			return DICT_H_AVP_NAME;
+
+		case DICT_COMMAND:
+			if (slot == 0) {
+				*hval = hash_key(obj->data.cmd.cmd_code, obj->data.cmd.cmd_flag_val & CMD_FLAG_REQUEST);
+				return DICT_H_CMD_CODE;
+			}
+			return -1;
+
+		case DICT_APPLICATION:
+			if (slot == 0) {
+				*hval = hash_key(obj->data.application.application_id, 0);
+				return DICT_H_APPLICATION;
+			}
+			return -1;
+
+		case DICT_ENUMVAL:
+			if (slot == 0) {
+				if (!hash_enum_value(obj->parent->data.type.type_base, &obj->data.enumval.enum_value, &key))
+					return -1;
+				*hval = hash_key((uintptr_t)obj->parent, key);
+				return DICT_H_ENUM_VAL;
+			}
+			*hval = hash_key((uintptr_t)obj->parent, fd_os_hash((uint8_t *)obj->data.enumval.enum_name, obj->datastr_len));
+			return DICT_H_ENUM_NAME;
+
+		default:
+			return -1;
+	}
+}
+
+/* Make sure the indexes can receive a new object without allocating memory */
+static int dict_hash_reserve(struct dictionary * dict, struct dict_object * obj)
+{
+	int slot;
+
+	for (slot = 0; slot < 2; slot++) {
+		struct dict_hash * h;
+		struct dict_object ** buckets;
+		uint32_t hval, size, i;
+		int idx = hash_obj(obj, slot, &hval);
+
+		if (idx < 0)
+			continue;
+		h = &dict->dict_hash[idx];
+		if (h->count < h->size)
+			continue;
+
+		/* Double the size of the table and rehash */
+		size = h->size ? h->size * 2 : 64;
+		CHECK_MALLOC( buckets = calloc(size, sizeof(struct dict_object *)) );
+		for (i = 0; i < h->size; i++) {
+			while (h->buckets[i]) {
+				struct dict_object * o = h->buckets[i];
+				h->buckets[i] = o->hnext[slot];
+				o->hnext[slot] = buckets[o->hval[slot] & (size - 1)];
+				buckets[o->hval[slot] & (size - 1)] = o;
+			}
+		}
+		free(h->buckets);
+		h->buckets = buckets;
+		h->size = size;
+	}
+	return 0;
+}
+
+/* Link an object in its indexes, after dict_hash_reserve */
+static void dict_hash_link(struct dictionary * dict, struct dict_object * obj)
+{
+	int slot;
+
+	for (slot = 0; slot < 2; slot++) {
+		struct dict_hash * h;
+		int idx = hash_obj(obj, slot, &obj->hval[slot]);
+
+		if (idx < 0)
+			continue;
+		h = &dict->dict_hash[idx];
+		ASSERT(h->count < h->size);
+		obj->hnext[slot] = h->buckets[obj->hval[slot] & (h->size - 1)];
+		h->buckets[obj->hval[slot] & (h->size - 1)] = obj;
+		h->count++;
+	}
+}
+
+/* Unlink an object from the indexes, if it was linked */
+static void dict_hash_unlink(struct dictionary * dict, struct dict_object * obj)
+{
+	int slot;
+
+	for (slot = 0; slot < 2; slot++) {
+		struct dict_hash * h;
+		struct dict_object ** po;
+		uint32_t hval;
+		int idx = hash_obj(obj, slot, &hval);
+
+		if (idx < 0)
+			continue;
+		h = &dict->dict_hash[idx];
+		if (!h->size)
+			continue;
+		for (po = &h->buckets[hval & (h->size - 1)]; *po; po = &(*po)->hnext[slot]) {
+			if (*po == obj) {
+				*po = obj->hnext[slot];
+				obj->hnext[slot] = NULL;
+				h->count--;
+				break;
+			}
+		}
+	}
+}
+
+/* Once the dictionary is frozen, the indexes are also copied in a snapshot that fd_dict_search reads without
+ * the lock. Each change publishes a new version of the snapshot (copy-on-write): the indexes affected by the change
+ * are rebuilt, the other ones are shared with the previous version. */
+
+/* The indexes of the snapshot affected by adding or removing an object */
+static uint32_t dict_snap_which(struct dict_object * obj)
+{
+	uint32_t which = 0, hval;
+	int slot, idx;
+
+	for (slot = 0; slot < 2; slot++) {
+		idx = hash_obj(obj, slot, &hval);
+		if (idx >= 0)
+			which |= 1U << idx;
+	}
+	return which;
+}
+
+/* Free a snapshot version and all the previous ones */
+static void dict_snap_free(struct dict_snapshot * snap)
+{
+	while (snap) {
+		struct dict_snapshot * older = snap->older;
+		int i;
+		for (i = 0; i < DICT_H_MAX; i++) {
+			if (snap->owned & (1U << i))
+				free(snap->idx[i]);
+		}
+		free(snap);
+		snap = older;
+	}
+}
+
+/* Publish a new version of the snapshot, where the indexes in "which" are rebuilt. The dict_lock must be held for writing. */
+static int dict_snap_publish(struct dictionary * dict, uint32_t which)
+{
+	struct dict_snapshot * cur = dict->dict_snap, * new;
+	int i;
+
+	/* Nothing changed in the indexes (e.g. a new type or rule) */
+	if (cur && !which)
+		return 0;
+
+	CHECK_MALLOC( new = calloc(1, sizeof(struct dict_snapshot)) );
+	new->version = cur ? cur->version + 1 : 1;
+
+	for (i = 0; i < DICT_H_MAX; i++) {
+		struct dict_hash * h = &dict->dict_hash[i];
+		struct dict_snap_index * si;
+		uint32_t size = 8, b;
+		int slot = dict_hash_slot[i];
+
+		if (cur && !(which & (1U << i))) {
+			/* The index is shared, it is now freed with the new version */
+			new->idx[i] = cur->idx[i];
+			new->owned |= cur->owned & (1U << i);
+			cur->owned &= ~(1U << i);
+			continue;
+		}
+		new->owned |= 1U << i;
+		if (!h->count)
+			continue;
+
+		/* At most half of the slots are used, so that the probe sequences stay short */
+		while (size < 2 * h->count)
+			size *= 2;
+		CHECK_MALLOC_DO( si = calloc(1, sizeof(struct dict_snap_index) + size * sizeof(si->slots[0])),
+			{
+				dict_snap_free(new);
+				return ENOMEM;
+			} );
+		si->mask = size - 1;
+		for (b = 0; b < h->size; b++) {
+			struct dict_object * o;
+			for (o = h->buckets[b]; o; o = o->hnext[slot]) {
+				uint32_t j = o->hval[slot] & si->mask;
+				while (si->slots[j].obj)
+					j = (j + 1) & si->mask;
+				si->slots[j].obj = o;
+				si->slots[j].hval = o->hval[slot];
+			}
+		}
+		new->idx[i] = si;
+	}
+
+	/* A lookup may still be reading the previous versions without the lock, so they are kept until fd_dict_fini */
+	new->older = cur;
+	__atomic_store_n(&dict->dict_snap, new, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* The searches that are served entirely by the snapshot, and can be done without the lock */
+static int dict_snap_serves(enum dict_object_type type, int criteria, const void * what)
+{
+	switch (type) {
+		case DICT_APPLICATION:
+			return criteria == APPLICATION_BY_ID;
+
+		case DICT_AVP:
+			return (criteria == AVP_BY_CODE) || (criteria == AVP_BY_NAME)
+				|| (criteria == AVP_BY_CODE_AND_VENDOR) || (criteria == AVP_BY_NAME_AND_VENDOR);
+
+		case DICT_COMMAND:
+			return (criteria == CMD_BY_CODE_R) || (criteria == CMD_BY_CODE_A);
+
+		case DICT_ENUMVAL:
+			{
+				/* Only when the type object is provided and its values are indexed */
+				const struct dict_enumval_request * req = what;
+				if ((criteria != ENUMVAL_BY_STRUCT) || !req || !verify_object(req->type_obj) || (req->type_obj->type != DICT_TYPE))
+					return 0;
+				if (req->search.enum_name)
+					return 1;
+				return (req->type_obj->data.type.type_base != AVP_TYPE_FLOAT32) && (req->type_obj->data.type.type_base != AVP_TYPE_FLOAT64);
+			}
+
+		default:
+			return 0;
+	}
+}
+
 /*******************************************************************************************************/
 /*******************************************************************************************************/
 /*                                                                                                     */
@@ -528,31 +837,6 @@ in the local context where they are called. They are meant to be called only fro
 }
 
 
-/* For search of octetstrings in lists. */
-#define SEARCH_os(  str, strlen, sentinel, osdatafield, isindex ) {		\
-	uint8_t * __str = (uint8_t *) (str);					\
-	size_t __strlen = (size_t)(strlen);					\
-	int __cmp;								\
-	struct fd_list * __li;							\
-	ret = 0;								\
-	for  (__li = (sentinel)->next; __li != (sentinel); __li = __li->next) {	\
-		__cmp = fd_os_cmp(__str, __strlen,				\
-			_O(__li->o)->data. osdatafield .data,			\
-			_O(__li->o)->data. osdatafield .len);			\
-		if (__cmp == 0) {						\
-			if (result)						\
-				*result = _O(__li->o);				\
-			goto end;						\
-		}								\
-		if ((isindex) && (__cmp < 0))					\
-			break;							\
-	}									\
-	if (result)								\
-		*result = NULL;							\
-	else									\
-		ret = ENOENT;							\
-}
-
 /* For search of AVP name in rule lists -- the list is not ordered by AVP names! */
 #define SEARCH_ruleavpname( str, strlen, sentinel ) {				\
 	char * __str = (char *) (str);						\
@@ -603,32 +887,33 @@ in the local context where they are called. They are meant to be called only fro
 		ret = ENOENT;							\
 }
 
-/* For search of commands in lists by code and flag. R_flag_val = 0 or CMD_FLAG_REQUEST */
-#define SEARCH_codefl( value, R_flag_val, sentinel) {					\
-	int __cmp;								\
-	struct fd_list * __li;							\
+/* For search in a hash index. "match" is evaluated on the candidate objects __o that have the same hash value.
+   Once the dictionary is frozen, the snapshot is used, so that the search is also valid without the lock. */
+#define SEARCH_hash( index, hvalue, match ) {					\
+	struct dict_snapshot * __snap = __atomic_load_n(&dict->dict_snap, __ATOMIC_ACQUIRE);	\
+	struct dict_hash * __h = &dict->dict_hash[(index)];			\
+	int __slot = dict_hash_slot[(index)];					\
+	uint32_t __hv = (hvalue);						\
+	struct dict_object * __o = NULL;					\
 	ret = 0;								\
-	for  (__li = (sentinel)->next; __li != (sentinel); __li = __li->next) {	\
-		__cmp = ORDER_scalar(value, 					\
-				_O(__li->o)->data.cmd.cmd_code );		\
-		if (__cmp == 0) {						\
-			uint8_t __mask, __val;					\
-			__mask = _O(__li->o)->data.cmd.cmd_flag_mask;		\
-			__val  = _O(__li->o)->data.cmd.cmd_flag_val;		\
-			if ( ! (__mask & CMD_FLAG_REQUEST) )			\
-				continue;					\
-			if ( ( __val & CMD_FLAG_REQUEST ) != R_flag_val )	\
-				continue;					\
-			if (result)						\
-				*result = _O(__li->o);				\
-			goto end;						\
+	if (__snap) {								\
+		struct dict_snap_index * __si = __snap->idx[(index)];		\
+		uint32_t __j;							\
+		if (__si) {							\
+			for (__j = __hv & __si->mask; (__o = __si->slots[__j].obj); __j = (__j + 1) & __si->mask) {\
+				if ((__si->slots[__j].hval == __hv) && (match))	\
+					break;					\
+			}							\
+		}								\
+	} else if (__h->size) {							\
+		for (__o = __h->buckets[__hv & (__h->size - 1)]; __o; __o = __o->hnext[__slot]) {\
+			if ((__o->hval[__slot] == __hv) && (match))		\
+				break;						\
 		}								\
-		if (__cmp < 0)							\
-			break;							\
 	}									\
 	if (result)								\
-		*result = NULL;							\
-	else									\
+		*result = __o;							\
+	else if (!__o)								\
 		ret = ENOENT;							\
 }
 
@@ -694,7 +979,13 @@ static int search_application ( struct dictionary * dict, int criteria, const vo
 		case APPLICATION_BY_ID:
 			id = *(application_id_t *) what;
 
-			SEARCH_scalar( id, &dict->dict_applications.list[0],  application.application_id, 1, &dict->dict_applications );
+			if (id == 0) {
+				/* the sentinel */
+				if (result)
+					*result = &dict->dict_applications;
+				break;
+			}
+			SEARCH_hash( DICT_H_APPLICATION, hash_key(id, 0), __o->data.application.application_id == id );
 			break;
 
 		case APPLICATION_BY_NAME:
@@ -778,48 +1069,44 @@ static int search_enumval ( struct dictionary * dict, int criteria, const void *
 
 				if ( _what->search.enum_name != NULL ) {
 					/* We are looking for this string */
-					SEARCH_os0(  _what->search.enum_name, &parent->list[1], enumval.enum_name, 1 );
+					size_t len = strlen(_what->search.enum_name);
+					SEARCH_hash( DICT_H_ENUM_NAME,
+							hash_key((uintptr_t)parent, fd_os_hash((uint8_t *)_what->search.enum_name, len)),
+							(__o->parent == parent) && !fd_os_cmp(_what->search.enum_name, len, __o->data.enumval.enum_name, __o->datastr_len) );
 				} else {
+					uint64_t key;
+					union avp_value * val = &_what->search.enum_value;
 					/* We are looking for the value in enum_value */
 					switch (parent->data.type.type_base) {
 						case AVP_TYPE_OCTETSTRING:
-							SEARCH_os(	 _what->search.enum_value.os.data,
-									 _what->search.enum_value.os.len,
-									 &parent->list[2],
-									 enumval.enum_value.os ,
-									 1 );
+							hash_enum_value(AVP_TYPE_OCTETSTRING, val, &key);
+							SEARCH_hash( DICT_H_ENUM_VAL, hash_key((uintptr_t)parent, key),
+									(__o->parent == parent) && !fd_os_cmp(val->os.data, val->os.len,
+										__o->data.enumval.enum_value.os.data, __o->data.enumval.enum_value.os.len) );
 							break;
 
 						case AVP_TYPE_INTEGER32:
-							SEARCH_scalar(	_what->search.enum_value.i32,
-									&parent->list[2],
-									enumval.enum_value.i32,
-									1,
-									(struct dict_object *)NULL);
+							hash_enum_value(AVP_TYPE_INTEGER32, val, &key);
+							SEARCH_hash( DICT_H_ENUM_VAL, hash_key((uintptr_t)parent, key),
+									(__o->parent == parent) && (__o->data.enumval.enum_value.i32 == val->i32) );
 							break;
 
 						case AVP_TYPE_INTEGER64:
-							SEARCH_scalar(	_what->search.enum_value.i64,
-									&parent->list[2],
-									enumval.enum_value.i64,
-									1,
-									(struct dict_object *)NULL);
+							hash_enum_value(AVP_TYPE_INTEGER64, val, &key);
+							SEARCH_hash( DICT_H_ENUM_VAL, hash_key((uintptr_t)parent, key),
+									(__o->parent == parent) && (__o->data.enumval.enum_value.i64 == val->i64) );
 							break;
 
 						case AVP_TYPE_UNSIGNED32:
-							SEARCH_scalar(	_what->search.enum_value.u32,
-									&parent->list[2],
-									enumval.enum_value.u32,
-									1,
-									(struct dict_object *)NULL);
+							hash_enum_value(AVP_TYPE_UNSIGNED32, val, &key);
+							SEARCH_hash( DICT_H_ENUM_VAL, hash_key((uintptr_t)parent, key),
+									(__o->parent == parent) && (__o->data.enumval.enum_value.u32 == val->u32) );
 							break;
 
 						case AVP_TYPE_UNSIGNED64:
-							SEARCH_scalar(	_what->search.enum_value.u64,
-									&parent->list[2],
-									enumval.enum_value.u64,
-									1,
-									(struct dict_object *)NULL);
+							hash_enum_value(AVP_TYPE_UNSIGNED64, val, &key);
+							SEARCH_hash( DICT_H_ENUM_VAL, hash_key((uintptr_t)parent, key),
+									(__o->parent == parent) && (__o->data.enumval.enum_value.u64 == val->u64) );
 							break;
 
 						case AVP_TYPE_FLOAT32:
@@ -856,6 +1143,21 @@ end:
 	return ret;
 }
 
+/* AVP search in the indexes, by vendor id and code or name */
+#define SEARCH_AVP_code( vendor_id, code ) {					\
+	vendor_id_t __vid = (vendor_id);					\
+	avp_code_t __code = (code);						\
+	SEARCH_hash( DICT_H_AVP_CODE, hash_key(__vid, __code),			\
+		(__o->data.avp.avp_code == __code) && (__o->data.avp.avp_vendor == __vid) );	\
+}
+#define SEARCH_AVP_name( vendor_id, name, len ) {				\
+	vendor_id_t __vid = (vendor_id);					\
+	char * __name = (char *)(name);						\
+	size_t __len = (len);							\
+	SEARCH_hash( DICT_H_AVP_NAME, hash_key(__vid, fd_os_hash((uint8_t *)__name, __len)),	\
+		(__o->data.avp.avp_vendor == __vid) && !fd_os_cmp(__name, __len, __o->data.avp.avp_name, __o->datastr_len) );	\
+}
+
 static int search_avp ( struct dictionary * dict, int criteria, const void * what, struct dict_object **result )
 {
 	int ret = 0;
@@ -868,39 +1170,28 @@ static int search_avp ( struct dictionary * dict, int criteria, const void * wha
 				avp_code_t code;
 				code = *(avp_code_t *) what;
 
-				SEARCH_scalar( code, &dict->dict_vendors.list[1],  avp.avp_code, 1, (struct dict_object *)NULL );
+				SEARCH_AVP_code( 0, code );
 			}
 			break;
 
 		case AVP_BY_NAME:
 			/* "what" is the AVP name, vendor 0 */
-			SEARCH_os0( what, &dict->dict_vendors.list[2], avp.avp_name, 1);
+			SEARCH_AVP_name( 0, what, strlen((char *)what) );
 			break;
 
 		case AVP_BY_CODE_AND_VENDOR:
 		case AVP_BY_NAME_AND_VENDOR:
 			{
 				struct dict_avp_request * _what = (struct dict_avp_request *) what;
-				struct dict_object * vendor = NULL;
 
 				CHECK_PARAMS( (criteria != AVP_BY_NAME_AND_VENDOR) || _what->avp_name  );
 
-				/* Now look for the vendor first */
-				CHECK_FCT( search_vendor( dict, VENDOR_BY_ID, &_what->avp_vendor, &vendor ) );
-				if (vendor == NULL) {
-					if (result)
-						*result = NULL;
-					else
-						ret = ENOENT;
-					goto end;
-				}
-
-				/* We now have our vendor = head of the appropriate avp list */
+				/* The indexes are by vendor id, no need to look for the vendor first: if it does not exist, no AVP matches */
 				if (criteria == AVP_BY_NAME_AND_VENDOR) {
-					SEARCH_os0( _what->avp_name, &vendor->list[2], avp.avp_name, 1);
+					SEARCH_AVP_name( _what->avp_vendor, _what->avp_name, strlen(_what->avp_name) );
 				} else {
 					/* AVP_BY_CODE_AND_VENDOR */
-					SEARCH_scalar( _what->avp_code, &vendor->list[1], avp.avp_code, 1, (struct dict_object *)NULL );
+					SEARCH_AVP_code( _what->avp_vendor, _what->avp_code );
 				}
 			}
 			break;
@@ -932,12 +1223,12 @@ static int search_avp ( struct dictionary * dict, int criteria, const void * wha
 					goto end;
 				}
 
-				/* We now have our vendor = head of the appropriate avp list */
+				/* We now have our vendor */
 				if (_what->avp_data.avp_code) {
 					CHECK_PARAMS( ! _what->avp_data.avp_name );
-					SEARCH_scalar( _what->avp_data.avp_code, &vendor->list[1], avp.avp_code, 1, (struct dict_object *)NULL );
+					SEARCH_AVP_code( vendor->data.vendor.vendor_id, _what->avp_data.avp_code );
 				} else {
-					SEARCH_os0( _what->avp_data.avp_name, &vendor->list[2], avp.avp_name, 1);
+					SEARCH_AVP_name( vendor->data.vendor.vendor_id, _what->avp_data.avp_name, strlen(_what->avp_data.avp_name) );
 				}
 			}
 			break;
@@ -946,14 +1237,20 @@ static int search_avp ( struct dictionary * dict, int criteria, const void * wha
 			{
 				struct fd_list * li;
 				size_t wl = strlen((char *)what);
+				struct dict_object * found = NULL;
+
+				if (!result)
+					result = &found;
 
 				/* First, search for vendor 0 */
-				SEARCH_os0_l( what, wl, &dict->dict_vendors.list[2], avp.avp_name, 1);
+				SEARCH_AVP_name( 0, what, wl );
 
 				/* If not found, loop for all vendors, until found */
-				for (li = dict->dict_vendors.list[0].next; li != &dict->dict_vendors.list[0]; li = li->next) {
-					SEARCH_os0_l( what, wl, &_O(li->o)->list[2], avp.avp_name, 1);
+				for (li = dict->dict_vendors.list[0].next; (li != &dict->dict_vendors.list[0]) && !*result; li = li->next) {
+					SEARCH_AVP_name( _O(li->o)->data.vendor.vendor_id, what, wl );
 				}
+				if ((result == &found) && !found)
+					ret = ENOENT;
 			}
 			break;
 
@@ -992,7 +1289,8 @@ static int search_cmd ( struct dictionary * dict, int criteria, const void * wha
 				}
 
 				/* perform the search */
-				SEARCH_codefl( code, searchfl, &dict->dict_cmd_code );
+				SEARCH_hash( DICT_H_CMD_CODE, hash_key(code, searchfl),
+						(__o->data.cmd.cmd_code == code) && ((__o->data.cmd.cmd_flag_val & CMD_FLAG_REQUEST) == searchfl) );
 			}
 			break;
 
@@ -1278,6 +1576,8 @@ DECLARE_FD_DUMP_PROTOTYPE(fd_dict_dump, struct dictionary * dict)
 	CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "\n {dict}(@%p): statistics", dict), goto error);
 	for (i=1; i<=DICT_TYPE_MAX; i++)
 		CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "\n   %5d: %s",  dict->dict_count[i], dict_obj_info[i].name), goto error);
+	if (dict->dict_snap)
+		CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "\n   frozen, snapshot version %d", dict->dict_snap->version), goto error);
 
 	CHECK_POSIX_DO(  pthread_rwlock_unlock( &dict->dict_lock ), /* ignore */  );
 	return *buf;
@@ -1596,6 +1896,9 @@ int fd_dict_new ( struct dictionary * dict, enum dict_object_type type, void * d
 	/* We will change the dictionary => acquire the write lock */
 	CHECK_POSIX_DO(  ret = pthread_rwlock_wrlock(&dict->dict_lock),  goto error_free  );
 
+	/* Make room in the hash indexes first, so that linking the object cannot fail after it is in the lists */
+	CHECK_FCT_DO( ret = dict_hash_reserve(dict, new), goto error_unlock );
+
 	/* Now link the object -- this also checks that no object with same keys already exists */
 	switch (type) {
 		case DICT_VENDOR:
@@ -1663,12 +1966,29 @@ int fd_dict_new ( struct dictionary * dict, enum dict_object_type type, void * d
 			ret = fd_list_insert_ordered ( &parent->list[2], &new->list[0], (int (*)(void*, void *))order_rule_by_avpvc, (void **)&locref );
 			if (ret)
 				goto error_unlock;
+			dict_rules_drop(parent);
 			break;
 
 		default:
 			ASSERT(0);
 	}
 
+	/* Link the object in the hash indexes */
+	dict_hash_link(dict, new);
+
+	/* If the dictionary is frozen, the lookups will find the new object once the new snapshot is published */
+	if (dict->dict_snap) {
+		CHECK_FCT_DO( ret = dict_snap_publish(dict, dict_snap_which(new)),
+			{
+				int i;
+				dict_hash_unlink(dict, new);
+				for (i=0; i<NB_LISTS_PER_OBJ; i++)
+					if (_OBINFO(new).haslist[i])
+						fd_list_unlink( &new->list[i] );
+				goto error_unlock;
+			} );
+	}
+
 	/* A new object has been created, increment the global counter */
 	dict->dict_count[type]++;
 
@@ -1895,6 +2215,12 @@ int fd_dict_delete(struct dict_object * obj)
 		}
 	}
 
+	/* Once the dictionary is frozen, the lookups without the lock may return the object at any time */
+	if (!ret && dict->dict_snap) {
+		TRACE_DEBUG (INFO, "Cannot delete object, the dictionary is frozen");
+		ret = EBUSY;
+	}
+
 	/* ok, now destroy the object */
 	if (!ret)
 		destroy_object(obj);
@@ -1915,14 +2241,19 @@ int fd_dict_search ( struct dictionary * dict, enum dict_object_type type, int c
 	/* Check param */
 	CHECK_PARAMS( dict && (dict->dict_eyec == DICT_EYECATCHER) && CHECK_TYPE(type) );
 
-	/* Lock the dictionary for reading */
-	CHECK_POSIX(  pthread_rwlock_rdlock(&dict->dict_lock)  );
+	if (__atomic_load_n(&dict->dict_snap, __ATOMIC_ACQUIRE) && dict_snap_serves(type, criteria, what)) {
+		/* The dictionary is frozen and the search only uses the snapshot, no lock needed */
+		ret = dict_obj_info[type].search_fct (dict, criteria, what, result);
+	} else {
+		/* Lock the dictionary for reading */
+		CHECK_POSIX(  pthread_rwlock_rdlock(&dict->dict_lock)  );
 
-	/* Now call the type-specific search function */
-	ret = dict_obj_info[type].search_fct (dict, criteria, what, result);
+		/* Now call the type-specific search function */
+		ret = dict_obj_info[type].search_fct (dict, criteria, what, result);
 
-	/* Unlock */
-	CHECK_POSIX(  pthread_rwlock_unlock(&dict->dict_lock)  );
+		/* Unlock */
+		CHECK_POSIX(  pthread_rwlock_unlock(&dict->dict_lock)  );
+	}
 
 	/* Update the return value as needed */
 	if ((result != NULL) && (*result == NULL))
@@ -2096,26 +2427,55 @@ int fd_dict_init ( struct dictionary ** dict)
 	return 0;
 }
 
-/* Destroy a dictionary */
-int fd_dict_fini ( struct dictionary ** dict)
+/* Publish the first snapshot of the indexes, used by the lookups without lock from now on */
+int fd_dict_freeze ( struct dictionary * dict )
+{
+	int ret = 0;
+
+	TRACE_ENTRY("%p", dict);
+	CHECK_PARAMS( dict && (dict->dict_eyec == DICT_EYECATCHER) );
+
+	CHECK_POSIX(  pthread_rwlock_wrlock(&dict->dict_lock)  );
+	if (!dict->dict_snap) {
+		ret = dict_snap_publish(dict, (1U << DICT_H_MAX) - 1);
+	}
+	CHECK_POSIX(  pthread_rwlock_unlock(&dict->dict_lock)  );
+
+	return ret;
+}
+
+/* Destroy all the objects of a dictionary, and empty its hash indexes. The lock must be held for writing. */
+static void dict_clear ( struct dictionary * dict )
 {
 	int i;
 
+	/* Empty all the lists, free the elements */
+	destroy_list ( &dict->dict_cmd_error.list[2] );
+	dict_rules_drop( &dict->dict_cmd_error );
+	destroy_list ( &dict->dict_cmd_code );
+	destroy_list ( &dict->dict_cmd_name );
+	destroy_list ( &dict->dict_types );
+	for (i=0; i< NB_LISTS_PER_OBJ; i++) {
+		destroy_list ( &dict->dict_applications.list[i] );
+		destroy_list ( &dict->dict_vendors.list[i] );
+	}
+
+	for (i=0; i < DICT_H_MAX; i++)
+		free( dict->dict_hash[i].buckets );
+	memset(dict->dict_hash, 0, sizeof(dict->dict_hash));
+}
+
+/* Destroy a dictionary */
+int fd_dict_fini ( struct dictionary ** dict)
+{
 	TRACE_ENTRY("");
 	CHECK_PARAMS( dict && *dict && ((*dict)->dict_eyec == DICT_EYECATCHER) );
 
 	/* Acquire the write lock to make sure no other operation is ongoing */
 	CHECK_POSIX(  pthread_rwlock_wrlock(&(*dict)->dict_lock)  );
 
-	/* Empty all the lists, free the elements */
-	destroy_list ( &(*dict)->dict_cmd_error.list[2] );
-	destroy_list ( &(*dict)->dict_cmd_code );
-	destroy_list ( &(*dict)->dict_cmd_name );
-	destroy_list ( &(*dict)->dict_types );
-	for (i=0; i< NB_LISTS_PER_OBJ; i++) {
-		destroy_list ( &(*dict)->dict_applications.list[i] );
-		destroy_list ( &(*dict)->dict_vendors.list[i] );
-	}
+	dict_clear( *dict );
+	dict_snap_free( (*dict)->dict_snap );
 
 	/* Dictionary is empty, now destroy the lock */
 	CHECK_POSIX(  pthread_rwlock_unlock(&(*dict)->dict_lock)  );
@@ -2127,6 +2487,804 @@ int fd_dict_fini ( struct dictionary ** dict)
 	return 0;
 }
 
+/*******************************************************************************************************/
+/*******************************************************************************************************/
+/*                                                                                                     */
+/*                                  Binary images                                                      */
+/*                                                                                                     */
+/*******************************************************************************************************/
+/*******************************************************************************************************/
+
+/* A dictionary saved in an image is loaded by creating its objects and linking them in the lists in the saved order,
+ * instead of creating each object with fd_dict_new, which searches its place in the ordered lists. See dictionary-internal.h
+ * for the layout of the image. */
+
+/* The type of the type_dump callback */
+typedef DECLARE_FD_DUMP_PROTOTYPE((*image_dump_cb), union avp_value * val);
+
+/* An image being saved */
+struct image_save {
+	struct dictionary *	dict;
+	struct dict_object **	objs;	/* the objects of the dictionary, in the order of the image */
+	uint32_t		nb_obj;
+	uint32_t		max_obj;
+	struct image_map {
+		struct dict_object *	o;
+		uint32_t		ref;
+	} *			map;	/* to find the reference of an object, sorted by address */
+	struct dict_image_obj *	recs;
+	struct dict_image_head *heads;
+	uint32_t		nb_head;
+	struct dict_image_link *links;
+	uint32_t		nb_link;
+	char *			strs;
+	size_t			str_size;
+	size_t			str_alloc;
+};
+
+/* Append the objects of a list */
+static int image_gather(struct image_save * s, struct fd_list * head)
+{
+	struct fd_list * li;
+
+	for (li = head->next; li != head; li = li->next) {
+		/* The number of objects must match the dict_count values */
+		CHECK_PARAMS( s->nb_obj < s->max_obj );
+		s->objs[s->nb_obj++] = _O(li->o);
+	}
+	return 0;
+}
+
+static int image_map_cmp(const void * a, const void * b)
+{
+	uintptr_t o1 = (uintptr_t)((const struct image_map *)a)->o;
+	uintptr_t o2 = (uintptr_t)((const struct image_map *)b)->o;
+	return ORDER_scalar( o1, o2 );
+}
+
+/* The reference of an object in the image */
+static int image_ref(struct image_save * s, struct dict_object * obj, uint32_t * ref)
+{
+	struct image_map key, * found;
+
+	if (obj == NULL)
+		*ref = DICT_IMAGE_REF_NONE;
+	else if (obj == &s->dict->dict_vendors)
+		*ref = DICT_IMAGE_REF_VENDOR0;
+	else if (obj == &s->dict->dict_applications)
+		*ref = DICT_IMAGE_REF_APP0;
+	else if (obj == &s->dict->dict_cmd_error)
+		*ref = DICT_IMAGE_REF_CMDERR;
+	else {
+		key.o = obj;
+		found = bsearch(&key, s->map, s->nb_obj, sizeof(struct image_map), image_map_cmp);
+		CHECK_PARAMS( found );
+		*ref = found->ref;
+	}
+	return 0;
+}
+
+/* Add a string in the image, return its offset */
+static int image_str(struct image_save * s, const void * str, size_t len, uint32_t * off)
+{
+	CHECK_PARAMS( len < UINT32_MAX - s->str_size - 1 );
+
+	if (s->str_size + len + 1 > s->str_alloc) {
+		size_t alloc = s->str_alloc ? s->str_alloc : 4096;
+		char * strs;
+		while (alloc < s->str_size + len + 1)
+			alloc *= 2;
+		CHECK_MALLOC( strs = realloc(s->strs, alloc) );
+		s->strs = strs;
+		s->str_alloc = alloc;
+	}
+	memcpy(s->strs + s->str_size, str, len);
+	s->strs[s->str_size + len] = '\0';
+	*off = s->str_size;
+	s->str_size += len + 1;
+	return 0;
+}
+
+/* Add the name of a callback in the image. The callback must be found by its name when the image is loaded. */
+static int image_fct(struct image_save * s, void * fct, uint32_t * off)
+{
+	Dl_info info;
+
+	*off = 0;
+	if (fct == NULL)
+		return 0;
+
+	if (!dladdr(fct, &info) || !info.dli_sname || (info.dli_saddr != fct) || (dlsym(RTLD_DEFAULT, info.dli_sname) != fct)) {
+		TRACE_DEBUG(INFO, "The type callback %p is not an exported symbol, the dictionary cannot be saved in an image", fct);
+		return ENOTSUP;
+	}
+	return image_str(s, info.dli_sname, strlen(info.dli_sname), off);
+}
+
+/* Build the image record for an object */
+static int image_save_obj(struct image_save * s, struct dict_object * obj, struct dict_image_obj * rec)
+{
+	char * name = NULL;
+
+	memset(rec, 0, sizeof(struct dict_image_obj));
+	rec->type = obj->type;
+	CHECK_FCT( image_ref(s, obj->parent, &rec->parent) );
+
+	switch (obj->type) {
+		case DICT_VENDOR:
+			name = obj->data.vendor.vendor_name;
+			rec->u32[0] = obj->data.vendor.vendor_id;
+			break;
+
+		case DICT_APPLICATION:
+			name = obj->data.application.application_name;
+			rec->u32[0] = obj->data.application.application_id;
+			break;
+
+		case DICT_TYPE:
+			name = obj->data.type.type_name;
+			rec->u32[0] = obj->data.type.type_base;
+			if (obj->data.type.type_check_param) {
+				TRACE_DEBUG(INFO, "The type '%s' has a check parameter, the dictionary cannot be saved in an image", name);
+				return ENOTSUP;
+			}
+			CHECK_FCT( image_fct(s, (void *)obj->data.type.type_interpret, &rec->fct[0]) );
+			CHECK_FCT( image_fct(s, (void *)obj->data.type.type_encode, &rec->fct[1]) );
+			CHECK_FCT( image_fct(s, (void *)obj->data.type.type_dump, &rec->fct[2]) );
+			CHECK_FCT( image_fct(s, (void *)obj->data.type.type_check, &rec->fct[3]) );
+			break;
+
+		case DICT_ENUMVAL:
+			name = obj->data.enumval.enum_name;
+			if (obj->parent->data.type.type_base == AVP_TYPE_OCTETSTRING) {
+				CHECK_FCT( image_str(s, obj->data.enumval.enum_value.os.data, obj->data.enumval.enum_value.os.len, &rec->os) );
+				rec->os_len = obj->data.enumval.enum_value.os.len;
+			} else {
+				/* All the scalar values are at the beginning of the union */
+				memcpy(&rec->u64, &obj->data.enumval.enum_value, sizeof(uint64_t));
+			}
+			break;
+
+		case DICT_AVP:
+			name = obj->data.avp.avp_name;
+			rec->u32[0] = obj->data.avp.avp_code;
+			rec->u32[1] = obj->data.avp.avp_vendor;
+			rec->u32[2] = obj->data.avp.avp_flag_mask | (obj->data.avp.avp_flag_val << 8);
+			rec->u32[3] = obj->data.avp.avp_basetype;
+			break;
+
+		case DICT_COMMAND:
+			name = obj->data.cmd.cmd_name;
+			rec->u32[0] = obj->data.cmd.cmd_code;
+			rec->u32[1] = obj->data.cmd.cmd_flag_mask | (obj->data.cmd.cmd_flag_val << 8);
+			break;
+
+		case DICT_RULE:
+			CHECK_FCT( image_ref(s, obj->data.rule.rule_avp, &rec->ref) );
+			rec->u32[0] = obj->data.rule.rule_position;
+			rec->u32[1] = obj->data.rule.rule_order;
+			rec->u32[2] = (uint32_t)obj->data.rule.rule_min;
+			rec->u32[3] = (uint32_t)obj->data.rule.rule_max;
+			break;
+
+		default:
+			ASSERT(0);
+	}
+
+	if (name) {
+		CHECK_FCT( image_str(s, name, obj->datastr_len, &rec->name) );
+		rec->name_len = obj->datastr_len;
+	}
+	return 0;
+}
+
+/* Save a list of the dictionary in the image */
+static int image_save_list(struct image_save * s, struct fd_list * sentinel, uint32_t ref, uint32_t list)
+{
+	struct dict_image_head * head;
+	struct fd_list * li;
+
+	if (FD_IS_LIST_EMPTY(sentinel))
+		return 0;
+
+	head = &s->heads[s->nb_head++];
+	head->ref = ref;
+	head->list = list;
+	head->first = s->nb_link;
+	head->count = 0;
+	for (li = sentinel->next; li != sentinel; li = li->next) {
+		struct dict_object * o = _O(li->o);
+		struct dict_image_link * link = &s->links[s->nb_link];
+		CHECK_PARAMS( s->nb_link < s->nb_obj * NB_LISTS_PER_OBJ );
+		CHECK_FCT( image_ref(s, o, &link->ref) );
+		link->list = li - &o->list[0];
+		s->nb_link++;
+		head->count++;
+	}
+	return 0;
+}
+
+/* Save all the lists that have their sentinel in an object */
+static int image_save_sentinels(struct image_save * s, struct dict_object * obj, uint32_t ref)
+{
+	int i;
+
+	for (i = 0; i < NB_LISTS_PER_OBJ; i++) {
+		if (!_OBINFO(obj).haslist[i])
+			CHECK_FCT( image_save_list(s, &obj->list[i], ref, i) );
+	}
+	return 0;
+}
+
+/* Build the image and write it, the lock must be held */
+static int image_save(struct image_save * s, const char * path, const char * tag)
+{
+	struct dictionary * dict = s->dict;
+	struct dict_image_hdr hdr;
+	uint32_t i, nb, end, ref;
+	char * tmp = NULL;
+	FILE * f = NULL;
+	int ret = 0;
+
+	for (i = 1; i <= DICT_TYPE_MAX; i++)
+		s->max_obj += dict->dict_count[i];
+	CHECK_MALLOC( s->objs = calloc(s->max_obj + 1, sizeof(struct dict_object *)) );
+
+	/* Gather the objects, parents first */
+	CHECK_FCT( image_gather(s, &dict->dict_vendors.list[0]) );
+	CHECK_FCT( image_gather(s, &dict->dict_applications.list[0]) );
+	nb = s->nb_obj;
+	CHECK_FCT( image_gather(s, &dict->dict_types) );
+	end = s->nb_obj;
+	for (i = nb; i < end; i++)
+		CHECK_FCT( image_gather(s, &s->objs[i]->list[1]) );
+	CHECK_FCT( image_gather(s, &dict->dict_vendors.list[1]) );
+	for (i = 0; s->objs[i] && (s->objs[i]->type == DICT_VENDOR); i++)
+		CHECK_FCT( image_gather(s, &s->objs[i]->list[1]) );
+	CHECK_FCT( image_gather(s, &dict->dict_cmd_code) );
+	nb = s->nb_obj;
+	CHECK_FCT( image_gather(s, &dict->dict_cmd_error.list[2]) );
+	for (i = 0; i < nb; i++) {
+		if ((s->objs[i]->type == DICT_COMMAND) || (s->objs[i]->type == DICT_AVP))
+			CHECK_FCT( image_gather(s, &s->objs[i]->list[2]) );
+	}
+	CHECK_PARAMS( s->nb_obj == s->max_obj );
+
+	/* The references of the objects */
+	CHECK_MALLOC( s->map = calloc(s->nb_obj + 1, sizeof(struct image_map)) );
+	for (i = 0; i < s->nb_obj; i++) {
+		s->map[i].o = s->objs[i];
+		s->map[i].ref = DICT_IMAGE_REF_OBJ + i;
+	}
+	qsort(s->map, s->nb_obj, sizeof(struct image_map), image_map_cmp);
+
+	/* The strings section starts with an empty string, then the tag */
+	memset(&hdr, 0, sizeof(hdr));
+	CHECK_FCT( image_str(s, "", 0, &ref) );
+	CHECK_FCT( image_str(s, tag, strlen(tag), &hdr.tag) );
+
+	/* The objects */
+	CHECK_MALLOC( s->recs = calloc(s->nb_obj + 1, sizeof(struct dict_image_obj)) );
+	for (i = 0; i < s->nb_obj; i++)
+		CHECK_FCT( image_save_obj(s, s->objs[i], &s->recs[i]) );
+
+	/* The lists */
+	CHECK_MALLOC( s->heads = calloc(DICT_IMAGE_L_MAX + (s->nb_obj + DICT_IMAGE_REF_OBJ) * NB_LISTS_PER_OBJ, sizeof(struct dict_image_head)) );
+	CHECK_MALLOC( s->links = calloc(s->nb_obj * NB_LISTS_PER_OBJ + 1, sizeof(struct dict_image_link)) );
+	CHECK_FCT( image_save_list(s, &dict->dict_vendors.list[0], DICT_IMAGE_REF_NONE, DICT_IMAGE_L_VENDORS) );
+	CHECK_FCT( image_save_list(s, &dict->dict_applications.list[0], DICT_IMAGE_REF_NONE, DICT_IMAGE_L_APPLICATIONS) );
+	CHECK_FCT( image_save_list(s, &dict->dict_types, DICT_IMAGE_REF_NONE, DICT_IMAGE_L_TYPES) );
+	CHECK_FCT( image_save_list(s, &dict->dict_cmd_name, DICT_IMAGE_REF_NONE, DICT_IMAGE_L_CMD_NAME) );
+	CHECK_FCT( image_save_list(s, &dict->dict_cmd_code, DICT_IMAGE_REF_NONE, DICT_IMAGE_L_CMD_CODE) );
+	CHECK_FCT( image_save_sentinels(s, &dict->dict_vendors, DICT_IMAGE_REF_VENDOR0) );
+	CHECK_FCT( image_save_sentinels(s, &dict->dict_applications, DICT_IMAGE_REF_APP0) );
+	CHECK_FCT( image_save_sentinels(s, &dict->dict_cmd_error, DICT_IMAGE_REF_CMDERR) );
+	for (i = 0; i < s->nb_obj; i++)
+		CHECK_FCT( image_save_sentinels(s, s->objs[i], DICT_IMAGE_REF_OBJ + i) );
+
+	/* The header */
+	memcpy(hdr.magic, DICT_IMAGE_MAGIC, sizeof(hdr.magic));
+	hdr.version = DICT_IMAGE_VERSION;
+	hdr.bom = DICT_IMAGE_BOM;
+	hdr.nb_obj = s->nb_obj;
+	hdr.nb_head = s->nb_head;
+	hdr.nb_link = s->nb_link;
+	hdr.obj_off = sizeof(hdr);
+	hdr.head_off = hdr.obj_off + (uint64_t)hdr.nb_obj * sizeof(struct dict_image_obj);
+	hdr.link_off = hdr.head_off + (uint64_t)hdr.nb_head * sizeof(struct dict_image_head);
+	hdr.str_off = hdr.link_off + (uint64_t)hdr.nb_link * sizeof(struct dict_image_link);
+	hdr.str_size = s->str_size;
+
+	/* Write a new file, then replace the previous image, so that the image is never read incomplete */
+	CHECK_MALLOC( tmp = malloc(strlen(path) + 5) );
+	sprintf(tmp, "%s.tmp", path);
+	f = fopen(tmp, "wb");
+	if (f == NULL) {
+		ret = errno;
+		TRACE_ERROR("Cannot create the dictionary image '%s': %s", tmp, strerror(ret));
+		free(tmp);
+		return ret;
+	}
+	if ((fwrite(&hdr, sizeof(hdr), 1, f) != 1)
+	 || (fwrite(s->recs, sizeof(struct dict_image_obj), hdr.nb_obj, f) != hdr.nb_obj)
+	 || (fwrite(s->heads, sizeof(struct dict_image_head), hdr.nb_head, f) != hdr.nb_head)
+	 || (fwrite(s->links, sizeof(struct dict_image_link), hdr.nb_link, f) != hdr.nb_link)
+	 || (fwrite(s->strs, 1, s->str_size, f) != s->str_size)) {
+		ret = errno ?: EIO;
+	}
+	if (fclose(f) && !ret)
+		ret = errno ?: EIO;
+	if (!ret && rename(tmp, path))
+		ret = errno;
+	if (ret) {
+		TRACE_ERROR("Cannot write the dictionary image '%s': %s", path, strerror(ret));
+		unlink(tmp);
+	}
+	free(tmp);
+	return ret;
+}
+
+/* Save the dictionary in an image file */
+int fd_dict_image_save ( struct dictionary * dict, const char * path, const char * tag )
+{
+	struct image_save s;
+	int ret;
+
+	TRACE_ENTRY("%p %p %p", dict, path, tag);
+	CHECK_PARAMS( dict && (dict->dict_eyec == DICT_EYECATCHER) && path && tag );
+
+	memset(&s, 0, sizeof(s));
+	s.dict = dict;
+
+	CHECK_POSIX(  pthread_rwlock_rdlock(&dict->dict_lock)  );
+	ret = image_save(&s, path, tag);
+	CHECK_POSIX(  pthread_rwlock_unlock(&dict->dict_lock)  );
+
+	free(s.objs);
+	free(s.map);
+	free(s.recs);
+	free(s.heads);
+	free(s.links);
+	free(s.strs);
+
+	if (!ret) {
+		TRACE_DEBUG(FULL, "Dictionary saved in image '%s' (%u objects)", path, s.nb_obj);
+	}
+	return ret;
+}
+
+/* An image being loaded */
+struct image_load {
+	struct dictionary *	dict;
+	const struct dict_image_hdr * hdr;
+	const struct dict_image_obj * recs;
+	const struct dict_image_head * heads;
+	const struct dict_image_link * links;
+	const char *		strs;
+	struct dict_object **	objs;	/* the objects created */
+	uint32_t		nb_obj;
+	uint8_t *		linked;	/* for each list of each reference, IMAGE_LINKED_* */
+	struct dict_hash	hash[DICT_H_MAX];
+};
+#define IMAGE_LINKED_ELEMENT	1	/* the list is linked as an element of a list */
+#define IMAGE_LINKED_SENTINEL	2	/* the list is the sentinel of a list */
+
+/* Check that a section is inside the image */
+static int image_section_ok(uint64_t size, uint64_t off, uint32_t nb, size_t item)
+{
+	return ((off % 8) == 0) && (off <= size) && ((uint64_t)nb * item <= size - off);
+}
+
+/* Check that a string is inside the strings section */
+static int image_str_ok(struct image_load * l, uint32_t off, uint32_t len)
+{
+	return (off > 0) && (off < l->hdr->str_size) && (len < l->hdr->str_size - off) && (l->strs[off + len] == '\0');
+}
+
+/* Check the header and sections of the image */
+static int image_check(struct image_load * l, const void * img, uint64_t size, const char * tag)
+{
+	const struct dict_image_hdr * hdr = img;
+	const char * t;
+
+	if ((size < sizeof(struct dict_image_hdr)) || memcmp(hdr->magic, DICT_IMAGE_MAGIC, sizeof(hdr->magic))) {
+		TRACE_DEBUG(INFO, "The file is not a dictionary image");
+		return EINVAL;
+	}
+	if ((hdr->version != DICT_IMAGE_VERSION) || (hdr->bom != DICT_IMAGE_BOM)) {
+		TRACE_DEBUG(INFO, "The dictionary image was saved by a different version of freeDiameter or on a different host");
+		return ESTALE;
+	}
+	if (!image_section_ok(size, hdr->obj_off, hdr->nb_obj, sizeof(struct dict_image_obj))
+	 || !image_section_ok(size, hdr->head_off, hdr->nb_head, sizeof(struct dict_image_head))
+	 || !image_section_ok(size, hdr->link_off, hdr->nb_link, sizeof(struct dict_image_link))
+	 || (hdr->str_size == 0) || (hdr->str_size >= UINT32_MAX)
+	 || !image_section_ok(size, hdr->str_off, 1, hdr->str_size)
+	 || (hdr->nb_obj > UINT32_MAX - DICT_IMAGE_REF_OBJ)) {
+		TRACE_DEBUG(INFO, "The dictionary image is truncated or corrupted");
+		return EINVAL;
+	}
+
+	l->hdr = hdr;
+	l->recs = (const void *)((const char *)img + hdr->obj_off);
+	l->heads = (const void *)((const char *)img + hdr->head_off);
+	l->links = (const void *)((const char *)img + hdr->link_off);
+	l->strs = (const char *)img + hdr->str_off;
+
+	t = l->strs + hdr->tag;
+	if ((hdr->tag == 0) || (hdr->tag >= hdr->str_size) || !memchr(t, '\0', hdr->str_size - hdr->tag)) {
+		TRACE_DEBUG(INFO, "The dictionary image is corrupted");
+		return EINVAL;
+	}
+	if (strcmp(t, tag)) {
+		TRACE_DEBUG(INFO, "The dictionary image was saved with a different tag: '%s'", t);
+		return ESTALE;
+	}
+	return 0;
+}
+
+/* Find the object of a reference (NULL for DICT_IMAGE_REF_NONE) */
+static int image_obj(struct image_load * l, uint32_t ref, struct dict_object ** obj)
+{
+	switch (ref) {
+		case DICT_IMAGE_REF_NONE:	*obj = NULL; break;
+		case DICT_IMAGE_REF_VENDOR0:	*obj = &l->dict->dict_vendors; break;
+		case DICT_IMAGE_REF_APP0:	*obj = &l->dict->dict_applications; break;
+		case DICT_IMAGE_REF_CMDERR:	*obj = &l->dict->dict_cmd_error; break;
+		default:
+			CHECK_PARAMS( ref - DICT_IMAGE_REF_OBJ < l->nb_obj );
+			*obj = l->objs[ref - DICT_IMAGE_REF_OBJ];
+	}
+	return 0;
+}
+
+/* Find a type callback by its name */
+static int image_sym(struct image_load * l, uint32_t off, void ** sym)
+{
+	const char * end;
+	
+	*sym = NULL;
+	if (off == 0)
+		return 0;
+	/* The name must end inside the strings section */
+	CHECK_PARAMS( off < l->hdr->str_size );
+	CHECK_PARAMS( end = memchr(l->strs + off, '\0', l->hdr->str_size - off) );
+	CHECK_PARAMS( image_str_ok(l, off, end - (l->strs + off)) );
+	*sym = dlsym(RTLD_DEFAULT, l->strs + off);
+	if (*sym == NULL) {
+		TRACE_DEBUG(INFO, "The type callback '%s' of the dictionary image is not available", l->strs + off);
+		return ENOENT;
+	}
+	return 0;
+}
+
+/* Create an object from its record, except the references to other objects */
+static int image_load_obj(struct image_load * l, const struct dict_image_obj * rec, struct dict_object ** obj)
+{
+	struct dict_object * new;
+	char * name = NULL;
+	void * fct[4];
+	int i;
+
+	CHECK_PARAMS( CHECK_TYPE(rec->type) );
+	if (rec->type != DICT_RULE) {
+		CHECK_PARAMS( image_str_ok(l, rec->name, rec->name_len) );
+		for (i = 0; i < 4; i++)
+			CHECK_FCT( image_sym(l, rec->fct[i], &fct[i]) );
+	}
+
+	CHECK_MALLOC( new = malloc(sizeof(struct dict_object)) );
+	init_object(new, rec->type);
+	if (rec->type != DICT_RULE) {
+		CHECK_MALLOC_DO( name = os0dup(l->strs + rec->name, rec->name_len), { free(new); return ENOMEM; } );
+		new->datastr_len = rec->name_len;
+	}
+
+	switch (rec->type) {
+		case DICT_VENDOR:
+			new->data.vendor.vendor_id = rec->u32[0];
+			new->data.vendor.vendor_name = name;
+			break;
+
+		case DICT_APPLICATION:
+			new->data.application.application_id = rec->u32[0];
+			new->data.application.application_name = name;
+			break;
+
+		case DICT_TYPE:
+			new->data.type.type_base = rec->u32[0];
+			new->data.type.type_name = name;
+			new->data.type.type_interpret = (dict_avpdata_interpret)fct[0];
+			new->data.type.type_encode = (dict_avpdata_encode)fct[1];
+			new->data.type.type_dump = (image_dump_cb)fct[2];
+			new->data.type.type_check = (dict_avpdata_check)fct[3];
+			break;
+
+		case DICT_ENUMVAL:
+			/* The value is set once the parent type is known */
+			new->data.enumval.enum_name = name;
+			break;
+
+		case DICT_AVP:
+			new->data.avp.avp_code = rec->u32[0];
+			new->data.avp.avp_vendor = rec->u32[1];
+			new->data.avp.avp_name = name;
+			new->data.avp.avp_flag_mask = rec->u32[2] & 0xff;
+			new->data.avp.avp_flag_val = rec->u32[2] >> 8;
+			new->data.avp.avp_basetype = rec->u32[3];
+			break;
+
+		case DICT_COMMAND:
+			new->data.cmd.cmd_code = rec->u32[0];
+			new->data.cmd.cmd_name = name;
+			new->data.cmd.cmd_flag_mask = rec->u32[1] & 0xff;
+			new->data.cmd.cmd_flag_val = rec->u32[1] >> 8;
+			break;
+
+		case DICT_RULE:
+			/* The AVP is set once all the objects are created */
+			new->data.rule.rule_position = rec->u32[0];
+			new->data.rule.rule_order = rec->u32[1];
+			new->data.rule.rule_min = (int)rec->u32[2];
+			new->data.rule.rule_max = (int)rec->u32[3];
+			break;
+	}
+
+	*obj = new;
+	return 0;
+}
+
+/* Set the references of an object to the other objects, with the same checks as fd_dict_new */
+static int image_load_refs(struct image_load * l, const struct dict_image_obj * rec, struct dict_object * obj)
+{
+	struct dict_object * parent;
+
+	CHECK_FCT( image_obj(l, rec->parent, &parent) );
+	switch (_OBINFO(obj).parent) {
+		case 0:
+			CHECK_PARAMS( parent == NULL );
+			break;
+		case 2:
+			CHECK_PARAMS( parent != NULL );
+		case 1:
+			if (parent == NULL)
+				break;
+			if (obj->type == DICT_RULE) {
+				CHECK_PARAMS( (parent->type == DICT_COMMAND)
+						|| ((parent->type == DICT_AVP) && (parent->data.avp.avp_basetype == AVP_TYPE_GROUPED)) );
+			} else {
+				CHECK_PARAMS( parent->type == _OBINFO(obj).parenttype );
+			}
+	}
+	obj->parent = parent;
+
+	if (obj->type == DICT_RULE) {
+		CHECK_FCT( image_obj(l, rec->ref, &obj->data.rule.rule_avp) );
+		CHECK_PARAMS( obj->data.rule.rule_avp && (obj->data.rule.rule_avp->type == DICT_AVP) );
+	}
+
+	if (obj->type == DICT_ENUMVAL) {
+		if (parent->data.type.type_base == AVP_TYPE_OCTETSTRING) {
+			CHECK_PARAMS( image_str_ok(l, rec->os, rec->os_len) );
+			CHECK_MALLOC( obj->data.enumval.enum_value.os.data = os0dup(l->strs + rec->os, rec->os_len) );
+			obj->data.enumval.enum_value.os.len = rec->os_len;
+		} else {
+			memcpy(&obj->data.enumval.enum_value, &rec->u64, sizeof(uint64_t));
+		}
+	}
+	return 0;
+}
+
+/* The sentinel of a list of the image */
+static int image_head(struct image_load * l, const struct dict_image_head * head, struct fd_list ** sentinel)
+{
+	struct dict_object * o;
+	uint8_t * linked;
+
+	if (head->ref == DICT_IMAGE_REF_NONE) {
+		switch (head->list) {
+			case DICT_IMAGE_L_VENDORS:	*sentinel = &l->dict->dict_vendors.list[0]; break;
+			case DICT_IMAGE_L_APPLICATIONS:	*sentinel = &l->dict->dict_applications.list[0]; break;
+			case DICT_IMAGE_L_TYPES:	*sentinel = &l->dict->dict_types; break;
+			case DICT_IMAGE_L_CMD_NAME:	*sentinel = &l->dict->dict_cmd_name; break;
+			case DICT_IMAGE_L_CMD_CODE:	*sentinel = &l->dict->dict_cmd_code; break;
+			default:
+				/* Invalid list */
+				CHECK_PARAMS( *sentinel = NULL );
+		}
+	} else {
+		CHECK_FCT( image_obj(l, head->ref, &o) );
+		CHECK_PARAMS( (head->list < NB_LISTS_PER_OBJ) && !_OBINFO(o).haslist[head->list] );
+		*sentinel = &o->list[head->list];
+	}
+
+	/* Each list has only one head; the lists of the dictionary structure use the slots of reference 0 */
+	linked = &l->linked[head->ref * NB_LISTS_PER_OBJ + (head->ref ? head->list : 0)];
+	if (head->ref == DICT_IMAGE_REF_NONE) {
+		CHECK_PARAMS( !(*linked & (IMAGE_LINKED_SENTINEL << head->list)) );
+		*linked |= IMAGE_LINKED_SENTINEL << head->list;
+	} else {
+		CHECK_PARAMS( !*linked );
+		*linked = IMAGE_LINKED_SENTINEL;
+	}
+	return 0;
+}
+
+/* Check the lists of the image, so that linking them cannot fail */
+static int image_check_lists(struct image_load * l)
+{
+	uint32_t i, j;
+	int k;
+
+	for (i = 0; i < l->hdr->nb_head; i++) {
+		const struct dict_image_head * head = &l->heads[i];
+		struct fd_list * sentinel;
+
+		CHECK_FCT( image_head(l, head, &sentinel) );
+		CHECK_PARAMS( (head->first <= l->hdr->nb_link) && (head->count <= l->hdr->nb_link - head->first) );
+		for (j = head->first; j < head->first + head->count; j++) {
+			const struct dict_image_link * link = &l->links[j];
+			CHECK_PARAMS( (link->ref >= DICT_IMAGE_REF_OBJ) && (link->ref - DICT_IMAGE_REF_OBJ < l->nb_obj) );
+			CHECK_PARAMS( (link->list < NB_LISTS_PER_OBJ) && _OBINFO(l->objs[link->ref - DICT_IMAGE_REF_OBJ]).haslist[link->list] );
+			CHECK_PARAMS( !l->linked[link->ref * NB_LISTS_PER_OBJ + link->list] );
+			l->linked[link->ref * NB_LISTS_PER_OBJ + link->list] = IMAGE_LINKED_ELEMENT;
+		}
+	}
+
+	/* Each object must be in all its lists */
+	for (i = 0; i < l->nb_obj; i++) {
+		for (k = 0; k < NB_LISTS_PER_OBJ; k++) {
+			if (_OBINFO(l->objs[i]).haslist[k])
+				CHECK_PARAMS( l->linked[(i + DICT_IMAGE_REF_OBJ) * NB_LISTS_PER_OBJ + k] == IMAGE_LINKED_ELEMENT );
+		}
+	}
+	return 0;
+}
+
+/* Allocate the hash indexes for the objects of the image */
+static int image_alloc_hash(struct image_load * l)
+{
+	uint32_t i, hval;
+	int slot, idx;
+
+	for (i = 0; i < l->nb_obj; i++) {
+		for (slot = 0; slot < 2; slot++) {
+			idx = hash_obj(l->objs[i], slot, &hval);
+			if (idx >= 0)
+				l->hash[idx].count++;
+		}
+	}
+	for (idx = 0; idx < DICT_H_MAX; idx++) {
+		/* Same invariant as dict_hash_reserve: count < size */
+		uint32_t size = 64;
+		while (size <= l->hash[idx].count)
+			size *= 2;
+		CHECK_MALLOC( l->hash[idx].buckets = calloc(size, sizeof(struct dict_object *)) );
+		l->hash[idx].size = size;
+		l->hash[idx].count = 0;
+	}
+	return 0;
+}
+
+/* Replace the contents of the dictionary with the image; nothing can fail here. The lock must be held. */
+static void image_install(struct image_load * l)
+{
+	struct dictionary * dict = l->dict;
+	uint32_t i, j;
+
+	dict_clear(dict);
+	memcpy(dict->dict_hash, l->hash, sizeof(dict->dict_hash));
+	memset(l->hash, 0, sizeof(l->hash));
+
+	for (i = 0; i < l->nb_obj; i++) {
+		struct dict_object * o = l->objs[i];
+		o->dico = dict;
+		dict_hash_link(dict, o);
+		dict->dict_count[o->type]++;
+	}
+
+	for (i = 0; i < l->hdr->nb_head; i++) {
+		const struct dict_image_head * head = &l->heads[i];
+		struct fd_list * sentinel = NULL;
+		struct dict_object * o = NULL;
+
+		if (head->ref == DICT_IMAGE_REF_NONE) {
+			switch (head->list) {
+				case DICT_IMAGE_L_VENDORS:	sentinel = &dict->dict_vendors.list[0]; break;
+				case DICT_IMAGE_L_APPLICATIONS:	sentinel = &dict->dict_applications.list[0]; break;
+				case DICT_IMAGE_L_TYPES:	sentinel = &dict->dict_types; break;
+				case DICT_IMAGE_L_CMD_NAME:	sentinel = &dict->dict_cmd_name; break;
+				case DICT_IMAGE_L_CMD_CODE:	sentinel = &dict->dict_cmd_code; break;
+			}
+		} else {
+			(void) image_obj(l, head->ref, &o);
+			sentinel = &o->list[head->list];
+		}
+
+		/* The elements are in the order of the list, append them */
+		for (j = head->first; j < head->first + head->count; j++) {
+			o = l->objs[l->links[j].ref - DICT_IMAGE_REF_OBJ];
+			fd_list_insert_before(sentinel, &o->list[l->links[j].list]);
+		}
+	}
+	l->nb_obj = 0; /* the objects belong to the dictionary now */
+}
+
+/* Load the dictionary from an image file */
+int fd_dict_image_load ( struct dictionary * dict, const char * path, const char * tag )
+{
+	struct image_load l;
+	struct stat st;
+	void * img = MAP_FAILED;
+	uint32_t i;
+	int fd, ret = 0;
+
+	TRACE_ENTRY("%p %p %p", dict, path, tag);
+	CHECK_PARAMS( dict && (dict->dict_eyec == DICT_EYECATCHER) && path && tag );
+
+	memset(&l, 0, sizeof(l));
+	l.dict = dict;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		ret = errno;
+		TRACE_DEBUG(INFO, "Cannot open the dictionary image '%s': %s", path, strerror(ret));
+		return ret;
+	}
+	CHECK_SYS_DO( fstat(fd, &st), { ret = __ret__; goto out; } );
+	if (st.st_size > 0)
+		img = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (img == MAP_FAILED) {
+		ret = st.st_size ? errno : EINVAL;
+		TRACE_DEBUG(INFO, "Cannot map the dictionary image '%s': %s", path, strerror(ret));
+		goto out;
+	}
+	CHECK_FCT_DO( ret = image_check(&l, img, st.st_size, tag), goto out );
+
+	/* Create the objects */
+	CHECK_MALLOC_DO( l.objs = calloc(l.hdr->nb_obj + 1, sizeof(struct dict_object *)), { ret = ENOMEM; goto out; } );
+	for (l.nb_obj = 0; l.nb_obj < l.hdr->nb_obj; l.nb_obj++) {
+		CHECK_FCT_DO( ret = image_load_obj(&l, &l.recs[l.nb_obj], &l.objs[l.nb_obj]), goto out );
+	}
+	for (i = 0; i < l.nb_obj; i++) {
+		CHECK_FCT_DO( ret = image_load_refs(&l, &l.recs[i], l.objs[i]), goto out );
+	}
+
+	/* Check the lists and prepare the indexes */
+	CHECK_MALLOC_DO( l.linked = calloc(((size_t)l.nb_obj + DICT_IMAGE_REF_OBJ) * NB_LISTS_PER_OBJ, 1), { ret = ENOMEM; goto out; } );
+	CHECK_FCT_DO( ret = image_check_lists(&l), goto out );
+	CHECK_FCT_DO( ret = image_alloc_hash(&l), goto out );
+
+	/* Now replace the contents of the dictionary */
+	CHECK_POSIX_DO( ret = pthread_rwlock_wrlock(&dict->dict_lock), goto out );
+	if (dict->dict_snap) {
+		/* Lookups may be using the objects without the lock */
+		TRACE_DEBUG(INFO, "The dictionary is frozen, it cannot be loaded from an image");
+		ret = EBUSY;
+	} else {
+		i = l.nb_obj;
+		image_install(&l);
+	}
+	CHECK_POSIX_DO( pthread_rwlock_unlock(&dict->dict_lock), /* continue */ );
+	if (!ret) {
+		TRACE_DEBUG(FULL, "Dictionary loaded from image '%s' (%u objects)", path, i);
+	}
+
+out:
+	for (i = 0; i < l.nb_obj; i++) {
+		if (l.objs[i])
+			destroy_object(l.objs[i]);
+	}
+	for (i = 0; i < DICT_H_MAX; i++)
+		free(l.hash[i].buckets);
+	free(l.objs);
+	free(l.linked);
+	if (img != MAP_FAILED)
+		munmap(img, st.st_size);
+	close(fd);
+	return ret;
+}
+
 /*******************************************************************************************************/
 /*******************************************************************************************************/
 /*                                                                                                     */
@@ -2169,6 +3327,78 @@ int fd_dict_iterate_rules ( struct dict_object *parent, void * data, int (*cb)(v
 	return ret;
 }
 
+static int order_rules_slot(const void * a, const void * b)
+{
+	uintptr_t o1 = (uintptr_t)((const struct dict_rules_slot *)a)->avp;
+	uintptr_t o2 = (uintptr_t)((const struct dict_rules_slot *)b)->avp;
+	return ORDER_scalar( o1, o2 );
+}
+
+/* Compile the rules of a command or grouped AVP, the lock must be held */
+static int dict_rules_compile(struct dict_object * parent, struct dict_rules_compiled ** compiled)
+{
+	struct dict_rules_compiled * c;
+	struct fd_list * li;
+	int nb = 0;
+
+	for (li = parent->list[2].next; li != &parent->list[2]; li = li->next)
+		nb++;
+
+	/* One block for the header and the three arrays */
+	CHECK_MALLOC( c = malloc(sizeof(struct dict_rules_compiled)
+				+ nb * (sizeof(struct dict_rule_data) + sizeof(struct dict_rules_slot) + sizeof(char *))) );
+	c->nb = 0;
+	c->rules = (struct dict_rule_data *)(c + 1);
+	c->slots = (struct dict_rules_slot *)(c->rules + nb);
+	c->names = (const char **)(c->slots + nb);
+
+	for (li = parent->list[2].next; li != &parent->list[2]; li = li->next) {
+		struct dict_rule_data * rule = &_O(li->o)->data.rule;
+		c->rules[c->nb] = *rule;
+		c->names[c->nb] = rule->rule_avp->data.avp.avp_name;
+		c->slots[c->nb].avp = rule->rule_avp;
+		c->slots[c->nb].idx = c->nb;
+		c->nb++;
+	}
+	qsort(c->slots, nb, sizeof(struct dict_rules_slot), order_rules_slot);
+
+	*compiled = c;
+	return 0;
+}
+
+int fd_dict_iterate_rules_compiled ( struct dict_object *parent, void * data, int (*cb)(void *, struct dict_rules_compiled *) )
+{
+	struct dict_rules_compiled * c, * expected = NULL;
+	int ret = 0;
+
+	TRACE_ENTRY("%p %p %p", parent, data, cb);
+
+	/* Check parameters */
+	CHECK_PARAMS(  verify_object(parent) && cb  );
+	CHECK_PARAMS(  (parent->type == DICT_COMMAND)
+			|| ((parent->type == DICT_AVP) && (parent->data.avp.avp_basetype == AVP_TYPE_GROUPED)) );
+
+	/* Acquire the read lock, the compiled rules are only dropped under the write lock */
+	CHECK_POSIX(  pthread_rwlock_rdlock(&parent->dico->dict_lock)  );
+
+	c = __atomic_load_n(&parent->rules_cmp, __ATOMIC_ACQUIRE);
+	if (!c) {
+		/* Compile the rules; if another thread did it in the meantime, use its version */
+		CHECK_FCT_DO( ret = dict_rules_compile(parent, &c), goto out );
+		if (!__atomic_compare_exchange_n(&parent->rules_cmp, &expected, c, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			free(c);
+			c = expected;
+		}
+	}
+
+	ret = (*cb)(data, c);
+out:
+	/* Release the lock */
+	CHECK_POSIX(  pthread_rwlock_unlock(&parent->dico->dict_lock)  );
+
+	return ret;
+}
+
 /* Create the list of vendors. Returns a 0-terminated array, that must be freed after use. Returns NULL on error. */
 uint32_t * fd_dict_get_vendorid_list(struct dictionary * dict)
 {
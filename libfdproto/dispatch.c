@@ -37,7 +37,8 @@
 
 /* The dispatch module in the library is quite simple: callbacks are saved in a global list
  * in no particular order. In addition, they are also linked from the dictionary objects they
- * refer to. */
+ * refer to, and indexed by their criteria in a hash table (see disp_key below), so that finding
+ * the callbacks for a message or an AVP only takes a few lookups. */
 
 /* Protection for the lists managed in this module. */
 pthread_rwlock_t fd_disp_lock = PTHREAD_RWLOCK_INITIALIZER;
@@ -48,53 +49,278 @@ static struct fd_list all_handlers = FD_LIST_INITIALIZER( all_handlers );
 /* List of handlers registered for DISP_HOW_ANY. Other handlers are stored in the dictionary */
 static struct fd_list any_handlers = FD_LIST_INITIALIZER( any_handlers );
 
+/* An entry in the index: the handlers registered with exactly the same criteria. */
+struct disp_key {
+	struct disp_key *next;	/* chaining in the bucket */
+	uint32_t	 hash;	/* hash of the criteria */
+	struct disp_when when;	/* the criteria, unused fields are NULL */
+	struct fd_list	 hdls;	/* the handlers, in the order they were registered */
+	int		 avp_hdls;	/* in the key of an AVP alone: number of handlers on this AVP (whatever the other criteria) */
+	int		 avp_values;	/* ... and how many of these also require an enumerated value */
+};
+
+/* The index, protected by fd_disp_lock. It grows with the number of keys. */
+static struct {
+	struct disp_key **buckets;
+	uint32_t	  size;	/* power of 2, 0 before the first handler */
+	uint32_t	  count;
+} disp_index;
+
+/* The registration order of the handlers, to call them in this order when they come from several keys */
+static uint64_t disp_seq;
+
 /* The structure to store a callback */
 struct disp_hdl {
 	int		 eyec;	/* Eye catcher, DISP_EYEC */
 	struct fd_list	 all;	/* link in the all_handlers list */
 	struct fd_list	 parent;/* link in dictionary cb_list or in any_handlers */
+	struct fd_list	 key;	/* link in the hdls list of its key in the index */
+	struct disp_key	*k;	/* this key, NULL for DISP_HOW_ANY or once the handler is no longer indexed */
+	uint64_t	 seq;	/* registration order */
 	enum disp_how	 how;	/* Copy of registration parameter */
 	struct disp_when when;	/* Copy of registration parameter */
 	int		(*cb)( struct msg **, struct avp *, struct session *, void *, enum disp_action *);	/* The callback itself */
 	void            *opaque; /* opaque data passed back to the callback */
+	unsigned long long hits; /* number of times the callback was called (updated atomically) */
+	unsigned long long time; /* total time spent in the callback, in ns (updated atomically) */
 };
 
 #define DISP_EYEC	0xD15241C1
 #define VALIDATE_HDL( _hdl ) \
 	( ( ( _hdl ) != NULL ) && ( ((struct disp_hdl *)( _hdl ))->eyec == DISP_EYEC ) )
 
+/* Initial size of the index */
+#define DISP_INDEX_MIN	64
+
 /**************************************************************************************/
 
-/* Call CBs from a given list (any_handlers if cb_list is NULL) -- must have locked fd_disp_lock before */
-int fd_disp_call_cb_int( struct fd_list * cb_list, struct msg ** msg, struct avp *avp, struct session *sess, enum disp_action *action, 
+static uint32_t disp_key_hash(struct dict_object * app, struct dict_object * cmd, struct dict_object * avp, struct dict_object * value)
+{
+	uint64_t h = (uintptr_t)app;
+	h = (h * 0x9E3779B97F4A7C15ULL) ^ (uintptr_t)cmd;
+	h = (h * 0x9E3779B97F4A7C15ULL) ^ (uintptr_t)avp;
+	h = (h * 0x9E3779B97F4A7C15ULL) ^ (uintptr_t)value;
+	h *= 0x9E3779B97F4A7C15ULL;
+	return (uint32_t)(h >> 32);
+}
+
+/* Search a key in the index -- must have locked fd_disp_lock before */
+static struct disp_key * disp_key_find(struct dict_object * app, struct dict_object * cmd, struct dict_object * avp, struct dict_object * value)
+{
+	struct disp_key * k;
+	uint32_t hash;
+
+	if (!disp_index.size)
+		return NULL;
+
+	hash = disp_key_hash(app, cmd, avp, value);
+	for (k = disp_index.buckets[hash & (disp_index.size - 1)]; k; k = k->next) {
+		if ((k->hash == hash) && (k->when.app == app) && (k->when.command == cmd) && (k->when.avp == avp) && (k->when.value == value))
+			return k;
+	}
+	return NULL;
+}
+
+/* Search a key in the index, or create it -- must have locked fd_disp_lock for writing */
+static int disp_key_get(struct dict_object * app, struct dict_object * cmd, struct dict_object * avp, struct dict_object * value, struct disp_key ** key)
+{
+	struct disp_key * k;
+	uint32_t i;
+
+	if ((*key = disp_key_find(app, cmd, avp, value)) != NULL)
+		return 0;
+
+	/* Grow the index first if needed */
+	if (disp_index.count >= disp_index.size) {
+		uint32_t size = disp_index.size ? disp_index.size * 2 : DISP_INDEX_MIN;
+		struct disp_key ** buckets;
+
+		CHECK_MALLOC( buckets = calloc(size, sizeof(struct disp_key *)) );
+		for (i = 0; i < disp_index.size; i++) {
+			while ((k = disp_index.buckets[i]) != NULL) {
+				disp_index.buckets[i] = k->next;
+				k->next = buckets[k->hash & (size - 1)];
+				buckets[k->hash & (size - 1)] = k;
+			}
+		}
+		free(disp_index.buckets);
+		disp_index.buckets = buckets;
+		disp_index.size = size;
+	}
+
+	CHECK_MALLOC( k = malloc(sizeof(struct disp_key)) );
+	memset(k, 0, sizeof(struct disp_key));
+	k->hash = disp_key_hash(app, cmd, avp, value);
+	k->when.app = app;
+	k->when.command = cmd;
+	k->when.avp = avp;
+	k->when.value = value;
+	fd_list_init(&k->hdls, NULL);
+
+	k->next = disp_index.buckets[k->hash & (disp_index.size - 1)];
+	disp_index.buckets[k->hash & (disp_index.size - 1)] = k;
+	disp_index.count++;
+
+	*key = k;
+	return 0;
+}
+
+/* Free a key that is no longer used -- must have locked fd_disp_lock for writing */
+static void disp_key_release(struct disp_key * key)
+{
+	struct disp_key ** pk;
+
+	if (!FD_IS_LIST_EMPTY(&key->hdls) || key->avp_hdls)
+		return;
+
+	for (pk = &disp_index.buckets[key->hash & (disp_index.size - 1)]; *pk; pk = &(*pk)->next) {
+		if (*pk == key) {
+			*pk = key->next;
+			break;
+		}
+	}
+	disp_index.count--;
+	free(key);
+
+	if (!disp_index.count) {
+		free(disp_index.buckets);
+		memset(&disp_index, 0, sizeof(disp_index));
+	}
+}
+
+/* Link a handler in the index -- must have locked fd_disp_lock for writing */
+static int disp_index_link(struct disp_hdl * hdl)
+{
+	struct disp_key * base = NULL;
+
+	/* The key of the AVP alone tells if the AVP has handlers at all, and if they need the enumerated value */
+	if (hdl->when.avp) {
+		CHECK_FCT( disp_key_get(NULL, NULL, hdl->when.avp, NULL, &base) );
+		base->avp_hdls++;
+		if (hdl->when.value)
+			base->avp_values++;
+	}
+
+	CHECK_FCT_DO( disp_key_get(hdl->when.app, hdl->when.command, hdl->when.avp, hdl->when.value, &hdl->k),
+		{
+			if (base) {
+				base->avp_hdls--;
+				if (hdl->when.value)
+					base->avp_values--;
+				disp_key_release(base);
+			}
+			return __ret__;
+		} );
+	fd_list_insert_before(&hdl->k->hdls, &hdl->key);
+	return 0;
+}
+
+/* Unlink a handler from the index -- must have locked fd_disp_lock for writing */
+static void disp_index_unlink(struct disp_hdl * hdl)
+{
+	struct disp_key * base;
+
+	if (!hdl->k)
+		return;
+
+	fd_list_unlink(&hdl->key);
+	disp_key_release(hdl->k);
+	hdl->k = NULL;
+
+	if (hdl->when.avp && ((base = disp_key_find(NULL, NULL, hdl->when.avp, NULL)) != NULL)) {
+		base->avp_hdls--;
+		if (hdl->when.value)
+			base->avp_values--;
+		disp_key_release(base);
+	}
+}
+
+/* Add the handlers of a key to the lists to call, if any */
+static void disp_probe(struct fd_list ** lists, int * nb, struct dict_object * app, struct dict_object * cmd, struct dict_object * avp, struct dict_object * value)
+{
+	struct disp_key * k = disp_key_find(app, cmd, avp, value);
+	if (k && !FD_IS_LIST_EMPTY(&k->hdls))
+		lists[(*nb)++] = &k->hdls;
+}
+
+/**************************************************************************************/
+
+/* Tell if handlers are registered for an AVP, and if some of them need its enumerated value -- must have locked fd_disp_lock before */
+int fd_disp_avp_handlers( struct dict_object * obj_avp, int * values )
+{
+	struct disp_key * base = disp_key_find(NULL, NULL, obj_avp, NULL);
+
+	if (!base || !base->avp_hdls) {
+		*values = 0;
+		return 0;
+	}
+	*values = base->avp_values;
+	return base->avp_hdls;
+}
+
+/* Call the CBs registered at a given level (DISP_HOW_AVP for both AVP levels) that match the message -- must have locked fd_disp_lock before */
+int fd_disp_call_cb_int( enum disp_how how, struct msg ** msg, struct avp *avp, struct session *sess, enum disp_action *action, 
 			struct dict_object * obj_app, struct dict_object * obj_cmd, struct dict_object * obj_avp, struct dict_object * obj_enu,
 			char ** drop_reason, struct msg ** drop_msg)
 {
-	struct fd_list * senti, *li;
-	int r;
-	TRACE_ENTRY("%p %p %p %p %p %p %p %p %p", cb_list, msg, avp, sess, action, obj_app, obj_cmd, obj_avp, obj_enu);
+	struct fd_list * lists[8], * pos[8];
+	int nb = 0, i, r;
+	TRACE_ENTRY("%d %p %p %p %p %p %p %p %p", how, msg, avp, sess, action, obj_app, obj_cmd, obj_avp, obj_enu);
 	CHECK_PARAMS(msg && action);
 	
-	senti = cb_list;
-	if (!senti)
-		senti = &any_handlers;
+	/* Find the keys matching this message / avp. The criteria that were not set at registration are NULL in the keys */
+	switch (how) {
+		case DISP_HOW_ANY:
+			lists[nb++] = &any_handlers;
+			break;
+		
+		case DISP_HOW_APPID:
+			if (obj_app)
+				disp_probe(lists, &nb, obj_app, NULL, NULL, NULL);
+			break;
+		
+		case DISP_HOW_CC:
+			disp_probe(lists, &nb, NULL, obj_cmd, NULL, NULL);
+			if (obj_app)
+				disp_probe(lists, &nb, obj_app, obj_cmd, NULL, NULL);
+			break;
+		
+		case DISP_HOW_AVP:
+		case DISP_HOW_AVP_ENUMVAL:
+			for (i = 0; i < 8; i++) {
+				if (((i & 1) && !obj_app) || ((i & 2) && !obj_cmd) || ((i & 4) && !obj_enu))
+					continue;
+				disp_probe(lists, &nb, (i & 1) ? obj_app : NULL, (i & 2) ? obj_cmd : NULL, obj_avp, (i & 4) ? obj_enu : NULL);
+			}
+			break;
+		
+		default:
+			CHECK_PARAMS(how = 0);
+	}
 	
-	for (li = senti->next; li != senti; li = li->next) {
-		struct disp_hdl * hdl = (struct disp_hdl *)(li->o);
+	for (i = 0; i < nb; i++)
+		pos[i] = lists[i]->next;
+	
+	/* Call the handlers of all these keys in the order they were registered */
+	while (1) {
+		struct disp_hdl * hdl = NULL;
+		struct timespec start, end;
+		int next = -1;
 		
-		TRACE_DEBUG(ANNOYING, "when: %p %p %p %p", hdl->when.app, hdl->when.command, hdl->when.avp, hdl->when.value);
+		for (i = 0; i < nb; i++) {
+			if ((pos[i] != lists[i]) && ((next < 0) || (((struct disp_hdl *)(pos[i]->o))->seq < hdl->seq))) {
+				next = i;
+				hdl = (struct disp_hdl *)(pos[i]->o);
+			}
+		}
+		if (next < 0)
+			break;
+		pos[next] = pos[next]->next;
 		
-		/* Check this handler matches this message / avp */
-		if (hdl->when.app     && (hdl->when.app     != obj_app))
-			continue;
-		if (hdl->when.command && (hdl->when.command != obj_cmd))
-			continue;
-		if (hdl->when.avp     && (hdl->when.avp     != obj_avp))
-			continue;
-		if (hdl->when.value   && (hdl->when.value   != obj_enu))
-			continue;
+		TRACE_DEBUG(ANNOYING, "when: %p %p %p %p", hdl->when.app, hdl->when.command, hdl->when.avp, hdl->when.value);
 		
 		/* We have a match, the cb must be called. */
+		CHECK_SYS_DO( clock_gettime(CLOCK_MONOTONIC, &start), memset(&start, 0, sizeof(start)) );
 		CHECK_FCT_DO( (r = (*hdl->cb)(msg, avp, sess, hdl->opaque, action)),
 			{
 				*drop_reason = "Internal error: a DISPATCH callback returned an error";
@@ -102,6 +328,9 @@ int fd_disp_call_cb_int( struct fd_list * cb_list, struct msg ** msg, struct avp
 				*msg = NULL;
 			}
 		 );
+		CHECK_SYS_DO( clock_gettime(CLOCK_MONOTONIC, &end), end = start );
+		__atomic_add_fetch(&hdl->hits, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&hdl->time, (end.tv_sec - start.tv_sec) * 1000000000ULL + end.tv_nsec - start.tv_nsec, __ATOMIC_RELAXED);
 		
 		if (*action != DISP_ACT_CONT)
 			break;
@@ -110,10 +339,22 @@ int fd_disp_call_cb_int( struct fd_list * cb_list, struct msg ** msg, struct avp
 			break;
 	}
 	
-	/* We're done on this list */
+	/* We're done on this level */
 	return 0;
 }
 
+/* Unlink the handlers registered on a dictionary object that is being destroyed */
+void fd_disp_unlink_obj( struct fd_list * cb_list )
+{
+	CHECK_POSIX_DO( pthread_rwlock_wrlock(&fd_disp_lock), /* continue */ );
+	while (!FD_IS_LIST_EMPTY(cb_list)) {
+		struct disp_hdl * hdl = (struct disp_hdl *)(cb_list->next->o);
+		fd_list_unlink(&hdl->parent);
+		disp_index_unlink(hdl);
+	}
+	CHECK_POSIX_DO( pthread_rwlock_unlock(&fd_disp_lock), /* continue */ );
+}
+
 /**************************************************************************************/
 
 /* Create a new handler and link it */
@@ -166,6 +407,7 @@ int fd_disp_register ( int (*cb)( struct msg **, struct avp *, struct session *,
 	new->eyec = DISP_EYEC;
 	fd_list_init(&new->all, new);
 	fd_list_init(&new->parent, new);
+	fd_list_init(&new->key, new);
 	new->how = how;
 	switch (how) {
 		case DISP_HOW_ANY:
@@ -185,6 +427,15 @@ int fd_disp_register ( int (*cb)( struct msg **, struct avp *, struct session *,
 	
 	/* Now, link this new element in the appropriate lists */
 	CHECK_POSIX( pthread_rwlock_wrlock(&fd_disp_lock) );
+	if (how != DISP_HOW_ANY) {
+		CHECK_FCT_DO( disp_index_link(new),
+			{
+				CHECK_POSIX_DO( pthread_rwlock_unlock(&fd_disp_lock), /* continue */ );
+				free(new);
+				return __ret__;
+			} );
+	}
+	new->seq = ++disp_seq;
 	fd_list_insert_before(&all_handlers, &new->all);
 	fd_list_insert_before(cb_list, &new->parent);
 	CHECK_POSIX( pthread_rwlock_unlock(&fd_disp_lock) );
@@ -208,6 +459,7 @@ int fd_disp_unregister ( struct disp_hdl ** handle, void ** opaque )
 	CHECK_POSIX( pthread_rwlock_wrlock(&fd_disp_lock) );
 	fd_list_unlink(&del->all);
 	fd_list_unlink(&del->parent);
+	disp_index_unlink(del);
 	CHECK_POSIX( pthread_rwlock_unlock(&fd_disp_lock) );
 	
 	if (opaque)
@@ -226,3 +478,90 @@ void fd_disp_unregister_all ( void )
 	}
 	return;
 }
+
+/**************************************************************************************/
+
+/* Get the statistics of a handler */
+int fd_disp_getstats ( struct disp_hdl * handle, unsigned long long * hits, struct timespec * time )
+{
+	unsigned long long ns;
+	
+	TRACE_ENTRY("%p %p %p", handle, hits, time);
+	CHECK_PARAMS( VALIDATE_HDL(handle) );
+	
+	if (hits)
+		*hits = __atomic_load_n(&handle->hits, __ATOMIC_RELAXED);
+	if (time) {
+		ns = __atomic_load_n(&handle->time, __ATOMIC_RELAXED);
+		time->tv_sec = ns / 1000000000ULL;
+		time->tv_nsec = ns % 1000000000ULL;
+	}
+	return 0;
+}
+
+/* Dump the name of an object of the criteria, if set */
+static DECLARE_FD_DUMP_PROTOTYPE(disp_dump_obj, char * label, struct dict_object * obj)
+{
+	enum dict_object_type type;
+	char * name = NULL;
+	
+	FD_DUMP_HANDLE_OFFSET();
+	
+	if (!obj)
+		return *buf;
+	
+	if (fd_dict_gettype(obj, &type) == 0) {
+		union {
+			struct dict_application_data app;
+			struct dict_cmd_data cmd;
+			struct dict_avp_data avp;
+			struct dict_enumval_data enu;
+		} data;
+		if (fd_dict_getval(obj, &data) == 0) {
+			switch (type) {
+				case DICT_APPLICATION:	name = data.app.application_name; break;
+				case DICT_COMMAND:	name = data.cmd.cmd_name; break;
+				case DICT_AVP:		name = data.avp.avp_name; break;
+				case DICT_ENUMVAL:	name = data.enu.enum_name; break;
+				default:		break;
+			}
+		}
+	}
+	CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, " %s:'%s'", label, name ?: "(invalid)"), return NULL);
+	return *buf;
+}
+
+/* Dump the handlers with their criteria and statistics, one per line */
+DECLARE_FD_DUMP_PROTOTYPE(fd_disp_dump)
+{
+	static const char * hownames[] = { "?", "ANY", "APPID", "CC", "AVP", "AVP_ENUMVAL" };
+	struct fd_list * li;
+	
+	FD_DUMP_HANDLE_OFFSET();
+	
+	CHECK_POSIX_DO( pthread_rwlock_rdlock(&fd_disp_lock), return NULL );
+	if (FD_IS_LIST_EMPTY(&all_handlers)) {
+		CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "{disphdl}: (none)"), goto error);
+	}
+	for (li = all_handlers.next; li != &all_handlers; li = li->next) {
+		struct disp_hdl * hdl = (struct disp_hdl *)(li->o);
+		struct timespec time;
+		unsigned long long hits;
+		
+		CHECK_FCT_DO( fd_disp_getstats(hdl, &hits, &time), break );
+		CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "{disphdl}(@%p): cb:%p o:%p %s", hdl, hdl->cb, hdl->opaque,
+					hownames[(hdl->how <= DISP_HOW_AVP_ENUMVAL) ? hdl->how : 0]), goto error);
+		CHECK_MALLOC_DO( disp_dump_obj( FD_DUMP_STD_PARAMS, "app", hdl->when.app), goto error);
+		CHECK_MALLOC_DO( disp_dump_obj( FD_DUMP_STD_PARAMS, "cmd", hdl->when.command), goto error);
+		CHECK_MALLOC_DO( disp_dump_obj( FD_DUMP_STD_PARAMS, "avp", hdl->when.avp), goto error);
+		CHECK_MALLOC_DO( disp_dump_obj( FD_DUMP_STD_PARAMS, "val", hdl->when.value), goto error);
+		CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, " hits:%llu time:%ld.%06lds%s", hits, (long)time.tv_sec, time.tv_nsec / 1000,
+					(li->next != &all_handlers) ? "\n" : ""), goto error);
+	}
+	CHECK_POSIX_DO( pthread_rwlock_unlock(&fd_disp_lock), /* continue */ );
+	
+	return *buf;
+error:
+	CHECK_POSIX_DO( pthread_rwlock_unlock(&fd_disp_lock), /* continue */ );
+	return NULL;
+}
@@ -40,6 +40,7 @@
 
 #include <freeDiameter/freeDiameter-host.h>
 #include <freeDiameter/libfdproto.h>
+#include <stdint.h>
 
 /* Internal to the library */
 extern const char * type_base_name[];
@@ -50,16 +51,55 @@ void fd_sess_fini(void);
 /* Iterator on the rules of a parent object */
 int fd_dict_iterate_rules ( struct dict_object *parent, void * data, int (*cb)(void *, struct dict_rule_data *) );
 
+/* The rules of a command or grouped AVP, compiled once so that a list of AVPs can be checked in a single pass */
+struct dict_rules_slot {
+	struct dict_object *	avp;	/* the rule_avp of the rule */
+	int			idx;	/* the index of the rule in the rules array */
+};
+struct dict_rules_compiled {
+	int			nb;	/* number of rules */
+	struct dict_rule_data *	rules;	/* the rules, in the same order as fd_dict_iterate_rules */
+	const char **		names;	/* the names of the AVPs of the rules */
+	struct dict_rules_slot *slots;	/* the rules ordered by the address of their AVP model, see fd_dict_rules_slot */
+};
+/* Call cb once with the compiled rules of parent, while the dictionary is locked for reading */
+int fd_dict_iterate_rules_compiled ( struct dict_object *parent, void * data, int (*cb)(void *, struct dict_rules_compiled *) );
+/* Find the index of the rule about an AVP model, or -1 */
+static __inline__ int fd_dict_rules_slot ( struct dict_rules_compiled * rules, struct dict_object * avp )
+{
+	int lo = 0, hi = rules->nb - 1;
+	while (lo <= hi) {
+		int mid = (lo + hi) / 2;
+		if (rules->slots[mid].avp == avp)
+			return rules->slots[mid].idx;
+		if ((uintptr_t)rules->slots[mid].avp < (uintptr_t)avp)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+	return -1;
+}
+
 /* Dispatch / messages / dictionary API */
 int fd_dict_disp_cb(enum dict_object_type type, struct dict_object *obj, struct fd_list ** cb_list);
 DECLARE_FD_DUMP_PROTOTYPE(fd_dict_dump_avp_value, union avp_value *avp_value, struct dict_object * model, int indent, int header);
-int fd_disp_call_cb_int( struct fd_list * cb_list, struct msg ** msg, struct avp *avp, struct session *sess, enum disp_action *action, 
+int fd_disp_avp_handlers( struct dict_object * obj_avp, int * values );
+int fd_disp_call_cb_int( enum disp_how how, struct msg ** msg, struct avp *avp, struct session *sess, enum disp_action *action, 
 			struct dict_object * obj_app, struct dict_object * obj_cmd, struct dict_object * obj_avp, struct dict_object * obj_enu,
 			char ** drop_reason, struct msg ** drop_msg);
+void fd_disp_unlink_obj( struct fd_list * cb_list );
 extern pthread_rwlock_t fd_disp_lock;
 
 /* Messages / sessions API */
 int fd_sess_reclaim_msg ( struct session ** session );
 
+/* Pooled allocator for the messages objects */
+int fd_msg_pool_init(void);
+int fd_mp_init(size_t msgsize, size_t avpsize);
+void * fd_mp_alloc(enum fd_msg_pool_class cls);
+void fd_mp_free(enum fd_msg_pool_class cls, void * obj);
+void * fd_mp_buf_alloc(size_t len);
+void fd_mp_buf_free(void * ptr);
+
 
 #endif /* _LIBFDPROTO_INTERNAL_H */
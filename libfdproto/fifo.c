@@ -47,6 +47,42 @@
 
 #include "fdproto-internal.h"
 
+#include <sys/eventfd.h>
+
+/* Distribution of the durations measured on a queue (time between posting and getting an item, time blocked in post).
+ * The buckets are log-linear as in HDR histograms: HIST_SUB buckets for each power of 2 of nanoseconds,
+ * so that a percentile is known with a relative precision of 1 / HIST_SUB, whatever its magnitude.
+ * The counters are updated with relaxed atomic operations so that the ring backend does not need the lock. */
+#define HIST_SUB_BITS	3
+#define HIST_SUB	(1 << HIST_SUB_BITS)
+#define HIST_MAX_EXP	36	/* durations above 2^37 ns (about 2 minutes) are counted in the last bucket */
+#define HIST_BUCKETS	((HIST_MAX_EXP - HIST_SUB_BITS + 2) * HIST_SUB)
+
+struct fifo_hist {
+	long long	count[HIST_BUCKETS];
+	long long	max;	/* the highest duration measured, in ns */
+};
+
+/* Number of items retrieved during each of the last seconds, to compute the throughput over sliding windows.
+ * A slot is reset by the first item retrieved in a new second; concurrent getters on a ring queue may lose
+ * a few counts at that time, which is acceptable for monitoring. */
+#define RATE_SLOTS	64	/* must be more than the longest window (60s) */
+
+struct fifo_rate {
+	time_t		sec[RATE_SLOTS];
+	long long	count[RATE_SLOTS];
+};
+
+/* A priority class of a queue (fd_fifo_set_classes). The items of each class are kept in their own list. */
+struct fifo_class {
+	struct fd_list	list;	/* the items of this class */
+	int		count;
+	int		weight;	/* items popped from this class per round with the weighted scheduler, 0 with strict priority */
+	int		credit;	/* items this class can still pop in the current round */
+	long long	total_items;
+	struct fifo_hist delay;
+};
+
 /* Definition of a FIFO queue object */
 struct fifo {
 	int		eyec;	/* An eye catcher, also used to check a queue is valid. FIFO_EYEC */
@@ -75,13 +111,68 @@ struct fifo {
 	struct timespec blocking_time; /* Cumulated time threads trying to post new items were blocked (queue full). */
 	struct timespec last_time;     /* For the last element retrieved from the queue, how long it take between posting (including blocking) and popping */
 
+	struct fifo_hist delay;	   /* Distribution of the time between posting and popping of the items */
+	struct fifo_hist blocking; /* Distribution of the time spent in post calls waiting for room in the queue */
+	struct fifo_rate rate;	   /* Number of items popped during the last seconds */
+
+	struct fifo_ring *ring;	/* If not NULL, the items are stored in this lock-free ring instead of the list (fd_fifo_new_ring) */
+
+	struct fifo_item *spare;  /* items of the list that are reused instead of being freed, chained through item.next */
+	int		nspare;
+
+	int		efd;	  /* eventfd readable while the queue is not empty (fd_fifo_get_fd), -1 if not requested */
+	int		efd_ready; /* the eventfd is currently signaled */
+
+	struct fifo_class *classes; /* If not NULL, the items are stored in these lists instead of list, by priority (fd_fifo_set_classes) */
+	int		nb_classes;
+	int		nb_nolimit; /* posting in the nb_nolimit first classes does not wait for the max */
+	int		(*classify)(void * item);
 };
 
+/* Number of spare items a queue keeps, so that posting does not need to allocate memory in steady state */
+#define FIFO_SPARE_MAX	256
+
 struct fifo_item {
 	struct fd_list   item;
 	struct timespec  posted_on;
 };
 
+/* The lock-free backend is a bounded multi-producers / multi-consumers ring as described by D. Vyukov.
+ * Each cell carries a sequence number that tells if it is ready for the next producer or for the next consumer,
+ * so that posting and getting an item only contend on a CAS of the enqueue or dequeue position.
+ * The mutex and condition variables of the queue are used only to park the threads when the ring is empty
+ * (or full), the count of parked threads (thrs, thrs_push) tells the other side whether it must wake them up.
+ * When the ring is full but the max of the queue allows more items (no max, or fd_fifo_post_noblock), the items
+ * overflow in the list of the queue, under the lock. While this list is not empty, the new items also go there,
+ * and the getters take them from there once the ring is empty, so that the order is kept. */
+struct ring_cell {
+	unsigned long	 seq;
+	void		*item;
+	struct timespec	 posted_on;
+};
+
+#define RING_PAD	64	/* keep the positions in separate cache lines */
+
+struct fifo_ring {
+	struct ring_cell *cells;
+	unsigned long	 mask;	/* number of cells - 1, the number of cells is a power of 2 */
+	char		 _pad0[RING_PAD];
+	unsigned long	 enq;	/* position of the next item to post */
+	char		 _pad1[RING_PAD];
+	unsigned long	 deq;	/* position of the next item to get */
+	char		 _pad2[RING_PAD];
+	int		 spill;	/* number of items in the overflow list (queue->list) */
+	/* The statistics, updated atomically instead of under the queue lock */
+	long long	 total_items;
+	long long	 total_ns;
+	long long	 blocking_ns;
+	long long	 last_ns;
+};
+
+/* Number of cells of a ring: twice the max so that fd_fifo_post_noblock rarely overflows, at least RING_MIN. */
+#define RING_MIN	64
+#define RING_DEFAULT	1024	/* when the queue has no max, the overflow list takes the items beyond */
+
 /* The eye catcher value */
 #define FIFO_EYEC	0xe7ec1130
 
@@ -89,6 +180,29 @@ struct fifo_item {
 #define CHECK_FIFO( _queue ) (( (_queue) != NULL) && ( (_queue)->eyec == FIFO_EYEC) )
 
 
+/* Get a list item, a spare one if possible. The queue is locked. */
+static struct fifo_item * fifo_item_get(struct fifo * queue)
+{
+	struct fifo_item * fi = queue->spare;
+	if (!fi)
+		return malloc(sizeof(struct fifo_item));
+	queue->spare = (struct fifo_item *)fi->item.next;
+	queue->nspare--;
+	return fi;
+}
+
+/* Release a list item that has been unlinked. The queue is locked. */
+static void fifo_item_put(struct fifo * queue, struct fifo_item * fi)
+{
+	if (queue->nspare >= FIFO_SPARE_MAX) {
+		free(fi);
+		return;
+	}
+	fi->item.next = (struct fd_list *)queue->spare;
+	queue->spare = fi;
+	queue->nspare++;
+}
+
 /* Create a new queue, with max number of items -- use 0 for no max */
 int fd_fifo_new ( struct fifo ** queue, int max )
 {
@@ -109,6 +223,7 @@ int fd_fifo_new ( struct fifo ** queue, int max )
 	CHECK_POSIX( pthread_cond_init(&new->cond_pull, NULL) );
 	CHECK_POSIX( pthread_cond_init(&new->cond_push, NULL) );
 	new->max = max;
+	new->efd = -1;
 
 	fd_list_init(&new->list, NULL);
 
@@ -117,6 +232,376 @@ int fd_fifo_new ( struct fifo ** queue, int max )
 	return 0;
 }
 
+/* Create a new queue that uses the lock-free ring backend */
+int fd_fifo_new_ring ( struct fifo ** queue, int max )
+{
+	struct fifo_ring * r;
+	unsigned long size, i;
+	int ret;
+
+	TRACE_ENTRY( "%p %d", queue, max );
+
+	CHECK_PARAMS( queue && (max >= 0) );
+
+	if (max) {
+		for (size = RING_MIN; size < 2 * (unsigned long)max; size <<= 1)
+			/* next power of 2 */;
+	} else {
+		size = RING_DEFAULT;
+	}
+
+	CHECK_MALLOC( r = calloc(1, sizeof(struct fifo_ring)) );
+	CHECK_MALLOC_DO( r->cells = malloc(size * sizeof(struct ring_cell)), { free(r); return ENOMEM; } );
+	for (i = 0; i < size; i++)
+		r->cells[i].seq = i;
+	r->mask = size - 1;
+
+	CHECK_FCT_DO( ret = fd_fifo_new( queue, max ), { free(r->cells); free(r); return ret; } );
+	(*queue)->ring = r;
+
+	return 0;
+}
+
+/* Store an item in the ring, returns 0 if the ring is full */
+static int ring_push(struct fifo_ring * r, void * item, struct timespec * posted_on)
+{
+	struct ring_cell * c;
+	unsigned long pos = __atomic_load_n(&r->enq, __ATOMIC_RELAXED);
+
+	for (;;) {
+		long dif;
+		c = &r->cells[pos & r->mask];
+		dif = (long)__atomic_load_n(&c->seq, __ATOMIC_ACQUIRE) - (long)pos;
+		if (dif == 0) {
+			if (__atomic_compare_exchange_n(&r->enq, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (dif < 0) {
+			return 0;
+		} else {
+			pos = __atomic_load_n(&r->enq, __ATOMIC_RELAXED);
+		}
+	}
+
+	c->item = item;
+	memcpy(&c->posted_on, posted_on, sizeof(struct timespec));
+	__atomic_store_n(&c->seq, pos + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+/* Retrieve an item from the ring, returns NULL if the ring is empty */
+static void * ring_pop(struct fifo_ring * r, struct timespec * posted_on)
+{
+	struct ring_cell * c;
+	void * item;
+	unsigned long pos = __atomic_load_n(&r->deq, __ATOMIC_RELAXED);
+
+	for (;;) {
+		long dif;
+		c = &r->cells[pos & r->mask];
+		dif = (long)__atomic_load_n(&c->seq, __ATOMIC_ACQUIRE) - (long)(pos + 1);
+		if (dif == 0) {
+			if (__atomic_compare_exchange_n(&r->deq, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (dif < 0) {
+			return NULL;
+		} else {
+			pos = __atomic_load_n(&r->deq, __ATOMIC_RELAXED);
+		}
+	}
+
+	item = c->item;
+	memcpy(posted_on, &c->posted_on, sizeof(struct timespec));
+	__atomic_store_n(&c->seq, pos + r->mask + 1, __ATOMIC_RELEASE);
+	return item;
+}
+
+/* Is there an item ready to be retrieved? */
+static int ring_ready(struct fifo_ring * r)
+{
+	unsigned long pos = __atomic_load_n(&r->deq, __ATOMIC_RELAXED);
+	if (__atomic_load_n(&r->cells[pos & r->mask].seq, __ATOMIC_ACQUIRE) == pos + 1)
+		return 1;
+	return __atomic_load_n(&r->spill, __ATOMIC_SEQ_CST) > 0;
+}
+
+/* Wake up one of the threads parked on cond, if there is any */
+static void ring_wake(struct fifo * queue, int * waiters, pthread_cond_t * cond)
+{
+	/* pairs with the fence of the parking thread, between its increment of the waiters and its last check of the ring */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(waiters, __ATOMIC_RELAXED) > 0) {
+		CHECK_POSIX_DO(  pthread_mutex_lock( &queue->mtx ), return  );
+		CHECK_POSIX_DO(  pthread_cond_signal( cond ), /* continue */  );
+		CHECK_POSIX_DO(  pthread_mutex_unlock( &queue->mtx ), /* continue */  );
+	}
+}
+
+static __inline__ long long ts_diff_ns(struct timespec * from, struct timespec * to)
+{
+	return (to->tv_sec - from->tv_sec) * 1000000000LL + (to->tv_nsec - from->tv_nsec);
+}
+
+static __inline__ void ns_to_ts(long long ns, struct timespec * ts)
+{
+	ts->tv_sec  = ns / 1000000000;
+	ts->tv_nsec = ns % 1000000000;
+}
+
+/* Index of the histogram bucket of a duration */
+static __inline__ int hist_bucket(long long ns)
+{
+	int e;
+
+	if (ns < HIST_SUB)
+		return (ns > 0) ? (int)ns : 0;
+	e = 63 - __builtin_clzll((unsigned long long)ns);
+	if (e > HIST_MAX_EXP)
+		return HIST_BUCKETS - 1;
+	return (e - HIST_SUB_BITS + 1) * HIST_SUB + (int)((ns >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/* Highest duration counted in a bucket */
+static long long hist_bucket_high(int b)
+{
+	int e;
+
+	if (b < HIST_SUB)
+		return b;
+	e = b / HIST_SUB + HIST_SUB_BITS - 1;
+	return ((long long)(HIST_SUB + (b % HIST_SUB) + 1) << (e - HIST_SUB_BITS)) - 1;
+}
+
+/* Record a duration */
+static void hist_add(struct fifo_hist * h, long long ns)
+{
+	long long max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+
+	__atomic_add_fetch(&h->count[hist_bucket(ns)], 1, __ATOMIC_RELAXED);
+	while ((max < ns) && !__atomic_compare_exchange_n(&h->max, &max, ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		/* retry */;
+}
+
+/* Smallest duration such that a fraction q of the measures are below it, in ns */
+static long long hist_quantile(struct fifo_hist * h, long long total, double q)
+{
+	long long target, cum = 0, max;
+	int b;
+
+	target = (long long)(q * total + 0.999999);
+	if (target < 1)
+		target = 1;
+	max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+	for (b = 0; b < HIST_BUCKETS; b++) {
+		cum += __atomic_load_n(&h->count[b], __ATOMIC_RELAXED);
+		if (cum >= target) {
+			long long high = hist_bucket_high(b);
+			return (high < max) ? high : max;
+		}
+	}
+	return max;
+}
+
+/* Fill a struct fd_fifo_latency from a histogram */
+static void hist_get(struct fifo_hist * h, struct fd_fifo_latency * lat)
+{
+	long long total = 0;
+	int b;
+
+	for (b = 0; b < HIST_BUCKETS; b++)
+		total += __atomic_load_n(&h->count[b], __ATOMIC_RELAXED);
+
+	memset(lat, 0, sizeof(struct fd_fifo_latency));
+	lat->count = total;
+	if (!total)
+		return;
+	ns_to_ts(hist_quantile(h, total, 0.5),   &lat->p50);
+	ns_to_ts(hist_quantile(h, total, 0.9),   &lat->p90);
+	ns_to_ts(hist_quantile(h, total, 0.99),  &lat->p99);
+	ns_to_ts(hist_quantile(h, total, 0.999), &lat->p999);
+	ns_to_ts(__atomic_load_n(&h->max, __ATOMIC_RELAXED), &lat->max);
+}
+
+/* Restart a histogram from empty. A duration recorded at the same time may be lost, which is acceptable for monitoring. */
+static void hist_reset(struct fifo_hist * h)
+{
+	int b;
+
+	for (b = 0; b < HIST_BUCKETS; b++)
+		__atomic_store_n(&h->count[b], 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&h->max, 0, __ATOMIC_RELAXED);
+}
+
+/* Count an item retrieved at time now */
+static void rate_add(struct fifo_rate * r, time_t now)
+{
+	int slot = (int)(now % RATE_SLOTS);
+	time_t sec = __atomic_load_n(&r->sec[slot], __ATOMIC_RELAXED);
+
+	if ((sec != now) && __atomic_compare_exchange_n(&r->sec[slot], &sec, now, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		__atomic_store_n(&r->count[slot], 0, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&r->count[slot], 1, __ATOMIC_RELAXED);
+}
+
+/* Average number of items retrieved per second during the last complete seconds of the window */
+static double rate_get(struct fifo_rate * r, time_t now, int window)
+{
+	long long total = 0;
+	time_t s;
+
+	for (s = now - window; s < now; s++) {
+		int slot = (int)(s % RATE_SLOTS);
+		if (__atomic_load_n(&r->sec[slot], __ATOMIC_RELAXED) == s)
+			total += __atomic_load_n(&r->count[slot], __ATOMIC_RELAXED);
+	}
+	return (double)total / window;
+}
+
+/* Signal or reset the eventfd of the queue according to its count. The queue is locked. */
+static void fifo_fd_sync(struct fifo * queue)
+{
+	uint64_t val = 1;
+	int ready = (__atomic_load_n(&queue->count, __ATOMIC_SEQ_CST) > 0);
+
+	if ((queue->efd < 0) || (ready == queue->efd_ready))
+		return;
+
+	if (ready) {
+		CHECK_SYS_DO( write(queue->efd, &val, sizeof(val)), return );
+	} else {
+		CHECK_SYS_DO( read(queue->efd, &val, sizeof(val)), return );
+	}
+	queue->efd_ready = ready;
+}
+
+/* Same for the ring backend, called after the count went through 0. The last caller sees the final count. */
+static void ring_fd_sync(struct fifo * queue)
+{
+	if (__atomic_load_n(&queue->efd, __ATOMIC_RELAXED) < 0)
+		return;
+
+	CHECK_POSIX_DO(  pthread_mutex_lock( &queue->mtx ), return  );
+	fifo_fd_sync(queue);
+	CHECK_POSIX_DO(  pthread_mutex_unlock( &queue->mtx ), /* continue */  );
+}
+
+/* Get the file descriptor that tells if the queue has items */
+int fd_fifo_get_fd ( struct fifo * queue, int * fd )
+{
+	int ret = 0;
+
+	TRACE_ENTRY( "%p %p", queue, fd );
+
+	CHECK_PARAMS( CHECK_FIFO( queue ) && fd );
+
+	CHECK_POSIX(  pthread_mutex_lock( &queue->mtx )  );
+	if (queue->efd < 0) {
+		int efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (efd < 0) {
+			ret = errno;
+			TRACE_ERROR("ERROR: in 'eventfd' :\t%s", strerror(ret));
+		} else {
+			__atomic_store_n(&queue->efd, efd, __ATOMIC_SEQ_CST);
+			fifo_fd_sync(queue);
+		}
+	}
+	*fd = queue->efd;
+	CHECK_POSIX(  pthread_mutex_unlock( &queue->mtx )  );
+
+	return ret;
+}
+
+/* Use priority classes in a queue */
+int fd_fifo_set_classes ( struct fifo * queue, int nb, int (*classify)(void * item), int * weights, int nb_nolimit )
+{
+	struct fifo_class * classes = NULL;
+	int i;
+
+	TRACE_ENTRY( "%p %d %p %p %d", queue, nb, classify, weights, nb_nolimit );
+
+	CHECK_PARAMS( CHECK_FIFO( queue ) && (nb > 0) && classify && (nb_nolimit >= 0) && (nb_nolimit <= nb) );
+	if (weights) {
+		for (i = 0; i < nb; i++) {
+			CHECK_PARAMS( weights[i] > 0 );
+		}
+	}
+	/* The ring cannot reorder the items */
+	CHECK_PARAMS_DO( queue->ring == NULL, return ENOTSUP );
+
+	CHECK_POSIX(  pthread_mutex_lock( &queue->mtx )  );
+
+	if (queue->classes) {
+		/* Only the scheduling can be updated */
+		CHECK_PARAMS_DO( nb == queue->nb_classes, { pthread_mutex_unlock( &queue->mtx ); return EINVAL; } );
+		classes = queue->classes;
+	} else {
+		CHECK_MALLOC_DO( classes = calloc(nb, sizeof(struct fifo_class)), { pthread_mutex_unlock( &queue->mtx ); return ENOMEM; } );
+		for (i = 0; i < nb; i++)
+			fd_list_init(&classes[i].list, NULL);
+
+		/* The items already queued go to the last class */
+		fd_list_move_end(&classes[nb - 1].list, &queue->list);
+		classes[nb - 1].count = queue->count;
+	}
+
+	for (i = 0; i < nb; i++) {
+		classes[i].weight = weights ? weights[i] : 0;
+		classes[i].credit = classes[i].weight;
+	}
+	queue->nb_nolimit = nb_nolimit;
+	queue->nb_classes = nb;
+	queue->classes = classes;
+	__atomic_store_n(&queue->classify, classify, __ATOMIC_RELEASE);
+
+	CHECK_POSIX(  pthread_mutex_unlock( &queue->mtx )  );
+
+	return 0;
+}
+
+/* Class of a new item, before the queue is locked */
+static __inline__ int fifo_classify(struct fifo * queue, void * item)
+{
+	int (*classify)(void *) = __atomic_load_n(&queue->classify, __ATOMIC_ACQUIRE);
+	return classify ? (*classify)(item) : 0;
+}
+
+/* The list where an item of class cls is stored. The queue is locked. */
+static struct fd_list * fifo_class_list(struct fifo * queue, int cls, struct fifo_class ** c)
+{
+	*c = NULL;
+	if (!queue->classes)
+		return &queue->list;
+	if ((cls < 0) || (cls >= queue->nb_classes))
+		cls = queue->nb_classes - 1;
+	*c = &queue->classes[cls];
+	return &(*c)->list;
+}
+
+/* The class from which the next item is popped: the first non-empty one with strict priority, or the first
+ * non-empty one that has credit left in the current round with the weighted scheduler. The queue is locked and not empty. */
+static struct fifo_class * fifo_class_next(struct fifo * queue)
+{
+	int i, round;
+
+	for (round = 0; round < 2; round++) {
+		for (i = 0; i < queue->nb_classes; i++) {
+			struct fifo_class * c = &queue->classes[i];
+			if (!c->count)
+				continue;
+			if (!c->weight)
+				return c;
+			if (c->credit > 0) {
+				c->credit--;
+				return c;
+			}
+		}
+		/* All the classes with items have used their credit, start a new round */
+		for (i = 0; i < queue->nb_classes; i++)
+			queue->classes[i].credit = queue->classes[i].weight;
+	}
+	ASSERT(0);
+	return &queue->classes[queue->nb_classes - 1];
+}
+
 int fd_fifo_set_max (struct fifo * queue, int max)
 {
     queue->max = max;
@@ -140,6 +625,44 @@ DECLARE_FD_DUMP_PROTOTYPE(fd_fifo_dump, char * name, struct fifo * queue, fd_fif
 	}
 
 	CHECK_POSIX_DO(  pthread_mutex_lock( &queue->mtx ), /* continue */  );
+	if (queue->ring) {
+		struct fifo_ring * r = queue->ring;
+		struct timespec total, blocking, last;
+		ns_to_ts(__atomic_load_n(&r->total_ns, __ATOMIC_RELAXED), &total);
+		ns_to_ts(__atomic_load_n(&r->blocking_ns, __ATOMIC_RELAXED), &blocking);
+		ns_to_ts(__atomic_load_n(&r->last_ns, __ATOMIC_RELAXED), &last);
+		CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "ring:%lu items:%d,%d,%d threads:%d,%d stats:%lld/%ld.%06ld,%ld.%06ld,%ld.%06ld thresholds:%d,%d,%d,%p,%p,%p",
+							r->mask + 1, fd_fifo_length(queue), queue->highest_ever, queue->max,
+							queue->thrs, queue->thrs_push,
+							__atomic_load_n(&r->total_items, __ATOMIC_RELAXED),(long)total.tv_sec,(long)(total.tv_nsec/1000),(long)blocking.tv_sec,(long)(blocking.tv_nsec/1000),(long)last.tv_sec,(long)(last.tv_nsec/1000),
+							queue->high, queue->low, queue->highest, queue->h_cb, queue->l_cb, queue->data),
+				 goto error);
+		if (dump_item) {
+			/* Best effort: the items may be retrieved by other threads meanwhile */
+			unsigned long pos, end = __atomic_load_n(&r->enq, __ATOMIC_ACQUIRE);
+			struct fd_list * li;
+			int i = 0;
+			for (pos = __atomic_load_n(&r->deq, __ATOMIC_ACQUIRE); pos != end; pos++) {
+				struct ring_cell * c = &r->cells[pos & r->mask];
+				if (__atomic_load_n(&c->seq, __ATOMIC_ACQUIRE) != pos + 1)
+					continue;
+				CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "\n [#%i](@%p)@%ld.%06ld: ",
+							i++, c->item, (long)c->posted_on.tv_sec,(long)(c->posted_on.tv_nsec/1000)),
+						 goto error);
+				CHECK_MALLOC_DO( (*dump_item)(FD_DUMP_STD_PARAMS, c->item), goto error);
+			}
+			/* Then the overflow, protected by the lock */
+			for (li = queue->list.next; li != &queue->list; li = li->next) {
+				struct fifo_item * fi = (struct fifo_item *)li;
+				CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "\n [#%i](@%p)@%ld.%06ld: ",
+							i++, fi->item.o, (long)fi->posted_on.tv_sec,(long)(fi->posted_on.tv_nsec/1000)),
+						 goto error);
+				CHECK_MALLOC_DO( (*dump_item)(FD_DUMP_STD_PARAMS, fi->item.o), goto error);
+			}
+		}
+		CHECK_POSIX_DO(  pthread_mutex_unlock( &queue->mtx ), /* continue */  );
+		return *buf;
+	}
 	CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "items:%d,%d,%d threads:%d,%d stats:%lld/%ld.%06ld,%ld.%06ld,%ld.%06ld thresholds:%d,%d,%d,%p,%p,%p",
 						queue->count, queue->highest_ever, queue->max,
 						queue->thrs, queue->thrs_push,
@@ -148,15 +671,18 @@ DECLARE_FD_DUMP_PROTOTYPE(fd_fifo_dump, char * name, struct fifo * queue, fd_fif
 			 goto error);
 
 	if (dump_item) {
-		struct fd_list * li;
-		int i = 0;
-		for (li = queue->list.next; li != &queue->list; li = li->next) {
-			struct fifo_item * fi = (struct fifo_item *)li;
-			CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "\n [#%i](@%p)@%ld.%06ld: ",
-						i++, fi->item.o, (long)fi->posted_on.tv_sec,(long)(fi->posted_on.tv_nsec/1000)),
-					 goto error);
-			CHECK_MALLOC_DO( (*dump_item)(FD_DUMP_STD_PARAMS, fi->item.o), goto error);
-		}
+		struct fd_list * li, * sentinel;
+		int i = 0, c = 0;
+		do {
+			sentinel = queue->classes ? &queue->classes[c].list : &queue->list;
+			for (li = sentinel->next; li != sentinel; li = li->next) {
+				struct fifo_item * fi = (struct fifo_item *)li;
+				CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "\n [#%i](@%p)@%ld.%06ld: ",
+							i++, fi->item.o, (long)fi->posted_on.tv_sec,(long)(fi->posted_on.tv_nsec/1000)),
+						 goto error);
+				CHECK_MALLOC_DO( (*dump_item)(FD_DUMP_STD_PARAMS, fi->item.o), goto error);
+			}
+		} while (++c < queue->nb_classes);
 	}
 	CHECK_POSIX_DO(  pthread_mutex_unlock( &queue->mtx ), /* continue */  );
 
@@ -208,6 +734,7 @@ int fd_fifo_del ( struct fifo  ** queue )
 
 	/* sanity check */
 	ASSERT(FD_IS_LIST_EMPTY(&q->list));
+	ASSERT((q->ring == NULL) || !ring_ready(q->ring));
 
 	/* And destroy it */
 	CHECK_POSIX(  pthread_mutex_unlock( &q->mtx )  );
@@ -218,12 +745,86 @@ int fd_fifo_del ( struct fifo  ** queue )
 
 	CHECK_POSIX_DO(  pthread_mutex_destroy( &q->mtx ),  );
 
+	if (q->ring) {
+		free(q->ring->cells);
+		free(q->ring);
+	}
+	while (q->spare) {
+		struct fifo_item * fi = q->spare;
+		q->spare = (struct fifo_item *)fi->item.next;
+		free(fi);
+	}
+	if (q->efd >= 0)
+		close(q->efd);
+	free(q->classes);
 	free(q);
 	*queue = NULL;
 
 	return 0;
 }
 
+static void * mq_pop(struct fifo * queue, struct timespec * now);
+static void * ring_unspill(struct fifo * queue, struct timespec * posted_on);
+static struct timespec * fifo_now(struct timespec * now);
+int fd_fifo_post_internal ( struct fifo * queue, void ** item, int skip_max );
+
+/* fd_fifo_move when one of the queues uses the ring backend or priority classes: the items are re-posted one by one in the new queue.
+ * The statistics of the old queue are not merged in this case. */
+static int fifo_move_items ( struct fifo * old, struct fifo * new, struct fifo ** loc_update )
+{
+	int ret = 0;
+#ifndef NDEBUG
+	int loops = 0;
+#endif
+
+	/* Update loc_update, so that no new item is posted in the old queue */
+	if (loc_update)
+		*loc_update = new;
+
+	CHECK_POSIX(  pthread_mutex_lock( &old->mtx )  );
+
+	CHECK_PARAMS_DO( (! old->thrs_push), {
+			pthread_mutex_unlock( &old->mtx );
+			return EINVAL;
+		} );
+
+	/* Any waiting thread on the old queue returns an error */
+	old->eyec = 0xdead;
+	while (old->thrs) {
+		CHECK_POSIX(  pthread_mutex_unlock( &old->mtx ));
+		CHECK_POSIX(  pthread_cond_signal( &old->cond_pull )  );
+		usleep(1000);
+
+		CHECK_POSIX(  pthread_mutex_lock( &old->mtx )  );
+		ASSERT( ++loops < 200 ); /* detect infinite loops */
+	}
+
+	for (;;) {
+		void * item;
+		if (old->ring) {
+			struct timespec posted_on;
+			item = ring_pop(old->ring, &posted_on);
+			if (!item && old->ring->spill)
+				item = ring_unspill(old, &posted_on);
+			if (!item)
+				break;
+			__atomic_sub_fetch(&old->count, 1, __ATOMIC_SEQ_CST);
+		} else {
+			struct timespec now;
+			if (!old->count)
+				break;
+			item = mq_pop(old, fifo_now(&now));
+		}
+		CHECK_FCT_DO( ret = fd_fifo_post_internal(new, &item, 1), break );
+	}
+	fifo_fd_sync(old);
+
+	old->eyec = FIFO_EYEC;
+	CHECK_POSIX(  pthread_mutex_unlock( &old->mtx )  );
+
+	return ret;
+}
+
 /* Move the content of old into new, and update loc_update atomically. We leave the old queue empty but valid */
 int fd_fifo_move ( struct fifo * old, struct fifo * new, struct fifo ** loc_update )
 {
@@ -238,6 +839,8 @@ int fd_fifo_move ( struct fifo * old, struct fifo * new, struct fifo ** loc_upda
 	if (new->high) {
 		TODO("Implement support for thresholds in fd_fifo_move...");
 	}
+	if (old->ring || new->ring || old->classes || new->classes)
+		return fifo_move_items(old, new, loc_update);
 
 	/* Update loc_update */
 	if (loc_update)
@@ -274,6 +877,8 @@ int fd_fifo_move ( struct fifo * old, struct fifo * new, struct fifo ** loc_upda
 	/* Reset old */
 	old->count = 0;
 	old->eyec = FIFO_EYEC;
+	fifo_fd_sync(old);
+	fifo_fd_sync(new);
 
 	/* Merge the stats in the new queue */
 	new->total_items += old->total_items;
@@ -312,6 +917,25 @@ int fd_fifo_getstats( struct fifo * queue, int * current_count, int * limit_coun
 	/* Check the parameters */
 	CHECK_PARAMS( CHECK_FIFO( queue ) );
 
+	if (queue->ring) {
+		struct fifo_ring * r = queue->ring;
+		if (current_count)
+			*current_count = fd_fifo_length(queue);
+		if (limit_count)
+			*limit_count = queue->max;
+		if (highest_count)
+			*highest_count = __atomic_load_n(&queue->highest_ever, __ATOMIC_RELAXED);
+		if (total_count)
+			*total_count = __atomic_load_n(&r->total_items, __ATOMIC_RELAXED);
+		if (total)
+			ns_to_ts(__atomic_load_n(&r->total_ns, __ATOMIC_RELAXED), total);
+		if (blocking)
+			ns_to_ts(__atomic_load_n(&r->blocking_ns, __ATOMIC_RELAXED), blocking);
+		if (last)
+			ns_to_ts(__atomic_load_n(&r->last_ns, __ATOMIC_RELAXED), last);
+		return 0;
+	}
+
 	/* lock the queue */
 	CHECK_POSIX(  pthread_mutex_lock( &queue->mtx )  );
 
@@ -344,13 +968,127 @@ int fd_fifo_getstats( struct fifo * queue, int * current_count, int * limit_coun
 }
 
 
+/* Get the distribution of the queueing delay and blocking time */
+int fd_fifo_getlatency( struct fifo * queue, struct fd_fifo_latency * delay, struct fd_fifo_latency * blocking)
+{
+	TRACE_ENTRY( "%p %p %p", queue, delay, blocking);
+
+	if (queue == NULL) {
+		/* Not an error, as in fd_fifo_getstats */
+		if (delay)
+			memset(delay, 0, sizeof(struct fd_fifo_latency));
+		if (blocking)
+			memset(blocking, 0, sizeof(struct fd_fifo_latency));
+		return 0;
+	}
+
+	CHECK_PARAMS( CHECK_FIFO( queue ) );
+
+	if (delay)
+		hist_get(&queue->delay, delay);
+	if (blocking)
+		hist_get(&queue->blocking, blocking);
+
+	return 0;
+}
+
+/* Restart the distributions of the queueing delay and blocking time */
+int fd_fifo_resetlatency( struct fifo * queue )
+{
+	int i;
+
+	TRACE_ENTRY( "%p", queue);
+
+	if (queue == NULL)
+		return 0;
+
+	CHECK_PARAMS( CHECK_FIFO( queue ) );
+
+	hist_reset(&queue->delay);
+	hist_reset(&queue->blocking);
+	CHECK_POSIX(  pthread_mutex_lock( &queue->mtx )  );
+	for (i = 0; i < queue->nb_classes; i++)
+		hist_reset(&queue->classes[i].delay);
+	CHECK_POSIX(  pthread_mutex_unlock( &queue->mtx )  );
+
+	return 0;
+}
+
+/* Get the throughput of the queue over the last 1, 10 and 60 seconds */
+int fd_fifo_getrates( struct fifo * queue, double * rate_1s, double * rate_10s, double * rate_60s)
+{
+	struct timespec now;
+
+	TRACE_ENTRY( "%p %p %p %p", queue, rate_1s, rate_10s, rate_60s);
+
+	if (queue == NULL) {
+		if (rate_1s)
+			*rate_1s = 0;
+		if (rate_10s)
+			*rate_10s = 0;
+		if (rate_60s)
+			*rate_60s = 0;
+		return 0;
+	}
+
+	CHECK_PARAMS( CHECK_FIFO( queue ) );
+	CHECK_SYS(  clock_gettime(CLOCK_REALTIME, &now)  );
+
+	if (rate_1s)
+		*rate_1s = rate_get(&queue->rate, now.tv_sec, 1);
+	if (rate_10s)
+		*rate_10s = rate_get(&queue->rate, now.tv_sec, 10);
+	if (rate_60s)
+		*rate_60s = rate_get(&queue->rate, now.tv_sec, 60);
+
+	return 0;
+}
+
+/* Get the statistics of a priority class */
+int fd_fifo_getclassstats( struct fifo * queue, int cls, int * current_count, long long * total_count, struct fd_fifo_latency * delay)
+{
+	TRACE_ENTRY( "%p %d %p %p %p", queue, cls, current_count, total_count, delay);
+
+	if (queue == NULL) {
+		/* Not an error, as in fd_fifo_getstats */
+		return 0;
+	}
+
+	CHECK_PARAMS( CHECK_FIFO( queue ) && (cls >= 0) );
+
+	if (!queue->classes) {
+		/* The whole queue is class 0 */
+		CHECK_PARAMS( cls == 0 );
+		CHECK_FCT( fd_fifo_getstats(queue, current_count, NULL, NULL, total_count, NULL, NULL, NULL) );
+		if (delay)
+			hist_get(&queue->delay, delay);
+		return 0;
+	}
+
+	CHECK_PARAMS( cls < queue->nb_classes );
+
+	CHECK_POSIX(  pthread_mutex_lock( &queue->mtx )  );
+	if (current_count)
+		*current_count = queue->classes[cls].count;
+	if (total_count)
+		*total_count = queue->classes[cls].total_items;
+	if (delay)
+		hist_get(&queue->classes[cls].delay, delay);
+	CHECK_POSIX(  pthread_mutex_unlock( &queue->mtx )  );
+
+	return 0;
+}
+
 /* alternate version with no error checking */
 int fd_fifo_length ( struct fifo * queue )
 {
+	int count;
+
 	if ( !CHECK_FIFO( queue ) )
 		return 0;
 
-	return queue->count; /* Let's hope it's read atomically, since we are not locking... */
+	count = __atomic_load_n(&queue->count, __ATOMIC_RELAXED);
+	return (count > 0) ? count : 0; /* with the ring, a consumer may decrement the count before the producer increments it */
 }
 
 /* Set the thresholds of the queue */
@@ -386,7 +1124,7 @@ static void fifo_cleanup_push(void * queue)
 	TRACE_ENTRY( "%p", queue );
 
 	/* The thread has been cancelled, therefore it does not wait on the queue anymore */
-	q->thrs_push--;
+	__atomic_sub_fetch(&q->thrs_push, 1, __ATOMIC_SEQ_CST); /* atomic because read without the lock for ring queues */
 
 	/* Now unlock the queue, and we're done */
 	CHECK_POSIX_DO(  pthread_mutex_unlock( &q->mtx ),  /* nothing */  );
@@ -396,39 +1134,173 @@ static void fifo_cleanup_push(void * queue)
 }
 
 
+/* Wait until the queue is below its max number of items. The queue is locked. */
+static void fifo_wait_room(struct fifo * queue)
+{
+	while (queue->max && (queue->count >= queue->max)) {
+		int ret = 0;
+
+		/* We have to wait for an item to be pulled */
+		queue->thrs_push++ ;
+		pthread_cleanup_push( fifo_cleanup_push, queue);
+		ret = pthread_cond_wait( &queue->cond_push, &queue->mtx );
+		pthread_cleanup_pop(0);
+		queue->thrs_push-- ;
+
+#ifdef NDEBUG
+		(void)ret;
+#endif
+		ASSERT( ret == 0 );
+	}
+}
+
+/* Try storing an item in a ring queue, respecting the max unless skip_max. Nothing goes in the ring while the overflow list is in use. */
+static int ring_try_post(struct fifo * queue, void * item, int skip_max, struct timespec * posted_on)
+{
+	if ((!skip_max) && queue->max && (__atomic_load_n(&queue->count, __ATOMIC_SEQ_CST) >= queue->max))
+		return 0;
+	if (__atomic_load_n(&queue->ring->spill, __ATOMIC_SEQ_CST))
+		return 0;
+	return ring_push(queue->ring, item, posted_on);
+}
+
+/* Store an item in the overflow list of a ring queue. The queue is locked. */
+static int ring_spill(struct fifo * queue, void * item, struct timespec * posted_on)
+{
+	struct fifo_item * fi;
+
+	CHECK_MALLOC( fi = fifo_item_get(queue) );
+	fd_list_init(&fi->item, item);
+	memcpy(&fi->posted_on, posted_on, sizeof(struct timespec));
+	fd_list_insert_before( &queue->list, &fi->item);
+	__atomic_add_fetch(&queue->ring->spill, 1, __ATOMIC_SEQ_CST);
+	return 0;
+}
+
+/* Retrieve the first item of the overflow list of a ring queue, NULL if it is empty. The queue is locked. */
+static void * ring_unspill(struct fifo * queue, struct timespec * posted_on)
+{
+	struct fifo_item * fi;
+	void * item;
+
+	if (FD_IS_LIST_EMPTY(&queue->list))
+		return NULL;
+	fi = (struct fifo_item *)(queue->list.next);
+	fd_list_unlink(&fi->item);
+	item = fi->item.o;
+	memcpy(posted_on, &fi->posted_on, sizeof(struct timespec));
+	fifo_item_put(queue, fi);
+	__atomic_sub_fetch(&queue->ring->spill, 1, __ATOMIC_SEQ_CST);
+	return item;
+}
+
+/* Post a new item in a ring queue. The queue lock is used only to wait while the queue is full, or when the
+ ring is full but the max allows the item (skip_max or no max): it then overflows in the list, without waiting. */
+static int ring_post ( struct fifo * queue, void ** item, int skip_max )
+{
+	struct fifo_ring * r = queue->ring;
+	struct timespec posted_on, queued_on;
+	int count, highest, blocked = 0;
+
+	/* Get the timing of this call */
+	CHECK_SYS(  clock_gettime(CLOCK_REALTIME, &posted_on)  );
+
+	while (!ring_try_post(queue, *item, skip_max, &posted_on)) {
+		int ret = 0, posted = 0;
+
+		CHECK_POSIX(  pthread_mutex_lock( &queue->mtx )  );
+		__atomic_add_fetch(&queue->thrs_push, 1, __ATOMIC_SEQ_CST);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		pthread_cleanup_push( fifo_cleanup_push, queue);
+		if (ring_try_post(queue, *item, skip_max, &posted_on)) {
+			posted = 1;
+		} else if (skip_max || (!queue->max) || (__atomic_load_n(&queue->count, __ATOMIC_SEQ_CST) < queue->max)) {
+			/* The ring is full or overflowing already, but the queue accepts the item */
+			ret = ring_spill(queue, *item, &posted_on);
+			posted = 1;
+		} else {
+			/* We have to wait for an item to be pulled */
+			ret = pthread_cond_wait( &queue->cond_push, &queue->mtx );
+			ASSERT( ret == 0 );
+			blocked = 1;
+		}
+		pthread_cleanup_pop(0);
+		__atomic_sub_fetch(&queue->thrs_push, 1, __ATOMIC_SEQ_CST);
+		CHECK_POSIX(  pthread_mutex_unlock( &queue->mtx )  );
+
+		if (posted) {
+			if (ret)
+				return ret;
+			break;
+		}
+	}
+	*item = NULL;
+
+	count = __atomic_add_fetch(&queue->count, 1, __ATOMIC_SEQ_CST);
+	if (count == 1)
+		ring_fd_sync(queue);
+	highest = __atomic_load_n(&queue->highest_ever, __ATOMIC_RELAXED);
+	while ((highest < count) && !__atomic_compare_exchange_n(&queue->highest_ever, &highest, count, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		/* retry */;
+
+	/* update queue timing info "blocking time", only when we had to wait */
+	if (blocked) {
+		long long blocked_ns;
+		CHECK_SYS_DO(  clock_gettime(CLOCK_REALTIME, &queued_on), goto skip_timing  );
+		blocked_ns = ts_diff_ns(&posted_on, &queued_on);
+		__atomic_add_fetch(&r->blocking_ns, blocked_ns, __ATOMIC_RELAXED);
+		hist_add(&queue->blocking, blocked_ns);
+	} else {
+		hist_add(&queue->blocking, 0);
+	}
+skip_timing:
+
+	/* Signal if threads are asleep */
+	ring_wake(queue, &queue->thrs, &queue->cond_pull);
+	if (blocked)
+		/* cascade */
+		ring_wake(queue, &queue->thrs_push, &queue->cond_push);
+
+	/* Call high-watermark cb as needed */
+	if (queue->high && ((count % queue->high) == 0)) {
+		CHECK_POSIX(  pthread_mutex_lock( &queue->mtx )  );
+		queue->highest = count;
+		CHECK_POSIX(  pthread_mutex_unlock( &queue->mtx )  );
+		if (queue->h_cb)
+			(*queue->h_cb)(queue, &queue->data);
+	}
+
+	/* Done */
+	return 0;
+}
+
 /* Post a new item in the queue */
 int fd_fifo_post_internal ( struct fifo * queue, void ** item, int skip_max )
 {
 	struct fifo_item * new;
-	int call_cb = 0;
+	struct fifo_class * c;
+	struct fd_list * list;
+	int call_cb = 0, cls;
 	struct timespec posted_on, queued_on;
 
+	if (queue->ring)
+		return ring_post(queue, item, skip_max);
+
 	/* Get the timing of this call */
 	CHECK_SYS(  clock_gettime(CLOCK_REALTIME, &posted_on)  );
 
+	/* Find the priority class of the item, if any */
+	cls = fifo_classify(queue, *item);
+
 	/* lock the queue */
 	CHECK_POSIX(  pthread_mutex_lock( &queue->mtx )  );
 
-	if ((!skip_max) && (queue->max)) {
-		while (queue->count >= queue->max) {
-			int ret = 0;
-
-			/* We have to wait for an item to be pulled */
-			queue->thrs_push++ ;
-			pthread_cleanup_push( fifo_cleanup_push, queue);
-			ret = pthread_cond_wait( &queue->cond_push, &queue->mtx );
-			pthread_cleanup_pop(0);
-			queue->thrs_push-- ;
-
-#ifdef NDEBUG
-			(void)ret;
-#endif
-			ASSERT( ret == 0 );
-		}
-	}
+	list = fifo_class_list(queue, cls, &c);
+	if (!skip_max && !(c && (c - queue->classes < queue->nb_nolimit)))
+		fifo_wait_room(queue);
 
 	/* Create a new list item */
-	CHECK_MALLOC_DO(  new = malloc (sizeof (struct fifo_item)) , {
+	CHECK_MALLOC_DO(  new = fifo_item_get(queue) , {
 			pthread_mutex_unlock( &queue->mtx );
 			return ENOMEM;
 		} );
@@ -437,8 +1309,10 @@ int fd_fifo_post_internal ( struct fifo * queue, void ** item, int skip_max )
 	*item = NULL;
 
 	/* Add the new item at the end */
-	fd_list_insert_before( &queue->list, &new->item);
+	fd_list_insert_before( list, &new->item);
 	queue->count++;
+	if (c)
+		c->count++;
 	if (queue->highest_ever < queue->count)
 		queue->highest_ever = queue->count;
 	if (queue->high && ((queue->count % queue->high) == 0)) {
@@ -448,6 +1322,7 @@ int fd_fifo_post_internal ( struct fifo * queue, void ** item, int skip_max )
 
 	/* store timing */
 	memcpy(&new->posted_on, &posted_on, sizeof(struct timespec));
+	fifo_fd_sync(queue);
 
 	/* update queue timing info "blocking time" */
 	{
@@ -455,6 +1330,7 @@ int fd_fifo_post_internal ( struct fifo * queue, void ** item, int skip_max )
 		CHECK_SYS(  clock_gettime(CLOCK_REALTIME, &queued_on)  );
 		blocked_ns = (queued_on.tv_sec - posted_on.tv_sec) * 1000000000;
 		blocked_ns += (queued_on.tv_nsec - posted_on.tv_nsec);
+		hist_add(&queue->blocking, blocked_ns);
 		blocked_ns += queue->blocking_time.tv_nsec;
 		queue->blocking_time.tv_sec += blocked_ns / 1000000000;
 		queue->blocking_time.tv_nsec = blocked_ns % 1000000000;
@@ -504,26 +1380,144 @@ int fd_fifo_post_noblock ( struct fifo * queue, void ** item )
 
 }
 
-/* Pop the first item from the queue */
-static void * mq_pop(struct fifo * queue)
+/* Post several items in the queue, with a single lock and wake-up as long as the queue has room */
+int fd_fifo_post_batch_int ( struct fifo * queue, void ** items, int nb )
+{
+	int i, call_cb = 0;
+	struct timespec posted_on, queued_on;
+
+	TRACE_ENTRY( "%p %p %d", queue, items, nb );
+
+	/* Check the parameters */
+	CHECK_PARAMS( CHECK_FIFO( queue ) && items && (nb >= 0) );
+	for (i = 0; i < nb; i++) {
+		CHECK_PARAMS( items[i] );
+	}
+
+	if (queue->ring || queue->classify) {
+		/* There is no lock to share, or each item has its own class */
+		for (i = 0; i < nb; i++) {
+			CHECK_FCT( fd_fifo_post_internal(queue, &items[i], 0) );
+		}
+		return 0;
+	}
+
+	/* Get the timing of this call */
+	CHECK_SYS(  clock_gettime(CLOCK_REALTIME, &posted_on)  );
+
+	/* lock the queue */
+	CHECK_POSIX(  pthread_mutex_lock( &queue->mtx )  );
+
+	for (i = 0; i < nb; ) {
+		int added = 0;
+
+		fifo_wait_room(queue);
+
+		/* Add as many items as the queue accepts */
+		while ((i < nb) && ((!queue->max) || (queue->count < queue->max))) {
+			struct fifo_item * new;
+
+			CHECK_MALLOC_DO(  new = fifo_item_get(queue) , {
+					pthread_mutex_unlock( &queue->mtx );
+					return ENOMEM;
+				} );
+
+			fd_list_init(&new->item, items[i]);
+			items[i++] = NULL;
+			memcpy(&new->posted_on, &posted_on, sizeof(struct timespec));
+
+			fd_list_insert_before( &queue->list, &new->item);
+			queue->count++;
+			added++;
+			if (queue->highest_ever < queue->count)
+				queue->highest_ever = queue->count;
+			if (queue->high && ((queue->count % queue->high) == 0)) {
+				call_cb++;
+				queue->highest = queue->count;
+			}
+		}
+
+		/* Signal the threads waiting for these items */
+		fifo_fd_sync(queue);
+		if (queue->thrs > 0) {
+			if (added > 1) {
+				CHECK_POSIX(  pthread_cond_broadcast(&queue->cond_pull)  );
+			} else {
+				CHECK_POSIX(  pthread_cond_signal(&queue->cond_pull)  );
+			}
+		}
+	}
+
+	/* update queue timing info "blocking time" */
+	{
+		long long blocked_ns;
+		CHECK_SYS(  clock_gettime(CLOCK_REALTIME, &queued_on)  );
+		blocked_ns = (queued_on.tv_sec - posted_on.tv_sec) * 1000000000;
+		blocked_ns += (queued_on.tv_nsec - posted_on.tv_nsec);
+		hist_add(&queue->blocking, blocked_ns);
+		blocked_ns += queue->blocking_time.tv_nsec;
+		queue->blocking_time.tv_sec += blocked_ns / 1000000000;
+		queue->blocking_time.tv_nsec = blocked_ns % 1000000000;
+	}
+
+	if (queue->thrs_push > 0) {
+		/* cascade */
+		CHECK_POSIX(  pthread_cond_signal(&queue->cond_push)  );
+	}
+
+	/* Unlock */
+	CHECK_POSIX(  pthread_mutex_unlock( &queue->mtx )  );
+
+	/* Call high-watermark cb as needed */
+	for (; call_cb && queue->h_cb; call_cb--)
+		(*queue->h_cb)(queue, &queue->data);
+
+	/* Done */
+	return 0;
+}
+
+/* Get the current time for the statistics of the queue, NULL if it is not available */
+static struct timespec * fifo_now(struct timespec * now)
+{
+	CHECK_SYS_DO(  clock_gettime(CLOCK_REALTIME, now), return NULL  );
+	return now;
+}
+
+/* Pop the first item from the queue, now is used for the timings (fifo_now) */
+static void * mq_pop(struct fifo * queue, struct timespec * now)
 {
 	void * ret = NULL;
 	struct fifo_item * fi;
-	struct timespec now;
+	struct fifo_class * c = NULL;
+	struct fd_list * list = &queue->list;
+
+	if (queue->classes) {
+		c = fifo_class_next(queue);
+		list = &c->list;
+		c->count--;
+		c->total_items++;
+	}
 
-	ASSERT( ! FD_IS_LIST_EMPTY(&queue->list) );
+	ASSERT( ! FD_IS_LIST_EMPTY(list) );
 
-	fi = (struct fifo_item *)(queue->list.next);
+	fi = (struct fifo_item *)(list->next);
 	ret = fi->item.o;
 	fd_list_unlink(&fi->item);
 	queue->count--;
 	queue->total_items++;
+	if (!queue->count)
+		fifo_fd_sync(queue);
 
 	/* Update the timings */
-	CHECK_SYS_DO(  clock_gettime(CLOCK_REALTIME, &now), goto skip_timing  );
+	if (now == NULL)
+		goto skip_timing;
 	{
-		long long elapsed = (now.tv_sec - fi->posted_on.tv_sec) * 1000000000;
-		elapsed += now.tv_nsec - fi->posted_on.tv_nsec;
+		long long elapsed = (now->tv_sec - fi->posted_on.tv_sec) * 1000000000;
+		elapsed += now->tv_nsec - fi->posted_on.tv_nsec;
+		hist_add(&queue->delay, elapsed);
+		if (c)
+			hist_add(&c->delay, elapsed);
+		rate_add(&queue->rate, now->tv_sec);
 
 		queue->last_time.tv_sec = elapsed / 1000000000;
 		queue->last_time.tv_nsec = elapsed % 1000000000;
@@ -533,7 +1527,7 @@ static void * mq_pop(struct fifo * queue)
 		queue->total_time.tv_nsec = elapsed % 1000000000;
 	}
 skip_timing:
-	free(fi);
+	fifo_item_put(queue, fi);
 
 	if (queue->thrs_push) {
 		CHECK_POSIX_DO( pthread_cond_signal( &queue->cond_push ), );
@@ -543,12 +1537,12 @@ skip_timing:
 }
 
 /* Check if the low watermark callback must be called. */
-static __inline__ int test_l_cb(struct fifo * queue)
+static __inline__ int test_l_cb(struct fifo * queue, int count)
 {
 	if ((queue->high == 0) || (queue->low == 0) || (queue->l_cb == 0))
 		return 0;
 
-	if (((queue->count % queue->high) == queue->low) && (queue->highest > queue->count)) {
+	if (((count % queue->high) == queue->low) && (queue->highest > count)) {
 		queue->highest -= queue->high;
 		return 1;
 	}
@@ -556,17 +1550,76 @@ static __inline__ int test_l_cb(struct fifo * queue)
 	return 0;
 }
 
+/* Retrieve the next item of a ring queue, returns 0 if it is empty */
+static int ring_get_item(struct fifo * queue, void ** item)
+{
+	struct fifo_ring * r = queue->ring;
+	struct timespec posted_on, now;
+	int count, call_cb = 0;
+
+	*item = ring_pop(r, &posted_on);
+	if ((*item == NULL) && __atomic_load_n(&r->spill, __ATOMIC_SEQ_CST)) {
+		/* The ring is empty, the next items are in the overflow list */
+		CHECK_POSIX_DO(  pthread_mutex_lock( &queue->mtx ), return 0  );
+		*item = ring_unspill(queue, &posted_on);
+		CHECK_POSIX_DO(  pthread_mutex_unlock( &queue->mtx ), /* continue */  );
+	}
+	if (*item == NULL)
+		return 0;
+
+	count = __atomic_sub_fetch(&queue->count, 1, __ATOMIC_SEQ_CST);
+	if (count <= 0)
+		ring_fd_sync(queue);
+	ring_wake(queue, &queue->thrs_push, &queue->cond_push);
+
+	/* Update the timings */
+	__atomic_add_fetch(&r->total_items, 1, __ATOMIC_RELAXED);
+	CHECK_SYS_DO(  clock_gettime(CLOCK_REALTIME, &now), goto skip_timing  );
+	{
+		long long elapsed = ts_diff_ns(&posted_on, &now);
+		__atomic_store_n(&r->last_ns, elapsed, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&r->total_ns, elapsed, __ATOMIC_RELAXED);
+		hist_add(&queue->delay, elapsed);
+		rate_add(&queue->rate, now.tv_sec);
+	}
+skip_timing:
+
+	/* Call low watermark callback as needed */
+	if (queue->high && queue->low && queue->l_cb) {
+		CHECK_POSIX_DO(  pthread_mutex_lock( &queue->mtx ), return 1  );
+		call_cb = test_l_cb(queue, count);
+		CHECK_POSIX_DO(  pthread_mutex_unlock( &queue->mtx ), /* continue */  );
+		if (call_cb)
+			(*queue->l_cb)(queue, &queue->data);
+	}
+
+	return 1;
+}
+
 /* Try popping an item */
 int fd_fifo_tryget_int ( struct fifo * queue, void ** item )
 {
 	int wouldblock = 0;
 	int call_cb = 0;
+	struct timespec now;
 
 	TRACE_ENTRY( "%p %p", queue, item );
 
 	/* Check the parameters */
 	CHECK_PARAMS( CHECK_FIFO( queue ) && item );
 
+	if (queue->ring) {
+		if (ring_get_item(queue, item))
+			return 0;
+		if (__atomic_load_n(&queue->thrs_push, __ATOMIC_SEQ_CST) > 0) {
+			/* A thread is trying to push something, let's give it a chance */
+			usleep(1000);
+			if (ring_get_item(queue, item))
+				return 0;
+		}
+		return EWOULDBLOCK;
+	}
+
 	/* lock the queue */
 	CHECK_POSIX(  pthread_mutex_lock( &queue->mtx )  );
 
@@ -574,8 +1627,8 @@ int fd_fifo_tryget_int ( struct fifo * queue, void ** item )
 	if (queue->count > 0) {
 got_item:
 		/* There are elements in the queue, so pick the first one */
-		*item = mq_pop(queue);
-		call_cb = test_l_cb(queue);
+		*item = mq_pop(queue, fifo_now(&now));
+		call_cb = test_l_cb(queue, queue->count);
 	} else {
 		if (queue->thrs_push > 0) {
 			/* A thread is trying to push something, let's give it a chance */
@@ -609,7 +1662,7 @@ static void fifo_cleanup(void * queue)
 	TRACE_ENTRY( "%p", queue );
 
 	/* The thread has been cancelled, therefore it does not wait on the queue anymore */
-	q->thrs--;
+	__atomic_sub_fetch(&q->thrs, 1, __ATOMIC_SEQ_CST); /* atomic because read without the lock for ring queues */
 
 	/* Now unlock the queue, and we're done */
 	CHECK_POSIX_DO(  pthread_mutex_unlock( &q->mtx ),  /* nothing */  );
@@ -618,11 +1671,47 @@ static void fifo_cleanup(void * queue)
 	return;
 }
 
+/* fifo_tget for a ring queue: the lock is taken only to wait for an item */
+static int ring_tget ( struct fifo * queue, void ** item, int istimed, const struct timespec *abstime)
+{
+	int ret = 0;
+
+	while (!ring_get_item(queue, item)) {
+		/* We have to wait for a new item */
+		CHECK_POSIX(  pthread_mutex_lock( &queue->mtx )  );
+		__atomic_add_fetch(&queue->thrs, 1, __ATOMIC_SEQ_CST);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		pthread_cleanup_push( fifo_cleanup, queue);
+		if (CHECK_FIFO( queue ) && !ring_ready(queue->ring)) {
+			if (istimed) {
+				ret = pthread_cond_timedwait( &queue->cond_pull, &queue->mtx, abstime );
+			} else {
+				ret = pthread_cond_wait( &queue->cond_pull, &queue->mtx );
+			}
+		}
+		pthread_cleanup_pop(0);
+		if (!CHECK_FIFO( queue )) {
+			/* The queue is being destroyed, do not access it after the unlock */
+			TRACE_DEBUG(FULL, "The queue is being destroyed -> EPIPE");
+			ret = EPIPE;
+		}
+		__atomic_sub_fetch(&queue->thrs, 1, __ATOMIC_SEQ_CST);
+		CHECK_POSIX(  pthread_mutex_unlock( &queue->mtx )  );
+
+		if (ret != 0)
+			/* ETIMEDOUT / EPIPE / other error */
+			return ret;
+	}
+
+	return 0;
+}
+
 /* The internal function for fd_fifo_timedget and fd_fifo_get */
 static int fifo_tget ( struct fifo * queue, void ** item, int istimed, const struct timespec *abstime)
 {
 	int call_cb = 0;
 	int ret = 0;
+	struct timespec now;
 
 	/* Check the parameters */
 	CHECK_PARAMS( CHECK_FIFO( queue ) && item && (abstime || !istimed) );
@@ -630,6 +1719,9 @@ static int fifo_tget ( struct fifo * queue, void ** item, int istimed, const str
 	/* Initialize the return value */
 	*item = NULL;
 
+	if (queue->ring)
+		return ring_tget(queue, item, istimed, abstime);
+
 	/* lock the queue */
 	CHECK_POSIX(  pthread_mutex_lock( &queue->mtx )  );
 
@@ -644,8 +1736,8 @@ awaken:
 
 	if (queue->count > 0) {
 		/* There are items in the queue, so pick the first one */
-		*item = mq_pop(queue);
-		call_cb = test_l_cb(queue);
+		*item = mq_pop(queue, fifo_now(&now));
+		call_cb = test_l_cb(queue, queue->count);
 	} else {
 		/* We have to wait for a new item */
 		queue->thrs++ ;
@@ -688,6 +1780,128 @@ int fd_fifo_timedget_int ( struct fifo * queue, void ** item, const struct times
 	return fifo_tget(queue, item, 1, abstime);
 }
 
+/* Number of items that a thread takes at once: when other threads are waiting on the queue, leave them their share */
+static __inline__ int batch_share(int max, int count, int thrs)
+{
+	int share = count / (thrs + 1);
+	if (share < 1)
+		share = 1;
+	if (share > max)
+		share = max;
+	return share;
+}
+
+/* The batch version of fifo_tget for a ring queue */
+static int ring_get_batch ( struct fifo * queue, void ** items, int max, int * nb, int block, const struct timespec *abstime)
+{
+	int want;
+
+	/* Wait for the first item */
+	if (block) {
+		int ret = ring_tget(queue, &items[0], abstime ? 1 : 0, abstime);
+		if (ret)
+			return ret;
+	} else if (!ring_get_item(queue, &items[0])) {
+		return EWOULDBLOCK;
+	}
+	*nb = 1;
+
+	/* And take the following ones */
+	want = batch_share(max, fd_fifo_length(queue) + 1, __atomic_load_n(&queue->thrs, __ATOMIC_RELAXED));
+	while ((*nb < want) && ring_get_item(queue, &items[*nb]))
+		(*nb)++;
+
+	return 0;
+}
+
+/* The internal function for the fd_fifo_*get_batch functions */
+static int fifo_get_batch ( struct fifo * queue, void ** items, int max, int * nb, int block, const struct timespec *abstime)
+{
+	int call_cb = 0;
+	int ret = 0;
+	struct timespec now;
+
+	/* Check the parameters */
+	CHECK_PARAMS( CHECK_FIFO( queue ) && items && (max > 0) && nb );
+
+	/* Initialize the return value */
+	*nb = 0;
+
+	if (queue->ring)
+		return ring_get_batch(queue, items, max, nb, block, abstime);
+
+	/* lock the queue */
+	CHECK_POSIX(  pthread_mutex_lock( &queue->mtx )  );
+
+awaken:
+	/* Check queue status */
+	if (!CHECK_FIFO( queue )) {
+		/* The queue is being destroyed */
+		CHECK_POSIX(  pthread_mutex_unlock( &queue->mtx )  );
+		TRACE_DEBUG(FULL, "The queue is being destroyed -> EPIPE");
+		return EPIPE;
+	}
+
+	if (queue->count > 0) {
+		/* There are items in the queue, pick our share, all with the same timing */
+		struct timespec * pnow = fifo_now(&now);
+		int want = batch_share(max, queue->count, queue->thrs);
+		while (*nb < want) {
+			items[(*nb)++] = mq_pop(queue, pnow);
+			call_cb += test_l_cb(queue, queue->count);
+		}
+	} else if (block) {
+		/* We have to wait for a new item */
+		queue->thrs++ ;
+		pthread_cleanup_push( fifo_cleanup, queue);
+		if (abstime) {
+			ret = pthread_cond_timedwait( &queue->cond_pull, &queue->mtx, abstime );
+		} else {
+			ret = pthread_cond_wait( &queue->cond_pull, &queue->mtx );
+		}
+		pthread_cleanup_pop(0);
+		queue->thrs-- ;
+		if (ret == 0)
+			goto awaken;  /* test for spurious wake-ups */
+
+		/* otherwise (ETIMEDOUT / other error) just continue */
+	} else {
+		ret = EWOULDBLOCK;
+	}
+
+	/* Unlock */
+	CHECK_POSIX(  pthread_mutex_unlock( &queue->mtx )  );
+
+	/* Call low watermark callback as needed */
+	for (; call_cb; call_cb--)
+		(*queue->l_cb)(queue, &queue->data);
+
+	/* Done */
+	return ret;
+}
+
+/* Get the next available items, block until there is one */
+int fd_fifo_get_batch_int ( struct fifo * queue, void ** items, int max, int * nb )
+{
+	TRACE_ENTRY( "%p %p %d %p", queue, items, max, nb );
+	return fifo_get_batch(queue, items, max, nb, 1, NULL);
+}
+
+/* Get the available items, do not block */
+int fd_fifo_tryget_batch_int ( struct fifo * queue, void ** items, int max, int * nb )
+{
+	TRACE_ENTRY( "%p %p %d %p", queue, items, max, nb );
+	return fifo_get_batch(queue, items, max, nb, 0, NULL);
+}
+
+/* Get the next available items, block until there is one, or the timeout expires */
+int fd_fifo_timedget_batch_int ( struct fifo * queue, void ** items, int max, int * nb, const struct timespec *abstime )
+{
+	TRACE_ENTRY( "%p %p %d %p %p", queue, items, max, nb, abstime );
+	CHECK_PARAMS( abstime );
+	return fifo_get_batch(queue, items, max, nb, 1, abstime);
+}
+
 /* Test if data is available in the queue, without pulling it */
 int fd_fifo_select ( struct fifo * queue, const struct timespec *abstime )
 {
@@ -696,18 +1910,27 @@ int fd_fifo_select ( struct fifo * queue, const struct timespec *abstime )
 
 	CHECK_PARAMS_DO( CHECK_FIFO( queue ), return -EINVAL );
 
+	/* With the ring, only wait under the lock (see ring_tget) */
+	if (queue->ring && ring_ready(queue->ring))
+		return fd_fifo_length(queue) ?: 1;
+
 	/* lock the queue */
 	CHECK_POSIX_DO(  pthread_mutex_lock( &queue->mtx ), return -__ret__  );
 
 awaken:
-	ret = (queue->count > 0 ) ? queue->count : 0;
+	if (queue->ring)
+		ret = ring_ready(queue->ring) ? (fd_fifo_length(queue) ?: 1) : 0;
+	else
+		ret = (queue->count > 0 ) ? queue->count : 0;
 	if ((ret == 0) && (abstime != NULL)) {
 		/* We have to wait for a new item */
-		queue->thrs++ ;
+		__atomic_add_fetch(&queue->thrs, 1, __ATOMIC_SEQ_CST);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
 		pthread_cleanup_push( fifo_cleanup, queue);
-		ret = pthread_cond_timedwait( &queue->cond_pull, &queue->mtx, abstime );
+		if (!queue->ring || !ring_ready(queue->ring))
+			ret = pthread_cond_timedwait( &queue->cond_pull, &queue->mtx, abstime );
 		pthread_cleanup_pop(0);
-		queue->thrs-- ;
+		__atomic_sub_fetch(&queue->thrs, 1, __ATOMIC_SEQ_CST);
 		if (ret == 0)
 			goto awaken;  /* test for spurious wake-ups */
 
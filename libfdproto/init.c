@@ -59,6 +59,7 @@ int fd_libproto_init()
 	
 	/* Initialize the modules that need it */
 	fd_msg_eteid_init();
+	CHECK_FCT( fd_msg_pool_init() );
 	CHECK_FCT( fd_sess_init() );
 	
 	return 0;
@@ -95,10 +95,11 @@ struct avp {
 	struct avp_hdr		 avp_public;		/* AVP data that can be managed by other modules */
 	
 	uint8_t			*avp_source;		/* If the message was parsed from a buffer, pointer to the AVP data start in the buffer. */
-	uint8_t			*avp_rawdata;		/* when the data can not be interpreted, the raw data is copied here. The header is not part of it. */
+	uint8_t			*avp_rawdata;		/* when the data can not be interpreted, the raw data is copied here (fd_mp_buf_alloc). The header is not part of it. */
 	size_t			 avp_rawlen;		/* The length of the raw buffer. */
 	union avp_value		 avp_storage;		/* To avoid many alloc/free, store the integer values here and set avp_public.avp_data to &storage */
-	int			 avp_mustfreeos;	/* 1 if an octetstring is malloc'd in avp_storage and must be freed. */
+	int			 avp_mustfreeos;	/* 1 if an octetstring is malloc'd in avp_storage and must be freed, 2 if it comes from fd_mp_buf_alloc. */
+	struct msg_rawbuf	*avp_rawbuf;		/* If not NULL, the octetstring in avp_storage points inside this received buffer, on which we hold a reference. */
 };
 
 /* Macro to compute the AVP header size */
@@ -111,6 +112,15 @@ struct avp {
 /* Check the type and eyecatcher */
 #define CHECK_AVP(_x) ((_x) && (_C(_x)->type == MSG_AVP) && (_A(_x)->avp_eyec == MSG_AVP_EYEC))
 
+/* A buffer received from the network. It is shared by the message parsed from it and by the octetstring
+  values that point directly inside it, so that these values do not need to be copied (see parsedict_do_avp). */
+struct msg_rawbuf {
+	pthread_mutex_t		 rb_lock;		/* Protects the reference counter */
+	int			 rb_refcount;		/* The message until fd_msg_parse_dict completes, and each AVP value pointing inside the buffer */
+	uint8_t			*rb_data;		/* The buffer, freed with the last reference */
+	size_t			 rb_len;		/* Its size */
+};
+
 /* The following structure represents an instance of a message (command and children AVPs). */
 struct msg {
 	struct msg_avp_chain	 msg_chain;		/* List of the AVPs in the message */
@@ -122,7 +132,8 @@ struct msg {
 	}  			 msg_model_not_found;	/* When model resolution has failed, store a copy of the data here to avoid searching again */
 	struct msg_hdr		 msg_public;		/* Message data that can be managed by extensions. */
 	
-	uint8_t			*msg_rawbuffer;		/* data buffer that was received, saved during fd_msg_parse_buffer and freed in fd_msg_parse_dict */
+	struct msg_rawbuf	*msg_rawbuffer;		/* data buffer that was received, saved during fd_msg_parse_buffer and released in fd_msg_parse_dict */
+	int			 msg_raw;		/* The AVP objects were not created yet, the AVPs are only in msg_rawbuffer (see fd_msg_parse_buffer_raw) */
 	int			 msg_routable;		/* Is this a routable message? (0: undef, 1: routable, 2: non routable) */
 	struct msg		*msg_query;		/* the associated query if the message is a received answer */
 	int			 msg_associated;	/* and the counter part information in the query, to avoid double free */
@@ -206,6 +217,69 @@ static void init_msg ( struct msg * msg )
 	CHECK_POSIX_DO( pthread_mutex_init(&msg->msg_pmdl.lock, NULL), );
 }
 
+/* Duplicate an octetstring value into a (possibly pooled) buffer, with a terminating '\0' as os0dup */
+static uint8_t * os0dup_pool(uint8_t * s, size_t l)
+{
+	uint8_t * r;
+	CHECK_MALLOC_DO( r = fd_mp_buf_alloc(l+1), return NULL );
+	if (l)
+		memcpy(r, s, l);
+	r[l] = '\0';
+	return r;
+}
+
+/* Wrap a received buffer for sharing. */
+static struct msg_rawbuf * rawbuf_new(uint8_t * data, size_t len)
+{
+	struct msg_rawbuf * rb;
+	CHECK_MALLOC_DO( rb = fd_mp_buf_alloc(sizeof(struct msg_rawbuf)), return NULL );
+	CHECK_POSIX_DO( pthread_mutex_init(&rb->rb_lock, NULL), { fd_mp_buf_free(rb); return NULL; } );
+	rb->rb_refcount = 1;
+	rb->rb_data = data;
+	rb->rb_len = len;
+	return rb;
+}
+
+/* Take an additional reference on a received buffer */
+static void rawbuf_ref(struct msg_rawbuf * rb)
+{
+	CHECK_POSIX_DO( pthread_mutex_lock(&rb->rb_lock), /* continue */ );
+	rb->rb_refcount++;
+	CHECK_POSIX_DO( pthread_mutex_unlock(&rb->rb_lock), /* continue */ );
+}
+
+/* Release a reference, the buffer is freed with the last one */
+static void rawbuf_unref(struct msg_rawbuf * rb)
+{
+	int last;
+	CHECK_POSIX_DO( pthread_mutex_lock(&rb->rb_lock), /* continue */ );
+	last = (--rb->rb_refcount == 0);
+	CHECK_POSIX_DO( pthread_mutex_unlock(&rb->rb_lock), /* continue */ );
+	if (last) {
+		CHECK_POSIX_DO( pthread_mutex_destroy(&rb->rb_lock), /* continue */ );
+		free(rb->rb_data);
+		fd_mp_buf_free(rb);
+	}
+}
+
+/* Free the octetstring value of an AVP if we own it */
+static void free_avp_os(struct avp * avp)
+{
+	if (avp->avp_rawbuf) {
+		rawbuf_unref(avp->avp_rawbuf);
+		avp->avp_rawbuf = NULL;
+	}
+	switch (avp->avp_mustfreeos) {
+		case 1:
+			free(avp->avp_storage.os.data);
+			break;
+		case 2:
+			fd_mp_buf_free(avp->avp_storage.os.data);
+			break;
+	}
+	avp->avp_mustfreeos = 0;
+}
+
 
 /* Create a new AVP instance */
 int fd_msg_avp_new ( struct dict_object * model, int flags, struct avp ** avp )
@@ -223,7 +297,7 @@ int fd_msg_avp_new ( struct dict_object * model, int flags, struct avp ** avp )
 	}
 	
 	/* Create a new object */
-	CHECK_MALLOC(  new = malloc (sizeof(struct avp))  );
+	CHECK_MALLOC(  new = fd_mp_alloc (FD_MSG_POOL_AVP)  );
 	
 	/* Initialize the fields */
 	init_avp(new);
@@ -231,7 +305,7 @@ int fd_msg_avp_new ( struct dict_object * model, int flags, struct avp ** avp )
 	if (model) {
 		struct dict_avp_data dictdata;
 		
-		CHECK_FCT_DO(  fd_dict_getval(model, &dictdata), { free(new); return __ret__; }  );
+		CHECK_FCT_DO(  fd_dict_getval(model, &dictdata), { fd_mp_free(FD_MSG_POOL_AVP, new); return __ret__; }  );
 	
 		new->avp_model = model;
 		new->avp_public.avp_code    = dictdata.avp_code;
@@ -247,7 +321,7 @@ int fd_msg_avp_new ( struct dict_object * model, int flags, struct avp ** avp )
 	if (flags & AVPFL_SET_RAWDATA_FROM_AVP) {
 		new->avp_rawlen = (*avp)->avp_public.avp_len - GETAVPHDRSZ( (*avp)->avp_public.avp_flags );
 		if (new->avp_rawlen) {
-			CHECK_MALLOC_DO(  new->avp_rawdata = malloc(new->avp_rawlen), { free(new); return __ret__; }  );
+			CHECK_MALLOC_DO(  new->avp_rawdata = fd_mp_buf_alloc(new->avp_rawlen), { fd_mp_free(FD_MSG_POOL_AVP, new); return __ret__; }  );
 			memset(new->avp_rawdata, 0x00, new->avp_rawlen);
 		}
 	}
@@ -273,7 +347,7 @@ int fd_msg_new ( struct dict_object * model, int flags, struct msg ** msg )
 	}
 	
 	/* Create a new object */
-	CHECK_MALLOC(  new = malloc (sizeof(struct msg))  );
+	CHECK_MALLOC(  new = fd_mp_alloc (FD_MSG_POOL_MSG)  );
 	
 	/* Initialize the fields */
 	init_msg(new);
@@ -285,18 +359,18 @@ int fd_msg_new ( struct dict_object * model, int flags, struct msg ** msg )
 		struct dict_cmd_data     dictdata;
 		struct dict_object     	*dictappl;
 		
-		CHECK_FCT_DO( fd_dict_getdict(model, &dict), { free(new); return __ret__; } );
-		CHECK_FCT_DO( fd_dict_getval(model, &dictdata), { free(new); return __ret__; }  );
+		CHECK_FCT_DO( fd_dict_getdict(model, &dict), { fd_mp_free(FD_MSG_POOL_MSG, new); return __ret__; } );
+		CHECK_FCT_DO( fd_dict_getval(model, &dictdata), { fd_mp_free(FD_MSG_POOL_MSG, new); return __ret__; }  );
 		
 		new->msg_model = model;
 		new->msg_public.msg_flags	= dictdata.cmd_flag_val;
 		new->msg_public.msg_code	= dictdata.cmd_code;
 
 		/* Initialize application from the parent, if any */
-		CHECK_FCT_DO(  fd_dict_search( dict, DICT_APPLICATION, APPLICATION_OF_COMMAND, model, &dictappl, 0), { free(new); return __ret__; }  );
+		CHECK_FCT_DO(  fd_dict_search( dict, DICT_APPLICATION, APPLICATION_OF_COMMAND, model, &dictappl, 0), { fd_mp_free(FD_MSG_POOL_MSG, new); return __ret__; }  );
 		if (dictappl != NULL) {
 			struct dict_application_data appdata;
-			CHECK_FCT_DO(  fd_dict_getval(dictappl, &appdata), { free(new); return __ret__; }  );
+			CHECK_FCT_DO(  fd_dict_getval(dictappl, &appdata), { fd_mp_free(FD_MSG_POOL_MSG, new); return __ret__; }  );
 			new->msg_public.msg_appl = appdata.application_id;
 		}
 	}
@@ -312,7 +386,8 @@ int fd_msg_new ( struct dict_object * model, int flags, struct msg ** msg )
 
 static int bufferize_avp(unsigned char * buffer, size_t buflen, size_t * offset,  struct avp * avp);
 static int parsebuf_list(unsigned char * buf, size_t buflen, struct fd_list * head);
-static int parsedict_do_chain(struct dictionary * dict, struct fd_list * head, int mandatory, struct fd_pei *error_info);
+static int raw_split(struct msg * msg);
+static int parsedict_do_chain(struct dictionary * dict, struct fd_list * head, int mandatory, struct fd_pei *error_info, struct msg_rawbuf * rb);
 
 
 /* Create answer from a request */
@@ -364,16 +439,16 @@ int fd_msg_new_answer_from_req ( struct dictionary * dict, struct msg ** msg, in
 		union avp_value val;
 		
 		if (!sess_id_avp) {
-			CHECK_FCT_DO( fd_dict_search( dict, DICT_AVP, AVP_BY_NAME, "Session-Id", &sess_id_avp, ENOENT), { free(ans); return __ret__; } );
+			CHECK_FCT_DO( fd_dict_search( dict, DICT_AVP, AVP_BY_NAME, "Session-Id", &sess_id_avp, ENOENT), { fd_mp_free(FD_MSG_POOL_MSG, ans); return __ret__; } );
 		}
-		CHECK_FCT_DO( fd_sess_getsid ( sess, &sid, &sidlen ), { free(ans); return __ret__; } );
-		CHECK_FCT_DO( fd_msg_avp_new ( sess_id_avp, 0, &avp ), { free(ans); return __ret__; } );
+		CHECK_FCT_DO( fd_sess_getsid ( sess, &sid, &sidlen ), { fd_mp_free(FD_MSG_POOL_MSG, ans); return __ret__; } );
+		CHECK_FCT_DO( fd_msg_avp_new ( sess_id_avp, 0, &avp ), { fd_mp_free(FD_MSG_POOL_MSG, ans); return __ret__; } );
 		val.os.data = sid;
 		val.os.len  = sidlen;
-		CHECK_FCT_DO( fd_msg_avp_setvalue( avp, &val ), { free(avp); free(ans); return __ret__; } );
-		CHECK_FCT_DO( fd_msg_avp_add( ans, MSG_BRW_FIRST_CHILD, avp ), { free(avp); free(ans); return __ret__; } );
+		CHECK_FCT_DO( fd_msg_avp_setvalue( avp, &val ), { fd_mp_free(FD_MSG_POOL_AVP, avp); fd_mp_free(FD_MSG_POOL_MSG, ans); return __ret__; } );
+		CHECK_FCT_DO( fd_msg_avp_add( ans, MSG_BRW_FIRST_CHILD, avp ), { fd_mp_free(FD_MSG_POOL_AVP, avp); fd_mp_free(FD_MSG_POOL_MSG, ans); return __ret__; } );
 		ans->msg_sess = sess;
-		CHECK_FCT_DO( fd_sess_ref_msg(sess), { free(ans); return __ret__; }  );
+		CHECK_FCT_DO( fd_sess_ref_msg(sess), { fd_mp_free(FD_MSG_POOL_MSG, ans); return __ret__; }  );
 	}
 	
 	/* Add all Proxy-Info AVPs from the query if any */
@@ -382,7 +457,7 @@ int fd_msg_new_answer_from_req ( struct dictionary * dict, struct msg ** msg, in
 		struct fd_pei pei;
 		struct fd_list avpcpylist = FD_LIST_INITIALIZER(avpcpylist);
 		
-		CHECK_FCT_DO(  fd_msg_browse(qry, MSG_BRW_FIRST_CHILD, &avp, NULL) , { free(ans); return __ret__; } );
+		CHECK_FCT_DO(  fd_msg_browse(qry, MSG_BRW_FIRST_CHILD, &avp, NULL) , { fd_mp_free(FD_MSG_POOL_MSG, ans); return __ret__; } );
 		while (avp) {
 			if ( (avp->avp_public.avp_code   == AC_PROXY_INFO)
 			  && (avp->avp_public.avp_vendor == 0) ) {
@@ -393,15 +468,15 @@ int fd_msg_new_answer_from_req ( struct dictionary * dict, struct msg ** msg, in
 				size_t offset = 0;
 
 				/* Create a buffer with the content of the AVP. This is easier than going through the list */
-				CHECK_FCT_DO(  fd_msg_update_length(avp), { free(ans); return __ret__; }  );
-				CHECK_MALLOC_DO(  buf = malloc(avp->avp_public.avp_len), { free(ans); return __ret__; }  );
-				CHECK_FCT_DO( bufferize_avp(buf, avp->avp_public.avp_len, &offset, avp), { free(buf); free(ans); return __ret__; }  );
+				CHECK_FCT_DO(  fd_msg_update_length(avp), { fd_mp_free(FD_MSG_POOL_MSG, ans); return __ret__; }  );
+				CHECK_MALLOC_DO(  buf = malloc(avp->avp_public.avp_len), { fd_mp_free(FD_MSG_POOL_MSG, ans); return __ret__; }  );
+				CHECK_FCT_DO( bufferize_avp(buf, avp->avp_public.avp_len, &offset, avp), { free(buf); fd_mp_free(FD_MSG_POOL_MSG, ans); return __ret__; }  );
 
 				/* Now we parse this buffer to create a copy AVP */
-				CHECK_FCT_DO( parsebuf_list(buf, avp->avp_public.avp_len, &avpcpylist), { free(buf); free(ans); return __ret__; } );
+				CHECK_FCT_DO( parsebuf_list(buf, avp->avp_public.avp_len, &avpcpylist), { free(buf); fd_mp_free(FD_MSG_POOL_MSG, ans); return __ret__; } );
 				
 				/* Parse dictionary objects now to remove the dependency on the buffer */
-				CHECK_FCT_DO( parsedict_do_chain(dict, &avpcpylist, 0, &pei), { /* leaking the avpcpylist -- this should never happen anyway */ free(buf); free(ans); return __ret__; } );
+				CHECK_FCT_DO( parsedict_do_chain(dict, &avpcpylist, 0, &pei, NULL), { /* leaking the avpcpylist -- this should never happen anyway */ free(buf); fd_mp_free(FD_MSG_POOL_MSG, ans); return __ret__; } );
 
 				/* Done for this AVP */
 				free(buf);
@@ -410,7 +485,7 @@ int fd_msg_new_answer_from_req ( struct dictionary * dict, struct msg ** msg, in
 				fd_list_move_end(&ans->msg_chain.children, &avpcpylist);
 			}
 			/* move to next AVP in the message, we can have several Proxy-Info instances */
-			CHECK_FCT_DO( fd_msg_browse(avp, MSG_BRW_NEXT, &avp, NULL), { free(ans); return __ret__; } );
+			CHECK_FCT_DO( fd_msg_browse(avp, MSG_BRW_NEXT, &avp, NULL), { fd_mp_free(FD_MSG_POOL_MSG, ans); return __ret__; } );
 		}
 	}
 
@@ -425,6 +500,33 @@ int fd_msg_new_answer_from_req ( struct dictionary * dict, struct msg ** msg, in
 
 /***************************************************************************************************************/
 
+/* Lazy parsing: when a dictionary is registered with fd_msg_parse_lazy, the AVPs of received messages are decoded
+ only when they are accessed the first time (see lazy_decode) instead of in fd_msg_parse_dict on the whole message. */
+static struct dictionary * lazy_dict = NULL;
+
+static int parsedict_do_avp(struct dictionary * dict, struct avp * avp, int mandatory, struct fd_pei *error_info, struct msg_rawbuf * rb, int lazy);
+static struct msg_rawbuf * rawbuf_of(struct msg_avp_chain * obj);
+
+/* Decode the header level of an AVP that was received but not parsed yet. The errors are not reported here, the AVP
+ simply stays undecoded (as if fd_msg_parse_dict was not called), and the error is found later by fd_msg_parse_dict. */
+static void lazy_decode(struct avp * avp, struct dictionary * dict)
+{
+	struct fd_pei pei;
+	
+	if (!dict || !avp->avp_source)
+		return;
+	
+	(void) parsedict_do_avp(dict, avp, 0, &pei, rawbuf_of(_C(avp)), 1);
+}
+
+int fd_msg_parse_lazy ( struct dictionary * dict )
+{
+	TRACE_ENTRY("%p", dict);
+	
+	lazy_dict = dict;
+	return 0;
+}
+
 /* Explore a message */
 int fd_msg_browse_internal ( msg_or_avp * reference, enum msg_brw_dir dir, msg_or_avp ** found, int * depth )
 {
@@ -454,6 +556,15 @@ int fd_msg_browse_internal ( msg_or_avp * reference, enum msg_brw_dir dir, msg_o
 			_C(reference)->children.head,
 			_C(reference)->children.o);
 
+	/* A raw message has no children until they are needed */
+	if (_C(reference)->type == MSG_MSG) {
+		CHECK_FCT( raw_split(_M(reference)) );
+	}
+	
+	/* A grouped AVP has no children until it is decoded */
+	if ((_C(reference)->type == MSG_AVP) && ((dir == MSG_BRW_FIRST_CHILD) || (dir == MSG_BRW_LAST_CHILD) || (dir == MSG_BRW_WALK)))
+		lazy_decode(_A(reference), lazy_dict);
+
 	/* Now search */
 	switch (dir) {
 		case MSG_BRW_NEXT:
@@ -560,6 +671,11 @@ int fd_msg_avp_add ( msg_or_avp * reference, enum msg_brw_dir dir, struct avp *a
 	/* Check the parameters */
 	CHECK_PARAMS(  VALIDATE_OBJ(reference)  &&  CHECK_AVP(avp)  &&  FD_IS_LIST_EMPTY(&avp->avp_chain.chaining)  );
 	
+	/* The received AVPs must be created before we add new ones */
+	if (_C(reference)->type == MSG_MSG) {
+		CHECK_FCT( raw_split(_M(reference)) );
+	}
+	
 	/* Now insert */
 	switch (dir) {
 		case MSG_BRW_NEXT:
@@ -628,7 +744,12 @@ int fd_msg_search_avp ( msg_or_avp * reference, struct dict_object * what, struc
 	if (avp && nextavp) {
 		struct dictionary * dict;
 		CHECK_FCT( fd_dict_getdict( what, &dict) );
-		CHECK_FCT_DO( fd_msg_parse_dict( nextavp, dict, NULL ), /* nothing */ );
+		if (lazy_dict) {
+			/* Grouped AVPs inside are decoded when they are accessed */
+			lazy_decode(nextavp, dict);
+		} else {
+			CHECK_FCT_DO( fd_msg_parse_dict( nextavp, dict, NULL ), /* nothing */ );
+		}
 	}
 	
 	if (avp || nextavp)
@@ -643,6 +764,12 @@ int fd_msg_search_avp ( msg_or_avp * reference, struct dict_object * what, struc
 
 void fd_msg_unhook_avp (msg_or_avp *msg)
 {
+	/* An undecoded AVP points inside the buffer of the message, which may be freed after this call */
+	if (lazy_dict && (_C(msg)->type == MSG_AVP) && rawbuf_of(_C(msg))) {
+		struct fd_pei pei;
+		(void) parsedict_do_avp(lazy_dict, _A(msg), 0, &pei, rawbuf_of(_C(msg)), 0);
+	}
+	
 	/* Unlink this object if needed */
 	fd_list_unlink( &(_C(msg))->chaining );
 }
@@ -659,15 +786,15 @@ static int destroy_obj (struct msg_avp_chain * obj )
 	fd_list_unlink( &obj->chaining );
 	
 	/* Free the octetstring if needed */
-	if ((obj->type == MSG_AVP) && (_A(obj)->avp_mustfreeos == 1)) {
-		free(_A(obj)->avp_storage.os.data);
+	if (obj->type == MSG_AVP) {
+		free_avp_os(_A(obj));
 	}
 	/* Free the rawdata if needed */
 	if ((obj->type == MSG_AVP) && (_A(obj)->avp_rawdata != NULL)) {
-		free(_A(obj)->avp_rawdata);
+		fd_mp_buf_free(_A(obj)->avp_rawdata);
 	}
 	if ((obj->type == MSG_MSG) && (_M(obj)->msg_rawbuffer != NULL)) {
-		free(_M(obj)->msg_rawbuffer);
+		rawbuf_unref(_M(obj)->msg_rawbuffer);
 	}
 	
 	if ((obj->type == MSG_MSG) && (_M(obj)->msg_src_id != NULL)) {
@@ -687,7 +814,7 @@ static int destroy_obj (struct msg_avp_chain * obj )
 	}
 	
 	/* free the object */
-	free(obj);
+	fd_mp_free((obj->type == MSG_MSG) ? FD_MSG_POOL_MSG : FD_MSG_POOL_AVP, obj);
 	
 	return 0;
 }
@@ -1205,6 +1332,9 @@ int fd_msg_avp_hdr ( struct avp *avp, struct avp_hdr **pdata )
 	TRACE_ENTRY("%p %p", avp, pdata);
 	CHECK_PARAMS(  CHECK_AVP(avp) && pdata  );
 	
+	/* Decode the value on first access if the message was parsed lazily */
+	lazy_decode(avp, lazy_dict);
+	
 	*pdata = &avp->avp_public;
 	return 0;
 }
@@ -1430,6 +1560,36 @@ int fd_msg_source_setrr( struct msg * msg, DiamId_t diamid, size_t diamidlen, st
 		cached_avp_rr_model = avp_rr_model;
 		CHECK_POSIX( pthread_mutex_unlock(&cached_avp_rr_lock) );
 	}
+	
+	/* For a raw message, append the AVP directly at the end of the received buffer. No AVP object points inside this buffer yet,
+	 but the realloc invalidates the data pointers returned by fd_msg_raw_next, as documented. */
+	if (msg->msg_raw) {
+		struct msg_rawbuf * rb = msg->msg_rawbuffer;
+		struct dict_avp_data dictdata;
+		size_t hdrsz, avplen;
+		uint8_t * data;
+		
+		CHECK_FCT( fd_dict_getval(avp_rr_model, &dictdata) );
+		hdrsz = GETAVPHDRSZ(dictdata.avp_flag_val);
+		avplen = hdrsz + diamidlen;
+		
+		CHECK_MALLOC( data = realloc(rb->rb_data, rb->rb_len + PAD4(avplen)) );
+		rb->rb_data = data;
+		data += rb->rb_len;
+		
+		*(uint32_t *)data = htonl(dictdata.avp_code);
+		*(uint32_t *)(data + 4) = htonl(avplen);
+		data[4] = dictdata.avp_flag_val;
+		if (dictdata.avp_flag_val & AVP_FLAG_VENDOR) {
+			*(uint32_t *)(data + 8) = htonl(dictdata.avp_vendor);
+		}
+		memcpy(data + hdrsz, diamid, diamidlen);
+		memset(data + avplen, 0, PAD4(avplen) - avplen);
+		
+		rb->rb_len += PAD4(avplen);
+		msg->msg_public.msg_length = rb->rb_len;
+		return 0;
+	}
 
 	/* Create the AVP with this model */
 	CHECK_FCT( fd_msg_avp_new ( avp_rr_model, 0, &avp ) );
@@ -1499,6 +1659,28 @@ int fd_msg_sess_get(struct dictionary * dict, struct msg * msg, struct session *
 		return 0;
 	}
 	
+	/* In a raw message, read the Session-Id directly from the received buffer */
+	if (msg->msg_raw) {
+		struct avp_hdr ahdr;
+		uint8_t * data;
+		size_t pos = 0, datalen;
+		int ret;
+		
+		*session = NULL;
+		while ((ret = fd_msg_raw_next(msg, &pos, &ahdr, &data, &datalen)) == 0) {
+			if ((ahdr.avp_code == AC_SESSION_ID) && !(ahdr.avp_flags & AVP_FLAG_VENDOR)) {
+				if (datalen > 0) {
+					CHECK_FCT( fd_sess_fromsid_msg ( data, datalen, &msg->msg_sess, new) );
+					*session = msg->msg_sess;
+				}
+				break;
+			}
+		}
+		if (ret && (ret != ENOENT))
+			return ret;
+		return 0;
+	}
+	
 	/* OK, we have to search for Session-Id AVP -- it is usually the first AVP, but let's be permissive here */
 	/* -- note: we accept messages that have not yet been dictionary parsed... */
 	CHECK_FCT(  fd_msg_browse(msg, MSG_BRW_FIRST_CHILD, &avp, NULL)  );
@@ -1554,6 +1736,12 @@ void fd_msg_eteid_init(void)
 	fd_eteid = (t << 20) | ((uint32_t)lrand48() & ( (1 << 20) - 1 ));
 }
 
+/* Initialize the pools with the size of our objects */
+int fd_msg_pool_init(void)
+{
+	return fd_mp_init(sizeof(struct msg), sizeof(struct avp));
+}
+
 uint32_t fd_msg_eteid_get ( void )
 {
 	uint32_t ret;
@@ -1592,10 +1780,7 @@ int fd_msg_avp_setvalue ( struct avp *avp, union avp_value *value )
 	}
 	
 	/* First, clean any previous value */
-	if (avp->avp_mustfreeos != 0) {
-		free(avp->avp_storage.os.data);
-		avp->avp_mustfreeos = 0;
-	}
+	free_avp_os(avp);
 	
 	memset(&avp->avp_storage, 0, sizeof(union avp_value));
 	
@@ -1610,8 +1795,8 @@ int fd_msg_avp_setvalue ( struct avp *avp, union avp_value *value )
 	
 	/* Duplicate an octetstring if needed. */
 	if (type == AVP_TYPE_OCTETSTRING) {
-		CHECK_MALLOC(  avp->avp_storage.os.data = os0dup(value->os.data, value->os.len)  );
-		avp->avp_mustfreeos = 1;
+		CHECK_MALLOC(  avp->avp_storage.os.data = os0dup_pool(value->os.data, value->os.len)  );
+		avp->avp_mustfreeos = 2;
 	}
 	
 	/* Set the data pointer of the public part */
@@ -1691,10 +1876,7 @@ int fd_msg_avp_value_encode ( void *data, struct avp *avp )
 	/* Ok, now we can encode the value */
 	
 	/* First, clean any previous value */
-	if (avp->avp_mustfreeos != 0) {
-		free(avp->avp_storage.os.data);
-		avp->avp_mustfreeos = 0;
-	}
+	free_avp_os(avp);
 	avp->avp_public.avp_value = NULL;
 	memset(&avp->avp_storage, 0, sizeof(union avp_value));
 	
@@ -1789,17 +1971,9 @@ static int bufferize_msg(unsigned char * buffer, size_t buflen, size_t * offset,
 
 static int bufferize_chain(unsigned char * buffer, size_t buflen, size_t * offset, struct fd_list * list);
 
-/* Write an AVP in the buffer */
-static int bufferize_avp(unsigned char * buffer, size_t buflen, size_t * offset,  struct avp * avp)
+/* Write an AVP header in the buffer */
+static void bufferize_avp_hdr(unsigned char * buffer, size_t * offset,  struct avp * avp)
 {
-	struct dict_avp_data dictdata;
-	
-	TRACE_ENTRY("%p %zd %p %p", buffer, buflen, offset, avp);
-	
-	if ((buflen - *offset) < avp->avp_public.avp_len)
-		return ENOSPC;
-	
-	/* Write the header */
 	PUT_in_buf_32(avp->avp_public.avp_code, buffer + *offset);
 	*offset += 4;
 	
@@ -1811,6 +1985,20 @@ static int bufferize_avp(unsigned char * buffer, size_t buflen, size_t * offset,
 		PUT_in_buf_32(avp->avp_public.avp_vendor, buffer + *offset);
 		*offset += 4;
 	}
+}
+
+/* Write an AVP in the buffer */
+static int bufferize_avp(unsigned char * buffer, size_t buflen, size_t * offset,  struct avp * avp)
+{
+	struct dict_avp_data dictdata;
+	
+	TRACE_ENTRY("%p %zd %p %p", buffer, buflen, offset, avp);
+	
+	if ((buflen - *offset) < avp->avp_public.avp_len)
+		return ENOSPC;
+	
+	/* Write the header */
+	bufferize_avp_hdr(buffer, offset, avp);
 	
 	/* Then we must write the AVP value */
 	
@@ -1912,6 +2100,23 @@ int fd_msg_bufferize ( struct msg * msg, unsigned char ** buffer, size_t * len )
 	/* Check the parameters */
 	CHECK_PARAMS(  buffer && CHECK_MSG(msg)  );
 	
+	/* A raw message is sent as received, only the header is written again (e.g. the hop-by-hop id) */
+	if (msg->msg_raw) {
+		struct msg_rawbuf * rb = msg->msg_rawbuffer;
+		
+		msg->msg_public.msg_length = rb->rb_len;
+		CHECK_FCT( bufferize_msg(rb->rb_data, rb->rb_len, &offset, msg) );
+		
+		CHECK_MALLOC(  buf = malloc(rb->rb_len)  );
+		memcpy(buf, rb->rb_data, rb->rb_len);
+		
+		if (len) {
+			*len = rb->rb_len;
+		}
+		*buffer = buf;
+		return 0;
+	}
+	
 	/* Update the length. This also checks that all AVP have their values set */
 	CHECK_FCT(  fd_msg_update_length(msg)  );
 	
@@ -1946,61 +2151,280 @@ int fd_msg_bufferize ( struct msg * msg, unsigned char ** buffer, size_t * len )
 }
 
 
+/* Scatter-gather version of the bufferization: the AVP headers and small values are written in a "stub" area allocated
+ with the iovec array, the larger values are referenced where they are stored (in the AVP, or in the received buffer). */
+
+/* Values up to this size are copied in the stub area, this is cheaper than an additional iovec */
+#define IOV_COPY_MAX	32
+
+/* Stored in front of the iovec array returned by fd_msg_bufferize_iov */
+struct msg_iov_hdr {
+	struct msg_rawbuf	*rb;		/* A reference on the received buffer while the iovec may point inside */
+};
+
+/* How an AVP is written: 0: entirely in the stub area; 1: header in stub, then the children (grouped); 2: header in stub, then *data is referenced */
+static int iov_avp_kind(struct avp * avp, uint8_t ** data, size_t * len)
+{
+	struct dict_avp_data dictdata;
+	
+	if (avp->avp_model == NULL) {
+		if ( avp->avp_rawdata != NULL ) {
+			*data = avp->avp_rawdata;
+			*len = avp->avp_rawlen;
+		} else if ( avp->avp_source != NULL ) {
+			*data = avp->avp_source;
+			*len = avp->avp_public.avp_len - GETAVPHDRSZ(avp->avp_public.avp_flags);
+		} else {
+			return 0;
+		}
+	} else {
+		CHECK_FCT_DO(  fd_dict_getval(avp->avp_model, &dictdata), return 0  );
+		if (dictdata.avp_basetype == AVP_TYPE_GROUPED)
+			return 1;
+		if ((dictdata.avp_basetype != AVP_TYPE_OCTETSTRING) || (avp->avp_public.avp_value == NULL))
+			return 0;
+		*data = avp->avp_public.avp_value->os.data;
+		*len = avp->avp_public.avp_value->os.len;
+	}
+	
+	return (*len > IOV_COPY_MAX) ? 2 : 0;
+}
+
+/* Compute the number of iovecs and stub bytes needed for a list of AVPs */
+static void iov_size_chain(struct fd_list * list, int * cnt, size_t * stubsz)
+{
+	struct fd_list * avpch;
+	
+	for (avpch = list->next; avpch != list; avpch = avpch->next) {
+		struct avp * avp = _A(avpch->o);
+		uint8_t * data;
+		size_t len;
+		
+		switch (iov_avp_kind(avp, &data, &len)) {
+			case 0:
+				*stubsz += PAD4(avp->avp_public.avp_len);
+				*cnt += 1;
+				break;
+			case 1:
+				*stubsz += GETAVPHDRSZ(avp->avp_public.avp_flags);
+				*cnt += 1;
+				iov_size_chain(&avp->avp_chain.children, cnt, stubsz);
+				break;
+			case 2:
+				*stubsz += GETAVPHDRSZ(avp->avp_public.avp_flags) + PAD4(len) - len;
+				*cnt += 3;
+				break;
+		}
+	}
+}
+
+/* State while the iovec array is filled */
+struct iov_state {
+	struct iovec	*iov;		/* The array */
+	int		 cnt;		/* Number of iovec used */
+	uint8_t		*stub;		/* The stub area */
+	size_t		 stubsz;	/* its size */
+	size_t		 stubused;	/* and the bytes already written */
+};
+
+/* Account for len bytes written at the end of the stub area, merged with the previous iovec if it is contiguous */
+static void iov_add_stub(struct iov_state * st, size_t len)
+{
+	uint8_t * start = st->stub + st->stubused;
+	
+	if (!len)
+		return;
+	
+	if (st->cnt && ((uint8_t *)st->iov[st->cnt - 1].iov_base + st->iov[st->cnt - 1].iov_len == start)) {
+		st->iov[st->cnt - 1].iov_len += len;
+	} else {
+		st->iov[st->cnt].iov_base = start;
+		st->iov[st->cnt].iov_len = len;
+		st->cnt++;
+	}
+	st->stubused += len;
+}
+
+static int iov_fill_chain(struct iov_state * st, struct fd_list * list)
+{
+	struct fd_list * avpch;
+	
+	for (avpch = list->next; avpch != list; avpch = avpch->next) {
+		struct avp * avp = _A(avpch->o);
+		uint8_t * data;
+		size_t len, offset = st->stubused;
+		
+		switch (iov_avp_kind(avp, &data, &len)) {
+			case 0:
+				CHECK_FCT( bufferize_avp(st->stub, st->stubsz, &offset, avp) );
+				iov_add_stub(st, offset - st->stubused);
+				break;
+				
+			case 1:
+				bufferize_avp_hdr(st->stub, &offset, avp);
+				iov_add_stub(st, offset - st->stubused);
+				CHECK_FCT( iov_fill_chain(st, &avp->avp_chain.children) );
+				break;
+				
+			case 2:
+				bufferize_avp_hdr(st->stub, &offset, avp);
+				iov_add_stub(st, offset - st->stubused);
+				st->iov[st->cnt].iov_base = data;
+				st->iov[st->cnt].iov_len = len;
+				st->cnt++;
+				/* The stub area is zeroed, so this is the padding */
+				iov_add_stub(st, PAD4(len) - len);
+				break;
+		}
+	}
+	
+	return 0;
+}
+
+int fd_msg_bufferize_iov ( struct msg * msg, struct iovec ** iov, int * iovcnt )
+{
+	struct msg_iov_hdr * hdr;
+	struct iov_state st;
+	int cnt = 1;
+	size_t stubsz = GETMSGHDRSZ(), offset = 0, total = 0;
+	int ret, i;
+	
+	TRACE_ENTRY("%p %p %p", msg, iov, iovcnt);
+	
+	/* Check the parameters */
+	CHECK_PARAMS(  iov && iovcnt && CHECK_MSG(msg)  );
+	
+	/* Update the length. This also checks that all AVP have their values set */
+	CHECK_FCT(  fd_msg_update_length(msg)  );
+	
+	/* Compute the size of the stub area and the number of iovecs */
+	if (msg->msg_raw) {
+		stubsz = 0;
+	} else {
+		iov_size_chain(&msg->msg_chain.children, &cnt, &stubsz);
+	}
+	
+	/* The stub area follows the iovec array */
+	CHECK_MALLOC(  hdr = calloc(1, sizeof(struct msg_iov_hdr) + cnt * sizeof(struct iovec) + stubsz)  );
+	
+	memset(&st, 0, sizeof(st));
+	st.iov = (struct iovec *)(hdr + 1);
+	st.stub = (uint8_t *)(st.iov + cnt);
+	st.stubsz = stubsz;
+	
+	if (msg->msg_raw) {
+		/* Rewrite the header in place and send the buffer as received */
+		CHECK_FCT_DO( ret = bufferize_msg(msg->msg_rawbuffer->rb_data, msg->msg_rawbuffer->rb_len, &offset, msg), goto error );
+		st.iov[0].iov_base = msg->msg_rawbuffer->rb_data;
+		st.iov[0].iov_len = msg->msg_rawbuffer->rb_len;
+		st.cnt = 1;
+	} else {
+		CHECK_FCT_DO( ret = bufferize_msg(st.stub, st.stubsz, &offset, msg), goto error );
+		iov_add_stub(&st, offset);
+		CHECK_FCT_DO( ret = iov_fill_chain(&st, &msg->msg_chain.children), goto error );
+	}
+	
+	for (i = 0; i < st.cnt; i++)
+		total += st.iov[i].iov_len;
+	ASSERT(total == msg->msg_public.msg_length); /* or the msg_update_length is buggy */
+	
+	/* Some values may point inside the received buffer; it must remain available until the iovec is freed */
+	if (msg->msg_rawbuffer) {
+		rawbuf_ref(msg->msg_rawbuffer);
+		hdr->rb = msg->msg_rawbuffer;
+	}
+	
+	*iov = st.iov;
+	*iovcnt = st.cnt;
+	return 0;
+	
+error:
+	free(hdr);
+	return ret;
+}
+
+void fd_msg_iov_free ( struct iovec * iov )
+{
+	struct msg_iov_hdr * hdr;
+	
+	TRACE_ENTRY("%p", iov);
+	
+	if (!iov)
+		return;
+	
+	hdr = ((struct msg_iov_hdr *)iov) - 1;
+	if (hdr->rb)
+		rawbuf_unref(hdr->rb);
+	free(hdr);
+}
+
+
 /***************************************************************************************************************/
 /* Parsing buffers and building AVP objects lists (not parsing the AVP values which requires dictionary knowledge) */
 
+/* Read the header of the AVP at buf + *offset and check that the AVP fits in the buffer. On return, *offset is the position of the AVP data. */
+static int parsebuf_avp_hdr(unsigned char * buf, size_t buflen, size_t * offset, struct avp_hdr * hdr)
+{
+	if (buflen - *offset < AVPHDRSZ_NOVEND) {
+		TRACE_DEBUG(INFO, "truncated buffer: remaining only %zd bytes", buflen - *offset);
+		return EBADMSG;
+	}
+	
+	hdr->avp_code    = ntohl(*(uint32_t *)(buf + *offset));
+	hdr->avp_flags   = buf[*offset + 4];
+	hdr->avp_len     = ((uint32_t)buf[*offset+5]) << 16 |  ((uint32_t)buf[*offset+6]) << 8 |  ((uint32_t)buf[*offset+7]) ;
+	hdr->avp_vendor  = 0;
+	
+	*offset += 8;
+	
+	if (hdr->avp_flags & AVP_FLAG_VENDOR) {
+		if (buflen - *offset < 4) {
+			TRACE_DEBUG(INFO, "truncated buffer: remaining only %zd bytes for vendor and data", buflen - *offset);
+			return EBADMSG;
+		}
+		hdr->avp_vendor  = ntohl(*(uint32_t *)(buf + *offset));
+		*offset += 4;
+	}
+	
+	/* Check the length is valid */
+	if ( hdr->avp_len < GETAVPHDRSZ(hdr->avp_flags) ) {
+		TRACE_DEBUG(INFO, "Invalid AVP size %d",
+				hdr->avp_len);
+		return EBADMSG;
+	}
+	/* Check there is enough remaining data in the buffer */
+	if ( (hdr->avp_len > GETAVPHDRSZ(hdr->avp_flags))
+	&& (buflen - *offset < hdr->avp_len - GETAVPHDRSZ(hdr->avp_flags))) {
+		TRACE_DEBUG(INFO, "truncated buffer: remaining only %zd bytes for data, and avp data size is %d", 
+				buflen - *offset, 
+				hdr->avp_len - GETAVPHDRSZ(hdr->avp_flags));
+		return EBADMSG;
+	}
+	
+	return 0;
+}
+
 /* Parse a buffer containing a supposed list of AVPs */
 static int parsebuf_list(unsigned char * buf, size_t buflen, struct fd_list * head)
 {
 	size_t offset = 0;
+	int ret;
 	
 	TRACE_ENTRY("%p %zd %p", buf, buflen, head);
 	
 	while (offset < buflen) {
 		struct avp * avp;
 		
-		if (buflen - offset < AVPHDRSZ_NOVEND) {
-			TRACE_DEBUG(INFO, "truncated buffer: remaining only %zd bytes", buflen - offset);
-			return EBADMSG;
-		}
-		
 		/* Create a new AVP object */
-		CHECK_MALLOC(  avp = malloc (sizeof(struct avp))  );
+		CHECK_MALLOC(  avp = fd_mp_alloc (FD_MSG_POOL_AVP)  );
 		
 		init_avp(avp);
 		
 		/* Initialize the header */
-		avp->avp_public.avp_code    = ntohl(*(uint32_t *)(buf + offset));
-		avp->avp_public.avp_flags   = buf[offset + 4];
-		avp->avp_public.avp_len     = ((uint32_t)buf[offset+5]) << 16 |  ((uint32_t)buf[offset+6]) << 8 |  ((uint32_t)buf[offset+7]) ;
-		
-		offset += 8;
-		
-		if (avp->avp_public.avp_flags & AVP_FLAG_VENDOR) {
-			if (buflen - offset < 4) {
-				TRACE_DEBUG(INFO, "truncated buffer: remaining only %zd bytes for vendor and data", buflen - offset);
-				free(avp);
-				return EBADMSG;
-			}
-			avp->avp_public.avp_vendor  = ntohl(*(uint32_t *)(buf + offset));
-			offset += 4;
-		}
-		
-		/* Check the length is valid */
-		if ( avp->avp_public.avp_len < GETAVPHDRSZ(avp->avp_public.avp_flags) ) {
-			TRACE_DEBUG(INFO, "Invalid AVP size %d",
-					avp->avp_public.avp_len);
-			free(avp);
-			return EBADMSG;
-		}
-		/* Check there is enough remaining data in the buffer */
-		if ( (avp->avp_public.avp_len > GETAVPHDRSZ(avp->avp_public.avp_flags))
-		&& (buflen - offset < avp->avp_public.avp_len - GETAVPHDRSZ(avp->avp_public.avp_flags))) {
-			TRACE_DEBUG(INFO, "truncated buffer: remaining only %zd bytes for data, and avp data size is %d", 
-					buflen - offset, 
-					avp->avp_public.avp_len - GETAVPHDRSZ(avp->avp_public.avp_flags));
-			free(avp);
-			return EBADMSG;
+		ret = parsebuf_avp_hdr(buf, buflen, &offset, &avp->avp_public);
+		if (ret) {
+			fd_mp_free(FD_MSG_POOL_AVP, avp);
+			return ret;
 		}
 		
 		/* buf[offset] is now the beginning of the data */
@@ -2016,15 +2440,147 @@ static int parsebuf_list(unsigned char * buf, size_t buflen, struct fd_list * he
 	return 0;
 }
 
-/* Create a message object from a buffer. Dictionary objects are not resolved, AVP contents are not interpreted, buffer is saved in msg */
-int fd_msg_parse_buffer ( unsigned char ** buffer, size_t buflen, struct msg ** msg )
+/* Check the AVPs in a buffer are correctly framed, without creating the objects. *end receives the offset after the last AVP padding. */
+static int parsebuf_check(unsigned char * buf, size_t buflen, size_t * end)
+{
+	size_t offset = 0;
+	struct avp_hdr hdr;
+	int ret;
+	
+	while (offset < buflen) {
+		ret = parsebuf_avp_hdr(buf, buflen, &offset, &hdr);
+		if (ret)
+			return ret;
+		offset += PAD4(hdr.avp_len - GETAVPHDRSZ(hdr.avp_flags));
+	}
+	
+	*end = offset;
+	return 0;
+}
+
+/* Create the AVP objects of a message received with fd_msg_parse_buffer_raw, the first time they are needed */
+static int raw_split(struct msg * msg)
+{
+	int ret;
+	
+	if (!msg->msg_raw)
+		return 0;
+	
+	ret = parsebuf_list(msg->msg_rawbuffer->rb_data + GETMSGHDRSZ(), msg->msg_rawbuffer->rb_len - GETMSGHDRSZ(), &msg->msg_chain.children);
+	if (ret) {
+		/* Remove the AVPs that were already created, the message is still usable as raw */
+		while (!FD_IS_LIST_EMPTY(&msg->msg_chain.children))
+			destroy_tree(_C(msg->msg_chain.children.next->o));
+		return ret;
+	}
+	
+	msg->msg_raw = 0;
+	return 0;
+}
+
+int fd_msg_is_raw ( struct msg * msg )
+{
+	TRACE_ENTRY("%p", msg);
+	
+	CHECK_PARAMS_DO( CHECK_MSG(msg), return 0 );
+	return msg->msg_raw;
+}
+
+int fd_msg_raw_next ( struct msg * msg, size_t * pos, struct avp_hdr * hdr, uint8_t ** data, size_t * datalen )
+{
+	struct msg_rawbuf * rb;
+	size_t offset;
+	
+	TRACE_ENTRY("%p %p %p %p %p", msg, pos, hdr, data, datalen);
+	
+	CHECK_PARAMS( CHECK_MSG(msg) && msg->msg_raw && pos && hdr && data );
+	rb = msg->msg_rawbuffer;
+	
+	offset = *pos ?: GETMSGHDRSZ();
+	if (offset >= rb->rb_len)
+		return ENOENT;
+	
+	CHECK_FCT( parsebuf_avp_hdr(rb->rb_data, rb->rb_len, &offset, hdr) );
+	hdr->avp_value = NULL;
+	
+	*data = rb->rb_data + offset;
+	if (datalen)
+		*datalen = hdr->avp_len - GETAVPHDRSZ(hdr->avp_flags);
+	*pos = offset + PAD4(hdr->avp_len - GETAVPHDRSZ(hdr->avp_flags));
+	return 0;
+}
+
+/* Tell if an AVP header matches a code and vendor */
+static int peek_match(struct avp_hdr * hdr, uint32_t code, vendor_id_t vendor)
+{
+	if (hdr->avp_code != code)
+		return 0;
+	if (vendor)
+		return (hdr->avp_flags & AVP_FLAG_VENDOR) && (hdr->avp_vendor == vendor);
+	return !(hdr->avp_flags & AVP_FLAG_VENDOR);
+}
+
+/* Read a 32-bit value in a top-level AVP, without creating or decoding the AVP objects */
+int fd_msg_peek_i32 ( struct msg * msg, uint32_t code, vendor_id_t vendor, int32_t * val )
+{
+	struct fd_list * li;
+	
+	TRACE_ENTRY("%p %u %u %p", msg, code, vendor, val);
+	
+	CHECK_PARAMS( CHECK_MSG(msg) && val );
+	
+	if (msg->msg_raw) {
+		struct msg_rawbuf * rb = msg->msg_rawbuffer;
+		size_t offset = GETMSGHDRSZ();
+		struct avp_hdr hdr;
+		
+		while (offset < rb->rb_len) {
+			if (parsebuf_avp_hdr(rb->rb_data, rb->rb_len, &offset, &hdr))
+				return EBADMSG;
+			if (peek_match(&hdr, code, vendor)) {
+				if (hdr.avp_len - GETAVPHDRSZ(hdr.avp_flags) != 4)
+					return EBADMSG;
+				*val = (int32_t)ntohl(*(uint32_t *)(rb->rb_data + offset));
+				return 0;
+			}
+			offset += PAD4(hdr.avp_len - GETAVPHDRSZ(hdr.avp_flags));
+		}
+		return ENOENT;
+	}
+	
+	for (li = msg->msg_chain.children.next; li != &msg->msg_chain.children; li = li->next) {
+		struct avp * avp = _A(li->o);
+		uint8_t * data;
+		
+		if (!peek_match(&avp->avp_public, code, vendor))
+			continue;
+		
+		/* Already decoded */
+		if (avp->avp_public.avp_value) {
+			*val = avp->avp_public.avp_value->i32;
+			return 0;
+		}
+		
+		/* Received but not decoded yet (or not found in the dictionary) */
+		data = avp->avp_source ?: avp->avp_rawdata;
+		if (!data || (avp->avp_public.avp_len - GETAVPHDRSZ(avp->avp_public.avp_flags) != 4))
+			return EBADMSG;
+		*val = (int32_t)ntohl(*(uint32_t *)data);
+		return 0;
+	}
+	return ENOENT;
+}
+
+/* Create a message object from a buffer. Dictionary objects are not resolved, AVP contents are not interpreted, buffer is saved in msg.
+ If raw is set, the AVP objects are only created when needed (see raw_split) */
+static int parse_buffer ( unsigned char ** buffer, size_t buflen, struct msg ** msg, int raw )
 {
 	struct msg * new = NULL;
 	int ret = 0;
 	uint32_t msglen = 0;
 	unsigned char * buf;
 	
-	TRACE_ENTRY("%p %zd %p", buffer, buflen, msg);
+	TRACE_ENTRY("%p %zd %p %d", buffer, buflen, msg, raw);
 	
 	CHECK_PARAMS(  buffer &&  *buffer  &&  msg  &&  (buflen >= GETMSGHDRSZ())  );
 	buf = *buffer;
@@ -2045,7 +2601,7 @@ int fd_msg_parse_buffer ( unsigned char ** buffer, size_t buflen, struct msg **
 	}
 	
 	/* Create a new object */
-	CHECK_MALLOC( new = malloc (sizeof(struct msg)) );
+	CHECK_MALLOC( new = fd_mp_alloc (FD_MSG_POOL_MSG) );
 	
 	/* Initialize the fields */
 	init_msg(new);
@@ -2061,16 +2617,36 @@ int fd_msg_parse_buffer ( unsigned char ** buffer, size_t buflen, struct msg **
 	new->msg_public.msg_hbhid = ntohl(*(uint32_t *)(buf+12));
 	new->msg_public.msg_eteid = ntohl(*(uint32_t *)(buf+16));
 	
+	if (raw) {
+		size_t end = 0;
+		
+		/* Only check the AVPs framing. The AVPs can be appended to the buffer only if the last one is padded. */
+		CHECK_FCT_DO( ret = parsebuf_check(buf + GETMSGHDRSZ(), buflen - GETMSGHDRSZ(), &end), { destroy_tree(_C(new)); return ret; }  );
+		new->msg_raw = ((buflen == msglen) && (end == buflen - GETMSGHDRSZ()));
+	}
+	
 	/* Parse the AVP list */
-	CHECK_FCT_DO( ret = parsebuf_list(buf + GETMSGHDRSZ(), buflen - GETMSGHDRSZ(), &new->msg_chain.children), { destroy_tree(_C(new)); return ret; }  );
+	if (!new->msg_raw) {
+		CHECK_FCT_DO( ret = parsebuf_list(buf + GETMSGHDRSZ(), buflen - GETMSGHDRSZ(), &new->msg_chain.children), { destroy_tree(_C(new)); return ret; }  );
+	}
 	
 	/* Parsing successful */
-	new->msg_rawbuffer = buf;
+	CHECK_MALLOC_DO( new->msg_rawbuffer = rawbuf_new(buf, buflen), { destroy_tree(_C(new)); return ENOMEM; } );
 	*buffer = NULL;
 	*msg = new;
 	return 0;
 }
 
+int fd_msg_parse_buffer ( unsigned char ** buffer, size_t buflen, struct msg ** msg )
+{
+	return parse_buffer(buffer, buflen, msg, 0);
+}
+
+int fd_msg_parse_buffer_raw ( unsigned char ** buffer, size_t buflen, struct msg ** msg )
+{
+	return parse_buffer(buffer, buflen, msg, 1);
+}
+
 		
 /***************************************************************************************************************/
 /* Parsing messages and AVP with dictionary information */
@@ -2084,15 +2660,16 @@ int fd_msg_parse_buffer ( unsigned char ** buffer, size_t buflen, struct msg **
 
 static char error_message[256];
 
-/* Process an AVP. If we are not in recheck, the avp_source must be set. */
-static int parsedict_do_avp(struct dictionary * dict, struct avp * avp, int mandatory, struct fd_pei *error_info)
+/* Process an AVP. If we are not in recheck, the avp_source must be set. In lazy mode, the children of a grouped AVP are
+ split from the source but not decoded. */
+static int parsedict_do_avp(struct dictionary * dict, struct avp * avp, int mandatory, struct fd_pei *error_info, struct msg_rawbuf * rb, int lazy)
 {
 	struct dict_avp_data dictdata;
 	struct dict_type_data derivedtypedata;
 	struct dict_object * avp_derived_type = NULL;
 	uint8_t * source;
 	
-	TRACE_ENTRY("%p %p %d %p", dict, avp, mandatory, error_info);
+	TRACE_ENTRY("%p %p %d %p %p %d", dict, avp, mandatory, error_info, rb, lazy);
 	
 	/* First check we received an AVP as input */
 	CHECK_PARAMS(  CHECK_AVP(avp) );
@@ -2103,8 +2680,11 @@ static int parsedict_do_avp(struct dictionary * dict, struct avp * avp, int mand
 		CHECK_FCT(  fd_dict_getval(avp->avp_model, &dictdata)  );
 
 		if ( avp->avp_public.avp_code == dictdata.avp_code  ) {
+			if (lazy)
+				return 0;
+			
 			/* Ok then just process the children if any */
-			return parsedict_do_chain(dict, &avp->avp_chain.children, mandatory && (avp->avp_public.avp_flags & AVP_FLAG_MANDATORY), error_info);
+			return parsedict_do_chain(dict, &avp->avp_chain.children, mandatory && (avp->avp_public.avp_flags & AVP_FLAG_MANDATORY), error_info, rb);
 		} else {
 			/* We just erase the old model */
 			avp->avp_model = NULL;
@@ -2158,7 +2738,7 @@ static int parsedict_do_avp(struct dictionary * dict, struct avp * avp, int mand
 			avp->avp_rawlen = avp->avp_public.avp_len - GETAVPHDRSZ( avp->avp_public.avp_flags );
 			
 			if (avp->avp_rawlen) {
-				CHECK_MALLOC(  avp->avp_rawdata = malloc(avp->avp_rawlen)  );
+				CHECK_MALLOC(  avp->avp_rawdata = fd_mp_buf_alloc(avp->avp_rawlen)  );
 			
 				memcpy(avp->avp_rawdata, avp->avp_source, avp->avp_rawlen);
 			}
@@ -2220,11 +2800,18 @@ static int parsedict_do_avp(struct dictionary * dict, struct avp * avp, int mand
 						snprintf(error_message, sizeof(error_message), "I cannot parse this AVP as a Grouped AVP");
 						error_info->pei_message = error_message;
 					}
+					/* Remove the children already created, so that the AVP is decoded (and the error found) again next time */
+					while (!FD_IS_LIST_EMPTY(&avp->avp_chain.children))
+						destroy_tree(_C(avp->avp_chain.children.next->o));
+					avp->avp_model = NULL;
 					avp->avp_source = source;
 					return ret;
 				}  );
 			
-			return parsedict_do_chain(dict, &avp->avp_chain.children, mandatory && (avp->avp_public.avp_flags & AVP_FLAG_MANDATORY), error_info);
+			if (lazy)
+				return 0;
+			
+			return parsedict_do_chain(dict, &avp->avp_chain.children, mandatory && (avp->avp_public.avp_flags & AVP_FLAG_MANDATORY), error_info, rb);
 		}
 			
 		case AVP_TYPE_OCTETSTRING:
@@ -2239,8 +2826,21 @@ static int parsedict_do_avp(struct dictionary * dict, struct avp * avp, int mand
 					return EBADMSG;
 				} );
 			avp->avp_storage.os.len = avp->avp_public.avp_len - GETAVPHDRSZ( avp->avp_public.avp_flags );
-			CHECK_MALLOC(  avp->avp_storage.os.data = os0dup(source, avp->avp_storage.os.len)  );
-			avp->avp_mustfreeos = 1;
+			
+			/* If the value is inside the received buffer, we can reference it instead of copying it. The value
+			 must still be terminated by a '\0' as with os0dup: this is the case when the next byte is padding (which
+			 we can overwrite, it must be 0 anyway) or already 0 (usually the first byte of the next AVP code). */
+			if (rb && (source >= rb->rb_data) && (source + avp->avp_storage.os.len < rb->rb_data + rb->rb_len)
+			       && ((avp->avp_storage.os.len & 3) || (source[avp->avp_storage.os.len] == '\0'))) {
+				source[avp->avp_storage.os.len] = '\0';
+				avp->avp_storage.os.data = source;
+				rawbuf_ref(rb);
+				avp->avp_rawbuf = rb;
+				break;
+			}
+			
+			CHECK_MALLOC(  avp->avp_storage.os.data = os0dup_pool(source, avp->avp_storage.os.len)  );
+			avp->avp_mustfreeos = 2;
 			break;
 		
 		case AVP_TYPE_INTEGER32:
@@ -2294,6 +2894,12 @@ static int parsedict_do_avp(struct dictionary * dict, struct avp * avp, int mand
 					LOG_E("Invalid AVP: %s", buf);
 					free(buf);
 				}
+				if (lazy) {
+					/* Leave the AVP undecoded so that the error is reported again by fd_msg_parse_dict */
+					free_avp_os(avp);
+					avp->avp_model = NULL;
+					avp->avp_source = source;
+				}
 				return ret; /* should we just return EBADMSG? */
 			}
 		}
@@ -2304,19 +2910,19 @@ static int parsedict_do_avp(struct dictionary * dict, struct avp * avp, int mand
 	return 0;
 }
 
-/* Process a list of AVPs */
-static int parsedict_do_chain(struct dictionary * dict, struct fd_list * head, int mandatory, struct fd_pei *error_info)
+/* Process a list of AVPs. rb is the buffer the AVPs were parsed from, if known. */
+static int parsedict_do_chain(struct dictionary * dict, struct fd_list * head, int mandatory, struct fd_pei *error_info, struct msg_rawbuf * rb)
 {
 	struct fd_list * avpch;
 	
-	TRACE_ENTRY("%p %p %d %p", dict, head, mandatory, error_info);
+	TRACE_ENTRY("%p %p %d %p %p", dict, head, mandatory, error_info, rb);
 	
 	/* Sanity check */
 	ASSERT ( head == head->head );
 	
 	/* Now process the list */
 	for (avpch=head->next; avpch != head; avpch = avpch->next) {
-		CHECK_FCT(  parsedict_do_avp(dict, _A(avpch->o), mandatory, error_info)  );
+		CHECK_FCT(  parsedict_do_avp(dict, _A(avpch->o), mandatory, error_info, rb, 0)  );
 	}
 	
 	/* Done */
@@ -2374,11 +2980,12 @@ static int parsedict_do_msg(struct dictionary * dict, struct msg * msg, int only
 chain:	
 	if (!only_hdr) {
 		/* Then process the children */
-		ret = parsedict_do_chain(dict, &msg->msg_chain.children, 1, error_info);
+		CHECK_FCT( raw_split(msg) );
+		ret = parsedict_do_chain(dict, &msg->msg_chain.children, 1, error_info, msg->msg_rawbuffer);
 
-		/* Free the raw buffer if any */
+		/* Release the raw buffer if any. It remains allocated as long as some AVP values point inside it. */
 		if ((ret == 0) && (msg->msg_rawbuffer != NULL)) {
-			free(msg->msg_rawbuffer);
+			rawbuf_unref(msg->msg_rawbuffer);
 			msg->msg_rawbuffer=NULL;
 		}
 	}
@@ -2392,6 +2999,19 @@ no_model:
 	return ENOTSUP;
 }
 
+/* Find the received buffer of the message an AVP belongs to, if it is still attached */
+static struct msg_rawbuf * rawbuf_of(struct msg_avp_chain * obj)
+{
+	/* Go up to the top-level object */
+	while (obj->chaining.head != &obj->chaining)
+		obj = _C(obj->chaining.head->o);
+	
+	if (obj->type == MSG_MSG)
+		return _M(obj)->msg_rawbuffer;
+	
+	return NULL;
+}
+
 int fd_msg_parse_dict ( msg_or_avp * object, struct dictionary * dict, struct fd_pei *error_info )
 {
 	TRACE_ENTRY("%p %p %p", dict, object, error_info);
@@ -2406,7 +3026,7 @@ int fd_msg_parse_dict ( msg_or_avp * object, struct dictionary * dict, struct fd
 			return parsedict_do_msg(dict, _M(object), 0, error_info);
 		
 		case MSG_AVP:
-			return parsedict_do_avp(dict, _A(object), 0, error_info);
+			return parsedict_do_avp(dict, _A(object), 0, error_info, rawbuf_of(_C(object)), 0);
 		
 		default:
 			ASSERT(0);
@@ -2417,49 +3037,23 @@ int fd_msg_parse_dict ( msg_or_avp * object, struct dictionary * dict, struct fd
 /***************************************************************************************************************/
 /* Parsing messages and AVP for rules (ABNF) compliance */
 
-/* This function is used to get stats (first occurrence position, last occurrence position, number of occurrences) 
-   of AVP instances of a given model in a chain of AVP */
-static void parserules_stat_avps( struct dict_object * model_avp, struct fd_list *list, int * count, int * firstpos, int * lastpos) 
-{
-	struct fd_list * li;
-	int curpos = 0; /* The current position in the list */
-	
-	TRACE_ENTRY("%p %p %p %p %p", model_avp, list, count, firstpos, lastpos);
-	
-	*count = 0;	/* number of instances found */
-	*firstpos = 0;	/* position of the first instance */
-	*lastpos = 0;	/* position of the last instance, starting from the end */
-	
-	for (li = list->next; li != list; li = li->next) {
-		/* Increment the current position counter */
-		curpos++;
-		
-		/* If we previously saved a "lastpos" information, increment it */
-		if (*lastpos != 0)
-			(*lastpos)++;
-		
-		/* Check the type of the next AVP. We can compare the references directly, it is safe. */
-		if (_A(li->o)->avp_model == model_avp) {
-			
-			/* This AVP is of the type we are searching */
-			(*count)++;
-			
-			/* If we don't have yet a "firstpos", save it */
-			if (*firstpos == 0)
-				*firstpos = curpos;
-			
-			/* Reset the lastpos */
-			(*lastpos) = 1;
-		}
-	}
-}
-
-/* We use this structure as parameter for the next function */
+/* We use this structure as parameter for parserules_check_rules */
 struct parserules_data {
 	struct fd_list  * sentinel;  	/* Sentinel of the list of children AVP */
 	struct fd_pei 	* pei;   	/* If the rule conflicts, save the error here */
 };
 
+/* Stats of the AVP instances concerning a rule, in a chain of AVP: number of occurrences, position of the first one,
+   and position of the last one (counted from the start here, then converted to a position from the end) */
+struct parserules_stat {
+	int count;
+	int first;
+	int last;
+};
+
+/* Number of rules for which the stats are kept on the stack */
+#define PARSERULES_STAT_STACK	64
+
 /* Create an empty AVP of a given model (to use in Failed-AVP) */
 static struct avp * empty_avp(struct dict_object * model_avp)
 {
@@ -2501,37 +3095,23 @@ static struct avp * empty_avp(struct dict_object * model_avp)
 	return avp;
 }
 
-/* Check that a list of AVPs is compliant with a given rule -- will be iterated on the list of rules */
-static int parserules_check_one_rule(void * data, struct dict_rule_data *rule)
+/* Check that the stats of AVPs in a list are compliant with a given rule */
+static int parserules_check_one_rule(struct parserules_data * pr_data, struct dict_rule_data *rule, const char * avp_name, int count, int first, int last)
 {
-	int count, first, last, min;
-	struct parserules_data * pr_data = data;
-	char * avp_name = "<unresolved name>";
+	int min;
 	
-	TRACE_ENTRY("%p %p", data, rule);
+	TRACE_ENTRY("%p %p %p %d %d %d", pr_data, rule, avp_name, count, first, last);
 	
-	/* Get statistics of the AVP concerned by this rule in the parent instance */
-	parserules_stat_avps( rule->rule_avp, pr_data->sentinel, &count, &first, &last);
-	
-	if (TRACE_BOOL(INFO))
-	{
-		struct dict_avp_data avpdata;
-		int ret;
-		ret = fd_dict_getval(rule->rule_avp, &avpdata);
-		if (ret == 0)
-			avp_name = avpdata.avp_name;
-		
-		TRACE_DEBUG(ANNOYING, "Checking rule: p:%d(%d) m/M:%2d/%2d. Counted %d (first: %d, last:%d) of AVP '%s'", 
-					rule->rule_position,
-					rule->rule_order,
-					rule->rule_min,
-					rule->rule_max,
-					count, 
-					first, 
-					last,
-					avp_name
-				);
-	}
+	TRACE_DEBUG(ANNOYING, "Checking rule: p:%d(%d) m/M:%2d/%2d. Counted %d (first: %d, last:%d) of AVP '%s'", 
+				rule->rule_position,
+				rule->rule_order,
+				rule->rule_min,
+				rule->rule_max,
+				count, 
+				first, 
+				last,
+				avp_name
+			);
 	
 	/* Now check the rule is not conflicting */
 	
@@ -2611,6 +3191,49 @@ static int parserules_check_one_rule(void * data, struct dict_rule_data *rule)
 	return 0;
 }
 
+/* Check that a list of AVPs is compliant with the compiled rules of its parent, in a single pass over the list */
+static int parserules_check_rules(void * data, struct dict_rules_compiled * rules)
+{
+	struct parserules_data * pr_data = data;
+	struct parserules_stat stack[PARSERULES_STAT_STACK], * stats = stack;
+	struct fd_list * li;
+	int curpos = 0, i, ret = 0;
+	
+	TRACE_ENTRY("%p %p", data, rules);
+	
+	if (rules->nb > PARSERULES_STAT_STACK) {
+		CHECK_MALLOC( stats = calloc(rules->nb, sizeof(struct parserules_stat)) );
+	} else {
+		memset(stats, 0, rules->nb * sizeof(struct parserules_stat));
+	}
+	
+	/* Get statistics of the AVPs concerned by the rules in the parent instance */
+	for (li = pr_data->sentinel->next; li != pr_data->sentinel; li = li->next) {
+		/* We can compare the references of the models directly, it is safe. */
+		curpos++;
+		i = fd_dict_rules_slot(rules, _A(li->o)->avp_model);
+		if (i < 0)
+			continue;
+		
+		stats[i].count++;
+		if (stats[i].first == 0)
+			stats[i].first = curpos;
+		stats[i].last = curpos;
+	}
+	
+	/* Now check the rules in their order, so that the first conflicting rule is reported as before */
+	for (i = 0; i < rules->nb; i++) {
+		ret = parserules_check_one_rule(pr_data, &rules->rules[i], rules->names[i], stats[i].count, stats[i].first,
+						stats[i].count ? curpos - stats[i].last + 1 : 0);
+		if (ret)
+			break;
+	}
+	
+	if (stats != stack)
+		free(stats);
+	return ret;
+}
+
 /* Check the rules recursively */
 static int parserules_do ( struct dictionary * dict, msg_or_avp * object, struct fd_pei *error_info, int mandatory)
 {
@@ -2686,7 +3309,7 @@ static int parserules_do ( struct dictionary * dict, msg_or_avp * object, struct
 	/* Now check all rules of this object */
 	data.sentinel = &_C(object)->children;
 	data.pei  = error_info;
-	CHECK_FCT( fd_dict_iterate_rules ( model, &data, parserules_check_one_rule ) );
+	CHECK_FCT( fd_dict_iterate_rules_compiled ( model, &data, parserules_check_rules ) );
 	
 	return 0;
 }
@@ -2722,6 +3345,12 @@ int fd_msg_update_length ( msg_or_avp * object )
 	/* Get the model of the object. This also validates the object */
 	CHECK_FCT( fd_msg_model ( object, &model ) );
 	
+	/* The length of a raw message is the length of its buffer */
+	if ((_C(object)->type == MSG_MSG) && _M(object)->msg_raw) {
+		_M(object)->msg_public.msg_length = _M(object)->msg_rawbuffer->rb_len;
+		return 0;
+	}
+	
 	/* Get the information of the model */
 	if (model) {
 		CHECK_FCT(  fd_dict_getval(model, &dictdata)  );
@@ -2802,7 +3431,6 @@ int fd_msg_dispatch ( struct msg ** msg, struct session * session, enum disp_act
 	struct dict_object * app;
 	struct dict_object * cmd;
 	struct avp * avp;
-	struct fd_list * cb_list;
 	int ret = 0, r2;
 	
 	TRACE_ENTRY("%p %p %p %p", msg, session, action, error_code);
@@ -2819,7 +3447,7 @@ int fd_msg_dispatch ( struct msg ** msg, struct session * session, enum disp_act
 	pthread_cleanup_push( fd_cleanup_rwlock, &fd_disp_lock );
 	
 	/* First, call the DISP_HOW_ANY callbacks */
-	CHECK_FCT_DO( ret = fd_disp_call_cb_int( NULL, msg, NULL, session, action, NULL, NULL, NULL, NULL, drop_reason, drop_msg ), goto out );
+	CHECK_FCT_DO( ret = fd_disp_call_cb_int( DISP_HOW_ANY, msg, NULL, session, action, NULL, NULL, NULL, NULL, drop_reason, drop_msg ), goto out );
 
 	TEST_ACTION_STOP();
 	
@@ -2846,15 +3474,14 @@ int fd_msg_dispatch ( struct msg ** msg, struct session * session, enum disp_act
 	/* So start browsing the message */
 	CHECK_FCT_DO( ret = fd_msg_browse( *msg, MSG_BRW_FIRST_CHILD, &avp, NULL ), goto out );
 	while (avp != NULL) {
-		/* For unknown AVP, we don't have a callback registered, so just skip */
-		if (avp->avp_model) {
+		int values = 0;
+		
+		/* For unknown AVP, or AVP without handler, we don't have a callback registered, so just skip */
+		if (avp->avp_model && fd_disp_avp_handlers(avp->avp_model, &values)) {
 			struct dict_object * enumval = NULL;
 			
-			/* Get the list of callback for this AVP */
-			CHECK_FCT_DO( ret = fd_dict_disp_cb(DICT_AVP, avp->avp_model, &cb_list), goto out );
-			
-			/* We search enumerated values only in case of non-grouped AVP */
-			if ( avp->avp_public.avp_value ) {
+			/* We search enumerated values only in case of non-grouped AVP, and if a callback depends on it */
+			if ( values && avp->avp_public.avp_value ) {
 				struct dict_object * type;
 				/* Check if the AVP has a constant value */
 				CHECK_FCT_DO( ret = fd_dict_search(dict, DICT_TYPE, TYPE_OF_AVP, avp->avp_model, &type, 0), goto out );
@@ -2868,7 +3495,7 @@ int fd_msg_dispatch ( struct msg ** msg, struct session * session, enum disp_act
 			}
 			
 			/* Call the callbacks */
-			CHECK_FCT_DO( ret = fd_disp_call_cb_int( cb_list, msg, avp, session, action, app, cmd, avp->avp_model, enumval, drop_reason, drop_msg ), goto out );
+			CHECK_FCT_DO( ret = fd_disp_call_cb_int( DISP_HOW_AVP, msg, avp, session, action, app, cmd, avp->avp_model, enumval, drop_reason, drop_msg ), goto out );
 			TEST_ACTION_STOP();
 		}
 		/* Go to next AVP */
@@ -2876,13 +3503,11 @@ int fd_msg_dispatch ( struct msg ** msg, struct session * session, enum disp_act
 	}
 		
 	/* Now call command and application callbacks */
-	CHECK_FCT_DO( ret = fd_dict_disp_cb(DICT_COMMAND, cmd, &cb_list), goto out );
-	CHECK_FCT_DO( ret = fd_disp_call_cb_int( cb_list, msg, NULL, session, action, app, cmd, NULL, NULL, drop_reason, drop_msg ), goto out );
+	CHECK_FCT_DO( ret = fd_disp_call_cb_int( DISP_HOW_CC, msg, NULL, session, action, app, cmd, NULL, NULL, drop_reason, drop_msg ), goto out );
 	TEST_ACTION_STOP();
 	
 	if (app) {
-		CHECK_FCT_DO( ret = fd_dict_disp_cb(DICT_APPLICATION, app, &cb_list), goto out );
-		CHECK_FCT_DO( ret = fd_disp_call_cb_int( cb_list, msg, NULL, session, action, app, cmd, NULL, NULL, drop_reason, drop_msg ), goto out );
+		CHECK_FCT_DO( ret = fd_disp_call_cb_int( DISP_HOW_APPID, msg, NULL, session, action, app, cmd, NULL, NULL, drop_reason, drop_msg ), goto out );
 		TEST_ACTION_STOP();
 	}
 out:
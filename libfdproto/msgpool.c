@@ -0,0 +1,502 @@
+/*********************************************************************************************************
+* Software License Agreement (BSD License)                                                               *
+* Author: Sebastien Decugis <sdecugis@freediameter.net>							 *
+*													 *
+* Copyright (c) 2023, WIDE Project and NICT								 *
+* All rights reserved.											 *
+* 													 *
+* Redistribution and use of this software in source and binary forms, with or without modification, are  *
+* permitted provided that the following conditions are met:						 *
+* 													 *
+* * Redistributions of source code must retain the above 						 *
+*   copyright notice, this list of conditions and the 							 *
+*   following disclaimer.										 *
+*    													 *
+* * Redistributions in binary form must reproduce the above 						 *
+*   copyright notice, this list of conditions and the 							 *
+*   following disclaimer in the documentation and/or other						 *
+*   materials provided with the distribution.								 *
+* 													 *
+* * Neither the name of the WIDE Project or NICT nor the 						 *
+*   names of its contributors may be used to endorse or 						 *
+*   promote products derived from this software without 						 *
+*   specific prior written permission of WIDE Project and 						 *
+*   NICT.												 *
+* 													 *
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED *
+* WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A *
+* PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR *
+* ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT 	 *
+* LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 	 *
+* INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR *
+* TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF   *
+* ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.								 *
+*********************************************************************************************************/
+
+/* Pooled allocator for the message objects.
+ *
+ * When enabled (fd_msg_pool_enable), the struct msg / struct avp objects and the small
+ * AVP payloads (octetstring values, raw data) are not obtained from malloc one at a time.
+ * Each class of objects is carved from large slabs, and freed objects are cached in
+ * per-thread "magazines" (small stacks of object pointers), following the classical 
+ * magazine / depot design:
+ *  - each thread owns two magazines per class (loaded and previous). Allocations and
+ *   frees are served from these without any locking in the common case.
+ *  - when both magazines are empty (resp. full), the thread exchanges a magazine with the
+ *   shared depot of the class, which is protected by a mutex.
+ *  - the depot refills from the slabs when it has no full magazine.
+ * Since a freed object simply lands in the magazines of the freeing thread, messages can
+ * be released by another thread than the one that created them (PSM -> routing -> dispatch
+ * -> out threads). The objects then migrate through the depot.
+ *
+ * The slabs are never given back to the system; once enabled, the pools cannot be disabled.
+ */
+
+#include "fdproto-internal.h"
+
+#include <sys/mman.h>
+
+/* Number of objects in a magazine */
+#define MP_MAG_SIZE	64
+
+/* Size of the slabs allocated from the system */
+#define MP_SLAB_SIZE	(256 * 1024)
+#define MP_HUGE_SLAB_SIZE	(2 * 1024 * 1024)
+
+/* Alignment of the objects inside the slabs */
+#define MP_ALIGN	16
+#define MP_ROUNDUP(_s)	(((_s) + MP_ALIGN - 1) & ~((size_t)MP_ALIGN - 1))
+
+/* Payload buffers are prefixed with this header, so that fd_mp_buf_free knows where they came from */
+#define MP_BUFHDR_SZ	MP_ALIGN
+#define MP_BUF_MALLOC	0xFFFFFFFF
+#define MP_BUF_SMALL_SZ	64
+#define MP_BUF_MEDIUM_SZ	256
+
+/* A magazine: a stack of cached objects */
+struct mp_magazine {
+	struct mp_magazine	*next;		/* link in the depot */
+	int			 rounds;	/* number of objects in objs */
+	void			*objs[MP_MAG_SIZE];
+};
+
+/* A class of objects, shared by all threads */
+struct mp_class {
+	const char		*name;
+	size_t			 objsize;	/* size of one object, including alignment */
+	
+	pthread_mutex_t		 lock;		/* protects all the fields below */
+	struct mp_magazine	*full;		/* magazines that contain at least one object */
+	struct mp_magazine	*empty;		/* magazines that contain no object */
+	void			*loose;		/* objects that could not be stored in a magazine, chained through their first word */
+	uint8_t			*slab_cur;	/* next free byte in the current slab */
+	size_t			 slab_left;	/* remaining bytes in the current slab */
+	
+	unsigned long long	 allocs;	/* counters of the threads that have terminated */
+	unsigned long long	 frees;
+	unsigned long long	 hits;
+	unsigned long long	 depot;		/* full magazines obtained from the depot */
+	unsigned long long	 slabs;		/* number of slabs allocated */
+	size_t			 slab_bytes;	/* total size of the slabs */
+	unsigned long long	 huge;		/* number of slabs backed by huge pages */
+};
+
+/* The per-thread cache of one class */
+struct mp_tcache_class {
+	struct mp_magazine	*loaded;
+	struct mp_magazine	*previous;
+	unsigned long long	 allocs;	/* only modified by the owner thread */
+	unsigned long long	 frees;
+	unsigned long long	 hits;
+};
+
+/* The per-thread cache */
+struct mp_tcache {
+	struct fd_list		 chain;		/* link in mp_tcaches */
+	struct mp_tcache_class	 cls[FD_MSG_POOL_MAX];
+};
+
+static struct mp_class mp_classes[FD_MSG_POOL_MAX] = {
+	{ "struct msg" },
+	{ "struct avp" },
+	{ "payload <= 64" },
+	{ "payload <= 256" }
+};
+
+static pthread_key_t	mp_tcache_key;
+static pthread_mutex_t	mp_tcache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct fd_list	mp_tcaches = FD_LIST_INITIALIZER(mp_tcaches);
+
+static int mp_initialized = 0;
+static volatile int mp_enabled = 0;
+static int mp_hugepages = 0;
+
+/* Give back all the magazines of a terminating thread to the depots */
+static void mp_tcache_release(void * arg)
+{
+	struct mp_tcache * tc = arg;
+	int i;
+	
+	if (!tc)
+		return;
+	
+	CHECK_POSIX_DO( pthread_mutex_lock(&mp_tcache_lock), /* continue */ );
+	fd_list_unlink(&tc->chain);
+	CHECK_POSIX_DO( pthread_mutex_unlock(&mp_tcache_lock), /* continue */ );
+	
+	for (i = 0; i < FD_MSG_POOL_MAX; i++) {
+		struct mp_class * c = &mp_classes[i];
+		struct mp_tcache_class * tcc = &tc->cls[i];
+		struct mp_magazine * mags[2] = { tcc->loaded, tcc->previous };
+		int m;
+		
+		CHECK_POSIX_DO( pthread_mutex_lock(&c->lock), /* continue */ );
+		for (m = 0; m < 2; m++) {
+			if (!mags[m])
+				continue;
+			if (mags[m]->rounds) {
+				mags[m]->next = c->full;
+				c->full = mags[m];
+			} else {
+				mags[m]->next = c->empty;
+				c->empty = mags[m];
+			}
+		}
+		c->allocs += tcc->allocs;
+		c->frees  += tcc->frees;
+		c->hits   += tcc->hits;
+		CHECK_POSIX_DO( pthread_mutex_unlock(&c->lock), /* continue */ );
+	}
+	
+	free(tc);
+}
+
+/* Retrieve (or create) the cache of the calling thread */
+static struct mp_tcache * mp_tcache_get(void)
+{
+	struct mp_tcache * tc;
+	int i;
+	
+	tc = pthread_getspecific(mp_tcache_key);
+	if (tc)
+		return tc;
+	
+	CHECK_MALLOC_DO( tc = calloc(1, sizeof(struct mp_tcache)), return NULL );
+	fd_list_init(&tc->chain, tc);
+	for (i = 0; i < FD_MSG_POOL_MAX; i++) {
+		CHECK_MALLOC_DO( tc->cls[i].loaded = calloc(1, sizeof(struct mp_magazine)), goto error );
+		CHECK_MALLOC_DO( tc->cls[i].previous = calloc(1, sizeof(struct mp_magazine)), goto error );
+	}
+	
+	CHECK_POSIX_DO( pthread_setspecific(mp_tcache_key, tc), goto error );
+	
+	CHECK_POSIX_DO( pthread_mutex_lock(&mp_tcache_lock), /* continue */ );
+	fd_list_insert_before(&mp_tcaches, &tc->chain);
+	CHECK_POSIX_DO( pthread_mutex_unlock(&mp_tcache_lock), /* continue */ );
+	
+	return tc;
+error:
+	for (i = 0; i < FD_MSG_POOL_MAX; i++) {
+		free(tc->cls[i].loaded);
+		free(tc->cls[i].previous);
+	}
+	free(tc);
+	return NULL;
+}
+
+/* Allocate a new slab for a class. Called with the class lock held. */
+static int mp_slab_new(struct mp_class * c)
+{
+	void * slab = NULL;
+	size_t size = MP_SLAB_SIZE;
+	
+#if defined(MAP_HUGETLB) && defined(MAP_ANONYMOUS)
+	if (mp_hugepages) {
+		slab = mmap(NULL, MP_HUGE_SLAB_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (slab == MAP_FAILED) {
+			int ret = errno;
+			LOG_N("Unable to obtain huge pages for the message pools (%s), falling back to normal pages.", strerror(ret));
+			mp_hugepages = 0;
+			slab = NULL;
+		} else {
+			size = MP_HUGE_SLAB_SIZE;
+			c->huge++;
+		}
+	}
+#endif /* MAP_HUGETLB */
+	
+	if (!slab) {
+		CHECK_MALLOC( slab = malloc(size) );
+	}
+	
+	c->slab_cur   = slab;
+	c->slab_left  = size;
+	c->slabs++;
+	c->slab_bytes += size;
+	
+	return 0;
+}
+
+/* Fill an empty magazine with objects from the loose list or the slabs. Called with the class lock held. */
+static int mp_refill(struct mp_class * c, struct mp_magazine * mag)
+{
+	while (mag->rounds < MP_MAG_SIZE) {
+		if (c->loose) {
+			void * obj = c->loose;
+			c->loose = *(void **)obj;
+			mag->objs[mag->rounds++] = obj;
+			continue;
+		}
+		if (c->slab_left < c->objsize) {
+			if (mag->rounds)
+				break; /* we will create the new slab next time */
+			CHECK_FCT( mp_slab_new(c) );
+		}
+		mag->objs[mag->rounds++] = c->slab_cur;
+		c->slab_cur  += c->objsize;
+		c->slab_left -= c->objsize;
+	}
+	return 0;
+}
+
+/* Initialize the pools module, called once from fd_libproto_init */
+int fd_mp_init(size_t msgsize, size_t avpsize)
+{
+	int i;
+	
+	TRACE_ENTRY("%zd %zd", msgsize, avpsize);
+	
+	mp_classes[FD_MSG_POOL_MSG].objsize = MP_ROUNDUP(msgsize);
+	mp_classes[FD_MSG_POOL_AVP].objsize = MP_ROUNDUP(avpsize);
+	mp_classes[FD_MSG_POOL_BUF_SMALL].objsize = MP_BUFHDR_SZ + MP_BUF_SMALL_SZ;
+	mp_classes[FD_MSG_POOL_BUF_MEDIUM].objsize = MP_BUFHDR_SZ + MP_BUF_MEDIUM_SZ;
+	
+	for (i = 0; i < FD_MSG_POOL_MAX; i++) {
+		CHECK_POSIX( pthread_mutex_init(&mp_classes[i].lock, NULL) );
+	}
+	
+	CHECK_POSIX( pthread_key_create(&mp_tcache_key, mp_tcache_release) );
+	
+	mp_initialized = 1;
+	return 0;
+}
+
+/* Get an object of a given class */
+void * fd_mp_alloc(enum fd_msg_pool_class cls)
+{
+	struct mp_class * c = &mp_classes[cls];
+	struct mp_tcache * tc;
+	struct mp_tcache_class * tcc;
+	struct mp_magazine * mag;
+	
+	if (!mp_enabled)
+		return malloc(c->objsize);
+	
+	tc = mp_tcache_get();
+	if (!tc)
+		return malloc(c->objsize); /* it is safe to give it back to the pool later */
+	
+	tcc = &tc->cls[cls];
+	tcc->allocs++;
+	
+	if (tcc->loaded->rounds) {
+		tcc->hits++;
+		return tcc->loaded->objs[--tcc->loaded->rounds];
+	}
+	
+	if (tcc->previous->rounds) {
+		mag = tcc->previous;
+		tcc->previous = tcc->loaded;
+		tcc->loaded = mag;
+		tcc->hits++;
+		return tcc->loaded->objs[--tcc->loaded->rounds];
+	}
+	
+	/* Both magazines are empty, go to the depot */
+	CHECK_POSIX_DO( pthread_mutex_lock(&c->lock), return NULL );
+	if (c->full) {
+		/* Exchange our empty magazine against a full one */
+		mag = c->full;
+		c->full = mag->next;
+		tcc->loaded->next = c->empty;
+		c->empty = tcc->loaded;
+		tcc->loaded = mag;
+		c->depot++;
+	} else {
+		/* Carve new objects */
+		CHECK_FCT_DO( mp_refill(c, tcc->loaded), 
+			{
+				CHECK_POSIX_DO( pthread_mutex_unlock(&c->lock), /* continue */ );
+				return NULL;
+			} );
+	}
+	CHECK_POSIX_DO( pthread_mutex_unlock(&c->lock), /* continue */ );
+	
+	return tcc->loaded->objs[--tcc->loaded->rounds];
+}
+
+/* Give back an object */
+void fd_mp_free(enum fd_msg_pool_class cls, void * obj)
+{
+	struct mp_class * c = &mp_classes[cls];
+	struct mp_tcache * tc;
+	struct mp_tcache_class * tcc;
+	struct mp_magazine * mag;
+	
+	if (!obj)
+		return;
+	
+	if (!mp_enabled) {
+		free(obj);
+		return;
+	}
+	
+	tc = mp_tcache_get();
+	if (!tc) {
+		/* We cannot tell if the object was carved from a slab, keep it in the depot */
+		CHECK_POSIX_DO( pthread_mutex_lock(&c->lock), return );
+		*(void **)obj = c->loose;
+		c->loose = obj;
+		CHECK_POSIX_DO( pthread_mutex_unlock(&c->lock), /* continue */ );
+		return;
+	}
+	
+	tcc = &tc->cls[cls];
+	tcc->frees++;
+	
+	if (tcc->loaded->rounds < MP_MAG_SIZE) {
+		tcc->loaded->objs[tcc->loaded->rounds++] = obj;
+		return;
+	}
+	
+	if (tcc->previous->rounds == 0) {
+		mag = tcc->previous;
+		tcc->previous = tcc->loaded;
+		tcc->loaded = mag;
+		tcc->loaded->objs[tcc->loaded->rounds++] = obj;
+		return;
+	}
+	
+	/* Both magazines are full, give one to the depot */
+	CHECK_POSIX_DO( pthread_mutex_lock(&c->lock), return );
+	mag = c->empty;
+	if (mag) {
+		c->empty = mag->next;
+	} else {
+		mag = calloc(1, sizeof(struct mp_magazine));
+	}
+	if (mag) {
+		mag->rounds = 0;
+		tcc->loaded->next = c->full;
+		c->full = tcc->loaded;
+		tcc->loaded = mag;
+		tcc->loaded->objs[tcc->loaded->rounds++] = obj;
+	} else {
+		*(void **)obj = c->loose;
+		c->loose = obj;
+	}
+	CHECK_POSIX_DO( pthread_mutex_unlock(&c->lock), /* continue */ );
+}
+
+/* Allocate a payload buffer of at least len bytes */
+void * fd_mp_buf_alloc(size_t len)
+{
+	uint8_t * buf;
+	uint32_t cls = MP_BUF_MALLOC;
+	
+	if (mp_enabled) {
+		if (len <= MP_BUF_SMALL_SZ)
+			cls = FD_MSG_POOL_BUF_SMALL;
+		else if (len <= MP_BUF_MEDIUM_SZ)
+			cls = FD_MSG_POOL_BUF_MEDIUM;
+	}
+	
+	if (cls == MP_BUF_MALLOC) {
+		buf = malloc(MP_BUFHDR_SZ + len);
+	} else {
+		buf = fd_mp_alloc(cls);
+	}
+	if (!buf)
+		return NULL;
+	
+	*(uint32_t *)buf = cls;
+	return buf + MP_BUFHDR_SZ;
+}
+
+/* Release a buffer obtained from fd_mp_buf_alloc */
+void fd_mp_buf_free(void * ptr)
+{
+	uint8_t * buf;
+	uint32_t cls;
+	
+	if (!ptr)
+		return;
+	
+	buf = (uint8_t *)ptr - MP_BUFHDR_SZ;
+	cls = *(uint32_t *)buf;
+	if (cls == MP_BUF_MALLOC) {
+		free(buf);
+	} else {
+		ASSERT(cls < FD_MSG_POOL_MAX);
+		fd_mp_free(cls, buf);
+	}
+}
+
+/* Switch to pooled allocations */
+int fd_msg_pool_enable(int hugepages)
+{
+	TRACE_ENTRY("%d", hugepages);
+	CHECK_PARAMS( mp_initialized );
+	
+	if (mp_enabled)
+		return 0;
+	
+	mp_hugepages = hugepages ? 1 : 0;
+	mp_enabled = 1;
+	
+	LOG_D("Message pools enabled (%s pages)", mp_hugepages ? "huge" : "normal");
+	return 0;
+}
+
+/* Check if the pools are in use */
+int fd_msg_pool_enabled(void)
+{
+	return mp_enabled;
+}
+
+/* Retrieve the counters of a class */
+int fd_msg_pool_getstats(enum fd_msg_pool_class cls, struct fd_msg_pool_stats * stats)
+{
+	struct mp_class * c;
+	struct fd_list * li;
+	
+	TRACE_ENTRY("%d %p", cls, stats);
+	CHECK_PARAMS( (cls >= 0) && (cls < FD_MSG_POOL_MAX) && stats && mp_initialized );
+	
+	c = &mp_classes[cls];
+	memset(stats, 0, sizeof(struct fd_msg_pool_stats));
+	stats->name = c->name;
+	stats->objsize = c->objsize;
+	
+	/* Counters of the live threads. These are read without lock, the values are approximate. */
+	CHECK_POSIX( pthread_mutex_lock(&mp_tcache_lock) );
+	for (li = mp_tcaches.next; li != &mp_tcaches; li = li->next) {
+		struct mp_tcache * tc = li->o;
+		stats->allocs += tc->cls[cls].allocs;
+		stats->frees  += tc->cls[cls].frees;
+		stats->hits   += tc->cls[cls].hits;
+	}
+	CHECK_POSIX( pthread_mutex_unlock(&mp_tcache_lock) );
+	
+	CHECK_POSIX( pthread_mutex_lock(&c->lock) );
+	stats->allocs 	 += c->allocs;
+	stats->frees  	 += c->frees;
+	stats->hits   	 += c->hits;
+	stats->depot  	  = c->depot;
+	stats->slabs  	  = c->slabs;
+	stats->slab_bytes = c->slab_bytes;
+	stats->huge   	  = c->huge;
+	CHECK_POSIX( pthread_mutex_unlock(&c->lock) );
+	
+	return 0;
+}
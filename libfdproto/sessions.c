@@ -42,11 +42,47 @@
 
 /*********************** Parameters **********************/
 
-/* Size of the hash table containing the session objects (pow of 2. ex: 12 => 2^12 = 4096). must be between 0 and 31. */
+/* Initial and minimum size of the hash table containing the session objects (pow of 2. ex: 12 => 2^12 = 4096). must be between 0 and 20.
+ * This is also the number of locks protecting the table. */
 #ifndef SESS_HASH_SIZE
 #define SESS_HASH_SIZE	12
 #endif /* SESS_HASH_SIZE */
 
+/* Maximum size of the hash table (pow of 2), the table does not grow beyond 2^SESS_HASH_MAX_SIZE buckets. */
+#ifndef SESS_HASH_MAX_SIZE
+#define SESS_HASH_MAX_SIZE	26
+#endif /* SESS_HASH_MAX_SIZE */
+
+/* The table grows when there are more than SESS_HASH_MAX_LOAD sessions per bucket in average, and shrinks when there are
+ * less than 1 / SESS_HASH_MIN_LOAD_DIV. */
+#ifndef SESS_HASH_MAX_LOAD
+#define SESS_HASH_MAX_LOAD	2
+#endif /* SESS_HASH_MAX_LOAD */
+#ifndef SESS_HASH_MIN_LOAD_DIV
+#define SESS_HASH_MIN_LOAD_DIV	2
+#endif /* SESS_HASH_MIN_LOAD_DIV */
+
+/* Resolution of the expiry timer wheel: a tick is 2^SESS_TW_TICK_BITS ns (2^23 ns = 8.4ms).
+ * Sessions expire at most one tick after their timeout. */
+#ifndef SESS_TW_TICK_BITS
+#define SESS_TW_TICK_BITS	23
+#endif /* SESS_TW_TICK_BITS */
+
+/* Maximum number of expired sessions cleaned up by the expiry thread each time it releases the expiry lock */
+#ifndef SESS_EXP_BATCH
+#define SESS_EXP_BATCH		64
+#endif /* SESS_EXP_BATCH */
+
+/* Number of states stored inline in each session. The states of the handlers with a higher id are stored in an array allocated separately. */
+#ifndef SESS_STATE_SLOTS
+#define SESS_STATE_SLOTS	4
+#endif /* SESS_STATE_SLOTS */
+
+/* Maximum number of session handlers existing at the same time */
+#ifndef SESS_MAX_HANDLERS
+#define SESS_MAX_HANDLERS	256
+#endif /* SESS_MAX_HANDLERS */
+
 /* Default lifetime of a session, in seconds. (31 days = 2678400 seconds) */
 #ifndef SESS_DEFAULT_LIFETIME
 #define SESS_DEFAULT_LIFETIME	2678400
@@ -71,21 +107,20 @@ struct session_handler {
 	void 		(*cleanup)(struct sess_state *, os0_t, void *); /* The cleanup function to be called for cleaning a state */
 	session_state_dump state_dump; /* dumper function */
 	void             *opaque; /* a value that is passed as is to the cleanup callback */
+	int		  busy;	/* number of states taken from the sessions by del_session_states and not cleaned up yet (atomic) */
 };
 
-static int 		hdl_id = 0;				/* A global counter to initialize the id field */
-static pthread_mutex_t	hdl_lock = PTHREAD_MUTEX_INITIALIZER;	/* lock to protect hdl_id; we could use atomic operations otherwise (less portable) */
+/* The handlers, by id - 1. The ids of destroyed handlers are reused, so that they stay small: they index the states in the sessions. */
+static struct session_handler * hdl_tab[SESS_MAX_HANDLERS];
+static pthread_mutex_t	hdl_lock = PTHREAD_MUTEX_INITIALIZER;	/* lock to protect the allocation of the ids */
 
 
-/* Data structures linked from the sessions, containing the applications states */
+/* The states removed from the sessions when their handler is destroyed, until the cleanup callback is called */
 struct state {
 	int			 eyec;	/* Must be SD_EYEC */
-	struct sess_state	*state;	/* The state registered by the application, never NULL (or the whole object is deleted) */
-	struct fd_list		 chain;	/* Chaining in the list of session's states ordered by hdl->id */
-	union {
-		struct session_handler	*hdl;	/* The handler for which this state was registered */
-		os0_t 			 sid;	/* For deleted state, the sid of the session it belong to */
-	};
+	struct sess_state	*state;	/* The state registered by the application */
+	struct fd_list		 chain;	/* Chaining in the list of deleted states */
+	os0_t 			 sid;	/* The sid of the session it belonged to */
 };
 
 /* Session object, one for each value of Session-Id AVP */
@@ -98,22 +133,54 @@ struct session {
 	struct fd_list	chain_h;/* chaining in the hash table of sessions. */
 
 	struct timespec	timeout;/* Timeout date for the session */
-	struct fd_list	expire;	/* List of expiring sessions, ordered by timeouts. */
+	struct fd_list	expire;	/* Chaining in the slot of the expiry wheel for this timeout, or in exp_due once expired. */
 
-	pthread_mutex_t stlock;	/* A lock to protect the list of states associated with this session */
-	struct fd_list	states;	/* Sentinel for the list of states of this session. */
+	pthread_mutex_t stlock;	/* A lock to protect more_states and msg_cnt */
+	struct sess_state * states[SESS_STATE_SLOTS]; /* The states of the handlers with id 1 .. SESS_STATE_SLOTS, accessed with atomic operations */
+	struct sess_state ** more_states; /* The states of the other handlers, by id - SESS_STATE_SLOTS - 1 */
+	int		nb_more;/* Size of the more_states array */
 	int		msg_cnt;/* Reference counter for the messages pointing to this session */
 	int		is_destroyed; /* boolean telling if fd_sess_detroy has been called on this */
 };
 
-/* Sessions hash table, to allow fast sid to session retrieval */
-static struct {
-	struct fd_list	sentinel;	/* sentinel element for this sublist. The sublist is ordered by hash value, then fd_os_cmp(sid). */
-	pthread_mutex_t lock;		/* the mutex for this sublist -- we might probably change it to rwlock for a little optimization */
-} sess_hash [ 1 << SESS_HASH_SIZE ] ;
-#define H_MASK( __hash ) ((__hash) & (( 1 << SESS_HASH_SIZE ) - 1))
-#define H_LIST( _hash ) (&(sess_hash[H_MASK(_hash)].sentinel))
-#define H_LOCK( _hash ) (&(sess_hash[H_MASK(_hash)].lock    ))
+/* Sessions hash table, to allow fast sid to session retrieval.
+ * The table uses linear hashing, so that it grows and shrinks one bucket at a time instead of being rehashed at once:
+ * there are size + split buckets, size being a power of 2. The buckets below split have already been split in two,
+ * the sessions with the (hash & size) bit set being moved to the bucket index + size.
+ * Each bucket is a list ordered by hash value, then fd_os_cmp(sid). The buckets are allocated in segments that never move.
+ * The buckets are protected by SESS_LOCKS rwlocks, the lock of a session is chosen by (hash & (SESS_LOCKS - 1)).
+ * Since the table never has less than SESS_LOCKS buckets, a bucket and the bucket it splits into have the same lock,
+ * so that a split (or a merge) only needs this lock, and the lookups in other buckets are not disturbed. */
+#define SESS_LOCKS	(1 << SESS_HASH_SIZE)
+#define SEG_BITS	SESS_HASH_SIZE
+#define SEG_SIZE	(1 << SEG_BITS)
+#define SEG_MAX		(1 << (SESS_HASH_MAX_SIZE - SEG_BITS))
+
+static pthread_rwlock_t	sess_locks[SESS_LOCKS];
+static struct fd_list *	sess_segs[SEG_MAX];	/* segments of SEG_SIZE bucket sentinels */
+static uint64_t		sess_shape;	/* log2(size) << 32 | split. Changed with sess_resize_lock and the lock of the split bucket */
+static pthread_mutex_t	sess_resize_lock = PTHREAD_MUTEX_INITIALIZER; /* only one thread resizes the table at a time */
+static uint32_t		sess_hashed = 0; /* number of sessions linked in the hash table (atomic) */
+
+#define H_LOCK( _hash ) (&sess_locks[(_hash) & (SESS_LOCKS - 1)])
+
+/* The sentinel of a bucket */
+static __inline__ struct fd_list * h_bucket(uint32_t b)
+{
+	return &sess_segs[b >> SEG_BITS][b & (SEG_SIZE - 1)];
+}
+
+/* The bucket containing the sessions with this hash. The lock of the hash must be held. */
+static struct fd_list * H_LIST(uint32_t hash)
+{
+	uint64_t shape = __atomic_load_n(&sess_shape, __ATOMIC_ACQUIRE);
+	uint32_t size = 1U << (shape >> 32);
+	uint32_t b = hash & (size - 1);
+
+	if (b < (uint32_t)shape)
+		b = hash & (2 * size - 1);
+	return h_bucket(b);
+}
 
 static uint32_t		sess_cnt = 0; /* counts all active session (that are in the expiry list) */
 
@@ -122,14 +189,28 @@ static uint32_t   	sid_h;	/* initialized to the current time in fd_sess_init */
 static uint32_t   	sid_l;	/* incremented each time a session id is created */
 static pthread_mutex_t 	sid_lock = PTHREAD_MUTEX_INITIALIZER;
 
-/* Expiring sessions management */
-static struct fd_list	exp_sentinel = FD_LIST_INITIALIZER(exp_sentinel);	/* list of sessions ordered by their timeout date */
-static pthread_mutex_t	exp_lock = PTHREAD_MUTEX_INITIALIZER;	/* lock protecting the list. */
+/* Expiring sessions management.
+ * The sessions are linked in a hierarchical timer wheel, so that setting or changing a timeout is O(1) whatever the number of sessions.
+ * The time is counted in ticks since the Epoch; level l of the wheel has TW_SLOTS slots, one for each value of the bits
+ * l*TW_BITS .. l*TW_BITS + TW_BITS - 1 of the tick. A session is linked at the level of the highest bit where the tick
+ * of its timeout differs from the current tick (tw_now), in the slot given by the bits of this level.
+ * When tw_now reaches the first tick of a slot of level l > 0, the sessions of this slot are moved to the lower levels;
+ * when it reaches the tick of a slot of level 0, its sessions are expired: they are moved to exp_due, and cleaned up by the expiry thread. */
+#define TW_BITS		6
+#define TW_SLOTS	(1 << TW_BITS)
+#define TW_LEVELS	((64 + TW_BITS - 1) / TW_BITS)
+
+static struct fd_list	tw_slots[TW_LEVELS][TW_SLOTS];	/* the slots of the wheel, initialized in fd_sess_init */
+static uint64_t		tw_map[TW_LEVELS];	/* bit set for each slot that may be non-empty */
+static uint64_t		tw_now;		/* current tick: the slots of the previous ticks have been expired */
+static uint64_t		tw_wake = 0;	/* tick at which the expiry thread wakes up, new timeouts before it must signal the thread */
+static struct fd_list	exp_due = FD_LIST_INITIALIZER(exp_due);	/* expired sessions, waiting for the expiry thread */
+static pthread_mutex_t	exp_lock = PTHREAD_MUTEX_INITIALIZER;	/* lock protecting the wheel and the list. */
 static pthread_cond_t	exp_cond = PTHREAD_COND_INITIALIZER;	/* condvar used by the expiry mechainsm. */
 static pthread_t	exp_thr = (pthread_t)NULL; 	/* The expiry thread that handles cleanup of expired sessions */
 
 /* Hierarchy of the locks, to avoid deadlocks:
- *  hash lock > state lock > expiry lock
+ *  resize lock > hash lock > state lock > expiry lock
  * i.e. state lock can be taken while holding the hash lock, but not while holding the expiry lock.
  * As well, the hash lock cannot be taken while holding a state lock.
  */
@@ -159,15 +240,52 @@ static struct session * new_session(os0_t sid, size_t sidlen, uint32_t hash)
 	fd_list_init(&sess->expire, sess);
 
 	CHECK_POSIX_DO( pthread_mutex_init(&sess->stlock, NULL), return NULL );
-	fd_list_init(&sess->states, sess);
 
 	return sess;
 }
 
+/* Check if some states are stored in a session. stlock must be held. */
+static int has_states(struct session * s)
+{
+	int i;
+
+	for (i = 0; i < SESS_STATE_SLOTS; i++)
+		if (__atomic_load_n(&s->states[i], __ATOMIC_ACQUIRE))
+			return 1;
+	for (i = 0; i < s->nb_more; i++)
+		if (s->more_states[i])
+			return 1;
+	return 0;
+}
+
+/* The handler of a state being removed from a session, idx is the handler id - 1. The session's stlock must be held,
+ so that fd_sess_handler_destroy cannot complete (nor the id be reused) before the state is cleaned up. */
+static struct session_handler * state_handler(int idx)
+{
+	struct session_handler * hdl = __atomic_load_n(&hdl_tab[idx], __ATOMIC_ACQUIRE);
+	if (hdl)
+		__atomic_add_fetch(&hdl->busy, 1, __ATOMIC_RELAXED);
+	return hdl;
+}
+
+/* Call the cleanup callback for a state removed from a session, hdl is the value returned by state_handler */
+static void state_cleanup(struct session_handler * hdl, int idx, struct sess_state * state, os0_t sid)
+{
+	if (!hdl) {
+		TRACE_DEBUG(INFO, "No handler %d for state %p registered with session '%s', the state is leaked", idx + 1, state, sid);
+		return;
+	}
+	TRACE_DEBUG(FULL, "Calling handler %p cleanup for state %p registered with session '%s'", hdl, state, sid);
+	(*hdl->cleanup)(state, sid, hdl->opaque);
+	/* the handler may be freed as soon as this is 0 */
+	__atomic_sub_fetch(&hdl->busy, 1, __ATOMIC_RELEASE);
+}
+
 /* destroy the session object. It should really be already unlinked... */
 static void del_session(struct session * s)
 {
-	ASSERT(FD_IS_LIST_EMPTY(&s->states));
+	ASSERT(!has_states(s));
+	free(s->more_states);
 	free(s->sid);
 	fd_list_unlink(&s->chain_h);
 	fd_list_unlink(&s->expire);
@@ -175,15 +293,225 @@ static void del_session(struct session * s)
 	free(s);
 }
 
-/* Destroy the states associated to a session or a sid, and mark it destroyed. */
-static int del_session_states (struct session * sess, os0_t sid, size_t sidlen)
+/* The tick of a timeout, rounded up so that sessions never expire early */
+static __inline__ uint64_t tw_tick(struct timespec * ts)
+{
+	uint64_t ns = (uint64_t)ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+	return (ns + (1ULL << SESS_TW_TICK_BITS) - 1) >> SESS_TW_TICK_BITS;
+}
+
+/* Link (or move) a session in the wheel according to its timeout. exp_lock must be held. Returns the tick of the session. */
+static uint64_t tw_place(struct session * sess)
+{
+	uint64_t tick = tw_tick(&sess->timeout);
+	int lvl = 0, slot;
+
+	if (tick < tw_now)
+		tick = tw_now; /* already expired, it goes in the current slot */
+	if (tick != tw_now)
+		lvl = (63 - __builtin_clzll(tick ^ tw_now)) / TW_BITS;
+	slot = (tick >> (lvl * TW_BITS)) & (TW_SLOTS - 1);
+
+	fd_list_unlink(&sess->expire);
+	fd_list_insert_before(&tw_slots[lvl][slot], &sess->expire);
+	tw_map[lvl] |= 1ULL << slot;
+	return tick;
+}
+
+/* The next tick after tw_now at which a slot of the wheel must be processed, and the level of this slot. 0 if the wheel is empty.
+ * Only the lowest non-empty level is relevant, the slots of higher levels are reached after all the lower level slots. exp_lock must be held. */
+static uint64_t tw_next(int * level)
+{
+	int lvl;
+
+	for (lvl = 0; lvl < TW_LEVELS; lvl++) {
+		int shift = lvl * TW_BITS;
+		int cur = (tw_now >> shift) & (TW_SLOTS - 1);
+		uint64_t bits = tw_map[lvl] & ~((2ULL << cur) - 1); /* the slots after the current one */
+
+		while (bits) {
+			int slot = __builtin_ctzll(bits);
+			if (!FD_IS_LIST_EMPTY(&tw_slots[lvl][slot])) {
+				uint64_t base = (shift + TW_BITS < 64) ? tw_now & ~((1ULL << (shift + TW_BITS)) - 1) : 0;
+				*level = lvl;
+				return base | ((uint64_t)slot << shift);
+			}
+			/* The sessions of this slot were removed */
+			tw_map[lvl] &= ~(1ULL << slot);
+			bits &= bits - 1;
+		}
+	}
+	return 0;
+}
+
+/* Advance the wheel up to the current time, moving the expired sessions to exp_due. exp_lock must be held. */
+static void tw_advance(void)
+{
+	struct timespec now;
+	uint64_t now_tick;
+
+	CHECK_SYS_DO( clock_gettime(CLOCK_REALTIME, &now), { ASSERT(0); return; } );
+	now_tick = ((uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec) >> SESS_TW_TICK_BITS;
+
+	while (tw_now <= now_tick) {
+		uint64_t next;
+		int lvl, slot;
+
+		/* Expire the current slot */
+		fd_list_move_end(&exp_due, &tw_slots[0][tw_now & (TW_SLOTS - 1)]);
+
+		/* Jump to the next slot to process. The ticks in between have no session. */
+		next = tw_next(&lvl);
+		if (!next || (next > now_tick)) {
+			tw_now = now_tick;
+			break;
+		}
+		tw_now = next;
+		if (lvl == 0)
+			continue;
+
+		/* Cascade: the sessions of this slot now belong to the lower levels */
+		slot = (next >> (lvl * TW_BITS)) & (TW_SLOTS - 1);
+		while (!FD_IS_LIST_EMPTY(&tw_slots[lvl][slot]))
+			tw_place((struct session *)(tw_slots[lvl][slot].next->o));
+		tw_map[lvl] &= ~(1ULL << slot);
+	}
+}
+
+/* Order of the sessions in a bucket */
+static int h_cmp(uint32_t hash, os0_t sid, size_t sidlen, struct session * s)
+{
+	if (s->hash != hash)
+		return (s->hash < hash) ? 1 : -1;
+	return fd_os_cmp(sid, sidlen, s->sid, s->sidlen);
+}
+
+/* Find a session in a bucket. If not found, *pos is where it must be inserted (before). The lock of the hash must be held. */
+static struct session * h_find(struct fd_list * bucket, uint32_t hash, os0_t sid, size_t sidlen, struct fd_list ** pos)
 {
-	int destroy_now;
-	int ret = 0;
 	struct fd_list * li;
+	struct session * found = NULL;
+
+	for (li = bucket->next; li != bucket; li = li->next) {
+		int cmp = h_cmp(hash, sid, sidlen, (struct session *)(li->o));
+		if (cmp > 0)
+			continue;
+		if (cmp == 0)
+			found = (struct session *)(li->o);
+		break;
+	}
+	if (pos)
+		*pos = li;
+	return found;
+}
+
+/* Split the next bucket if the table is too loaded. Called with no hash lock held. */
+static void h_grow(void)
+{
+	uint64_t shape;
+	uint32_t lvl, size, split, nb;
+	struct fd_list * from, * to, * li;
+
+	if (pthread_mutex_trylock(&sess_resize_lock))
+		return; /* another thread is resizing the table */
+
+	shape = sess_shape;
+	lvl = shape >> 32;
+	size = 1U << lvl;
+	split = (uint32_t)shape;
+	nb = size + split;
+	if ((lvl >= SESS_HASH_MAX_SIZE) || (__atomic_load_n(&sess_hashed, __ATOMIC_RELAXED) <= (uint64_t)nb * SESS_HASH_MAX_LOAD))
+		goto out;
+
+	/* The bucket split is divided between split and nb */
+	if (!sess_segs[nb >> SEG_BITS]) {
+		struct fd_list * seg;
+		int i;
+		CHECK_MALLOC_DO( seg = malloc(SEG_SIZE * sizeof(struct fd_list)), goto out );
+		for (i = 0; i < SEG_SIZE; i++)
+			fd_list_init(&seg[i], NULL);
+		sess_segs[nb >> SEG_BITS] = seg;
+	}
+
+	CHECK_POSIX_DO( pthread_rwlock_wrlock( H_LOCK(split) ), goto out );
+	from = h_bucket(split);
+	to = h_bucket(nb);
+	for (li = from->next; li != from; ) {
+		struct session * s = (struct session *)(li->o);
+		li = li->next;
+		if (s->hash & size) {
+			/* the order is kept since we append in order */
+			fd_list_unlink(&s->chain_h);
+			fd_list_insert_before(to, &s->chain_h);
+		}
+	}
+	if (++split == size) {
+		lvl++;
+		split = 0;
+	}
+	__atomic_store_n(&sess_shape, ((uint64_t)lvl << 32) | split, __ATOMIC_RELEASE);
+	CHECK_POSIX_DO( pthread_rwlock_unlock( H_LOCK((uint32_t)shape) ), /* continue */ );
+out:
+	CHECK_POSIX_DO( pthread_mutex_unlock(&sess_resize_lock), /* continue */ );
+}
+
+/* Merge the last buckets if the table is too empty. Called with no hash lock held. Two buckets are merged for each
+ * session removed, so that the table catches up with the sessions count while it is being emptied. */
+static void h_shrink(void)
+{
+	uint64_t shape;
+	uint32_t lvl, size, split;
+	struct fd_list * from, * to, * pos;
+	int step;
+
+	if (pthread_mutex_trylock(&sess_resize_lock))
+		return;
+
+	for (step = 0; step < 2; step++) {
+		shape = sess_shape;
+		lvl = shape >> 32;
+		size = 1U << lvl;
+		split = (uint32_t)shape;
+		if ((size + split <= SESS_LOCKS) || ((uint64_t)__atomic_load_n(&sess_hashed, __ATOMIC_RELAXED) * SESS_HASH_MIN_LOAD_DIV >= size + split))
+			break;
+
+		if (split == 0) {
+			lvl--;
+			size >>= 1;
+			split = size;
+		}
+		split--;
+
+		/* The last bucket, split + size, goes back into split. Both lists are ordered, merge them. */
+		CHECK_POSIX_DO( pthread_rwlock_wrlock( H_LOCK(split) ), break );
+		from = h_bucket(split + size);
+		to = h_bucket(split);
+		pos = to->next;
+		while (!FD_IS_LIST_EMPTY(from)) {
+			struct session * s = (struct session *)(from->next->o);
+			while ((pos != to) && (h_cmp(s->hash, s->sid, s->sidlen, (struct session *)(pos->o)) > 0))
+				pos = pos->next;
+			fd_list_unlink(&s->chain_h);
+			fd_list_insert_before(pos, &s->chain_h);
+		}
+		__atomic_store_n(&sess_shape, ((uint64_t)lvl << 32) | split, __ATOMIC_RELEASE);
+		CHECK_POSIX_DO( pthread_rwlock_unlock( H_LOCK(split) ), break );
+	}
+	CHECK_POSIX_DO( pthread_mutex_unlock(&sess_resize_lock), /* continue */ );
+}
+
+/* Destroy the states associated to a session or a sid, and mark it destroyed. If expired is set, the session is only
+   destroyed if it is still waiting for the expiry thread and its timeout was not extended, EALREADY is returned otherwise. */
+static int del_session_states (struct session * sess, os0_t sid, size_t sidlen, int expired)
+{
+	int destroy_now, i, skip = 0;
+	int ret = 0;
 	uint32_t hash;
-	/* place to save the list of states to be cleaned up. We do it after finding them to avoid deadlocks. the "o" field becomes a copy of the sid. */
-	struct fd_list deleted_states = FD_LIST_INITIALIZER( deleted_states );
+	/* place to save the states to be cleaned up. We do it after finding them to avoid deadlocks. */
+	struct sess_state * deleted[SESS_STATE_SLOTS];
+	struct sess_state ** deleted_more;
+	int nb_more;
+	struct session_handler * hdls[SESS_MAX_HANDLERS]; /* the handlers of these states, by id - 1 */
 
 	TRACE_ENTRY("%p %p %lu", sess, sid, sidlen);
 	CHECK_PARAMS( sess || sid );
@@ -195,31 +523,12 @@ static int del_session_states (struct session * sess, os0_t sid, size_t sidlen)
 	}
 
 	/* Lock the hash line */
-	CHECK_POSIX( pthread_mutex_lock( H_LOCK(hash) ) );
-	pthread_cleanup_push( fd_cleanup_mutex, H_LOCK(hash) );
+	CHECK_POSIX( pthread_rwlock_wrlock( H_LOCK(hash) ) );
+	pthread_cleanup_push( fd_cleanup_rwlock, H_LOCK(hash) );
 
 	if (!sess) {
 		/* lookup by sid; find the session if it still exists */
-		for (li = H_LIST(hash)->next; li != H_LIST(hash); li = li->next) {
-			int cmp;
-			struct session * s = (struct session *)(li->o);
-
-			/* The list is ordered by hash and sid (in case of collisions) */
-			if (s->hash < hash)
-				continue;
-			if (s->hash > hash)
-				break;
-
-			cmp = fd_os_cmp(s->sid, s->sidlen, sid, sidlen);
-			if (cmp < 0)
-				continue;
-			if (cmp > 0)
-				break;
-
-			/* A session with the same sid was already in the hash table */
-			sess = s;
-			break;
-		}
+		sess = h_find(H_LIST(hash), hash, sid, sidlen, NULL);
 		if (!sess) {
 			/* Somebody already dropped the session, skip */
 			ret = EALREADY;
@@ -230,44 +539,65 @@ static int del_session_states (struct session * sess, os0_t sid, size_t sidlen)
 	/* Unlink from the expiry list */
 	CHECK_POSIX_DO( pthread_mutex_lock( &exp_lock ), { ASSERT(0); /* otherwise cleanup handler is not pop'd */ } );
 	pthread_cleanup_push( fd_cleanup_mutex, &exp_lock );
-	if (!FD_IS_LIST_EMPTY(&sess->expire)) {
+	if (expired && (FD_IS_LIST_EMPTY(&sess->expire) || (tw_tick(&sess->timeout) > tw_now))) {
+		/* The session was destroyed, or fd_sess_settimeout moved it back in the wheel, since the expiry thread picked it */
+		skip = 1;
+	} else if (!FD_IS_LIST_EMPTY(&sess->expire)) {
 		sess_cnt--;
 		fd_list_unlink( &sess->expire ); /* no need to signal the condition here */
 	}
 	pthread_cleanup_pop(0);
 	CHECK_POSIX_DO( pthread_mutex_unlock( &exp_lock ), { ASSERT(0); /* otherwise cleanup handler is not pop'd */ } );
+	if (skip) {
+		ret = EALREADY;
+		goto out;
+	}
 
-	/* Now move all states associated to this session into deleted_states */
+	/* Now take all states associated to this session */
 	CHECK_POSIX_DO( pthread_mutex_lock( &sess->stlock ), { ASSERT(0); /* otherwise cleanup handler is not pop'd */ } );
-	while (!FD_IS_LIST_EMPTY(&sess->states)) {
-		struct state * st = (struct state *)(sess->states.next->o);
-		fd_list_unlink(&st->chain);
-		fd_list_insert_before(&deleted_states, &st->chain);
+	for (i = 0; i < SESS_STATE_SLOTS; i++) {
+		deleted[i] = __atomic_exchange_n(&sess->states[i], NULL, __ATOMIC_ACQ_REL);
+		if (deleted[i])
+			hdls[i] = state_handler(i);
 	}
+	deleted_more = sess->more_states;
+	nb_more = sess->nb_more;
+	for (i = 0; i < nb_more; i++) {
+		if (deleted_more[i])
+			hdls[SESS_STATE_SLOTS + i] = state_handler(SESS_STATE_SLOTS + i);
+	}
+	sess->more_states = NULL;
+	sess->nb_more = 0;
 	CHECK_POSIX_DO( pthread_mutex_unlock( &sess->stlock ), { ASSERT(0); /* otherwise cleanup handler is not pop'd */ } );
 
 	/* Mark the session as destroyed */
 	destroy_now = (sess->msg_cnt == 0);
 	if (destroy_now) {
 		fd_list_unlink( &sess->chain_h );
+		__atomic_sub_fetch(&sess_hashed, 1, __ATOMIC_RELAXED);
 	} else {
 		sess->is_destroyed = 1;
 	}
 out:
 	pthread_cleanup_pop(0);
-	CHECK_POSIX( pthread_mutex_unlock( H_LOCK(hash) ) );
+	CHECK_POSIX( pthread_rwlock_unlock( H_LOCK(hash) ) );
 
 	if (ret)
 		return ret;
 
+	if (destroy_now)
+		h_shrink();
+
 	/* Now, really delete the states */
-	while (!FD_IS_LIST_EMPTY(&deleted_states)) {
-		struct state * st = (struct state *)(deleted_states.next->o);
-		fd_list_unlink(&st->chain);
-		TRACE_DEBUG(FULL, "Calling handler %p cleanup for state %p registered with session '%s'", st->hdl, st, sid);
-		(*st->hdl->cleanup)(st->state, sid, st->hdl->opaque);
-		free(st);
+	for (i = 0; i < SESS_STATE_SLOTS; i++) {
+		if (deleted[i])
+			state_cleanup(hdls[i], i, deleted[i], sid);
+	}
+	for (i = 0; i < nb_more; i++) {
+		if (deleted_more[i])
+			state_cleanup(hdls[SESS_STATE_SLOTS + i], SESS_STATE_SLOTS + i, deleted_more[i], sid);
 	}
+	free(deleted_more);
 
 	/* Finally, destroy the session itself, if it is not referenced by any message anymore */
 	if (destroy_now) {
@@ -285,65 +615,76 @@ static void * exp_fct(void * arg)
 
 
 	do {
-		struct timespec	now;
-		struct session * first;
-		os0_t sid;
-		size_t sidlen;
+		os0_t sids[SESS_EXP_BATCH];
+		size_t sidlens[SESS_EXP_BATCH];
+		struct fd_list * li;
+		int i, nb = 0, err = 0;
 
 		CHECK_POSIX_DO( pthread_mutex_lock(&exp_lock),  break );
 		pthread_cleanup_push( fd_cleanup_mutex, &exp_lock );
 again:
-		/* Check if there are expiring sessions available */
-		if (FD_IS_LIST_EMPTY(&exp_sentinel)) {
-			/* Just wait for a change or cancellation */
-			CHECK_POSIX_DO( pthread_cond_wait( &exp_cond, &exp_lock ), break /* this might not pop the cleanup handler, but since we ASSERT(0), it is not the big issue... */ );
-			/* Restart the loop on wakeup */
-			goto again;
-		}
+		/* Move the sessions that have expired to exp_due */
+		tw_advance();
 
-		/* Get the pointer to the session that expires first */
-		first = (struct session *)(exp_sentinel.next->o);
-		ASSERT( VALIDATE_SI(first) );
+		if (FD_IS_LIST_EMPTY(&exp_due)) {
+			struct timespec	timeout;
+			uint64_t next;
+			int lvl, ret;
 
-		/* Get the current time */
-		CHECK_SYS_DO(  clock_gettime(CLOCK_REALTIME, &now),  break  );
+			/* A session may have been added in the current slot meanwhile */
+			if (!FD_IS_LIST_EMPTY(&tw_slots[0][tw_now & (TW_SLOTS - 1)]))
+				goto again;
+
+			next = tw_next(&lvl);
+			if (!next) {
+				/* Just wait for a change or cancellation */
+				tw_wake = (uint64_t)-1;
+				CHECK_POSIX_DO( pthread_cond_wait( &exp_cond, &exp_lock ), break /* this might not pop the cleanup handler, but since we ASSERT(0), it is not the big issue... */ );
+				/* Restart the loop on wakeup */
+				goto again;
+			}
 
-		/* If first session is not expired, we just wait until it happens */
-		if ( TS_IS_INFERIOR( &now, &first->timeout ) ) {
-			int ret;
-			/* use a local timespec value: first->timeout pointer can be invalid when 
-			   pthread_cond_timedwait end in this context */
-			struct timespec	timeout = first->timeout;
+			/* Wait until the next slot is reached, or a session is added before it */
+			tw_wake = next;
+			timeout.tv_sec  = (next << SESS_TW_TICK_BITS) / 1000000000ULL;
+			timeout.tv_nsec = (next << SESS_TW_TICK_BITS) % 1000000000ULL;
 			ret = pthread_cond_timedwait(&exp_cond, &exp_lock, &timeout);
 			switch (ret) {
 			case 0:
 			case ETIMEDOUT:
 				/* on wakeup or time-out, loop */
 				goto again;
-			case EINVAL:
-				if (clock_gettime(CLOCK_REALTIME, &now) < 0) {
-					break;
-				}
-				if (TS_IS_INFERIOR(&now, &first->timeout)) {
-					TRACE_DEBUG(FULL, "'pthread_cond_timedwait(&exp_cond, &exp_lock, &first->timeout)' : timer expired before loop could start");
-					goto again;
-				}
-				/* FALLTHROUGH */
 			default:
-				TRACE_ERROR("ERROR: in 'pthread_cond_timedwait(&exp_cond, &exp_lock, &first->timeout)' :\t%s", strerror(ret));
+				TRACE_ERROR("ERROR: in 'pthread_cond_timedwait(&exp_cond, &exp_lock, &timeout)' :\t%s", strerror(ret));
 				break;
 			}
+			break;
 		}
 
-		/* Now, the first session in the list is expired; destroy it */
-		CHECK_MALLOC_DO( sid = os0dup(first->sid, first->sidlen), break );
-		sidlen = first->sidlen;
+		/* Now, take a batch of the expired sessions; they are unlinked from exp_due when they are destroyed */
+		for (li = exp_due.next; (li != &exp_due) && (nb < SESS_EXP_BATCH); li = li->next) {
+			struct session * s = (struct session *)(li->o);
+			ASSERT( VALIDATE_SI(s) );
+			CHECK_MALLOC_DO( sids[nb] = os0dup(s->sid, s->sidlen), break );
+			sidlens[nb++] = s->sidlen;
+		}
 
 		pthread_cleanup_pop( 0 );
 		CHECK_POSIX_DO( pthread_mutex_unlock(&exp_lock),  break );
 
-		CHECK_FCT_DO( del_session_states(NULL, sid, sidlen), break );
-		free(sid);
+		/* and destroy them. A session destroyed or given a new timeout since the batch was taken is skipped (EALREADY). */
+		for (i = 0; i < nb; i++) {
+			if (!err) {
+				err = del_session_states(NULL, sids[i], sidlens[i], 1);
+				if (err == EALREADY)
+					err = 0;
+				else if (err)
+					TRACE_ERROR("ERROR: in 'del_session_states' :\t%s", strerror(err));
+			}
+			free(sids[i]);
+		}
+		if (err)
+			break;
 
 	} while (1);
 
@@ -359,6 +700,7 @@ again:
 /* Initialize the session module */
 int fd_sess_init(void)
 {
+	struct timespec ts;
 	int i;
 
 	TRACE_ENTRY( "" );
@@ -367,11 +709,20 @@ int fd_sess_init(void)
 	sid_h = (uint32_t) time(NULL);
 	sid_l = 0;
 
-	/* Initialize the hash table */
-	for (i = 0; i < sizeof(sess_hash) / sizeof(sess_hash[0]); i++) {
-		fd_list_init( &sess_hash[i].sentinel, NULL );
-		CHECK_POSIX(  pthread_mutex_init(&sess_hash[i].lock, NULL)  );
+	/* Initialize the hash table with its first segment */
+	CHECK_MALLOC( sess_segs[0] = malloc(SEG_SIZE * sizeof(struct fd_list)) );
+	for (i = 0; i < SEG_SIZE; i++)
+		fd_list_init( &sess_segs[0][i], NULL );
+	for (i = 0; i < SESS_LOCKS; i++) {
+		CHECK_POSIX(  pthread_rwlock_init(&sess_locks[i], NULL)  );
 	}
+	sess_shape = (uint64_t)SESS_HASH_SIZE << 32;
+
+	/* Initialize the expiry wheel at the current time */
+	for (i = 0; i < TW_LEVELS * TW_SLOTS; i++)
+		fd_list_init( &tw_slots[i / TW_SLOTS][i % TW_SLOTS], NULL );
+	CHECK_SYS( clock_gettime(CLOCK_REALTIME, &ts) );
+	tw_now = ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec) >> SESS_TW_TICK_BITS;
 
 	return 0;
 }
@@ -400,6 +751,7 @@ void fd_sess_fini(void)
 int fd_sess_handler_create ( struct session_handler ** handler, void (*cleanup)(struct sess_state *, os0_t, void *), session_state_dump dumper, void * opaque )
 {
 	struct session_handler *new;
+	int i;
 
 	TRACE_ENTRY("%p %p", handler, cleanup);
 
@@ -408,15 +760,27 @@ int fd_sess_handler_create ( struct session_handler ** handler, void (*cleanup)(
 	CHECK_MALLOC( new = malloc(sizeof(struct session_handler)) );
 	memset(new, 0, sizeof(struct session_handler));
 
-	CHECK_POSIX( pthread_mutex_lock(&hdl_lock) );
-	new->id = ++hdl_id;
-	CHECK_POSIX( pthread_mutex_unlock(&hdl_lock) );
-
 	new->eyec = SH_EYEC;
 	new->cleanup = cleanup;
 	new->state_dump = dumper;
 	new->opaque = opaque;
 
+	/* Use the smallest free id */
+	CHECK_POSIX( pthread_mutex_lock(&hdl_lock) );
+	for (i = 0; (i < SESS_MAX_HANDLERS) && hdl_tab[i]; i++)
+		;
+	if (i < SESS_MAX_HANDLERS) {
+		new->id = i + 1;
+		__atomic_store_n(&hdl_tab[i], new, __ATOMIC_RELEASE);
+	}
+	CHECK_POSIX( pthread_mutex_unlock(&hdl_lock) );
+
+	if (!new->id) {
+		TRACE_DEBUG(INFO, "Too many session handlers (%d), increase SESS_MAX_HANDLERS", SESS_MAX_HANDLERS);
+		free(new);
+		return ENOSPC;
+	}
+
 	*handler = new;
 	return 0;
 }
@@ -428,41 +792,55 @@ int fd_sess_handler_destroy ( struct session_handler ** handler, void ** opaque
 	struct session_handler * del;
 	/* place to save the list of states to be cleaned up. We do it after finding them to avoid deadlocks. the "o" field becomes a copy of the sid. */
 	struct fd_list deleted_states = FD_LIST_INITIALIZER( deleted_states );
-	int i;
+	int i, idx;
 
 	TRACE_ENTRY("%p", handler);
 	CHECK_PARAMS( handler && VALIDATE_SH(*handler) );
 
 	del = *handler;
 	*handler = NULL;
+	idx = del->id - 1;
 
 	del->eyec = 0xdead; /* The handler is not valid anymore for any other operation */
 
 	/* Now find all sessions with data registered for this handler, and move this data to the deleted_states list. */
-	for (i = 0; i < sizeof(sess_hash) / sizeof(sess_hash[0]); i++) {
-		struct fd_list * li_si;
-		CHECK_POSIX(  pthread_mutex_lock(&sess_hash[i].lock)  );
-
-		for (li_si = sess_hash[i].sentinel.next; li_si != &sess_hash[i].sentinel; li_si = li_si->next) { /* for each session in the hash line */
-			struct fd_list * li_st;
-			struct session * sess = (struct session *)(li_si->o);
-			CHECK_POSIX(  pthread_mutex_lock(&sess->stlock)  );
-			for (li_st = sess->states.next; li_st != &sess->states; li_st = li_st->next) { /* for each state in this session */
-				struct state * st = (struct state *)(li_st->o);
-				/* The list is ordered */
-				if (st->hdl->id < del->id)
-					continue;
-				if (st->hdl->id == del->id) {
-					/* This state belongs to the handler we are deleting, move the item to the deleted_states list */
-					fd_list_unlink(&st->chain);
-					st->sid = sess->sid;
-					fd_list_insert_before(&deleted_states, &st->chain);
+	for (i = 0; i < SESS_LOCKS; i++) {
+		uint64_t shape;
+		uint32_t b, nb;
+		CHECK_POSIX(  pthread_rwlock_rdlock(&sess_locks[i])  );
+
+		/* The buckets of this lock cannot be split or merged while we hold it */
+		shape = __atomic_load_n(&sess_shape, __ATOMIC_ACQUIRE);
+		nb = (1U << (shape >> 32)) + (uint32_t)shape;
+		for (b = i; b < nb; b += SESS_LOCKS) {
+			struct fd_list * li_si, * bucket = h_bucket(b);
+			for (li_si = bucket->next; li_si != bucket; li_si = li_si->next) { /* for each session in the hash line */
+				struct sess_state * state = NULL;
+				struct session * sess = (struct session *)(li_si->o);
+				CHECK_POSIX(  pthread_mutex_lock(&sess->stlock)  );
+				if (idx < SESS_STATE_SLOTS) {
+					state = __atomic_exchange_n(&sess->states[idx], NULL, __ATOMIC_ACQ_REL);
+				} else if (idx - SESS_STATE_SLOTS < sess->nb_more) {
+					state = sess->more_states[idx - SESS_STATE_SLOTS];
+					sess->more_states[idx - SESS_STATE_SLOTS] = NULL;
 				}
-				break;
+				if (state) {
+					/* This state belongs to the handler we are deleting, save it in the deleted_states list */
+					struct state * st = malloc(sizeof(struct state));
+					if (st) {
+						st->eyec = SD_EYEC;
+						st->state = state;
+						st->sid = sess->sid;
+						fd_list_init(&st->chain, st);
+						fd_list_insert_before(&deleted_states, &st->chain);
+					} else {
+						TRACE_ERROR("Not enough memory to clean up the state %p of session '%s', it is leaked", state, sess->sid);
+					}
+				}
+				CHECK_POSIX(  pthread_mutex_unlock(&sess->stlock)  );
 			}
-			CHECK_POSIX(  pthread_mutex_unlock(&sess->stlock)  );
 		}
-		CHECK_POSIX(  pthread_mutex_unlock(&sess_hash[i].lock)  );
+		CHECK_POSIX(  pthread_rwlock_unlock(&sess_locks[i])  );
 	}
 
 	/* Now, delete all states after calling their cleanup handler */
@@ -474,9 +852,19 @@ int fd_sess_handler_destroy ( struct session_handler ** handler, void ** opaque
 		free(st);
 	}
 
+	/* Wait for the states already taken by del_session_states to be cleaned up. Since we have visited all the sessions,
+	 no other state of this handler can be taken now. */
+	while (__atomic_load_n(&del->busy, __ATOMIC_ACQUIRE))
+		usleep(1000);
+
 	if (opaque)
 		*opaque = del->opaque;
 
+	/* The id can now be reused */
+	CHECK_POSIX( pthread_mutex_lock(&hdl_lock) );
+	__atomic_store_n(&hdl_tab[idx], NULL, __ATOMIC_RELEASE);
+	CHECK_POSIX( pthread_mutex_unlock(&hdl_lock) );
+
 	/* Free the handler */
 	free(del);
 
@@ -550,31 +938,31 @@ int fd_sess_new ( struct session ** session, DiamId_t diamid, size_t diamidlen,
 
 	hash = fd_os_hash(sid, sidlen);
 
-	/* Now find the place to add this object in the hash table. */
-	CHECK_POSIX( pthread_mutex_lock( H_LOCK(hash) ) );
-	pthread_cleanup_push( fd_cleanup_mutex, H_LOCK(hash) );
-
-	for (li = H_LIST(hash)->next; li != H_LIST(hash); li = li->next) {
-		int cmp;
-		struct session * s = (struct session *)(li->o);
-
-		/* The list is ordered by hash and sid (in case of collisions) */
-		if (s->hash < hash)
-			continue;
-		if (s->hash > hash)
-			break;
+	/* Most of the time the session already exists (received messages), look for it with the shared lock first. */
+	CHECK_POSIX( pthread_rwlock_rdlock( H_LOCK(hash) ) );
+	pthread_cleanup_push( fd_cleanup_rwlock, H_LOCK(hash) );
+	sess = h_find(H_LIST(hash), hash, sid, sidlen, NULL);
+	if (sess && !sess->is_destroyed) {
+		CHECK_POSIX_DO( pthread_mutex_lock(&sess->stlock), { ASSERT(0); /* otherwise cleanup handler is not pop'd */ } );
+		sess->msg_cnt++;
+		CHECK_POSIX_DO( pthread_mutex_unlock(&sess->stlock), { ASSERT(0); /* otherwise cleanup handler is not pop'd */ } );
+	} else {
+		sess = NULL;
+	}
+	pthread_cleanup_pop(0);
+	CHECK_POSIX( pthread_rwlock_unlock( H_LOCK(hash) ) );
+	if (sess) {
+		free(sid);
+		*session = sess;
+		return EALREADY;
+	}
 
-		cmp = fd_os_cmp(s->sid, s->sidlen, sid, sidlen);
-		if (cmp < 0)
-			continue;
-		if (cmp > 0)
-			break;
+	/* Now find the place to add this object in the hash table. */
+	CHECK_POSIX( pthread_rwlock_wrlock( H_LOCK(hash) ) );
+	pthread_cleanup_push( fd_cleanup_rwlock, H_LOCK(hash) );
 
-		/* A session with the same sid was already in the hash table */
-		found = 1;
-		*session = s;
-		break;
-	}
+	*session = h_find(H_LIST(hash), hash, sid, sidlen, &li);
+	found = (*session != NULL);
 
 	/* If the session did not exist, we can create it & link it in global tables */
 	if (!found) {
@@ -586,6 +974,7 @@ int fd_sess_new ( struct session ** session, DiamId_t diamid, size_t diamidlen,
 			} );
 
 		fd_list_insert_before(li, &sess->chain_h); /* hash table */
+		__atomic_add_fetch(&sess_hashed, 1, __ATOMIC_RELAXED);
 		sess->msg_cnt++;
 	} else {
 		free(sid);
@@ -608,21 +997,14 @@ int fd_sess_new ( struct session ** session, DiamId_t diamid, size_t diamidlen,
 		}
 	}
 
-	/* We must insert in the expiry list */
+	/* We must insert in the expiry wheel */
 	CHECK_POSIX( pthread_mutex_lock( &exp_lock ) );
 	pthread_cleanup_push( fd_cleanup_mutex, &exp_lock );
 
-	/* Find the position in that list. We take it in reverse order */
-	for (li = exp_sentinel.prev; li != &exp_sentinel; li = li->prev) {
-		struct session * s = (struct session *)(li->o);
-		if (TS_IS_INFERIOR( &s->timeout, &sess->timeout ) )
-			break;
-	}
-	fd_list_insert_after( li, &sess->expire );
 	sess_cnt++;
 
-	/* We added a new expiring element, we must signal */
-	if (li == &exp_sentinel) {
+	/* If the new session expires before the expiry thread wakes up, we must signal */
+	if (tw_place(sess) < tw_wake) {
 		CHECK_POSIX_DO( pthread_cond_signal(&exp_cond), { ASSERT(0); } ); /* if it fails, we might not pop the cleanup handlers, but this should not happen -- and we'd have a serious problem otherwise */
 	}
 
@@ -633,11 +1015,14 @@ int fd_sess_new ( struct session ** session, DiamId_t diamid, size_t diamidlen,
 out: /* <--- to here */
 	;
 	pthread_cleanup_pop(0);
-	CHECK_POSIX( pthread_mutex_unlock( H_LOCK(hash) ) );
+	CHECK_POSIX( pthread_rwlock_unlock( H_LOCK(hash) ) );
 
 	if (ret) /* in case of error */
 		return ret;
 
+	if (!found)
+		h_grow();
+
 	*session = sess; /* <-- overwrite *session by a wrong pointer */
 	return 0;
 }
@@ -688,8 +1073,6 @@ int fd_sess_getsid ( struct session * session, os0_t * sid, size_t * sidlen )
 /* Change the timeout value of a session */
 int fd_sess_settimeout( struct session * session, const struct timespec * timeout )
 {
-	struct fd_list * li;
-
 	TRACE_ENTRY("%p %p", session, timeout);
 	CHECK_PARAMS( VALIDATE_SI(session) && timeout );
 
@@ -697,23 +1080,11 @@ int fd_sess_settimeout( struct session * session, const struct timespec * timeou
 	CHECK_POSIX( pthread_mutex_lock( &exp_lock ) );
 	pthread_cleanup_push( fd_cleanup_mutex, &exp_lock );
 
-	/* Update the timeout */
-	fd_list_unlink(&session->expire);
+	/* Update the timeout and move the session in the wheel */
 	memcpy(&session->timeout, timeout, sizeof(struct timespec));
 
-	/* Find the new position in expire list. We take it in normal order */
-	for (li = exp_sentinel.next; li != &exp_sentinel; li = li->next) {
-		struct session * s = (struct session *)(li->o);
-
-		if (TS_IS_INFERIOR( &s->timeout, &session->timeout ) )
-			continue;
-
-		break;
-	}
-	fd_list_insert_before( li, &session->expire );
-
-	/* We added a new expiring element, we must signal if it was in first position */
-	if (session->expire.prev == &exp_sentinel) {
+	/* We must signal if it expires before the expiry thread wakes up */
+	if (tw_place(session) < tw_wake) {
 		CHECK_POSIX_DO( pthread_cond_signal(&exp_cond), { ASSERT(0); /* so that we don't have a pending cancellation handler */ } );
 	}
 
@@ -730,7 +1101,7 @@ int fd_sess_destroy ( struct session ** session )
 	TRACE_ENTRY("%p", session);
 	CHECK_PARAMS( session && VALIDATE_SI(*session) );
 
-	CHECK_FCT( del_session_states(*session, (*session)->sid, (*session)->sidlen) );
+	CHECK_FCT( del_session_states(*session, (*session)->sid, (*session)->sidlen, 0) );
 	*session = NULL;
 	
 	return 0;
@@ -750,20 +1121,24 @@ int fd_sess_reclaim ( struct session ** session )
 	hash = sess->hash;
 	*session = NULL;
 
-	CHECK_POSIX( pthread_mutex_lock( H_LOCK(hash) ) );
-	pthread_cleanup_push( fd_cleanup_mutex, H_LOCK(hash) );
+	CHECK_POSIX( pthread_rwlock_wrlock( H_LOCK(hash) ) );
+	pthread_cleanup_push( fd_cleanup_rwlock, H_LOCK(hash) );
 	CHECK_POSIX_DO( pthread_mutex_lock( &sess->stlock ), { ASSERT(0); /* otherwise, cleanup not popped on FreeBSD */ } );
 	pthread_cleanup_push( fd_cleanup_mutex, &sess->stlock );
 	CHECK_POSIX_DO( pthread_mutex_lock( &exp_lock ), { ASSERT(0); /* otherwise, cleanup not popped on FreeBSD */ } );
 	pthread_cleanup_push( fd_cleanup_mutex, &exp_lock );
 
-	/* We only do something if the states list is empty */
-	if (FD_IS_LIST_EMPTY(&sess->states)) {
+	/* We only do something if the session has no state */
+	if (!has_states(sess)) {
 		/* In this case, we do as in destroy */
-		fd_list_unlink( &sess->expire );
+		if (!FD_IS_LIST_EMPTY(&sess->expire)) {
+			sess_cnt--;
+			fd_list_unlink( &sess->expire );
+		}
 		destroy_now = (sess->msg_cnt == 0);
 		if (destroy_now) {
 			fd_list_unlink(&sess->chain_h);
+			__atomic_sub_fetch(&sess_hashed, 1, __ATOMIC_RELAXED);
 		} else {
 			/* just mark it as destroyed, it will be freed when the last message stops referencing it */
 			sess->is_destroyed = 1;
@@ -775,10 +1150,12 @@ int fd_sess_reclaim ( struct session ** session )
 	pthread_cleanup_pop(0);
 	CHECK_POSIX_DO( pthread_mutex_unlock( &sess->stlock ), { ASSERT(0); /* otherwise, cleanup not popped on FreeBSD */ } );
 	pthread_cleanup_pop(0);
-	CHECK_POSIX( pthread_mutex_unlock( H_LOCK(hash) ) );
+	CHECK_POSIX( pthread_rwlock_unlock( H_LOCK(hash) ) );
 
-	if (destroy_now)
+	if (destroy_now) {
 		del_session(sess);
+		h_shrink();
+	}
 
 	return 0;
 }
@@ -786,85 +1163,82 @@ int fd_sess_reclaim ( struct session ** session )
 /* Save a state information with a session */
 int fd_sess_state_store ( struct session_handler * handler, struct session * session, struct sess_state ** state )
 {
-	struct state *new;
-	struct fd_list * li;
-	int already = 0;
-	int ret = 0;
+	struct sess_state * old = NULL;
+	int idx, ret = 0;
 
 	TRACE_ENTRY("%p %p %p", handler, session, state);
 	CHECK_PARAMS( handler && VALIDATE_SH(handler) && session && VALIDATE_SI(session) && (!session->is_destroyed) && state );
 
-	/* Lock the session state list */
-	CHECK_POSIX( pthread_mutex_lock(&session->stlock) );
-	pthread_cleanup_push( fd_cleanup_mutex, &session->stlock );
-
-	/* Create the new state object */
-	CHECK_MALLOC_DO(new = malloc(sizeof(struct state)), { ret = ENOMEM; goto out; } );
-	memset(new, 0, sizeof(struct state));
-
-	new->eyec = SD_EYEC;
-	new->state= *state;
-	fd_list_init(&new->chain, new);
-	new->hdl = handler;
-
-	/* find place for this state in the list */
-	for (li = session->states.next; li != &session->states; li = li->next) {
-		struct state * st = (struct state *)(li->o);
-		/* The list is ordered by handler's id */
-		if (st->hdl->id < handler->id)
-			continue;
+	idx = handler->id - 1;
 
-		if (st->hdl->id == handler->id) {
-			TRACE_DEBUG(INFO, "A state was already stored for session '%s' and handler '%p', at location %p", session->sid, st->hdl, st->state);
-			already = EALREADY;
+	/* Most handlers have an inline slot, no lock needed */
+	if (idx < SESS_STATE_SLOTS) {
+		if (!__atomic_compare_exchange_n(&session->states[idx], &old, *state, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			TRACE_DEBUG(INFO, "A state was already stored for session '%s' and handler '%p', at location %p", session->sid, handler, old);
+			return EALREADY;
 		}
+		*state = NULL;
+		return 0;
+	}
+	idx -= SESS_STATE_SLOTS;
 
-		break;
+	/* Lock the session states */
+	CHECK_POSIX( pthread_mutex_lock(&session->stlock) );
+	pthread_cleanup_push( fd_cleanup_mutex, &session->stlock );
+
+	/* Grow the array if needed */
+	if (idx >= session->nb_more) {
+		struct sess_state ** more;
+		int nb = session->nb_more ?: SESS_STATE_SLOTS;
+		while (nb <= idx)
+			nb *= 2;
+		CHECK_MALLOC_DO( more = realloc(session->more_states, nb * sizeof(struct sess_state *)), { ret = ENOMEM; goto out; } );
+		memset(more + session->nb_more, 0, (nb - session->nb_more) * sizeof(struct sess_state *));
+		session->more_states = more;
+		session->nb_more = nb;
 	}
 
-	if (!already) {
-		fd_list_insert_before(li, &new->chain);
-		*state = NULL;
+	if (session->more_states[idx]) {
+		TRACE_DEBUG(INFO, "A state was already stored for session '%s' and handler '%p', at location %p", session->sid, handler, session->more_states[idx]);
+		ret = EALREADY;
 	} else {
-		free(new);
+		session->more_states[idx] = *state;
+		*state = NULL;
 	}
 out:
 	;
 	pthread_cleanup_pop(0);
 	CHECK_POSIX( pthread_mutex_unlock(&session->stlock) );
 
-	return ret ?: already;
+	return ret;
 }
 
 /* Get the data back */
 int fd_sess_state_retrieve ( struct session_handler * handler, struct session * session, struct sess_state ** state )
 {
-	struct fd_list * li;
-	struct state * st = NULL;
+	int idx;
 
 	TRACE_ENTRY("%p %p %p", handler, session, state);
 	CHECK_PARAMS( handler && VALIDATE_SH(handler) && session && VALIDATE_SI(session) && state );
 
+	idx = handler->id - 1;
+
+	/* Inline slot, no lock needed */
+	if (idx < SESS_STATE_SLOTS) {
+		*state = __atomic_exchange_n(&session->states[idx], NULL, __ATOMIC_ACQ_REL);
+		return 0;
+	}
+	idx -= SESS_STATE_SLOTS;
+
 	*state = NULL;
 
-	/* Lock the session state list */
+	/* Lock the session states */
 	CHECK_POSIX( pthread_mutex_lock(&session->stlock) );
 	pthread_cleanup_push( fd_cleanup_mutex, &session->stlock );
 
-	/* find the state in the list */
-	for (li = session->states.next; li != &session->states; li = li->next) {
-		st = (struct state *)(li->o);
-
-		/* The list is ordered by handler's id */
-		if (st->hdl->id > handler->id)
-			break;
-	}
-
-	/* If we found the state */
-	if (st && (st->hdl == handler)) {
-		fd_list_unlink(&st->chain);
-		*state = st->state;
-		free(st);
+	if (idx < session->nb_more) {
+		*state = session->more_states[idx];
+		session->more_states[idx] = NULL;
 	}
 
 	pthread_cleanup_pop(0);
@@ -914,8 +1288,8 @@ int fd_sess_reclaim_msg ( struct session ** session )
 
 	/* Lock the hash line to avoid possibility that session is freed while we are reclaiming */
 	hash = (*session)->hash;
-	CHECK_POSIX( pthread_mutex_lock( H_LOCK(hash)) );
-	pthread_cleanup_push( fd_cleanup_mutex, H_LOCK(hash) );
+	CHECK_POSIX( pthread_rwlock_rdlock( H_LOCK(hash)) );
+	pthread_cleanup_push( fd_cleanup_rwlock, H_LOCK(hash) );
 
 	/* Update the msg refcount */
 	CHECK_POSIX( pthread_mutex_lock(&(*session)->stlock) );
@@ -925,7 +1299,7 @@ int fd_sess_reclaim_msg ( struct session ** session )
 
 	/* Ok, now unlock the hash line */
 	pthread_cleanup_pop( 0 );
-	CHECK_POSIX( pthread_mutex_unlock( H_LOCK(hash) ) );
+	CHECK_POSIX( pthread_rwlock_unlock( H_LOCK(hash) ) );
 
 	/* and reclaim if no message references the session anymore */
 	if (reclaim == 1) {
@@ -958,18 +1332,21 @@ DECLARE_FD_DUMP_PROTOTYPE(fd_sess_dump, struct session * session, int with_state
 				 return NULL);
 
 		if (with_states) {
-			struct fd_list * li;
+			int i;
 			CHECK_POSIX_DO( pthread_mutex_lock(&session->stlock), /* ignore */ );
 			pthread_cleanup_push( fd_cleanup_mutex, &session->stlock );
 
-			for (li = session->states.next; li != &session->states; li = li->next) {
-				struct state * st = (struct state *)(li->o);
-				CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "\n  {state i:%d}(@%p): ", st->hdl->id, st), return NULL);
-				if (st->hdl->state_dump) {
-					CHECK_MALLOC_DO( (*st->hdl->state_dump)( FD_DUMP_STD_PARAMS, st->state),
+			for (i = 0; i < SESS_STATE_SLOTS + session->nb_more; i++) {
+				struct sess_state * st = (i < SESS_STATE_SLOTS) ? __atomic_load_n(&session->states[i], __ATOMIC_ACQUIRE) : session->more_states[i - SESS_STATE_SLOTS];
+				struct session_handler * hdl = __atomic_load_n(&hdl_tab[i], __ATOMIC_ACQUIRE);
+				if (!st)
+					continue;
+				CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "\n  {state i:%d}(@%p): ", i + 1, st), return NULL);
+				if (hdl && hdl->state_dump) {
+					CHECK_MALLOC_DO( (*hdl->state_dump)( FD_DUMP_STD_PARAMS, st),
 							fd_dump_extend( FD_DUMP_STD_PARAMS, "[dumper error]"));
 				} else {
-					CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "<%p>", st->state), return NULL);
+					CHECK_MALLOC_DO( fd_dump_extend( FD_DUMP_STD_PARAMS, "<%p>", st), return NULL);
 				}
 			}
 
@@ -1003,3 +1380,42 @@ int fd_sess_getcount(uint32_t *cnt)
 	CHECK_POSIX( pthread_mutex_unlock( &exp_lock ) );
 	return 0;
 }
+
+/* For monitoring: walk the hash table to compute its load and the length of its chains */
+int fd_sess_gethashstats(struct fd_sess_hashstats * stats)
+{
+	int i;
+
+	TRACE_ENTRY("%p", stats);
+	CHECK_PARAMS(stats);
+
+	memset(stats, 0, sizeof(struct fd_sess_hashstats));
+
+	for (i = 0; i < SESS_LOCKS; i++) {
+		uint64_t shape;
+		uint32_t b, nb;
+
+		CHECK_POSIX( pthread_rwlock_rdlock(&sess_locks[i]) );
+		shape = __atomic_load_n(&sess_shape, __ATOMIC_ACQUIRE);
+		nb = (1U << (shape >> 32)) + (uint32_t)shape;
+		for (b = i; b < nb; b += SESS_LOCKS) {
+			struct fd_list * li, * bucket = h_bucket(b);
+			uint32_t len = 0;
+			for (li = bucket->next; li != bucket; li = li->next)
+				len++;
+			stats->sessions += len;
+			stats->chains[(len < FD_SESS_CHAIN_HIST - 1) ? len : FD_SESS_CHAIN_HIST - 1]++;
+			if (len > stats->max_chain)
+				stats->max_chain = len;
+		}
+		CHECK_POSIX( pthread_rwlock_unlock(&sess_locks[i]) );
+	}
+
+	{
+		uint64_t shape = __atomic_load_n(&sess_shape, __ATOMIC_ACQUIRE);
+		stats->buckets = (1U << (shape >> 32)) + (uint32_t)shape;
+	}
+	stats->load = (double)stats->sessions / stats->buckets;
+
+	return 0;
+}
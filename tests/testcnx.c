@@ -34,6 +34,7 @@
 *********************************************************************************************************/
 
 #include "tests.h"
+#include <dirent.h>
 
 #ifndef TEST_PORT
 #define TEST_PORT	3868
@@ -712,6 +713,22 @@ static void * destroy_thr(void * arg)
 	fd_cnx_destroy(cnx);
 	return NULL;
 }
+
+/* Number of threads of the process */
+static int count_threads(void)
+{
+	DIR * dir;
+	struct dirent * ent;
+	int nb = 0;
+	
+	CHECK( 1, (dir = opendir("/proc/self/task")) ? 1 : 0 );
+	while ((ent = readdir(dir)) != NULL) {
+		if (ent->d_name[0] != '.')
+			nb++;
+	}
+	closedir(dir);
+	return nb;
+}
 	
 /* Main test routine */
 int main(int argc, char *argv[])
@@ -901,6 +918,291 @@ int main(int argc, char *argv[])
 		fd_cnx_destroy(client_side);
 		fd_cnx_destroy(server_side);
 	}
+	
+	/* TCP test with several messages received at once (no TLS) */
+	{
+		struct connect_flags cf;
+		struct iovec iov[4];
+		uint8_t * big;
+		size_t big_sz = 60000;
+		int i;
+		
+		memset(&cf, 0, sizeof(cf));
+		cf.proto = IPPROTO_TCP;
+		
+		/* Start the client thread */
+		CHECK( 0, pthread_create(&thr, NULL, connect_thr, &cf) );
+
+		/* Accept the connection of the client */
+		server_side = fd_cnx_serv_accept(listener);
+		CHECK( 1, server_side ? 1 : 0 );
+		CHECK( 0, fd_cnx_start_clear(server_side, 1) );
+		
+		/* Retrieve the client connection object */
+		CHECK( 0, pthread_join( thr, (void *)&client_side ) );
+		CHECK( 1, client_side ? 1 : 0 );
+		
+		/* A big message, that does not fit in the receive buffer after the first ones */
+		big = malloc(big_sz);
+		CHECK( 1, big ? 1 : 0 );
+		memset(big, 0xa5, big_sz);
+		big[0] = DIAMETER_VERSION;
+		big[1] = (big_sz >> 16) & 0xff;
+		big[2] = (big_sz >> 8) & 0xff;
+		big[3] = big_sz & 0xff;
+		
+		/* Send the messages in one write */
+		for (i = 0; i < 4; i++) {
+			iov[i].iov_base = (i == 2) ? big : cer_buf;
+			iov[i].iov_len  = (i == 2) ? big_sz : cer_sz;
+		}
+		CHECK( 0, fd_cnx_sendv(client_side, iov, 4));
+		
+		for (i = 0; i < 4; i++) {
+			CHECK( 0, fd_cnx_receive(server_side, NULL, &rcv_buf, &rcv_sz));
+			CHECK( (i == 2) ? big_sz : cer_sz, rcv_sz );
+			CHECK( 0, memcmp( rcv_buf, (i == 2) ? big : cer_buf, rcv_sz ) );
+			free(rcv_buf);
+		}
+		free(big);
+		
+		/* Now close the connections */
+		fd_cnx_destroy(client_side);
+		fd_cnx_destroy(server_side);
+	}
+	
+	/* TCP test of the out thread of a peer, that sends the queued messages in batches (no TLS) */
+	{
+		struct connect_flags cf;
+		struct fd_peer * peer = NULL;
+		struct dict_object * raa_model = NULL, * rar_model = NULL;
+		struct msg * msg;
+		struct msg_hdr * hdr;
+		struct timespec sent, rcvd;
+		uint32_t hbh, req_hbh;
+		int i, code;
+		int sv_batch = fd_g_config->cnf_send_batch, sv_delay = fd_g_config->cnf_send_delay;
+		void (*sv_pipe)(int);
+		
+		#define OUT_MSG( _model, _hbh ) {						\
+			CHECK( 0, fd_msg_new ( (_model), 0, &msg ) );			\
+			CHECK( 0, fd_msg_hdr ( msg, &hdr ) );				\
+			hdr->msg_hbhid = (_hbh);					\
+		}
+		#define RCV_HBH() {								\
+			CHECK( 0, fd_cnx_receive(server_side, NULL, &rcv_buf, &rcv_sz));\
+			CHECK( 1, rcv_sz >= 20 ? 1 : 0 );				\
+			memcpy(&hbh, rcv_buf + 12, sizeof(hbh));			\
+			hbh = ntohl(hbh);						\
+		}
+		
+		CHECK( 0, fd_dict_search ( fd_g_config->cnf_dict, DICT_COMMAND, CMD_BY_NAME, "Re-Auth-Answer", &raa_model, ENOENT ) );
+		CHECK( 0, fd_dict_search ( fd_g_config->cnf_dict, DICT_COMMAND, CMD_BY_NAME, "Re-Auth-Request", &rar_model, ENOENT ) );
+		
+		memset(&cf, 0, sizeof(cf));
+		cf.proto = IPPROTO_TCP;
+		CHECK( 0, pthread_create(&thr, NULL, connect_thr, &cf) );
+		server_side = fd_cnx_serv_accept(listener);
+		CHECK( 1, server_side ? 1 : 0 );
+		CHECK( 0, fd_cnx_start_clear(server_side, 1) );
+		CHECK( 0, pthread_join( thr, (void *)&client_side ) );
+		CHECK( 1, client_side ? 1 : 0 );
+		CHECK( 0, fd_cnx_start_clear(client_side, 0) );
+		
+		CHECK( 0, fd_peer_alloc(&peer) );
+		peer->p_hdr.info.pi_diamid = strdup("peer.test");
+		peer->p_hdr.info.pi_diamidlen = strlen(peer->p_hdr.info.pi_diamid);
+		CHECK( 0, fd_fifo_new(&peer->p_events, 0) );
+		peer->p_cnxctx = client_side;
+		fd_g_config->cnf_send_batch = 4;
+		fd_g_config->cnf_send_delay = 0;
+		
+		/* The messages already queued and the following ones are sent in order */
+		for (i = 0; i < 5; i++) {
+			OUT_MSG( raa_model, i );
+			CHECK( 0, fd_fifo_post(peer->p_tosend, &msg) );
+		}
+		CHECK( 0, fd_out_start(peer) );
+		for (; i < 10; i++) {
+			OUT_MSG( raa_model, i );
+			CHECK( 0, fd_fifo_post(peer->p_tosend, &msg) );
+		}
+		
+		/* A request gets the next hop-by-hop id of the peer, and is saved until its answer */
+		req_hbh = peer->p_hbh;
+		OUT_MSG( rar_model, 0 );
+		CHECK( 0, fd_fifo_post(peer->p_tosend, &msg) );
+		
+		for (i = 0; i < 11; i++) {
+			RCV_HBH();
+			CHECK( (i < 10) ? i : req_hbh, hbh );
+			CHECK( (i < 10) ? 0 : CMD_FLAG_REQUEST, rcv_buf[4] & CMD_FLAG_REQUEST );
+			free(rcv_buf);
+		}
+		CHECK( 0, fd_p_sr_fetch(&peer->p_sr, req_hbh, &msg) );
+		CHECK( 1, msg ? 1 : 0 );
+		CHECK( 0, fd_msg_free(msg) );
+		
+		/* With a delay, the thread waits for more messages before sending the batch */
+		fd_g_config->cnf_send_delay = 200000;
+		CHECK( 0, clock_gettime(CLOCK_REALTIME, &sent) );
+		OUT_MSG( raa_model, 20 );
+		CHECK( 0, fd_fifo_post(peer->p_tosend, &msg) );
+		usleep(50000);
+		OUT_MSG( raa_model, 21 );
+		CHECK( 0, fd_fifo_post(peer->p_tosend, &msg) );
+		RCV_HBH();
+		CHECK( 20, hbh );
+		free(rcv_buf);
+		CHECK( 0, clock_gettime(CLOCK_REALTIME, &rcvd) );
+		RCV_HBH();
+		CHECK( 21, hbh );
+		free(rcv_buf);
+		CHECK( 1, ((rcvd.tv_sec - sent.tv_sec) * 1000000000LL + rcvd.tv_nsec - sent.tv_nsec) >= 150000000LL ? 1 : 0 );
+		fd_g_config->cnf_send_delay = 0;
+		
+		/* When the connection fails, the error is reported and the routable messages are moved to p_tofailover */
+		sv_pipe = signal(SIGPIPE, SIG_IGN);
+		fd_cnx_destroy(server_side);
+		for (i = 0; (i < 1000) && !fd_fifo_length(peer->p_events); i++) {
+			OUT_MSG( raa_model, 100 + i );
+			CHECK( 0, fd_fifo_post(peer->p_tosend, &msg) );
+			usleep(1000);
+		}
+		CHECK( 0, fd_event_get(peer->p_events, &code, NULL, NULL) );
+		CHECK( FDEVP_CNX_ERROR, code );
+		OUT_MSG( raa_model, 999 );
+		CHECK( 0, fd_fifo_post(peer->p_tosend, &msg) );
+		do {
+			CHECK( 0, fd_fifo_get(peer->p_tofailover, &msg) );
+			CHECK( 0, fd_msg_hdr ( msg, &hdr ) );
+			hbh = hdr->msg_hbhid;
+			CHECK( 0, fd_msg_free(msg) );
+		} while (hbh != 999);
+		
+		CHECK( 0, fd_out_stop(peer) );
+		signal(SIGPIPE, sv_pipe);
+		fd_cnx_destroy(client_side);
+		peer->p_cnxctx = NULL;
+		while (fd_fifo_tryget(peer->p_tosend, &msg) == 0)
+			CHECK( 0, fd_msg_free(msg) );
+		while (fd_fifo_tryget(peer->p_tofailover, &msg) == 0)
+			CHECK( 0, fd_msg_free(msg) );
+		fd_event_destroy(&peer->p_events, free);
+		CHECK( 0, fd_peer_free(&peer) );
+		fd_g_config->cnf_send_batch = sv_batch;
+		fd_g_config->cnf_send_delay = sv_delay;
+		#undef OUT_MSG
+		#undef RCV_HBH
+	}
+	
+	/* TCP test with the I/O threads (no TLS) */
+	{
+		struct connect_flags cf;
+		int i;
+		
+		fd_g_config->cnf_io_thr = 2;
+		CHECK( 0, fd_reactor_init() );
+		
+		memset(&cf, 0, sizeof(cf));
+		cf.proto = IPPROTO_TCP;
+		
+		/* Start the client thread */
+		CHECK( 0, pthread_create(&thr, NULL, connect_thr, &cf) );
+
+		/* Accept the connection of the client */
+		server_side = fd_cnx_serv_accept(listener);
+		CHECK( 1, server_side ? 1 : 0 );
+		CHECK( 0, fd_cnx_start_clear(server_side, 1) );
+		
+		/* Retrieve the client connection object */
+		CHECK( 0, pthread_join( thr, (void *)&client_side ) );
+		CHECK( 1, client_side ? 1 : 0 );
+		CHECK( 0, fd_cnx_start_clear(client_side, 1) );
+		
+		/* Send messages in both directions */
+		for (i = 0; i < 10; i++) {
+			CHECK( 0, fd_cnx_send(server_side, cer_buf, cer_sz));
+			CHECK( 0, fd_cnx_send(client_side, cer_buf, cer_sz));
+		}
+		for (i = 0; i < 10; i++) {
+			CHECK( 0, fd_cnx_receive(client_side, NULL, &rcv_buf, &rcv_sz));
+			CHECK( cer_sz, rcv_sz );
+			CHECK( 0, memcmp( rcv_buf, cer_buf, cer_sz ) );
+			free(rcv_buf);
+			CHECK( 0, fd_cnx_receive(server_side, NULL, &rcv_buf, &rcv_sz));
+			CHECK( cer_sz, rcv_sz );
+			CHECK( 0, memcmp( rcv_buf, cer_buf, cer_sz ) );
+			free(rcv_buf);
+		}
+		
+		/* The disconnection is reported */
+		fd_cnx_destroy(client_side);
+		CHECK( ENOTCONN, fd_cnx_receive(server_side, NULL, &rcv_buf, &rcv_sz));
+		fd_cnx_destroy(server_side);
+		
+		CHECK( 0, fd_reactor_fini() );
+		fd_g_config->cnf_io_thr = 0;
+	}
+
+	/* TCP test with a full queue, the I/O thread still serves the other connections */
+	{
+		struct connect_flags cf;
+		struct fifo * queue = NULL;
+		int i, code;
+
+		fd_g_config->cnf_io_thr = 1;
+		CHECK( 0, fd_reactor_init() );
+
+		memset(&cf, 0, sizeof(cf));
+		cf.proto = IPPROTO_TCP;
+
+		CHECK( 0, pthread_create(&thr, NULL, connect_thr, &cf) );
+		server_side = fd_cnx_serv_accept(listener);
+		CHECK( 1, server_side ? 1 : 0 );
+		CHECK( 0, fd_cnx_start_clear(server_side, 1) );
+		CHECK( 0, pthread_join( thr, (void *)&client_side ) );
+		CHECK( 1, client_side ? 1 : 0 );
+		CHECK( 0, fd_cnx_start_clear(client_side, 1) );
+
+		/* The messages received by the server go to a queue of 2 messages that is not read yet */
+		CHECK( 0, fd_fifo_new ( &queue, 2 ) );
+		CHECK( 0, fd_cnx_recv_setaltfifo(server_side, queue) );
+		for (i = 0; i < 10; i++) {
+			CHECK( 0, fd_cnx_send(client_side, cer_buf, cer_sz));
+		}
+		for (i = 0; (i < 1000) && (fd_fifo_length(queue) < 2); i++)
+			usleep(1000);
+		CHECK( 1, fd_fifo_length(queue) >= 2 ? 1 : 0 );
+
+		/* The client connection, handled by the same thread, still receives */
+		for (i = 0; i < 10; i++) {
+			CHECK( 0, fd_cnx_send(server_side, cer_buf, cer_sz));
+		}
+		for (i = 0; i < 10; i++) {
+			CHECK( 0, fd_cnx_receive(client_side, NULL, &rcv_buf, &rcv_sz));
+			CHECK( cer_sz, rcv_sz );
+			free(rcv_buf);
+		}
+
+		/* The server connection resumes when the queue has room, and nothing is lost */
+		for (i = 0; i < 10; i++) {
+			CHECK( 0, fd_event_get(queue, &code, &rcv_sz, (void *)&rcv_buf) );
+			CHECK( FDEVP_CNX_MSG_RECV, code );
+			CHECK( cer_sz, rcv_sz );
+			CHECK( 0, memcmp( rcv_buf, cer_buf, cer_sz ) );
+			free(rcv_buf);
+		}
+
+		fd_cnx_destroy(client_side);
+		CHECK( 0, fd_event_get(queue, &code, NULL, NULL) );
+		CHECK( FDEVP_CNX_ERROR, code );
+		fd_cnx_destroy(server_side);
+		CHECK( 0, fd_fifo_del(&queue) );
+
+		CHECK( 0, fd_reactor_fini() );
+		fd_g_config->cnf_io_thr = 0;
+	}
 		
 #ifndef DISABLE_SCTP
 	/* Simple SCTP client / server test (no TLS) */
@@ -1187,6 +1489,108 @@ int main(int argc, char *argv[])
 		gnutls_certificate_free_credentials(hf.creds);
 	}
 	
+	/* TLS over TCP with the I/O threads: the records are decrypted without receiver threads */
+	{
+		struct connect_flags cf;
+		struct handshake_flags hf;
+		struct fifo * queue = NULL;
+		uint8_t * big;
+		size_t big_sz = 50000; /* several TLS records */
+		int nbthr, code;
+		
+		fd_g_config->cnf_io_thr = 1;
+		CHECK( 0, fd_reactor_init() );
+		
+		memset(&cf, 0, sizeof(cf));
+		cf.proto = IPPROTO_TCP;
+		
+		memset(&hf, 0, sizeof(hf));
+		CHECK_GNUTLS_DO( ret = gnutls_certificate_allocate_credentials (&hf.creds), );
+		CHECK( GNUTLS_E_SUCCESS, ret );
+		CHECK_GNUTLS_DO( ret = gnutls_certificate_set_x509_trust_mem( hf.creds, &ca, GNUTLS_X509_FMT_PEM), );
+		CHECK( 1, ret );
+		CHECK_GNUTLS_DO( ret = gnutls_certificate_set_x509_key_mem( hf.creds, &client_cert, &client_priv, GNUTLS_X509_FMT_PEM), );
+		CHECK( GNUTLS_E_SUCCESS, ret );
+		
+		CHECK( 0, pthread_create(&thr, NULL, connect_thr, &cf) );
+		server_side = fd_cnx_serv_accept(listener);
+		CHECK( 1, server_side ? 1 : 0 );
+		CHECK( 0, pthread_join( thr, (void *)&client_side ) );
+		CHECK( 1, client_side ? 1 : 0 );
+		hf.cnx = client_side;
+		
+		/* No thread is started for receiving on the connections */
+		nbthr = count_threads();
+		CHECK( 0, pthread_create(&thr, NULL, handshake_thr, &hf) );
+		CHECK( 0, fd_cnx_handshake(server_side, GNUTLS_SERVER, ALGO_HANDSHAKE_DEFAULT, NULL, NULL) );
+		CHECK( 0, pthread_join(thr, NULL) );
+		CHECK( 0, hf.ret );
+		CHECK( nbthr, count_threads() );
+		
+		/* Several messages at once in both directions */
+		for (i = 0; i < 10; i++) {
+			CHECK( 0, fd_cnx_send(server_side, cer_buf, cer_sz));
+			CHECK( 0, fd_cnx_send(client_side, cer_buf, cer_sz));
+		}
+		for (i = 0; i < 10; i++) {
+			CHECK( 0, fd_cnx_receive(client_side, NULL, &rcv_buf, &rcv_sz));
+			CHECK( cer_sz, rcv_sz );
+			CHECK( 0, memcmp( rcv_buf, cer_buf, cer_sz ) );
+			free(rcv_buf);
+			CHECK( 0, fd_cnx_receive(server_side, NULL, &rcv_buf, &rcv_sz));
+			CHECK( cer_sz, rcv_sz );
+			CHECK( 0, memcmp( rcv_buf, cer_buf, cer_sz ) );
+			free(rcv_buf);
+		}
+		
+		/* A message larger than a TLS record */
+		CHECK( 1, (big = malloc(big_sz)) ? 1 : 0 );
+		for (i = 0; i < big_sz; i++)
+			big[i] = (uint8_t)i;
+		big[0] = DIAMETER_VERSION;
+		big[1] = (big_sz >> 16) & 0xff;
+		big[2] = (big_sz >> 8) & 0xff;
+		big[3] = big_sz & 0xff;
+		CHECK( 0, fd_cnx_send(client_side, big, big_sz));
+		CHECK( 0, fd_cnx_receive(server_side, NULL, &rcv_buf, &rcv_sz));
+		CHECK( big_sz, rcv_sz );
+		CHECK( 0, memcmp( rcv_buf, big, big_sz ) );
+		free(rcv_buf);
+		free(big);
+		
+		/* The connection is paused while its queue is full, and resumes without loss */
+		CHECK( 0, fd_fifo_new ( &queue, 2 ) );
+		CHECK( 0, fd_cnx_recv_setaltfifo(server_side, queue) );
+		for (i = 0; i < 10; i++) {
+			CHECK( 0, fd_cnx_send(client_side, cer_buf, cer_sz));
+		}
+		for (i = 0; (i < 1000) && (fd_fifo_length(queue) < 2); i++)
+			usleep(1000);
+		usleep(50000);
+		CHECK( 1, fd_fifo_length(queue) < 10 ? 1 : 0 );
+		for (i = 0; i < 10; i++) {
+			CHECK( 0, fd_event_get(queue, &code, &rcv_sz, (void *)&rcv_buf) );
+			CHECK( FDEVP_CNX_MSG_RECV, code );
+			CHECK( cer_sz, rcv_sz );
+			CHECK( 0, memcmp( rcv_buf, cer_buf, cer_sz ) );
+			free(rcv_buf);
+		}
+		
+		/* The disconnection is reported */
+		fd_cnx_destroy(client_side);
+		CHECK( 0, fd_event_get(queue, &code, NULL, NULL) );
+		CHECK( FDEVP_CNX_ERROR, code );
+		fd_cnx_destroy(server_side);
+		CHECK( 0, fd_fifo_del(&queue) );
+		
+		gnutls_certificate_free_keys(hf.creds);
+		gnutls_certificate_free_cas(hf.creds);
+		gnutls_certificate_free_credentials(hf.creds);
+		
+		CHECK( 0, fd_reactor_fini() );
+		fd_g_config->cnf_io_thr = 0;
+	}
+	
 #ifndef DISABLE_SCTP
 	
 	
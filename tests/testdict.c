@@ -34,6 +34,7 @@
 *********************************************************************************************************/
 
 #include "tests.h"
+#include <fcntl.h>
 
 /* Test for the dict_iterate_rules function */
 int iter_test(void * data, struct dict_rule_data * rule)
@@ -46,6 +47,163 @@ int iter_test(void * data, struct dict_rule_data * rule)
 	return 0;
 }
 
+/* Benchmark of the searches: the cost of a lookup should not depend on the number of AVPs in the dictionary */
+#define BENCH_VENDOR	735679
+#define BENCH_LOOKUPS	200000
+
+static long long bench_ns(struct timespec * start)
+{
+	struct timespec end;
+	CHECK( 0, clock_gettime(CLOCK_MONOTONIC, &end) );
+	return (end.tv_sec - start->tv_sec) * 1000000000LL + (end.tv_nsec - start->tv_nsec);
+}
+
+/* The same lookups run by several threads at the same time, with the lock or in the frozen snapshot */
+#define BENCH_THREADS	4
+
+struct bench_thr {
+	struct dictionary *	dict;
+	int			nb;
+};
+
+static void * bench_searcher(void * arg)
+{
+	struct bench_thr * b = arg;
+	int i;
+	
+	for (i = 0; i < BENCH_LOOKUPS; i++) {
+		struct dict_avp_request req = { BENCH_VENDOR, (i % b->nb) + 1, NULL };
+		struct dict_object * avp = NULL;
+		CHECK( 0, fd_dict_search ( b->dict, DICT_AVP, AVP_BY_CODE_AND_VENDOR, &req, &avp, ENOENT ) );
+	}
+	return NULL;
+}
+
+/* Elapsed time divided by the total number of lookups of all the threads */
+static long long bench_threads(struct dictionary * dict, int nb)
+{
+	pthread_t thr[BENCH_THREADS];
+	struct bench_thr b = { dict, nb };
+	struct timespec start;
+	int i;
+	
+	CHECK( 0, clock_gettime(CLOCK_MONOTONIC, &start) );
+	for (i = 0; i < BENCH_THREADS; i++) {
+		CHECK( 0, pthread_create( &thr[i], NULL, bench_searcher, &b ) );
+	}
+	for (i = 0; i < BENCH_THREADS; i++) {
+		CHECK( 0, pthread_join( thr[i], NULL ) );
+	}
+	return bench_ns(&start) / (BENCH_THREADS * BENCH_LOOKUPS);
+}
+
+static void bench_search(void)
+{
+	struct dictionary * dict = NULL;
+	struct dict_vendor_data vendor_data = { BENCH_VENDOR, "Bench vendor" };
+	int sizes[] = { 500, 2000, 8000 };
+	long long by_code[3], by_name[3];
+	char name[32];
+	int s, i, nb = 0;
+	
+	CHECK( 0, fd_dict_init( &dict ) );
+	CHECK( 0, fd_dict_new ( dict, DICT_VENDOR, &vendor_data, NULL, NULL ) );
+	
+	for (s = 0; s < 3; s++) {
+		struct timespec start;
+		
+		/* Grow the dictionary */
+		for (; nb < sizes[s]; nb++) {
+			struct dict_avp_data avp_data = { nb + 1, BENCH_VENDOR, name, AVP_FLAG_VENDOR, AVP_FLAG_VENDOR, AVP_TYPE_UNSIGNED32 };
+			snprintf(name, sizeof(name), "Bench-AVP-%d", nb + 1);
+			CHECK( 0, fd_dict_new ( dict, DICT_AVP, &avp_data, NULL, NULL ) );
+		}
+		
+		/* Lookups by code, as when parsing messages */
+		CHECK( 0, clock_gettime(CLOCK_MONOTONIC, &start) );
+		for (i = 0; i < BENCH_LOOKUPS; i++) {
+			struct dict_avp_request req = { BENCH_VENDOR, (i % nb) + 1, NULL };
+			struct dict_object * avp = NULL;
+			CHECK( 0, fd_dict_search ( dict, DICT_AVP, AVP_BY_CODE_AND_VENDOR, &req, &avp, ENOENT ) );
+		}
+		by_code[s] = bench_ns(&start) / BENCH_LOOKUPS;
+		
+		/* Lookups by name */
+		CHECK( 0, clock_gettime(CLOCK_MONOTONIC, &start) );
+		for (i = 0; i < BENCH_LOOKUPS; i++) {
+			struct dict_avp_request req = { BENCH_VENDOR, 0, name };
+			struct dict_object * avp = NULL;
+			snprintf(name, sizeof(name), "Bench-AVP-%d", (i % nb) + 1);
+			CHECK( 0, fd_dict_search ( dict, DICT_AVP, AVP_BY_NAME_AND_VENDOR, &req, &avp, ENOENT ) );
+		}
+		by_name[s] = bench_ns(&start) / BENCH_LOOKUPS;
+		
+		LOG_N("dictionary with %d AVPs: %lld ns per search by code, %lld ns per search by name", nb, by_code[s], by_name[s]);
+	}
+	
+	/* With lists, the cost would be 16 times higher for the last size than for the first one */
+	CHECK( 1, by_code[2] < 5 * (by_code[0] + 1) ? 1 : 0 );
+	
+	/* Same lookups without locking */
+	{
+		struct timespec start;
+		long long frozen, locked_mt, frozen_mt;
+		
+		locked_mt = bench_threads(dict, nb);
+		CHECK( 0, fd_dict_freeze( dict ) );
+		frozen_mt = bench_threads(dict, nb);
+		LOG_N("%d threads searching a dictionary with %d AVPs: %lld ns per search with the lock, %lld ns per search when frozen", 
+			BENCH_THREADS, nb, locked_mt, frozen_mt);
+		CHECK( 1, frozen_mt <= locked_mt ? 1 : 0 );
+		
+		CHECK( 0, clock_gettime(CLOCK_MONOTONIC, &start) );
+		for (i = 0; i < BENCH_LOOKUPS; i++) {
+			struct dict_avp_request req = { BENCH_VENDOR, (i % nb) + 1, NULL };
+			struct dict_object * avp = NULL;
+			CHECK( 0, fd_dict_search ( dict, DICT_AVP, AVP_BY_CODE_AND_VENDOR, &req, &avp, ENOENT ) );
+			CHECK( 1, avp ? 1 : 0 );
+		}
+		frozen = bench_ns(&start) / BENCH_LOOKUPS;
+		LOG_N("frozen dictionary with %d AVPs: %lld ns per search by code", nb, frozen);
+	}
+	
+	/* Loading the dictionary from an image */
+	{
+		struct dictionary * loaded = NULL;
+		struct dict_avp_request req = { BENCH_VENDOR, nb, NULL };
+		char path[] = "/tmp/testdict.img.XXXXXX";
+		struct timespec start;
+		int fd;
+		
+		CHECK( 1, (fd = mkstemp(path)) >= 0 ? 1 : 0 );
+		close(fd);
+		CHECK( 0, fd_dict_image_save ( dict, path, "bench" ) );
+		CHECK( 0, fd_dict_init( &loaded ) );
+		CHECK( 0, clock_gettime(CLOCK_MONOTONIC, &start) );
+		CHECK( 0, fd_dict_image_load ( loaded, path, "bench" ) );
+		LOG_N("dictionary with %d AVPs loaded from image in %lld us", nb, bench_ns(&start) / 1000);
+		CHECK( 0, fd_dict_search ( loaded, DICT_AVP, AVP_BY_CODE_AND_VENDOR, &req, NULL, ENOENT ) );
+		CHECK( 0, fd_dict_fini( &loaded ) );
+		unlink(path);
+	}
+	
+	CHECK( 0, fd_dict_fini( &dict ) );
+}
+
+/* Searches in a frozen dictionary while it is being changed */
+static int searcher_stop = 0;
+static void * searcher(void * arg)
+{
+	struct dict_object * expected = arg, * obj;
+	avp_code_t code = 264; /* Origin-Host */
+	
+	while (!__atomic_load_n(&searcher_stop, __ATOMIC_ACQUIRE)) {
+		CHECK( 0, fd_dict_search ( fd_g_config->cnf_dict, DICT_AVP, AVP_BY_CODE, &code, &obj, ENOENT ) );
+		CHECK( expected, obj );
+	}
+	return NULL;
+}
+
 /* Main test routine */
 int main(int argc, char *argv[])
 {
@@ -165,6 +323,60 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	/* Test the binary images of the dictionary */
+	{
+		struct dictionary * dict = NULL;
+		struct dict_object * avp = NULL, * cmd = NULL, * type = NULL, * obj = NULL;
+		struct dict_avp_data avp_data;
+		struct dict_type_data type_data;
+		char path[] = "/tmp/testdict.img.XXXXXX";
+		int fd, nb1 = 0, nb2 = 0;
+		avp_code_t code = 264; /* Origin-Host */
+		
+		CHECK( 1, (fd = mkstemp(path)) >= 0 ? 1 : 0 );
+		close(fd);
+		CHECK( 0, fd_dict_image_save ( fd_g_config->cnf_dict, path, "test tag" ) );
+		
+		CHECK( 0, fd_dict_init ( &dict ) );
+		CHECK( ESTALE, fd_dict_image_load ( dict, path, "other tag" ) );
+		CHECK( ENOENT, fd_dict_search ( dict, DICT_AVP, AVP_BY_NAME, "Origin-Host", NULL, ENOENT ) );
+		CHECK( 0, fd_dict_image_load ( dict, path, "test tag" ) );
+		
+		/* The loaded objects are the same as the saved ones */
+		CHECK( 0, fd_dict_search ( dict, DICT_AVP, AVP_BY_CODE, &code, &avp, ENOENT ) );
+		CHECK( 0, fd_dict_getval ( avp, &avp_data ) );
+		CHECK( 0, strcmp(avp_data.avp_name, "Origin-Host") );
+		CHECK( 0, fd_dict_search ( dict, DICT_AVP, AVP_BY_NAME, "Example-AVP", &obj, ENOENT ) );
+		CHECK( 0, fd_dict_iterate_rules ( obj, &nb2, iter_test) );
+		CHECK( 2, nb2 );
+		CHECK( 0, fd_dict_search ( dict, DICT_COMMAND, CMD_BY_NAME, "Capabilities-Exchange-Request", &cmd, ENOENT ) );
+		CHECK( 0, fd_dict_search ( fd_g_config->cnf_dict, DICT_COMMAND, CMD_BY_NAME, "Capabilities-Exchange-Request", &obj, ENOENT ) );
+		nb2 = 0;
+		CHECK( 0, fd_dict_iterate_rules ( cmd, &nb2, iter_test) );
+		CHECK( 0, fd_dict_iterate_rules ( obj, &nb1, iter_test) );
+		CHECK( nb1, nb2 );
+		CHECK( 0, fd_dict_search ( dict, DICT_TYPE, TYPE_BY_NAME, "Address", &type, ENOENT ) );
+		CHECK( 0, fd_dict_getval ( type, &type_data ) );
+		CHECK( 1, type_data.type_encode == fd_dictfct_Address_encode ? 1 : 0 );
+		CHECK( 0, fd_dict_search ( dict, DICT_TYPE, TYPE_OF_AVP, avp, &obj, ENOENT ) );
+		
+		/* Loading again replaces the contents */
+		CHECK( 0, fd_dict_image_load ( dict, path, "test tag" ) );
+		CHECK( 0, fd_dict_search ( dict, DICT_AVP, AVP_BY_CODE, &code, &obj, ENOENT ) );
+		CHECK( 1, obj != avp ? 1 : 0 );
+		CHECK( 0, fd_dict_fini ( &dict ) );
+		
+		/* Invalid images */
+		CHECK( 0, fd_dict_init ( &dict ) );
+		CHECK( 1, (fd = open(path, O_WRONLY | O_TRUNC)) >= 0 ? 1 : 0 );
+		CHECK( 11, write(fd, "not an image", 11) );
+		close(fd);
+		CHECK( EINVAL, fd_dict_image_load ( dict, path, "test tag" ) );
+		unlink(path);
+		CHECK( ENOENT, fd_dict_image_load ( dict, path, "test tag" ) );
+		CHECK( 0, fd_dict_fini ( &dict ) );
+	}
+	
 	/* Test delete function */
 	{
 		struct fd_list * li = NULL;
@@ -203,6 +415,79 @@ int main(int argc, char *argv[])
 		
 	}
 	
+	/* Test the frozen dictionary */
+	{
+		struct dict_object * avp = NULL, * obj = NULL, * type = NULL, * enumval = NULL;
+		struct dict_avp_data avp_data = { 999998, 0, "Frozen-Test-AVP", 0, 0, AVP_TYPE_INTEGER32 };
+		struct dict_type_data type_data = { AVP_TYPE_INTEGER32, "Frozen-Test-Type", NULL, NULL, NULL };
+		struct dict_enumval_data enum_data = { "FROZEN_VALUE", { .i32 = 7 } };
+		struct dict_enumval_request enum_req;
+		avp_code_t code = 264; /* Origin-Host */
+		
+		CHECK( 0, fd_dict_search ( fd_g_config->cnf_dict, DICT_AVP, AVP_BY_NAME, "Origin-Host", &avp, ENOENT ) );
+		
+		CHECK( 0, fd_dict_freeze ( fd_g_config->cnf_dict ) );
+		CHECK( 0, fd_dict_freeze ( fd_g_config->cnf_dict ) );
+		
+		/* Searches in the snapshot */
+		CHECK( 0, fd_dict_search ( fd_g_config->cnf_dict, DICT_AVP, AVP_BY_CODE, &code, &obj, ENOENT ) );
+		CHECK( avp, obj );
+		CHECK( 0, fd_dict_search ( fd_g_config->cnf_dict, DICT_AVP, AVP_BY_NAME, "Origin-Host", &obj, ENOENT ) );
+		CHECK( avp, obj );
+		CHECK( ENOENT, fd_dict_search ( fd_g_config->cnf_dict, DICT_AVP, AVP_BY_NAME, "Frozen-Test-AVP", NULL, ENOENT ) );
+		
+		/* Objects added after the freeze are found */
+		CHECK( 0, fd_dict_new ( fd_g_config->cnf_dict, DICT_AVP, &avp_data, NULL, &avp ) );
+		CHECK( 0, fd_dict_search ( fd_g_config->cnf_dict, DICT_AVP, AVP_BY_NAME, "Frozen-Test-AVP", &obj, ENOENT ) );
+		CHECK( avp, obj );
+		code = 999998;
+		CHECK( 0, fd_dict_search ( fd_g_config->cnf_dict, DICT_AVP, AVP_BY_CODE, &code, &obj, ENOENT ) );
+		CHECK( avp, obj );
+		CHECK( 0, fd_dict_new ( fd_g_config->cnf_dict, DICT_AVP, &avp_data, NULL, NULL ) ); /* same definition */
+		
+		CHECK( 0, fd_dict_new ( fd_g_config->cnf_dict, DICT_TYPE, &type_data, NULL, &type ) );
+		CHECK( 0, fd_dict_new ( fd_g_config->cnf_dict, DICT_ENUMVAL, &enum_data, type, &enumval ) );
+		memset(&enum_req, 0, sizeof(enum_req));
+		enum_req.type_obj = type;
+		enum_req.search.enum_value.i32 = 7;
+		CHECK( 0, fd_dict_search ( fd_g_config->cnf_dict, DICT_ENUMVAL, ENUMVAL_BY_STRUCT, &enum_req, &obj, ENOENT ) );
+		CHECK( enumval, obj );
+		enum_req.search.enum_name = "FROZEN_VALUE";
+		CHECK( 0, fd_dict_search ( fd_g_config->cnf_dict, DICT_ENUMVAL, ENUMVAL_BY_STRUCT, &enum_req, &obj, ENOENT ) );
+		CHECK( enumval, obj );
+		
+		/* The previous versions of the snapshot are retired while searches are running */
+		{
+			pthread_t thr[2];
+			struct dict_object * oh = NULL;
+			char name[32];
+			int i;
+			
+			CHECK( 0, fd_dict_search ( fd_g_config->cnf_dict, DICT_AVP, AVP_BY_NAME, "Origin-Host", &oh, ENOENT ) );
+			for (i = 0; i < 2; i++) {
+				CHECK( 0, pthread_create( &thr[i], NULL, searcher, oh ) );
+			}
+			for (i = 0; i < 200; i++) {
+				struct dict_avp_data ad = { 999000 + i, 0, name, 0, 0, AVP_TYPE_INTEGER32 };
+				snprintf(name, sizeof(name), "Frozen-Test-AVP-%d", i);
+				CHECK( 0, fd_dict_new ( fd_g_config->cnf_dict, DICT_AVP, &ad, NULL, NULL ) );
+			}
+			__atomic_store_n(&searcher_stop, 1, __ATOMIC_RELEASE);
+			for (i = 0; i < 2; i++) {
+				CHECK( 0, pthread_join( thr[i], NULL ) );
+			}
+			CHECK( 0, fd_dict_search ( fd_g_config->cnf_dict, DICT_AVP, AVP_BY_NAME, "Frozen-Test-AVP-199", NULL, ENOENT ) );
+		}
+		
+		/* Objects cannot be deleted anymore */
+		CHECK( EBUSY, fd_dict_delete ( avp ) );
+		CHECK( 0, fd_dict_search ( fd_g_config->cnf_dict, DICT_AVP, AVP_BY_CODE, &code, &obj, ENOENT ) );
+		CHECK( avp, obj );
+	}
+	
+	/* Searches in a large dictionary */
+	bench_search();
+	
 	LOG_D( "Dictionary at the end of %s: %s", __FILE__, fd_dict_dump(FD_DUMP_TEST_PARAMS, fd_g_config->cnf_dict) ?: "error");
 	
 	/* That's all for the tests yet */
@@ -69,6 +69,16 @@ void * g_opaque = (void *)"test";
 /* cb_9 */  Define_cb( 9, *action = DISP_ACT_SEND );
 /* max: cb_<NB_CB - 1> */
 
+/* Record the order in which the callbacks are called, the opaque is the identifier of the callback */
+int cborder[NB_CB], nborder;
+int cb_order( struct msg ** msg, struct avp * avp, struct session * session, void * opaque, enum disp_action * action )
+{
+	*action = DISP_ACT_CONT;
+	if (nborder < NB_CB)
+		cborder[nborder++] = (int)(intptr_t)opaque;
+	return 0;
+}
+
 /* Create a new message containing what we want */
 struct msg * new_msg(int appid, struct dict_object * cmd, struct dict_object * avp1, struct dict_object * avp2, int val)
 {
@@ -98,6 +108,71 @@ struct msg * new_msg(int appid, struct dict_object * cmd, struct dict_object * a
 	return new;	
 }
 
+/* OUT routing callback, to check when the scores come from the routing cache */
+int rtcalled = 0;
+int cb_rt_out( void * cbdata, struct msg ** pmsg, struct fd_list * candidates )
+{
+	struct fd_list * li;
+	rtcalled++;
+	for (li = candidates->next; li != candidates; li = li->next)
+		((struct rtd_candidate *)li)->score += FD_SCORE_DEFAULT;
+	return 0;
+}
+
+/* Route a request and pick it from the queue of the peer */
+void route_msg(struct msg * msg, struct fd_peer * peer)
+{
+	struct timespec ts;
+	
+	CHECK( 0, fd_fifo_post( fd_g_outgoing, &msg ) );
+	CHECK( 0, clock_gettime(CLOCK_REALTIME, &ts) );
+	ts.tv_sec += 2;
+	CHECK( 0, fd_fifo_timedget( peer->p_tosend, &msg, &ts ) );
+	CHECK( 0, fd_msg_free( msg ) );
+}
+
+/* Dispatch callback of the pool test: the requests of application 2 wait while pool_block is set, as with a slow application */
+volatile int pool_block = 0;
+int pool_handled[3];
+int cb_pool( struct msg ** msg, struct avp * avp, struct session * session, void * opaque, enum disp_action * action )
+{
+	struct msg_hdr * hdr;
+	
+	CHECK( 0, fd_msg_hdr( *msg, &hdr ) );
+	while ((hdr->msg_appl == 2) && pool_block)
+		usleep(1000);
+	__sync_fetch_and_add(&pool_handled[hdr->msg_appl], 1);
+	CHECK( 0, fd_msg_free( *msg ) );
+	*msg = NULL;
+	*action = DISP_ACT_CONT;
+	return 0;
+}
+
+/* Wait up to 2 seconds until *counter reaches val */
+void wait_count(int * counter, int val)
+{
+	int i;
+	for (i = 0; (i < 2000) && (__sync_fetch_and_add(counter, 0) < val); i++)
+		usleep(1000);
+	CHECK( val, __sync_fetch_and_add(counter, 0) );
+}
+
+/* A request received from a peer for the local realm, that the routing-in threads handle locally */
+void route_in(int appid, struct dict_object * cmd, struct dict_object * dr, struct fd_peer * peer)
+{
+	struct msg * msg = new_msg( appid, cmd, NULL, NULL, 0 );
+	struct avp * avp;
+	union avp_value value;
+	
+	CHECK( 0, fd_msg_avp_new ( dr, 0, &avp ) );
+	value.os.data = (uint8_t *)fd_g_config->cnf_diamrlm;
+	value.os.len = fd_g_config->cnf_diamrlm_len;
+	CHECK( 0, fd_msg_avp_setvalue ( avp, &value ) );
+	CHECK( 0, fd_msg_avp_add ( msg, MSG_BRW_LAST_CHILD, avp ) );
+	CHECK( 0, fd_msg_source_set( msg, peer->p_hdr.info.pi_diamid, peer->p_hdr.info.pi_diamidlen ) );
+	CHECK( 0, fd_fifo_post( fd_g_incoming, &msg ) );
+}
+
 /* Main test routine */
 int main(int argc, char *argv[])
 {
@@ -677,6 +752,71 @@ int main(int argc, char *argv[])
 		CHECK( 0, fd_disp_unregister( &hdl[4], NULL ) );
 	}			
 	
+	/* Test the order of the callbacks registered on the same AVP with different criteria, and their counters */
+	{
+		unsigned long long hits;
+		struct timespec time;
+		char * buf = NULL;
+		size_t len;
+		
+		when.app = app2;
+		when.command = cmd2;
+		when.avp = avp2;
+		when.value = enu2;
+		CHECK( 0, fd_disp_register( cb_order, DISP_HOW_AVP_ENUMVAL, &when, (void *)1, &hdl[1] ) ); /* app2 + cmd2 + avp2 + enu2 */
+		when.command = NULL;
+		CHECK( 0, fd_disp_register( cb_order, DISP_HOW_AVP, &when, (void *)2, &hdl[2] ) ); /* app2 + avp2 */
+		when.app = NULL;
+		CHECK( 0, fd_disp_register( cb_order, DISP_HOW_AVP, &when, (void *)3, &hdl[3] ) ); /* avp2 */
+		when.app = app1;
+		CHECK( 0, fd_disp_register( cb_order, DISP_HOW_AVP, &when, (void *)4, &hdl[4] ) ); /* app1 + avp2 */
+		when.app = NULL;
+		CHECK( 0, fd_disp_register( cb_order, DISP_HOW_AVP_ENUMVAL, &when, (void *)5, &hdl[5] ) ); /* avp2 + enu2 */
+		
+		nborder = 0;
+		msg = new_msg( 2, cmd2, avp1, avp2, 2 );
+		CHECK( 0, fd_msg_dispatch ( &msg, sess, &action, &ec, &em, &error ) );
+		CHECK( 4, nborder );
+		CHECK( 1, cborder[0] );
+		CHECK( 2, cborder[1] );
+		CHECK( 3, cborder[2] );
+		CHECK( 5, cborder[3] );
+		CHECK( 0, fd_msg_free( msg ) );
+		
+		nborder = 0;
+		msg = new_msg( 1, cmd1, NULL, avp2, 1 );
+		CHECK( 0, fd_msg_dispatch ( &msg, sess, &action, &ec, &em, &error ) );
+		CHECK( 2, nborder );
+		CHECK( 3, cborder[0] );
+		CHECK( 4, cborder[1] );
+		CHECK( 0, fd_msg_free( msg ) );
+		
+		CHECK( 0, fd_disp_getstats( hdl[3], &hits, &time ) );
+		CHECK( 2, hits );
+		CHECK( 0, fd_disp_getstats( hdl[5], &hits, NULL ) );
+		CHECK( 1, hits );
+		CHECK( 0, fd_disp_getstats( hdl[4], &hits, NULL ) );
+		CHECK( 1, hits );
+		CHECK( 1, fd_disp_dump(&buf, &len, NULL) ? 1 : 0 );
+		#if 0
+		fd_log_debug("%s", buf);
+		#endif
+		free(buf);
+		
+		CHECK( 0, fd_disp_unregister( &hdl[1], NULL ) );
+		CHECK( 0, fd_disp_unregister( &hdl[2], NULL ) );
+		CHECK( 0, fd_disp_unregister( &hdl[3], NULL ) );
+		CHECK( 0, fd_disp_unregister( &hdl[4], NULL ) );
+		CHECK( 0, fd_disp_unregister( &hdl[5], NULL ) );
+		
+		/* No callback is called anymore */
+		nborder = 0;
+		msg = new_msg( 2, cmd2, avp1, avp2, 2 );
+		CHECK( 0, fd_msg_dispatch ( &msg, sess, &action, &ec, &em, &error ) );
+		CHECK( 0, nborder );
+		CHECK( 0, fd_msg_free( msg ) );
+	}
+	
 	/* Test application support advertisement */
 	{
 		struct dict_object * vnd;
@@ -723,6 +863,167 @@ int main(int argc, char *argv[])
 		CHECK( 1, ptr == g_opaque ? 1 : 0 );
 	}
 	
+	/* Test the dedicated dispatch pools */
+	{
+		struct fd_disp_pool * pool;
+		application_id_t appid;
+		int threads, limit;
+		
+		CHECK( 1, (pool = calloc(1, sizeof(struct fd_disp_pool))) ? 1 : 0 );
+		fd_list_init(&pool->chain, pool);
+		pool->appid = 2;
+		pool->threads = 2;
+		pool->qlimit = 10;
+#ifdef linux
+		{
+			/* pin the threads to the current CPU, which is allowed */
+			char cpus[16];
+			snprintf(cpus, sizeof(cpus), "%d", sched_getcpu());
+			pool->cpus = strdup(cpus);
+		}
+#endif /* linux */
+		fd_list_insert_before(&fd_g_config->cnf_disp_pools, &pool->chain);
+		
+		CHECK( 0, fd_queues_init() );
+		CHECK( 0, fd_rtdisp_init() );
+		
+		CHECK( 0, fd_stat_getpool( 0, &appid, &threads ) );
+		CHECK( 2, appid );
+		CHECK( 2, threads );
+		CHECK( ENOENT, fd_stat_getpool( 1, NULL, NULL ) );
+		CHECK( 0, fd_stat_getpoolstats( 0, NULL, &limit, NULL, NULL, NULL, NULL, NULL ) );
+		CHECK( 10, limit );
+		CHECK( 0, fd_stat_getpoollatency( 0, NULL, NULL ) );
+		CHECK( 0, fd_stat_getpoolrates( 0, NULL, NULL, NULL ) );
+		CHECK( ENOENT, fd_stat_getpoolstats( 1, NULL, NULL, NULL, NULL, NULL, NULL, NULL ) );
+		
+		/* Test the routing cache */
+		{
+			struct fd_peer * peer = NULL;
+			struct fd_rt_out_hdl * rh;
+			
+			/* A peer in OPEN state */
+			CHECK( 0, fd_peer_alloc(&peer) );
+			peer->p_hdr.info.pi_diamid = strdup("peer.test");
+			peer->p_hdr.info.pi_diamidlen = strlen(peer->p_hdr.info.pi_diamid);
+			peer->p_hdr.info.runtime.pir_relay = 1;
+			peer->p_state = STATE_OPEN;
+			peer->p_cnxctx = (void *)peer; /* not used while the peer is OPEN */
+			fd_list_insert_before(&fd_g_peers, &peer->p_hdr.chain);
+			fd_list_insert_before(&fd_g_activ_peers, &peer->p_actives);
+			
+			fd_g_config->cnf_rt_cache = 8;
+			CHECK( 0, fd_rt_out_register( cb_rt_out, NULL, 1, &rh ) );
+			CHECK( 0, fd_rt_out_cacheable( rh, 1 ) );
+			CHECK( EINVAL, fd_rt_out_cacheable( NULL, 1 ) );
+			
+			/* The next requests with the same destination reuse the scores */
+			route_msg( new_msg( 2, cmd1, NULL, NULL, 0 ), peer );
+			CHECK( 1, rtcalled );
+			route_msg( new_msg( 2, cmd1, NULL, NULL, 0 ), peer );
+			CHECK( 1, rtcalled );
+			route_msg( new_msg( 1, cmd1, NULL, NULL, 0 ), peer );
+			CHECK( 2, rtcalled );
+			
+			/* Until the cache is emptied */
+			CHECK( 0, fd_rt_out_cache_flush() );
+			route_msg( new_msg( 2, cmd1, NULL, NULL, 0 ), peer );
+			CHECK( 3, rtcalled );
+			
+			/* Or a callback is not cacheable */
+			CHECK( 0, fd_rt_out_cacheable( rh, 0 ) );
+			route_msg( new_msg( 2, cmd1, NULL, NULL, 0 ), peer );
+			route_msg( new_msg( 2, cmd1, NULL, NULL, 0 ), peer );
+			CHECK( 5, rtcalled );
+			
+			CHECK( 0, fd_rt_out_unregister( rh, NULL ) );
+			fd_g_config->cnf_rt_cache = 0;
+			fd_list_unlink(&peer->p_hdr.chain);
+			peer->p_cnxctx = NULL;
+			CHECK( 0, fd_peer_free(&peer) );
+		}
+		
+		/* The requests of application 2 are handled by the pool, and a full pool does not delay the other applications */
+		{
+			struct fd_peer * peer = NULL;
+			struct disp_hdl * ph = NULL;
+			struct dict_object * dr, * rc;
+			struct msg_hdr * hdr;
+			struct avp * avp;
+			struct avp_hdr * ahdr;
+			struct timespec ts;
+			int i, current;
+			
+			CHECK( 0, fd_dict_search ( fd_g_config->cnf_dict, DICT_AVP, AVP_BY_NAME, "Destination-Realm", &dr, ENOENT ) );
+			CHECK( 0, fd_dict_search ( fd_g_config->cnf_dict, DICT_AVP, AVP_BY_NAME, "Result-Code", &rc, ENOENT ) );
+			fd_g_config->cnf_diamid = strdup("local.test");
+			fd_g_config->cnf_diamid_len = strlen(fd_g_config->cnf_diamid);
+			fd_g_config->cnf_diamrlm = strdup("test");
+			fd_g_config->cnf_diamrlm_len = strlen(fd_g_config->cnf_diamrlm);
+			CHECK( 0, fd_msg_init() );
+			
+			/* The peer that sent the requests, the errors are queued for it */
+			CHECK( 0, fd_peer_alloc(&peer) );
+			peer->p_hdr.info.pi_diamid = strdup("peer.test");
+			peer->p_hdr.info.pi_diamidlen = strlen(peer->p_hdr.info.pi_diamid);
+			peer->p_state = STATE_OPEN;
+			peer->p_cnxctx = (void *)peer; /* not used while the peer is OPEN */
+			fd_list_insert_before(&fd_g_peers, &peer->p_hdr.chain);
+			
+			CHECK( 0, fd_disp_register( cb_pool, DISP_HOW_ANY, NULL, NULL, &ph ) );
+			
+			/* A request is passed to the pool, not to the shared dispatch threads */
+			route_in( 2, cmd1, dr, peer );
+			wait_count( &pool_handled[2], 1 );
+			CHECK( 0, pool_handled[1] );
+			
+			/* The 2 threads of the pool are blocked by the first requests, the next ones fill its queue */
+			pool_block = 1;
+			for (i = 0; i < 2 + 10; i++)
+				route_in( 2, cmd1, dr, peer );
+			for (i = 0; i < 2000; i++) {
+				CHECK( 0, fd_stat_getpoolstats( 0, &current, NULL, NULL, NULL, NULL, NULL, NULL ) );
+				if (current == 10)
+					break;
+				usleep(1000);
+			}
+			CHECK( 10, current );
+			CHECK( 0, fd_fifo_length( fd_g_local ) );
+			
+			/* The next request is answered with DIAMETER_TOO_BUSY, without blocking the routing thread */
+			route_in( 2, cmd1, dr, peer );
+			CHECK( 0, clock_gettime(CLOCK_REALTIME, &ts) );
+			ts.tv_sec += 2;
+			CHECK( 0, fd_fifo_timedget( peer->p_tosend, &msg, &ts ) );
+			CHECK( 0, fd_msg_hdr( msg, &hdr ) );
+			CHECK( 0, hdr->msg_flags & CMD_FLAG_REQUEST );
+			CHECK( 0, fd_msg_search_avp( msg, rc, &avp ) );
+			CHECK( 0, fd_msg_avp_hdr( avp, &ahdr ) );
+			CHECK( ER_DIAMETER_TOO_BUSY, ahdr->avp_value->u32 );
+			CHECK( 0, fd_msg_free( msg ) );
+			
+			/* The requests of the other applications are still handled */
+			route_in( 1, cmd1, dr, peer );
+			wait_count( &pool_handled[1], 1 );
+			
+			/* And the pool handles its queue once the application is faster */
+			pool_block = 0;
+			wait_count( &pool_handled[2], 1 + 2 + 10 );
+			
+			CHECK( 0, fd_disp_unregister( &ph, NULL ) );
+			fd_list_unlink(&peer->p_hdr.chain);
+			peer->p_cnxctx = NULL;
+			CHECK( 0, fd_peer_free(&peer) );
+		}
+		
+		/* Let the threads start waiting on their queues before these are destroyed */
+		usleep(100000); /* 100 millisec */
+		CHECK( 0, fd_rtdisp_cleanstop() );
+		CHECK( 0, fd_rtdisp_fini() );
+		CHECK( ENOENT, fd_stat_getpool( 0, NULL, NULL ) );
+		CHECK( ENOENT, fd_stat_getpoolstats( 0, NULL, NULL, NULL, NULL, NULL, NULL, NULL ) );
+	}
+	
 	/* That's all for the tests yet */
 	PASSTEST();
 } 
@@ -36,6 +36,7 @@
 #include "tests.h"
 #include <unistd.h>
 #include <limits.h>
+#include <sys/epoll.h>
 
 /* Wrapper for pthread_barrier stuff on Mac OS X */
 #ifndef HAVE_PTHREAD_BAR
@@ -187,31 +188,31 @@ static void * test_fct2(void * data)
 }
 
 
-/* Main test routine */
-int main(int argc, char *argv[])
+/* The queues are created with this backend */
+static int use_ring = 0;
+static int test_fifo_new(struct fifo ** queue, int max)
 {
-	struct timespec ts;
-	
-	struct msg * msg1 = NULL;
-	struct msg * msg2 = NULL;
-	struct msg * msg3 = NULL;
-	
-	/* First, initialize the daemon modules */
-	INIT_FD();
-	
-	/* Prolog: create the messages */
-	{
-		struct dict_object * acr_model = NULL;
-		struct dict_object * cer_model = NULL;
-		struct dict_object * dwr_model = NULL;
+	return use_ring ? fd_fifo_new_ring(queue, max) : fd_fifo_new(queue, max);
+}
 
-		CHECK( 0, fd_dict_search ( fd_g_config->cnf_dict, DICT_COMMAND, CMD_BY_NAME, "Accounting-Request", 			&acr_model, ENOENT ) );
-		CHECK( 0, fd_dict_search ( fd_g_config->cnf_dict, DICT_COMMAND, CMD_BY_NAME, "Capabilities-Exchange-Request", 	&cer_model, ENOENT ) );
-		CHECK( 0, fd_dict_search ( fd_g_config->cnf_dict, DICT_COMMAND, CMD_BY_NAME, "Device-Watchdog-Request",		&dwr_model, ENOENT ) );
-		CHECK( 0, fd_msg_new ( acr_model, 0, &msg1 ) );
-		CHECK( 0, fd_msg_new ( cer_model, 0, &msg2 ) );
-		CHECK( 0, fd_msg_new ( dwr_model, 0, &msg3 ) );
-	}
+static struct msg * msg1 = NULL;
+static struct msg * msg2 = NULL;
+static struct msg * msg3 = NULL;
+
+/* The tests run for each backend */
+/* The priority class of the test messages */
+static int test_class(void * item)
+{
+	if (item == msg1)
+		return 0;
+	if (item == msg2)
+		return 1;
+	return 2;
+}
+
+static void test_queues(void)
+{
+	struct timespec ts;
 	
 	/* Basic operation */
 	{
@@ -221,7 +222,7 @@ int main(int argc, char *argv[])
 		long long count;
 		
 		/* Create the queue */
-		CHECK( 0, fd_fifo_new(&queue, 0) );
+		CHECK( 0, test_fifo_new(&queue, 0) );
 		
 		/* Check the count is 0 */
 		CHECK( 0, fd_fifo_length(queue) );
@@ -283,6 +284,247 @@ int main(int argc, char *argv[])
 		CHECK( 0, fd_fifo_del(&queue) );
 	}
 	
+	/* Batch operations */
+	{
+		struct fifo * queue = NULL;
+		struct msg * msgs[3] = { msg1, msg2, msg3 };
+		struct msg * got[3];
+		int nb = 0;
+		long long count;
+		
+		CHECK( 0, test_fifo_new(&queue, 0) );
+		
+		/* Post the 3 messages at once */
+		CHECK( 0, fd_fifo_post_batch(queue, msgs, 3) );
+		CHECK( NULL, msgs[0] );
+		CHECK( NULL, msgs[2] );
+		CHECK( 3, fd_fifo_length(queue) );
+		
+		/* Retrieve them in order, at most 2 at a time */
+		CHECK( 0, fd_fifo_get_batch(queue, got, 2, &nb) );
+		CHECK( 2, nb );
+		CHECK( msg1, got[0] );
+		CHECK( msg2, got[1] );
+		CHECK( 0, fd_fifo_tryget_batch(queue, got, 3, &nb) );
+		CHECK( 1, nb );
+		CHECK( msg3, got[0] );
+		CHECK( EWOULDBLOCK, fd_fifo_tryget_batch(queue, got, 3, &nb) );
+		CHECK( 0, nb );
+		
+		/* The timed version times out */
+		CHECK(0, clock_gettime(CLOCK_REALTIME, &ts));
+		ts.tv_nsec += 1000000; /* 1 millisecond */
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_nsec -= 1000000000L;
+			ts.tv_sec += 1;
+		}
+		CHECK( ETIMEDOUT, fd_fifo_timedget_batch(queue, got, 3, &nb, &ts) );
+		
+		/* The statistics count each item */
+		CHECK( 0, fd_fifo_getstats(queue, NULL, NULL, NULL, &count, NULL, NULL, NULL) );
+		CHECK( 3, count );
+		
+		CHECK( 0, fd_fifo_del(&queue) );
+	}
+	
+	/* Latency histograms and throughput */
+	{
+		struct fifo * queue = NULL;
+		struct msg * msg;
+		struct fd_fifo_latency delay, blocking;
+		double r1, r10, r60;
+		
+		CHECK( 0, test_fifo_new(&queue, 0) );
+		
+		/* The first item waits 20ms in the queue, the second one does not */
+		msg = msg1;
+		CHECK( 0, fd_fifo_post(queue, &msg) );
+		usleep(20000);
+		msg = msg2;
+		CHECK( 0, fd_fifo_post(queue, &msg) );
+		CHECK( 0, fd_fifo_get(queue, &msg) );
+		CHECK( msg1, msg );
+		CHECK( 0, fd_fifo_get(queue, &msg) );
+		CHECK( msg2, msg );
+		
+		CHECK( 0, fd_fifo_getlatency(queue, &delay, &blocking) );
+		CHECK( 2, delay.count );
+		CHECK( 2, blocking.count );
+		CHECK( 1, delay.max.tv_sec * 1000000000LL + delay.max.tv_nsec >= 20000000LL );
+		CHECK( 1, delay.p50.tv_sec * 1000000000LL + delay.p50.tv_nsec < 20000000LL );
+		CHECK( 0, memcmp(&delay.p99, &delay.max, sizeof(struct timespec)) );
+		
+		/* After a reset, only the new items are in the distribution */
+		CHECK( 0, fd_fifo_resetlatency(queue) );
+		CHECK( 0, fd_fifo_getlatency(queue, &delay, &blocking) );
+		CHECK( 0, delay.count );
+		CHECK( 0, blocking.count );
+		CHECK( 0, delay.max.tv_sec + delay.max.tv_nsec );
+		msg = msg1;
+		CHECK( 0, fd_fifo_post(queue, &msg) );
+		CHECK( 0, fd_fifo_get(queue, &msg) );
+		CHECK( 0, fd_fifo_getlatency(queue, &delay, NULL) );
+		CHECK( 1, delay.count );
+		CHECK( 1, delay.max.tv_sec * 1000000000LL + delay.max.tv_nsec < 20000000LL );
+		
+		/* Once the second has elapsed, the 3 items are in the sliding windows */
+		CHECK( 0, clock_gettime(CLOCK_REALTIME, &ts) );
+		usleep((1000000000L - ts.tv_nsec) / 1000 + 10000);
+		CHECK( 0, fd_fifo_getrates(queue, &r1, &r10, &r60) );
+		CHECK( 1, r1 <= 3 );
+		CHECK( 3, (int)(r10 * 10 + 0.5) );
+		CHECK( 3, (int)(r60 * 60 + 0.5) );
+		
+		CHECK( 0, fd_fifo_del(&queue) );
+	}
+	
+	/* The ring overflows in a list instead of blocking */
+	if (use_ring) {
+		struct fifo * queue = NULL;
+		static int vals[3000];
+		int * item;
+		int i;
+
+		/* Without max, the queue is not bounded by the size of the ring */
+		CHECK( 0, fd_fifo_new_ring(&queue, 0) );
+		for (i = 0; i < 3000; i++) {
+			item = &vals[i];
+			CHECK( 0, fd_fifo_post(queue, &item) );
+		}
+		CHECK( 3000, fd_fifo_length(queue) );
+		for (i = 0; i < 3000; i++) {
+			CHECK( 0, fd_fifo_get(queue, &item) );
+			CHECK( 1, item == &vals[i] ? 1 : 0 );
+		}
+		CHECK( EWOULDBLOCK, fd_fifo_tryget(queue, &item) );
+		CHECK( 0, fd_fifo_del(&queue) );
+
+		/* With a max, fd_fifo_post_noblock goes beyond the ring (64 cells) and keeps the order */
+		CHECK( 0, fd_fifo_new_ring(&queue, 2) );
+		for (i = 0; i < 200; i++) {
+			item = &vals[i];
+			CHECK( 0, fd_fifo_post_noblock(queue, (void *)&item) );
+		}
+		CHECK( 0, fd_fifo_get(queue, &item) );
+		CHECK( 1, item == &vals[0] ? 1 : 0 );
+		item = &vals[200];
+		CHECK( 0, fd_fifo_post_noblock(queue, (void *)&item) );
+		CHECK( 200, fd_fifo_length(queue) );
+		for (i = 1; i <= 200; i++) {
+			CHECK( 0, fd_fifo_get(queue, &item) );
+			CHECK( 1, item == &vals[i] ? 1 : 0 );
+		}
+		CHECK( 0, fd_fifo_del(&queue) );
+	}
+
+	/* Priority classes */
+	if (!use_ring) {
+		struct fifo * queue = NULL;
+		struct msg * msgs[3] = { msg1, msg2, msg3 };
+		struct msg * msg;
+		int weights[3] = { 2, 1, 1 };
+		int i, count;
+		long long total;
+		
+		CHECK( 0, fd_fifo_new(&queue, 3) );
+		
+		/* msg3 is already queued when the classes are set, it goes to the last class */
+		msg = msg3;
+		CHECK( 0, fd_fifo_post(queue, &msg) );
+		CHECK( 0, fd_fifo_set_classes(queue, 3, test_class, NULL, 1) );
+		msg = msg2;
+		CHECK( 0, fd_fifo_post(queue, &msg) );
+		msg = msg1;
+		CHECK( 0, fd_fifo_post(queue, &msg) );
+		
+		/* The queue is full, but the first class is not limited */
+		msg = msg1;
+		CHECK( 0, fd_fifo_post(queue, &msg) );
+		CHECK( 4, fd_fifo_length(queue) );
+		
+		/* Strict priority */
+		CHECK( 0, fd_fifo_get(queue, &msg) );
+		CHECK( msg1, msg );
+		CHECK( 0, fd_fifo_get(queue, &msg) );
+		CHECK( msg1, msg );
+		CHECK( 0, fd_fifo_get(queue, &msg) );
+		CHECK( msg2, msg );
+		CHECK( 0, fd_fifo_get(queue, &msg) );
+		CHECK( msg3, msg );
+		
+		/* Weighted: 2 items of class 0 for 1 of each other class per round */
+		CHECK( 0, fd_fifo_set_max(queue, 0) );
+		CHECK( 0, fd_fifo_set_classes(queue, 3, test_class, weights, 1) );
+		for (i = 0; i < 9; i++) {
+			msg = msgs[i % 3];
+			CHECK( 0, fd_fifo_post(queue, &msg) );
+		}
+		for (i = 0; i < 9; i++) {
+			struct msg * expected[9] = { msg1, msg1, msg2, msg3, msg1, msg2, msg3, msg2, msg3 };
+			CHECK( 0, fd_fifo_get(queue, &msg) );
+			CHECK( expected[i], msg );
+		}
+		
+		/* Per-class statistics */
+		CHECK( 0, fd_fifo_getclassstats(queue, 0, &count, &total, NULL) );
+		CHECK( 0, count );
+		CHECK( 5, total );
+		CHECK( 0, fd_fifo_getclassstats(queue, 2, NULL, &total, NULL) );
+		CHECK( 4, total );
+		CHECK( EINVAL, fd_fifo_getclassstats(queue, 3, NULL, &total, NULL) );
+		
+		CHECK( 0, fd_fifo_del(&queue) );
+	}
+	
+	/* Multiplex two queues in an epoll loop */
+	{
+		struct fifo * q1 = NULL, * q2 = NULL;
+		struct epoll_event ev;
+		struct msg * msg;
+		int fd1, fd2, fd, epfd;
+		
+		CHECK( 0, test_fifo_new(&q1, 0) );
+		CHECK( 0, test_fifo_new(&q2, 0) );
+		
+		/* q1 already has an item when its descriptor is requested */
+		msg = msg1;
+		CHECK( 0, fd_fifo_post(q1, &msg) );
+		CHECK( 0, fd_fifo_get_fd(q1, &fd1) );
+		CHECK( 0, fd_fifo_get_fd(q2, &fd2) );
+		CHECK( 0, fd_fifo_get_fd(q1, &fd) );
+		CHECK( fd1, fd );
+		
+		CHECK( 1, (epfd = epoll_create1(0)) >= 0 );
+		ev.events = EPOLLIN;
+		ev.data.ptr = q1;
+		CHECK( 0, epoll_ctl(epfd, EPOLL_CTL_ADD, fd1, &ev) );
+		ev.data.ptr = q2;
+		CHECK( 0, epoll_ctl(epfd, EPOLL_CTL_ADD, fd2, &ev) );
+		
+		CHECK( 1, epoll_wait(epfd, &ev, 1, 0) );
+		CHECK( q1, ev.data.ptr );
+		CHECK( 0, fd_fifo_tryget(q1, &msg) );
+		CHECK( 0, epoll_wait(epfd, &ev, 1, 0) );
+		
+		/* The empty to non-empty transition of q2 wakes up the loop */
+		msg = msg2;
+		CHECK( 0, fd_fifo_post(q2, &msg) );
+		msg = msg3;
+		CHECK( 0, fd_fifo_post(q2, &msg) );
+		CHECK( 1, epoll_wait(epfd, &ev, 1, 1000) );
+		CHECK( q2, ev.data.ptr );
+		CHECK( 0, fd_fifo_tryget(q2, &msg) );
+		CHECK( msg2, msg );
+		CHECK( 1, epoll_wait(epfd, &ev, 1, 0) ); /* still one item */
+		CHECK( 0, fd_fifo_tryget(q2, &msg) );
+		CHECK( msg3, msg );
+		CHECK( 0, epoll_wait(epfd, &ev, 1, 0) );
+		
+		close(epfd);
+		CHECK( 0, fd_fifo_del(&q1) );
+		CHECK( 0, fd_fifo_del(&q2) );
+	}
+	
 	/* Test robustness, ensure no messages are lost */
 	{
 #define NBR_MSG		200
@@ -312,7 +554,7 @@ int main(int argc, char *argv[])
 		}
 		
 		/* Create the queue */
-		CHECK( 0, fd_fifo_new(&queue, 0) );
+		CHECK( 0, test_fifo_new(&queue, 0) );
 		
 		/* Create the barrier */
 		CHECK( 0, pthread_barrier_init(&bar, NULL, nbr_threads * 2 + 1) );
@@ -381,7 +623,7 @@ int main(int argc, char *argv[])
 		pthread_t		 th;
 		
 		/* Create the queue */
-		CHECK( 0, fd_fifo_new(&queue, 0) );
+		CHECK( 0, test_fifo_new(&queue, 0) );
 		
 		/* Create the barrier */
 		CHECK( 0, pthread_barrier_init(&bar, NULL, 2) );
@@ -448,7 +690,7 @@ int main(int argc, char *argv[])
 		struct msg * msg  = NULL;
 		
 		/* Create the queue */
-		CHECK( 0, fd_fifo_new(&queue, 0) );
+		CHECK( 0, test_fifo_new(&queue, 0) );
 		
 		/* Prepare the test data */
 		memset(&thrh_td, 0, sizeof(thrh_td));
@@ -528,11 +770,12 @@ int main(int argc, char *argv[])
 		int *			item, i;
 		
 		/* Create the queue */
-		CHECK( 0, fd_fifo_new(&queue, 10) );
+		CHECK( 0, test_fifo_new(&queue, 10) );
 		
 		/* Initialize the test data structures */
 		td.queue = queue;
 		td.nbr = 15;
+		iter = 0;
 		
 		CHECK( 0, pthread_create( &th, NULL, test_fct2, &td ) );
 		
@@ -567,6 +810,100 @@ int main(int argc, char *argv[])
 		CHECK( 0, pthread_join( th, NULL ) );
 		CHECK( 15, iter );
 		
+		CHECK( 0, fd_fifo_del(&queue) );
+		
+	}
+}
+
+/* Contention benchmark: nbr producers and nbr consumers exchange BENCH_ITEMS items through a queue */
+#define BENCH_ITEMS	20000
+#define BENCH_MAX_THR	64
+static int bench_item;
+static void * bench_post(void * data)
+{
+	struct test_data * td = (struct test_data *) data;
+	int i, *item;
+	for (i = 0; i < td->nbr; i++) {
+		item = &bench_item;
+		CHECK( 0, fd_fifo_post(td->queue, &item) );
+	}
+	return NULL;
+}
+static void * bench_get(void * data)
+{
+	struct test_data * td = (struct test_data *) data;
+	int i, *item;
+	for (i = 0; i < td->nbr; i++) {
+		CHECK( 0, fd_fifo_get(td->queue, &item) );
+	}
+	return NULL;
+}
+static long long bench_run(int ring, int nbr)
+{
+	struct fifo * queue = NULL;
+	struct test_data td;
+	pthread_t thr[BENCH_MAX_THR * 2];
+	struct timespec start, end;
+	long long count;
+	int i;
+	
+	use_ring = ring;
+	CHECK( 0, test_fifo_new(&queue, 100) );
+	td.queue = queue;
+	td.nbr = BENCH_ITEMS / nbr;
+	
+	CHECK( 0, clock_gettime(CLOCK_MONOTONIC, &start) );
+	for (i = 0; i < nbr; i++) {
+		CHECK( 0, pthread_create( &thr[2 * i], NULL, bench_get, &td ) );
+		CHECK( 0, pthread_create( &thr[2 * i + 1], NULL, bench_post, &td ) );
+	}
+	for (i = 0; i < nbr * 2; i++) {
+		CHECK( 0, pthread_join( thr[i], NULL ) );
+	}
+	CHECK( 0, clock_gettime(CLOCK_MONOTONIC, &end) );
+	
+	/* No item must be lost */
+	CHECK( 0, fd_fifo_getstats(queue, NULL, NULL, NULL, &count, NULL, NULL, NULL) );
+	CHECK( (long long)td.nbr * nbr, count );
+	CHECK( 0, fd_fifo_length(queue) );
+	CHECK( 0, fd_fifo_del(&queue) );
+	
+	return ((end.tv_sec - start.tv_sec) * 1000000000LL + (end.tv_nsec - start.tv_nsec)) / (td.nbr * nbr);
+}
+
+/* Main test routine */
+int main(int argc, char *argv[])
+{
+	/* First, initialize the daemon modules */
+	INIT_FD();
+	
+	/* Prolog: create the messages */
+	{
+		struct dict_object * acr_model = NULL;
+		struct dict_object * cer_model = NULL;
+		struct dict_object * dwr_model = NULL;
+
+		CHECK( 0, fd_dict_search ( fd_g_config->cnf_dict, DICT_COMMAND, CMD_BY_NAME, "Accounting-Request", 			&acr_model, ENOENT ) );
+		CHECK( 0, fd_dict_search ( fd_g_config->cnf_dict, DICT_COMMAND, CMD_BY_NAME, "Capabilities-Exchange-Request", 	&cer_model, ENOENT ) );
+		CHECK( 0, fd_dict_search ( fd_g_config->cnf_dict, DICT_COMMAND, CMD_BY_NAME, "Device-Watchdog-Request",		&dwr_model, ENOENT ) );
+		CHECK( 0, fd_msg_new ( acr_model, 0, &msg1 ) );
+		CHECK( 0, fd_msg_new ( cer_model, 0, &msg2 ) );
+		CHECK( 0, fd_msg_new ( dwr_model, 0, &msg3 ) );
+	}
+	
+	/* Run the tests with both backends */
+	for (use_ring = 0; use_ring < 2; use_ring++) {
+		test_queues();
+	}
+	
+	/* Compare the backends under contention */
+	{
+		int nbr;
+		for (nbr = 1; nbr <= BENCH_MAX_THR; nbr *= 2) {
+			long long list_ns = bench_run(0, nbr);
+			long long ring_ns = bench_run(1, nbr);
+			LOG_N("fifo contention, %2d producers / %2d consumers: list %5lld ns/item, ring %5lld ns/item", nbr, nbr, list_ns, ring_ns);
+		}
 	}
 	
 	/* Delete the messages */
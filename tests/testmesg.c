@@ -741,12 +741,341 @@ int main(int argc, char *argv[])
 			CHECK( 0, fd_msg_avp_hdr ( found, &avpdata ) );
 			CHECK( 8, avpdata->avp_value->os.len );
 			CHECK( 0, memcmp(avpdata->avp_value->os.data, "12345678", 8));
+			CHECK( 0, avpdata->avp_value->os.data[8] );
+			
+			/* The value may point inside the received buffer, check it survives the message */
+			fd_msg_unhook_avp( found );
+			CHECK( 0, fd_msg_free ( msg ) );
+			CHECK( 0, memcmp(avpdata->avp_value->os.data, "12345678", 8));
+			{
+				union avp_value value;
+				value.os.data = (unsigned char *)"abc";
+				value.os.len = 3;
+				CHECK( 0, fd_msg_avp_setvalue ( found, &value ) );
+				CHECK( 3, avpdata->avp_value->os.len );
+				CHECK( 0, memcmp(avpdata->avp_value->os.data, "abc", 4));
+			}
+			CHECK( 0, fd_msg_free ( found ) );
+
+		}
+
+		/* Test the lazy parsing mode */
+		{
+			struct dict_object * avp_model;
+			struct avp 	   * found;
+			struct avp 	   * grouped = NULL;
+			struct avp_hdr     * avpdata = NULL;
+			unsigned char 	   * buf_out = NULL;
+			size_t 		     len_out;
+
+			CHECK( 0, fd_msg_parse_lazy( fd_g_config->cnf_dict ) );
+
+			CPYBUF();
+			CHECK( 0, fd_msg_parse_buffer( &buf_cpy, 344, &msg) );
+
+			/* The AVPs are decoded when they are accessed, without fd_msg_parse_dict */
+			CHECK( 0, fd_dict_search ( fd_g_config->cnf_dict, DICT_AVP, AVP_BY_NAME, "AVP Test - no vendor - f32", &avp_model, ENOENT ) );
+			CHECK( 0, fd_msg_search_avp( msg, avp_model, &found ) );
+			CHECK( 0, fd_msg_avp_hdr ( found, &avpdata ) );
+			CHECK( 3.1415F, avpdata->avp_value->f32 );
+
+			{
+			struct dict_avp_request grouped_req = { 73565, 0, "AVP Test - grouped"};
+			CHECK( 0, fd_dict_search ( fd_g_config->cnf_dict, DICT_AVP, AVP_BY_NAME_AND_VENDOR, &grouped_req, &avp_model, ENOENT ) );
+			}
+			CHECK( 0, fd_msg_search_avp( msg, avp_model, &grouped ) );
+			CHECK( 0, fd_msg_browse ( grouped, MSG_BRW_FIRST_CHILD, &found, NULL) );
+			CHECK( 1, found ? 1 : 0 );
+			CHECK( 0, fd_msg_avp_hdr ( found, &avpdata ) );
+			CHECK( 8, avpdata->avp_value->os.len );
+			CHECK( 0, memcmp(avpdata->avp_value->os.data, "12345678", 8));
+
+			/* The partially decoded message is sent unchanged */
+			CHECK( 0, fd_msg_bufferize( msg, &buf_out, &len_out ) );
+			CHECK( 344, len_out );
+			CHECK( 0, memcmp(buf_out, buf, 344) );
+			free(buf_out);
+
+			/* The complete parsing still works on this message */
+			CHECK( 0, fd_msg_parse_dict( msg, fd_g_config->cnf_dict, NULL ) );
+			CHECK( 0, fd_msg_parse_rules( msg, fd_g_config->cnf_dict, NULL ) );
 
-			/* reinit the msg */
 			CHECK( 0, fd_msg_free ( msg ) );
-				
+
+			/* A truncated grouped AVP is still reported by fd_msg_parse_dict after a lazy access */
+			{
+				unsigned char trunc[] = {
+					0x01, 0x00, 0x00, 0x34,  0x80, 0x01, 0x1F, 0x65,	/* Test-Command-Request, 52 bytes */
+					0x00, 0x00, 0x00, 0x00,  0x00, 0x00, 0x00, 0x01,  0x00, 0x00, 0x00, 0x01,
+					0x00, 0x01, 0x1F, 0x64,  0x80, 0x00, 0x00, 0x20,  0x00, 0x01, 0x1F, 0x5D,	/* AVP Test - grouped, 32 bytes */
+					0x00, 0x00, 0xC3, 0x50,  0x00, 0x00, 0x00, 0x0C,  0x61, 0x62, 0x63, 0x64,	/* a complete child AVP */
+					0x00, 0x00, 0xC3, 0x51,  0x00, 0x00, 0x00, 0x14					/* a child AVP announcing 12 missing bytes */
+				};
+				struct fd_pei pei;
+
+				buf_cpy = malloc(sizeof(trunc));
+				CHECK( buf_cpy ? 1 : 0, 1);
+				memcpy(buf_cpy, trunc, sizeof(trunc));
+				CHECK( 0, fd_msg_parse_buffer( &buf_cpy, sizeof(trunc), &msg) );
+
+				CHECK( 0, fd_msg_search_avp( msg, avp_model, &grouped ) );
+				CHECK( 0, fd_msg_browse ( grouped, MSG_BRW_FIRST_CHILD, &found, NULL) );
+				CHECK( 1, found ? 0 : 1 );
+				CHECK( 0, fd_msg_browse ( grouped, MSG_BRW_FIRST_CHILD, &found, NULL) );
+				CHECK( 1, found ? 0 : 1 );
+
+				memset(&pei, 0, sizeof(pei));
+				CHECK( EBADMSG, fd_msg_parse_dict( msg, fd_g_config->cnf_dict, &pei ) );
+				CHECK( 0, strcmp(pei.pei_errcode, "DIAMETER_INVALID_AVP_VALUE") );
+				CHECK( EBADMSG, fd_msg_parse_dict( msg, fd_g_config->cnf_dict, &pei ) );
+
+				CHECK( 0, fd_msg_free ( msg ) );
+			}
+
+			CHECK( 0, fd_msg_parse_lazy( NULL ) );
 		}
-		
+
+		/* Test the raw messages */
+		{
+			struct msg 	   * ref = NULL;
+			struct avp 	   * avp = NULL;
+			struct avp_hdr     * avpdata = NULL;
+			struct avp_hdr 	     rawhdr;
+			unsigned char 	   * buf_ref = NULL, * buf_out = NULL, * data;
+			size_t 		     len_ref, len_out, pos = 0, datalen;
+			int 		     count = 0;
+
+			/* The reference: a message parsed as usual */
+			CPYBUF();
+			CHECK( 0, fd_msg_parse_buffer( &buf_cpy, 344, &ref) );
+			CHECK( 0, fd_msg_is_raw( ref ) );
+			CHECK( 0, fd_msg_source_setrr( ref, "relay.example", strlen("relay.example"), fd_g_config->cnf_dict ) );
+			CHECK( 0, fd_msg_bufferize( ref, &buf_ref, &len_ref ) );
+
+			CPYBUF();
+			CHECK( 0, fd_msg_parse_buffer_raw( &buf_cpy, 344, &msg) );
+			CHECK( 1, fd_msg_is_raw( msg ) );
+
+			/* Walk the AVPs in the buffer */
+			while (fd_msg_raw_next( msg, &pos, &rawhdr, &data, &datalen ) == 0) {
+				count++;
+			}
+			CHECK( 1, count > 0 ? 1 : 0 );
+			CHECK( 0, fd_msg_browse( ref, MSG_BRW_FIRST_CHILD, &avp, NULL ) );
+			CHECK( 0, fd_msg_avp_hdr( avp, &avpdata ) );
+			pos = 0;
+			CHECK( 0, fd_msg_raw_next( msg, &pos, &rawhdr, &data, &datalen ) );
+			CHECK( avpdata->avp_code, rawhdr.avp_code );
+			CHECK( avpdata->avp_len, rawhdr.avp_len );
+
+			/* The Route-Record is spliced in the buffer, and the result is the same as with the AVP objects */
+			CHECK( 0, fd_msg_source_setrr( msg, "relay.example", strlen("relay.example"), fd_g_config->cnf_dict ) );
+			CHECK( 1, fd_msg_is_raw( msg ) );
+			CHECK( 0, fd_msg_bufferize( msg, &buf_out, &len_out ) );
+			CHECK( len_ref, len_out );
+			CHECK( 0, memcmp(buf_out, buf_ref, len_ref) );
+			free(buf_out);
+
+			/* The buffer may have moved: the data must be read again, the positions are unchanged */
+			pos = 0;
+			CHECK( 0, fd_msg_raw_next( msg, &pos, &rawhdr, &data, &datalen ) );
+			CHECK( avpdata->avp_code, rawhdr.avp_code );
+			CHECK( avpdata->avp_len, rawhdr.avp_len );
+
+			/* The AVP objects are created when needed */
+			CHECK( 0, fd_msg_browse( msg, MSG_BRW_LAST_CHILD, &avp, NULL ) );
+			CHECK( 0, fd_msg_is_raw( msg ) );
+			CHECK( 0, fd_msg_parse_dict( avp, fd_g_config->cnf_dict, NULL ) );
+			CHECK( 0, fd_msg_avp_hdr( avp, &avpdata ) );
+			CHECK( AC_ROUTE_RECORD, avpdata->avp_code );
+			CHECK( 0, memcmp(avpdata->avp_value->os.data, "relay.example", strlen("relay.example") + 1) );
+			CHECK( 0, fd_msg_parse_dict( msg, fd_g_config->cnf_dict, NULL ) );
+			CHECK( 0, fd_msg_bufferize( msg, &buf_out, &len_out ) );
+			CHECK( len_ref, len_out );
+			CHECK( 0, memcmp(buf_out, buf_ref, len_ref) );
+			free(buf_out);
+
+			free(buf_ref);
+			CHECK( 0, fd_msg_free ( ref ) );
+			CHECK( 0, fd_msg_free ( msg ) );
+		}
+
+		/* Test the priority class of received requests that are not parsed yet */
+		{
+			unsigned char drmp[] = {
+				0x01, 0x00, 0x00, 0x2C,  0x80, 0x01, 0x1F, 0x65,	/* Test-Command-Request, 44 bytes */
+				0x00, 0x00, 0x00, 0x00,  0x00, 0x00, 0x00, 0x01,  0x00, 0x00, 0x00, 0x01,
+				0x00, 0x00, 0xC3, 0x50,  0x00, 0x00, 0x00, 0x0C,  0x61, 0x62, 0x63, 0x64,	/* an unknown AVP */
+				0x00, 0x00, 0x01, 0x2D,  0x00, 0x00, 0x00, 0x0C,  0x00, 0x00, 0x00, 0x03	/* DRMP = PRIORITY_3 */
+			};
+			struct fifo * queue = NULL;
+			struct msg * got = NULL;
+			struct avp * avp = NULL;
+			struct avp_hdr * avpdata = NULL;
+			int32_t val = 0;
+			int count = 0;
+			int prio_sched = fd_g_config->cnf_prio_sched;
+
+			fd_g_config->cnf_prio_sched = FD_PRIO_SCHED_STRICT;
+			CHECK( 0, fd_fifo_new ( &queue, 0 ) );
+			CHECK( 0, fd_queues_set_prio ( queue ) );
+
+			/* Parsed from the buffer, the AVP values are not decoded */
+			buf_cpy = malloc(sizeof(drmp));
+			CHECK( buf_cpy ? 1 : 0, 1);
+			memcpy(buf_cpy, drmp, sizeof(drmp));
+			CHECK( 0, fd_msg_parse_buffer( &buf_cpy, sizeof(drmp), &msg) );
+			CHECK( 0, fd_msg_peek_i32( msg, AC_DRMP, 0, &val ) );
+			CHECK( 3, val );
+			CHECK( ENOENT, fd_msg_peek_i32( msg, AC_DRMP, 10415, &val ) );
+			CHECK( 0, fd_fifo_post ( queue, &msg ) );
+			CHECK( 0, fd_fifo_getclassstats( queue, FD_PRIO_DRMP + 3, &count, NULL, NULL ) );
+			CHECK( 1, count );
+			CHECK( 0, fd_fifo_get ( queue, &got ) );
+			CHECK( 0, fd_msg_browse( got, MSG_BRW_LAST_CHILD, &avp, NULL ) );
+			CHECK( 0, fd_msg_avp_hdr( avp, &avpdata ) );
+			CHECK( AC_DRMP, avpdata->avp_code );
+			CHECK( 1, avpdata->avp_value ? 0 : 1 );
+			CHECK( 0, fd_msg_free ( got ) );
+
+			/* Parsed as raw, the message stays raw */
+			buf_cpy = malloc(sizeof(drmp));
+			CHECK( buf_cpy ? 1 : 0, 1);
+			memcpy(buf_cpy, drmp, sizeof(drmp));
+			CHECK( 0, fd_msg_parse_buffer_raw( &buf_cpy, sizeof(drmp), &msg) );
+			CHECK( 0, fd_fifo_post ( queue, &msg ) );
+			CHECK( 0, fd_fifo_getclassstats( queue, FD_PRIO_DRMP + 3, &count, NULL, NULL ) );
+			CHECK( 1, count );
+			CHECK( 0, fd_fifo_get ( queue, &got ) );
+			CHECK( 1, fd_msg_is_raw( got ) );
+			CHECK( 0, fd_msg_free ( got ) );
+
+			CHECK( 0, fd_fifo_del ( &queue ) );
+			fd_g_config->cnf_prio_sched = prio_sched;
+		}
+
+		/* Test the parsing threads (ParsingThreads) */
+		{
+			struct fd_peer * peer = NULL, * busy = NULL;
+			struct fd_event * ev;
+			struct msg_hdr * hdr;
+			uint8_t * rcv;
+			size_t sz;
+			void * data;
+			int event, i;
+
+			#define SUBMIT( _peer, _hbh ) {					\
+				rcv = malloc(344);					\
+				CHECK( rcv ? 1 : 0, 1);					\
+				memcpy(rcv, buf, 344);					\
+				rcv[15] = (_hbh);					\
+				CHECK( 0, fd_p_parse_submit( (_peer), rcv, 344 ) );	\
+			}
+			#define GET_PARSED( _peer, _hbh ) {						\
+				CHECK( 0, fd_p_parse_getevent( (_peer), &event, &sz, &data ) );	\
+				CHECK( FDEVP_CNX_MSG_PARSED, event );					\
+				CHECK( 0, fd_p_parse_result( data, &rcv, &sz, &msg ) );		\
+				CHECK( 0, fd_msg_hdr( msg, &hdr ) );					\
+				CHECK( (_hbh), hdr->msg_hbhid & 0xff );				\
+				CHECK( 0, fd_msg_free( msg ) );					\
+			}
+
+			fd_g_config->cnf_parse_thr = 1;
+			CHECK( 0, fd_p_parse_init() );
+			CHECK( 0, fd_peer_alloc(&peer) );
+			CHECK( 0, fd_fifo_new(&peer->p_events, 0) );
+			CHECK( 0, fd_peer_alloc(&busy) );
+			CHECK( 0, fd_fifo_new(&busy->p_events, 1) );
+			CHECK( 0, clock_gettime(CLOCK_REALTIME, &peer->p_psm_timer) );
+			peer->p_psm_timer.tv_sec += 60;
+
+			/* The messages are handled in the order of reception, before the events received after them */
+			for (i = 1; i <= 3; i++) {
+				SUBMIT( peer, i );
+			}
+			CHECK( 0, fd_event_send(peer->p_events, FDEVP_CNX_ERROR, 0, NULL) );
+			for (i = 1; i <= 3; i++) {
+				GET_PARSED( peer, i );
+			}
+			CHECK( 0, fd_p_parse_getevent( peer, &event, &sz, &data ) );
+			CHECK( FDEVP_CNX_ERROR, event );
+			CHECK( 0, fd_p_parse_pending( peer ) );
+
+			/* The PSM timer expires while an event waits for a message that is not parsed yet: the parsing
+			 thread is kept busy by the message of another peer, whose event queue is full */
+			CHECK( 0, fd_event_send(busy->p_events, FDEVP_CNX_ERROR, 0, NULL) );
+			SUBMIT( busy, 9 );
+			SUBMIT( peer, 4 );
+			CHECK( 0, fd_event_send(peer->p_events, FDEVP_CNX_ERROR, 0, NULL) );
+			CHECK( 0, clock_gettime(CLOCK_REALTIME, &peer->p_psm_timer) );
+			CHECK( 0, fd_p_parse_getevent( peer, &event, &sz, &data ) );
+			CHECK( FDEVP_PSM_TIMEOUT, event );
+			peer->p_psm_timer.tv_sec += 60;
+			CHECK( 0, fd_event_get(busy->p_events, &event, NULL, NULL) );
+			GET_PARSED( peer, 4 );
+			CHECK( 0, fd_p_parse_getevent( peer, &event, &sz, &data ) );
+			CHECK( FDEVP_CNX_ERROR, event );
+			GET_PARSED( busy, 9 );
+
+			/* The messages being parsed are discarded on cleanup */
+			for (i = 5; i <= 8; i++) {
+				SUBMIT( peer, i );
+			}
+			fd_p_parse_flush( peer );
+			CHECK( 0, fd_p_parse_pending( peer ) );
+
+			CHECK( 0, fd_p_parse_fini() );
+			fd_g_config->cnf_parse_thr = 0;
+			while (fd_fifo_tryget(peer->p_events, &ev) == 0)
+				free(ev);
+			CHECK( 0, fd_fifo_del(&peer->p_events) );
+			CHECK( 0, fd_peer_free(&peer) );
+			while (fd_fifo_tryget(busy->p_events, &ev) == 0)
+				free(ev);
+			CHECK( 0, fd_fifo_del(&busy->p_events) );
+			CHECK( 0, fd_peer_free(&busy) );
+		}
+
+		/* Test the scatter-gather serialization */
+		{
+			struct iovec 	   * iov = NULL;
+			int 		     iovcnt = 0, i, raw;
+			unsigned char 	   * buf_out = NULL, * buf_iov;
+			size_t 		     len_out, len_iov;
+
+			for (raw = 0; raw < 2; raw++) {
+				CPYBUF();
+				if (raw) {
+					CHECK( 0, fd_msg_parse_buffer_raw( &buf_cpy, 344, &msg) );
+					CHECK( 1, fd_msg_is_raw( msg ) );
+				} else {
+					CHECK( 0, fd_msg_parse_buffer( &buf_cpy, 344, &msg) );
+					CHECK( 0, fd_msg_parse_dict( msg, fd_g_config->cnf_dict, NULL ) );
+				}
+				CHECK( 0, fd_msg_source_setrr( msg, "relay.example", strlen("relay.example"), fd_g_config->cnf_dict ) );
+				CHECK( 0, fd_msg_bufferize( msg, &buf_out, &len_out ) );
+
+				CHECK( 0, fd_msg_bufferize_iov( msg, &iov, &iovcnt ) );
+				CHECK( 1, iovcnt > 0 ? 1 : 0 );
+				len_iov = 0;
+				for (i = 0; i < iovcnt; i++)
+					len_iov += iov[i].iov_len;
+				CHECK( len_out, len_iov );
+				CHECK( 1, (buf_iov = malloc(len_iov)) ? 1 : 0 );
+				len_iov = 0;
+				for (i = 0; i < iovcnt; i++) {
+					memcpy(buf_iov + len_iov, iov[i].iov_base, iov[i].iov_len);
+					len_iov += iov[i].iov_len;
+				}
+
+				CHECK( 0, memcmp(buf_out, buf_iov, len_out) );
+				fd_msg_iov_free(iov);
+				CHECK( 0, fd_msg_free ( msg ) );
+				free(buf_iov);
+				free(buf_out);
+			}
+		}
+
 		/* Test the msg_parse_dict function */
 		{
 			/* Test with an unknown command code */
@@ -1017,6 +1346,22 @@ int main(int argc, char *argv[])
 					/* Now remove this AVP */
 					CHECK( 0, fd_msg_free ( childavp ) );
 				}
+				
+				{
+					/* The rules are compiled at the first check, test that adding and deleting rules is taken into account */
+					struct dict_object * model = NULL, * rule = NULL;
+					struct dict_avp_request req = { 73565, 0, "AVP Test - os2" };
+					struct dict_rule_data data = { NULL, RULE_REQUIRED, 0, 1, 1 };
+					
+					CHECK( 0, fd_msg_model ( tavp, &model ) );
+					CHECK( 0, fd_dict_search( fd_g_config->cnf_dict, DICT_AVP, AVP_BY_NAME_AND_VENDOR, &req, &data.rule_avp, ENOENT));
+					CHECK( 0, fd_dict_new ( fd_g_config->cnf_dict, DICT_RULE, &data, model, &rule ) );
+					
+					CHECK_CONFLICT( msg, "DIAMETER_MISSING_AVP", "AVP Test - os2", 73565 );
+					
+					CHECK( 0, fd_dict_delete ( rule ) );
+					CHECK( 0, fd_msg_parse_rules( msg, fd_g_config->cnf_dict, &pei ) );
+				}
 			}
 		}
 		
@@ -46,6 +46,19 @@
 /* The number of times each operation is repeated to measure the average operation time */
 #define DEFAULT_NUMBER_OF_SAMPLES	100000
 
+/* Count the calls to malloc, to measure the allocations needed to queue a message.
+ This relies on the glibc internal allocator entry, and is not compatible with the sanitizers. */
+#if defined(__GLIBC__) && !defined(__SANITIZE_ADDRESS__) && !defined(__SANITIZE_THREAD__)
+#define COUNT_MALLOCS
+extern void * __libc_malloc(size_t size);
+static unsigned long malloc_count = 0;
+void * malloc(size_t size)
+{
+	__atomic_add_fetch(&malloc_count, 1, __ATOMIC_RELAXED);
+	return __libc_malloc(size);
+}
+#endif /* COUNT_MALLOCS */
+
 static void display_result(int nr, struct timespec * start, struct timespec * end, char * fct, char * type, char *op)
 {
 	long double dur = (long double)end->tv_sec + (long double)end->tv_nsec/1000000000;
@@ -187,6 +200,89 @@ static void load_all_extensions(char * prefix)
 	/* We should probably clean the list here ? */
 }
 
+struct stress_struct {
+	struct msg * m;
+	uint8_t * b;
+};
+
+/* Free the messages from a different thread than the one that created them */
+static void * free_thr(void * arg)
+{
+	struct stress_struct * stress_array = arg;
+	int i;
+	for (i=0; i < test_parameter; i++) {
+		fd_msg_free( stress_array[i].m );
+	}
+	return NULL;
+}
+
+#ifdef COUNT_MALLOCS
+/* Send events from another thread than the one that retrieves them, as the receiving threads and the PSM do */
+static void * event_thr(void * arg)
+{
+	struct fifo * queue = arg;
+	int i, ret = 0;
+	for (i=0; i < test_parameter; i++) {
+		ret |= fd_event_send(queue, FDEV_TRIGGER, 0, &queue);
+	}
+	CHECK( 0, ret );
+	return NULL;
+}
+
+/* Average number of calls to malloc to queue and retrieve a message (directly and wrapped in an event) */
+static void count_queue_mallocs(void)
+{
+	struct fifo * queue = NULL;
+	struct msg * msg = (struct msg *)&malloc_count; /* the queue does not access the items */
+	struct msg * m = NULL;
+	unsigned long start;
+	double fifo_rate, ev_rate, ev_thr_rate;
+	pthread_t thr;
+	int i, ret = 0;
+	
+	CHECK( 0, fd_fifo_new(&queue, 16) );
+	
+	/* Post and get a message through the queue */
+	start = __atomic_load_n(&malloc_count, __ATOMIC_RELAXED);
+	for (i=0; i < test_parameter; i++) {
+		m = msg;
+		ret |= fd_fifo_post(queue, &m);
+		ret |= fd_fifo_get(queue, &m);
+	}
+	fifo_rate = (double)(__atomic_load_n(&malloc_count, __ATOMIC_RELAXED) - start) / test_parameter;
+	CHECK( 0, ret );
+	
+	/* Same through an event */
+	start = __atomic_load_n(&malloc_count, __ATOMIC_RELAXED);
+	for (i=0; i < test_parameter; i++) {
+		ret |= fd_event_send(queue, FDEV_TRIGGER, 0, msg);
+		ret |= fd_event_get(queue, NULL, NULL, NULL);
+	}
+	ev_rate = (double)(__atomic_load_n(&malloc_count, __ATOMIC_RELAXED) - start) / test_parameter;
+	CHECK( 0, ret );
+	
+	/* And with the events sent from another thread */
+	start = __atomic_load_n(&malloc_count, __ATOMIC_RELAXED);
+	CHECK( 0, pthread_create(&thr, NULL, event_thr, queue) );
+	for (i=0; i < test_parameter; i++) {
+		ret |= fd_event_get(queue, NULL, NULL, NULL);
+	}
+	CHECK( 0, pthread_join(thr, NULL) );
+	ev_thr_rate = (double)(__atomic_load_n(&malloc_count, __ATOMIC_RELAXED) - start) / test_parameter;
+	CHECK( 0, ret );
+	
+	CHECK( 0, fd_fifo_del(&queue) );
+	
+	printf("Mallocs per queued message: %.4f (fifo), %.4f (event), %.4f (event from another thread)\n", fifo_rate, ev_rate, ev_thr_rate);
+	
+	/* Once the spare items and events are available, queuing does not allocate memory. 
+	 The thread creation and a few warm-up allocations are included in the counts. */
+	CHECK( 1, fifo_rate < 0.01 ? 1 : 0 );
+	CHECK( 1, ev_rate < 0.01 ? 1 : 0 );
+	CHECK( 1, ev_thr_rate < 0.01 ? 1 : 0 );
+}
+#endif /* COUNT_MALLOCS */
+
 /* Main test routine */
 int main(int argc, char *argv[])
 {
@@ -194,6 +290,7 @@ int main(int argc, char *argv[])
 	unsigned char * buf = NULL;
 	
 	int dictionaries_loaded = 0;
+	int pool_passes = 0;
 	
 	test_parameter = DEFAULT_NUMBER_OF_SAMPLES;
 	
@@ -526,10 +623,7 @@ int main(int argc, char *argv[])
 redo:	
 	/* Test the throughput of the different functions function */
 	{
-		struct stress_struct {
-			struct msg * m;
-			uint8_t * b;
-		} * stress_array;
+		struct stress_struct * stress_array;
 		int i;
 		struct timespec start, end;
 		
@@ -662,8 +756,13 @@ redo:
 		CHECK( 0, clock_gettime(CLOCK_REALTIME, &start) );
 		
 		/* Free those messages */
-		for (i=0; i < test_parameter; i++) {
-			fd_msg_free( stress_array[i].m );
+		if (fd_msg_pool_enabled()) {
+			/* With the pools, the objects go back to the depot through the magazines of this thread */
+			pthread_t thr;
+			CHECK( 0, pthread_create(&thr, NULL, free_thr, stress_array) );
+			CHECK( 0, pthread_join(thr, NULL) );
+		} else {
+			free_thr(stress_array);
 		}
 		
 		CHECK( 0, clock_gettime(CLOCK_REALTIME, &end) );
@@ -683,6 +782,36 @@ redo:
 		goto redo;
 	}
 	
+	if (pool_passes++ < 2) {
+		CHECK( 0, fd_msg_pool_enable(0) );
+		printf("Using the message pools, restarting...\n");
+		goto redo;
+	}
+	
+#ifdef COUNT_MALLOCS
+	count_queue_mallocs();
+#endif /* COUNT_MALLOCS */
+	
+	/* Check the pools counters: all objects have been released, and the objects freed by the other thread were reused */
+	{
+		int cls;
+		for (cls = 0; cls < FD_MSG_POOL_MAX; cls++) {
+			struct fd_msg_pool_stats stats;
+			CHECK( 0, fd_msg_pool_getstats(cls, &stats) );
+			printf("Pool %-15s: %llu allocs, %llu frees, %.1f%% hits, %llu depot, %llu slabs (%zd bytes)\n", 
+				stats.name, stats.allocs, stats.frees, 
+				stats.allocs ? (100.0 * stats.hits / stats.allocs) : 0.0,
+				stats.depot, stats.slabs, stats.slab_bytes);
+			CHECK( stats.allocs, stats.frees );
+		}
+		{
+			struct fd_msg_pool_stats stats;
+			CHECK( 0, fd_msg_pool_getstats(FD_MSG_POOL_MSG, &stats) );
+			CHECK( 1, stats.depot > 0 ? 1 : 0 );
+			CHECK( 1, stats.allocs > 0 ? 1 : 0 );
+		}
+	}
+	
 	/* That's all for the tests yet */
 	PASSTEST();
 } 
@@ -42,6 +42,10 @@
 #define TEST_SID	(os0_t)TEST_SID_IN
 
 #define TEST_EYEC	0x7e57e1ec
+
+/* The average chain length the sessions hash table should keep (SESS_HASH_MAX_LOAD) */
+#define SESS_MAX_LOAD_TEST	2
+
 struct sess_state {
 	int	eyec;	/* TEST_EYEC */
 	os0_t   sid; 	/* the session with which the data was registered */
@@ -81,6 +85,31 @@ static __inline__ struct sess_state * new_state(os0_t sid, int *freed)
 
 void * g_opaque = (void *)"test";
 
+/* A cleanup callback that waits until it is allowed to complete */
+static int slow_entered = 0;
+static int slow_release = 0;
+static void slowcleanup( struct sess_state * data, os0_t sid, void * opaque )
+{
+	__atomic_store_n(&slow_entered, 1, __ATOMIC_RELEASE);
+	while (!__atomic_load_n(&slow_release, __ATOMIC_ACQUIRE))
+		usleep(1000);
+	mycleanup(data, sid, opaque);
+}
+
+static void * sess_destroy_thr(void * arg)
+{
+	CHECK( 0, fd_sess_destroy( (struct session **)arg ) );
+	return NULL;
+}
+
+static int hdl_destroyed = 0;
+static void * hdl_destroy_thr(void * arg)
+{
+	CHECK( 0, fd_sess_handler_destroy( (struct session_handler **)arg, NULL ) );
+	__atomic_store_n(&hdl_destroyed, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
 /* Avoid a lot of casts */
 #undef strlen
 #define strlen(s) strlen((char *)s)
@@ -90,6 +119,103 @@ void * g_opaque = (void *)"test";
 #define strcmp(s1,s2) strcmp((char *)s1, (char *)s2)
 	
 
+/* Benchmark of the sessions hash table: number of sessions (change with -p) and of threads looking them up */
+#define BENCH_SESSIONS	2000000
+#define BENCH_THREADS	4
+
+struct bench_data {
+	struct session ** sess;
+	int		  nb;
+	int		  start;
+};
+
+static long long bench_ns(struct timespec * start)
+{
+	struct timespec end;
+	CHECK( 0, clock_gettime(CLOCK_MONOTONIC, &end) );
+	return (end.tv_sec - start->tv_sec) * 1000000000LL + (end.tv_nsec - start->tv_nsec);
+}
+
+/* Find all the sessions from their Session-Id, starting at a different place in each thread */
+static void * bench_lookup(void * arg)
+{
+	struct bench_data * bd = arg;
+	int i;
+	
+	for (i = 0; i < bd->nb; i++) {
+		struct session * sess = bd->sess[(bd->start + i) % bd->nb], * found;
+		os0_t sid;
+		size_t sidlen;
+		int new = 1;
+		if (fd_sess_getsid(sess, &sid, &sidlen) || fd_sess_fromsid(sid, sidlen, &found, &new) || new || (found != sess)) {
+			CHECK( sess, found );
+			break;
+		}
+	}
+	return NULL;
+}
+
+static void bench_sessions(void)
+{
+	struct fd_sess_hashstats hs;
+	struct bench_data bd[BENCH_THREADS];
+	pthread_t thr[BENCH_THREADS];
+	struct timespec start;
+	uint32_t initial_buckets, initial_sessions;
+	long long create_ns, lookup_ns, delete_ns;
+	int i, nb = test_parameter ? test_parameter : BENCH_SESSIONS;
+	struct session ** sess;
+	
+	CHECK( 0, fd_sess_gethashstats(&hs) );
+	initial_buckets = hs.buckets;
+	initial_sessions = hs.sessions;
+	
+	sess = calloc(nb, sizeof(struct session *));
+	CHECK( 1, sess ? 1 : 0 );
+	
+	/* Creation, the table grows with the sessions */
+	CHECK( 0, clock_gettime(CLOCK_MONOTONIC, &start) );
+	for (i = 0; i < nb; i++) {
+		CHECK( 0, fd_sess_new( &sess[i], TEST_DIAM_ID, CONSTSTRLEN(TEST_DIAM_ID), NULL, 0 ) );
+	}
+	create_ns = bench_ns(&start);
+	
+	CHECK( 0, fd_sess_gethashstats(&hs) );
+	CHECK( nb + initial_sessions, hs.sessions );
+	CHECK( 1, hs.buckets > initial_buckets );
+	CHECK( 1, hs.load <= 2.0 * SESS_MAX_LOAD_TEST );
+	LOG_N("sessions hash: %u sessions in %u buckets, load %.2f, longest chain %u, empty buckets %u", 
+		hs.sessions, hs.buckets, hs.load, hs.max_chain, hs.chains[0]);
+	
+	/* Concurrent lookups */
+	CHECK( 0, clock_gettime(CLOCK_MONOTONIC, &start) );
+	for (i = 0; i < BENCH_THREADS; i++) {
+		bd[i].sess = sess;
+		bd[i].nb = nb;
+		bd[i].start = i * (nb / BENCH_THREADS);
+		CHECK( 0, pthread_create( &thr[i], NULL, bench_lookup, &bd[i] ) );
+	}
+	for (i = 0; i < BENCH_THREADS; i++) {
+		CHECK( 0, pthread_join( thr[i], NULL ) );
+	}
+	lookup_ns = bench_ns(&start);
+	
+	/* Deletion, the table shrinks back */
+	CHECK( 0, clock_gettime(CLOCK_MONOTONIC, &start) );
+	for (i = 0; i < nb; i++) {
+		CHECK( 0, fd_sess_reclaim_msg( &sess[i] ) );
+	}
+	delete_ns = bench_ns(&start);
+	
+	CHECK( 0, fd_sess_gethashstats(&hs) );
+	CHECK( initial_sessions, hs.sessions );
+	CHECK( initial_buckets, hs.buckets );
+	
+	LOG_N("sessions hash, %d sessions: create %lld ns, lookup %lld ns (%d threads), delete %lld ns per session", 
+		nb, create_ns / nb, lookup_ns / nb, BENCH_THREADS, delete_ns / nb);
+	free(sess);
+}
+
 /* Main test routine */
 int main(int argc, char *argv[])
 {
@@ -277,6 +403,55 @@ int main(int argc, char *argv[])
 	}
 	
 	
+	/* Expiry of many sessions with different timeouts */
+	{
+		#define NB_EXP	1000
+		struct session * sess[NB_EXP], * tmp;
+		struct timespec now, timeout;
+		uint32_t initial, cnt;
+		int i;
+		
+		CHECK( 0, fd_sess_getcount(&initial) );
+		CHECK( 0, clock_gettime(CLOCK_REALTIME, &now) );
+		for (i = 0; i < NB_EXP; i++) {
+			CHECK( 0, fd_sess_new( &sess[i], TEST_DIAM_ID, CONSTSTRLEN(TEST_DIAM_ID), NULL, 0 ) );
+			/* timeouts spread between 200 and 400ms from now, the last created expiring first */
+			timeout = now;
+			timeout.tv_nsec += 200000000 + (NB_EXP - i) * (200000000 / NB_EXP);
+			if (timeout.tv_nsec >= 1000000000) {
+				timeout.tv_sec++;
+				timeout.tv_nsec -= 1000000000;
+			}
+			CHECK( 0, fd_sess_settimeout( sess[i], &timeout ) );
+		}
+		
+		/* Half of them are postponed */
+		for (i = 0; i < NB_EXP; i += 2) {
+			timeout = now;
+			timeout.tv_sec += 3600;
+			CHECK( 0, fd_sess_settimeout( sess[i], &timeout ) );
+		}
+		CHECK( 0, fd_sess_getcount(&cnt) );
+		CHECK( initial + NB_EXP, cnt );
+		
+		timeout.tv_sec = 0;
+		timeout.tv_nsec= 600000000; /* 600 ms */
+		CHECK( 0, nanosleep(&timeout, NULL) );
+		CHECK( 0, fd_sess_getcount(&cnt) );
+		CHECK( initial + NB_EXP / 2, cnt );
+		
+		/* The expired sessions are only marked destroyed since we still reference them */
+		for (i = 0; i < NB_EXP; i++) {
+			if (i % 2 == 0) {
+				tmp = sess[i];
+				CHECK( 0, fd_sess_destroy( &tmp ) );
+			}
+			CHECK( 0, fd_sess_reclaim_msg( &sess[i] ) );
+		}
+		CHECK( 0, fd_sess_getcount(&cnt) );
+		CHECK( initial, cnt );
+	}
+	
 	/* Test states operations */
 	{
 		struct sess_state * ms[6], *tms;
@@ -401,6 +576,92 @@ int main(int argc, char *argv[])
 		mycleanup(tms, str1, NULL);
 	}
 	
+	/* States of more handlers than the sessions have inline slots for */
+	{
+		#define NB_HDL	10
+		struct session_handler * hdls[NB_HDL];
+		struct session * sess;
+		struct sess_state * ms;
+		int freed[NB_HDL];
+		os0_t sid;
+		size_t sidlen;
+		int i;
+		
+		memset(freed, 0, sizeof(freed));
+		CHECK( 0, fd_sess_new( &sess, TEST_DIAM_ID, CONSTSTRLEN(TEST_DIAM_ID), NULL, 0 ) );
+		CHECK( 0, fd_sess_getsid(sess, &sid, &sidlen) );
+		for (i = 0; i < NB_HDL; i++) {
+			CHECK( 0, fd_sess_handler_create ( &hdls[i], mycleanup, NULL, NULL ) );
+			ms = new_state(sid, &freed[i]);
+			CHECK( 0, fd_sess_state_store ( hdls[i], sess, &ms ) );
+			CHECK( NULL, ms );
+		}
+		
+		/* A second state for the same handler is refused */
+		ms = new_state(sid, NULL);
+		CHECK( EALREADY, fd_sess_state_store ( hdls[NB_HDL - 1], sess, &ms ) );
+		CHECK( 1, ms ? 1 : 0 );
+		mycleanup(ms, sid, NULL);
+		
+		/* Retrieve half of the states */
+		for (i = 0; i < NB_HDL; i += 2) {
+			CHECK( 0, fd_sess_state_retrieve( hdls[i], sess, &ms ) );
+			CHECK( 1, ms ? 1 : 0 );
+			CHECK( &freed[i], ms->freed );
+			mycleanup(ms, sid, NULL);
+			CHECK( 0, fd_sess_state_retrieve( hdls[i], sess, &ms ) );
+			CHECK( NULL, ms );
+		}
+		
+		/* Destroying a handler cleans its states up, and its id can be reused */
+		CHECK( 0, fd_sess_handler_destroy( &hdls[1], NULL ) );
+		CHECK( 1, freed[1] );
+		CHECK( 0, fd_sess_handler_create ( &hdls[1], mycleanup, NULL, NULL ) );
+		CHECK( 0, fd_sess_state_retrieve( hdls[1], sess, &ms ) );
+		CHECK( NULL, ms );
+		
+		/* Destroying the session cleans up the other states */
+		CHECK( 0, fd_sess_destroy( &sess ) );
+		for (i = 0; i < NB_HDL; i++) {
+			CHECK( 1, freed[i] );
+			CHECK( 0, fd_sess_handler_destroy( &hdls[i], NULL ) );
+		}
+	}
+	
+	/* A handler is not destroyed (and its id not reused) while one of its states is being cleaned up by fd_sess_destroy */
+	{
+		struct session_handler * slow;
+		struct session * sess;
+		struct sess_state * ms;
+		pthread_t thr_sess, thr_hdl;
+		int freed = 0;
+		os0_t sid;
+		size_t sidlen;
+		
+		CHECK( 0, fd_sess_handler_create ( &slow, slowcleanup, NULL, NULL ) );
+		CHECK( 0, fd_sess_new( &sess, TEST_DIAM_ID, CONSTSTRLEN(TEST_DIAM_ID), NULL, 0 ) );
+		CHECK( 0, fd_sess_getsid(sess, &sid, &sidlen) );
+		ms = new_state(sid, &freed);
+		CHECK( 0, fd_sess_state_store ( slow, sess, &ms ) );
+		
+		CHECK( 0, pthread_create( &thr_sess, NULL, sess_destroy_thr, &sess ) );
+		while (!__atomic_load_n(&slow_entered, __ATOMIC_ACQUIRE))
+			usleep(1000);
+		CHECK( 0, pthread_create( &thr_hdl, NULL, hdl_destroy_thr, &slow ) );
+		usleep(100000);
+		CHECK( 0, __atomic_load_n(&hdl_destroyed, __ATOMIC_ACQUIRE) );
+		CHECK( 0, freed );
+		
+		__atomic_store_n(&slow_release, 1, __ATOMIC_RELEASE);
+		CHECK( 0, pthread_join( thr_sess, NULL ) );
+		CHECK( 0, pthread_join( thr_hdl, NULL ) );
+		CHECK( 1, __atomic_load_n(&hdl_destroyed, __ATOMIC_ACQUIRE) );
+		CHECK( 1, freed );
+	}
+	
+	/* Grow and shrink the hash table */
+	bench_sessions();
+	
 	/* TODO: add tests on messages referencing sessions */
 	
 	/* That's all for the tests yet */